@@ -128,6 +128,9 @@ class PDNSPBConnHandler(object):
                                                    rr.ttl,
                                                    rdatastr))
 
+            if response.latencyPhases:
+                print("- Latency: %s" % (', '.join(['%s %d usec' % (phase.name, phase.usec) for phase in response.latencyPhases])))
+
     def printSummary(self, msg, typestr):
         datestr = datetime.datetime.fromtimestamp(msg.timeSec).strftime('%Y-%m-%d %H:%M:%S')
         if msg.HasField('timeUsec'):
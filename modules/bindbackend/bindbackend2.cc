@@ -26,6 +26,7 @@
 #include <errno.h>
 #include <string>
 #include <set>
+#include <unordered_set>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -34,6 +35,8 @@
 #include <sstream>
 #include <boost/algorithm/string.hpp>
 #include <system_error>
+#include <thread>
+#include <mutex>
 
 #include "pdns/dnsseckeeper.hh"
 #include "pdns/dnssecinfra.hh"
@@ -50,6 +53,7 @@
 #include "pdns/qtype.hh"
 #include "pdns/misc.hh"
 #include "pdns/dynlistener.hh"
+#include "pdns/statbag.hh"
 #include "pdns/lock.hh"
 #include "pdns/namespaces.hh"
 
@@ -74,6 +78,8 @@
 Bind2Backend::state_t Bind2Backend::s_state;
 int Bind2Backend::s_first=1;
 bool Bind2Backend::s_ignore_broken_records=false;
+std::atomic<bool> Bind2Backend::s_loading(false);
+std::atomic<uint64_t> Bind2Backend::s_zonesQueued(0), Bind2Backend::s_zonesParsed(0), Bind2Backend::s_zonesFailed(0);
 
 pthread_rwlock_t Bind2Backend::s_state_lock=PTHREAD_RWLOCK_INITIALIZER;
 pthread_mutex_t Bind2Backend::s_supermaster_config_lock=PTHREAD_MUTEX_INITIALIZER; // protects writes to config file
@@ -363,6 +369,9 @@ void Bind2Backend::getAllDomains(vector<DomainInfo> *domains, bool include_disab
     // do not corrupt di if domain supplied by another backend.
     if (di.backend != this)
       continue;
+    BB2DomainInfo bbd;
+    if(!safeGetBBDomainInfo(di.id, &bbd) || !bbd.d_loaded)
+      continue; // not parsed (yet), there is no SOA to ask for
     this->getSOA(di.zone, soadata);
     di.serial=soadata.serial;
   }
@@ -443,9 +452,22 @@ void Bind2Backend::alsoNotifies(const DNSName& domain, set<string> *ips)
   }   
 }
 
+//! rough size of records in memory: the nodes of the three indexes, the buckets and the strings
+static size_t getMemoryUsage(const recordstorage_t& records)
+{
+  size_t ret = records.size() * (sizeof(Bind2DNSRecord) + 6 * sizeof(void*));
+  ret += boost::multi_index::get<UnorderedNameTag>(records).bucket_count() * sizeof(void*);
+  for(const auto& bdr : records)
+    ret += bdr.qname.getStorage().size() + bdr.content.size() + bdr.nsec3hash.size();
+  return ret;
+}
+
 // only parses, does NOT add to s_state!
 void Bind2Backend::parseZoneFile(BB2DomainInfo *bbd)
 {
+  DTime dt;
+  dt.set();
+
   NSEC3PARAMRecordContent ns3pr;
   bool nsec3zone;
   if (d_hybrid) {
@@ -453,9 +475,21 @@ void Bind2Backend::parseZoneFile(BB2DomainInfo *bbd)
     nsec3zone=dk.getNSEC3PARAM(bbd->d_name, &ns3pr);
   } else
     nsec3zone=getNSEC3PARAM(bbd->d_name, &ns3pr);
+  const string nsec3param = nsec3zone ? ns3pr.getZoneRepresentation() : string();
+
+  /* when reloading, the file is diffed against the records we are serving: records that
+     did not change are only looked up, not stored a second time */
+  shared_ptr<const recordstorage_t> previous;
+  if(bbd->d_loaded)
+    previous = bbd->d_records.get();
+  else
+    bbd->d_records = shared_ptr<recordstorage_t>(new recordstorage_t());
+
+  std::unordered_set<const Bind2DNSRecord*> matched;
+  vector<Bind2DNSRecord> added;
+  if(previous)
+    matched.reserve(previous->size());
 
-  bbd->d_records = shared_ptr<recordstorage_t>(new recordstorage_t());
-        
   ZoneParserTNG zpt(bbd->d_filename, bbd->d_name, s_binddirectory);
   DNSResourceRecord rr;
   string hashed;
@@ -463,22 +497,203 @@ void Bind2Backend::parseZoneFile(BB2DomainInfo *bbd)
     if(rr.qtype.getCode() == QType::NSEC || rr.qtype.getCode() == QType::NSEC3)
       continue; // we synthesise NSECs on demand
 
-    insertRecord(*bbd, rr.qname, rr.qtype, rr.content, rr.ttl, "");
+    if(!previous) {
+      insertRecord(*bbd, rr.qname, rr.qtype, rr.content, rr.ttl, "");
+      continue;
+    }
+
+    Bind2DNSRecord bdr;
+    if(!makeRecord(*bbd, rr.qname, rr.qtype, rr.content, rr.ttl, bdr))
+      continue;
+    if(!matchRecord(*previous, matched, bdr))
+      added.push_back(std::move(bdr));
+  }
+
+  string how = "loaded";
+  size_t peak;
+  if(previous) {
+    peak = getMemoryUsage(*previous) + matched.size() * 4 * sizeof(void*);
+    how = updateRecords(*bbd, *previous, matched, added, nsec3zone, ns3pr, nsec3param);
+    if(how != "unchanged")
+      peak += getMemoryUsage(*bbd->d_records.get());
+  }
+  else {
+    fixupOrderAndAuth(*bbd, nsec3zone, ns3pr);
+    doEmptyNonTerminals(*bbd, nsec3zone, ns3pr);
+    peak = getMemoryUsage(*bbd->d_records.get());
   }
-  fixupOrderAndAuth(*bbd, nsec3zone, ns3pr);
-  doEmptyNonTerminals(*bbd, nsec3zone, ns3pr);
+
   bbd->setCtime();
   bbd->d_loaded=true; 
   bbd->d_checknow=false;
-  bbd->d_status="parsed into memory at "+nowTime();
+  bbd->d_nsec3param=nsec3param;
+  bbd->d_status="parsed into memory at "+nowTime()+" ("+std::to_string(bbd->d_records.get()->size())+" records, "+how+", in "+std::to_string(dt.udiff()/1000)+" ms, peak ~"+std::to_string(peak/1024)+" kB)";
 }
 
-/** THIS IS AN INTERNAL FUNCTION! It does moadnsparser prio impedance matching
-    Much of the complication is due to the efforts to benefit from std::string reference counting copy on write semantics */
-void Bind2Backend::insertRecord(BB2DomainInfo& bb2, const DNSName &qname, const QType &qtype, const string &content, int ttl, const std::string& hashed, bool *auth)
+//! looks for a record of previous identical to bdr that was not matched yet, and marks it as matched
+bool Bind2Backend::matchRecord(const recordstorage_t& previous, std::unordered_set<const Bind2DNSRecord*>& matched, const Bind2DNSRecord& bdr)
+{
+  auto range = boost::multi_index::get<UnorderedNameTag>(previous).equal_range(bdr.qname);
+  for(auto iter = range.first; iter != range.second; ++iter) {
+    if(iter->qtype == bdr.qtype && iter->ttl == bdr.ttl && iter->content == bdr.content && iter->qname.getStorage() == bdr.qname.getStorage() && matched.insert(&*iter).second)
+      return true;
+  }
+  return false;
+}
+
+/* Replaces the records of bbd, which were previous, by the matched ones plus added, either
+   incrementally or by rebuilding them. Returns how it was done, for the zone status. */
+string Bind2Backend::updateRecords(BB2DomainInfo& bbd, const recordstorage_t& previous, const std::unordered_set<const Bind2DNSRecord*>& matched, vector<Bind2DNSRecord>& added, bool nsec3zone, const NSEC3PARAMRecordContent& ns3pr, const string& nsec3param)
+{
+  vector<const Bind2DNSRecord*> removed;
+  for(const auto& bdr : previous)
+    if(bdr.qtype && !matched.count(&bdr))
+      removed.push_back(&bdr);
+
+  if(added.empty() && removed.empty() && nsec3param == bbd.d_nsec3param)
+    return "unchanged";
+
+  if(nsec3param == bbd.d_nsec3param && applyDelta(bbd, previous, removed, added, nsec3zone, ns3pr))
+    return "incremental, "+std::to_string(added.size())+" added, "+std::to_string(removed.size())+" removed";
+
+  shared_ptr<recordstorage_t> records(new recordstorage_t());
+  for(const auto& bdr : previous) {
+    if(matched.count(&bdr)) {
+      Bind2DNSRecord copy(bdr);
+      copy.nsec3hash.clear();
+      copy.auth = true;
+      records->insert(std::move(copy));
+    }
+  }
+  for(auto& bdr : added)
+    records->insert(std::move(bdr));
+  bbd.d_records = records;
+  fixupOrderAndAuth(bbd, nsec3zone, ns3pr);
+  doEmptyNonTerminals(bbd, nsec3zone, ns3pr);
+  return "rebuilt, "+std::to_string(added.size())+" added, "+std::to_string(removed.size())+" removed";
+}
+
+/* Builds the records served after a reload from a copy of the previous ones, so the unchanged
+   records keep their auth flags and NSEC3 hashes. Changes to delegations, and zones where NSEC3
+   opt-out makes empty non-terminals depend on their descendants, are left to a full rebuild,
+   signalled by returning false, as are names that disappear while keeping descendants. */
+bool Bind2Backend::applyDelta(BB2DomainInfo& bbd, const recordstorage_t& previous, const vector<const Bind2DNSRecord*>& removed, const vector<Bind2DNSRecord>& added, bool nsec3zone, const NSEC3PARAMRecordContent& ns3pr)
+{
+  if(nsec3zone && ns3pr.d_flags)
+    return false;
+  if((removed.size() + added.size()) * 2 > previous.size())
+    return false;
+  for(const auto& bdr : removed)
+    if((bdr->qtype == QType::NS && !bdr->qname.isRoot()) || bdr->qtype == QType::DS)
+      return false;
+  for(const auto& bdr : added)
+    if((bdr.qtype == QType::NS && !bdr.qname.isRoot()) || bdr.qtype == QType::DS)
+      return false;
+
+  shared_ptr<recordstorage_t> records(new recordstorage_t(previous));
+  auto& nameindex = boost::multi_index::get<UnorderedNameTag>(*records);
+
+  auto hasType = [&nameindex](const DNSName& qname, uint16_t qtype) {
+    auto range = nameindex.equal_range(qname);
+    for(auto iter = range.first; iter != range.second; ++iter)
+      if(iter->qtype == qtype)
+        return true;
+    return false;
+  };
+  auto belowDelegation = [&hasType](DNSName shorter) {
+    while(shorter.chopOff())
+      if(!shorter.isRoot() && hasType(shorter, QType::NS))
+        return true;
+    return false;
+  };
+  auto hasDescendants = [&records](const DNSName& qname) {
+    auto iter = records->upper_bound(qname);
+    return iter != records->end() && iter->qname.isPartOf(qname);
+  };
+  auto getHash = [&nameindex, &bbd, &ns3pr](const DNSName& qname) {
+    auto range = nameindex.equal_range(qname);
+    for(auto iter = range.first; iter != range.second; ++iter)
+      if(!iter->nsec3hash.empty())
+        return iter->nsec3hash;
+    return toBase32Hex(hashQNameWithSalt(ns3pr, qname+bbd.d_name));
+  };
+
+  set<DNSName> gone;
+  for(const auto& bdr : removed) {
+    auto range = records->equal_range(bdr->qname);
+    for(auto iter = range.first; iter != range.second; ++iter) {
+      if(iter->qtype == bdr->qtype && iter->ttl == bdr->ttl && iter->content == bdr->content && iter->qname.getStorage() == bdr->qname.getStorage()) {
+        records->erase(iter);
+        break;
+      }
+    }
+    if(!nameindex.count(bdr->qname))
+      gone.insert(bdr->qname);
+  }
+
+  for(const auto& add : added) {
+    Bind2DNSRecord bdr(add);
+    bool skip = belowDelegation(bdr.qname);
+    bdr.auth = !skip && (bdr.qtype == QType::RRSIG || bdr.qname.isRoot() || !hasType(bdr.qname, QType::NS));
+    if(nsec3zone && !skip && bdr.qtype != QType::RRSIG && (bdr.auth || hasType(bdr.qname, QType::DS)))
+      bdr.nsec3hash = getHash(bdr.qname);
+
+    bool known = nameindex.count(bdr.qname);
+    auto range = nameindex.equal_range(bdr.qname);
+    for(auto iter = range.first; iter != range.second; ) {
+      if(!iter->qtype)
+        iter = nameindex.erase(iter);
+      else
+        ++iter;
+    }
+    records->insert(bdr);
+
+    if(known)
+      continue;
+    gone.erase(bdr.qname);
+    // what doEmptyNonTerminals() does for this record
+    DNSName shorter(bdr.qname);
+    while(shorter.chopOff()) {
+      range = nameindex.equal_range(shorter);
+      if(range.first == range.second) {
+        Bind2DNSRecord ent;
+        ent.qname = shorter;
+        ent.qtype = 0;
+        ent.ttl = 0;
+        ent.auth = bdr.auth;
+        if(nsec3zone && ent.auth)
+          ent.nsec3hash = toBase32Hex(hashQNameWithSalt(ns3pr, shorter+bbd.d_name));
+        records->insert(ent);
+      }
+      else if(bdr.auth && !range.first->qtype && !range.first->auth) {
+        Bind2DNSRecord ent(*range.first);
+        ent.auth = true;
+        if(nsec3zone)
+          ent.nsec3hash = toBase32Hex(hashQNameWithSalt(ns3pr, shorter+bbd.d_name));
+        nameindex.replace(range.first, ent);
+      }
+    }
+  }
+
+  for(const auto& qname : gone) {
+    if(hasDescendants(qname))
+      return false;
+    // empty non-terminals that were only there for this name
+    DNSName shorter(qname);
+    while(shorter.chopOff()) {
+      auto range = nameindex.equal_range(shorter);
+      if(range.first == range.second || range.first->qtype || std::next(range.first) != range.second || hasDescendants(shorter))
+        break;
+      nameindex.erase(range.first);
+    }
+  }
+
+  bbd.d_records = records;
+  return true;
+}
+
+bool Bind2Backend::makeRecord(const BB2DomainInfo& bb2, const DNSName &qname, const QType &qtype, const string &content, int ttl, Bind2DNSRecord& bdr)
 {
-  Bind2DNSRecord bdr;
-  shared_ptr<recordstorage_t> records = bb2.d_records.getWRITABLE();
   bdr.qname=qname;
 
   if(bb2.d_name.empty())
@@ -489,28 +704,36 @@ void Bind2Backend::insertRecord(BB2DomainInfo& bb2, const DNSName &qname, const
     string msg = "Trying to insert non-zone data, name='"+bdr.qname.toLogString()+"', qtype="+qtype.getName()+", zone='"+bb2.d_name.toLogString()+"'";
     if(s_ignore_broken_records) {
         L<<Logger::Warning<<msg<< " ignored" << endl;
-        return;
+        return false;
     }
     else
       throw PDNSException(msg);
   }
 
-//  bdr.qname.swap(bdr.qname);
+  bdr.qtype=qtype.getCode();
+  bdr.content=content;
+  bdr.ttl=ttl;
+  bdr.auth=true;
+  return true;
+}
+
+/** THIS IS AN INTERNAL FUNCTION! It does moadnsparser prio impedance matching
+    Much of the complication is due to the efforts to benefit from std::string reference counting copy on write semantics */
+void Bind2Backend::insertRecord(BB2DomainInfo& bb2, const DNSName &qname, const QType &qtype, const string &content, int ttl, const std::string& hashed, bool *auth)
+{
+  Bind2DNSRecord bdr;
+  shared_ptr<recordstorage_t> records = bb2.d_records.getWRITABLE();
+  if(!makeRecord(bb2, qname, qtype, content, ttl, bdr))
+    return;
 
   if(!records->empty() && bdr.qname==boost::prior(records->end())->qname)
     bdr.qname=boost::prior(records->end())->qname;
 
-  bdr.qname=bdr.qname;
-  bdr.qtype=qtype.getCode();
-  bdr.content=content; 
   bdr.nsec3hash = hashed;
   
   if (auth) // Set auth on empty non-terminals
     bdr.auth=*auth;
-  else
-    bdr.auth=true;
 
-  bdr.ttl=ttl;
   records->insert(bdr);
 }
 
@@ -546,7 +769,7 @@ string Bind2Backend::DLDomStatusHandler(const vector<string>&parts, Utility::pid
     for(vector<string>::const_iterator i=parts.begin()+1;i<parts.end();++i) {
       BB2DomainInfo bbd;
       if(safeGetBBDomainInfo(DNSName(*i), &bbd)) {	
-        ret<< *i << ": "<< (bbd.d_loaded ? "": "[rejected]") <<"\t"<<bbd.d_status<<"\n";
+        ret<< *i << ": "<< (bbd.d_loaded || bbd.d_queued ? "": "[rejected]") <<"\t"<<bbd.d_status<<"\n";
     }
       else
         ret<< *i << " no such domain\n";
@@ -555,7 +778,7 @@ string Bind2Backend::DLDomStatusHandler(const vector<string>&parts, Utility::pid
   else {
     ReadLock rl(&s_state_lock);
     for(state_t::const_iterator i = s_state.begin(); i != s_state.end() ; ++i) {
-      ret<< i->d_name << ": "<< (i->d_loaded ? "": "[rejected]") <<"\t"<<i->d_status<<"\n";
+      ret<< i->d_name << ": "<< (i->d_loaded || i->d_queued ? "": "[rejected]") <<"\t"<<i->d_status<<"\n";
     }
   }
 
@@ -570,7 +793,7 @@ string Bind2Backend::DLListRejectsHandler(const vector<string>&parts, Utility::p
   ostringstream ret;
   ReadLock rl(&s_state_lock);
   for(state_t::const_iterator i = s_state.begin(); i != s_state.end() ; ++i) {
-    if(!i->d_loaded)
+    if(!i->d_loaded && !i->d_queued)
       ret<<i->d_name<<"\t"<<i->d_status<<endl;
   }
   return ret.str();
@@ -626,6 +849,7 @@ Bind2Backend::Bind2Backend(const string &suffix, bool loadZones)
   d_getTSIGKeysQuery_stmt = NULL;
 
   setArgPrefix("bind"+suffix);
+  d_suffix=suffix;
   d_logprefix="[bind"+suffix+"backend]";
   d_hybrid=mustDo("hybrid");
   s_ignore_broken_records=mustDo("ignore-broken-records");
@@ -651,6 +875,11 @@ Bind2Backend::Bind2Backend(const string &suffix, bool loadZones)
   dl->registerFunc("BIND-DOMAIN-STATUS", &DLDomStatusHandler, "bindbackend: list status of all domains", "[domains]");
   dl->registerFunc("BIND-LIST-REJECTS", &DLListRejectsHandler, "bindbackend: list rejected domains");
   dl->registerFunc("BIND-ADD-ZONE", &DLAddDomainHandler, "bindbackend: add zone", "<domain> <filename>");
+
+  extern StatBag S;
+  S.declare("bind-zones-queued", "Number of zones from named.conf waiting to be parsed", getLoadStat);
+  S.declare("bind-zones-parsed", "Number of zones from named.conf parsed into memory", getLoadStat);
+  S.declare("bind-zones-failed", "Number of zones from named.conf that failed to parse", getLoadStat);
 }
 
 Bind2Backend::~Bind2Backend()
@@ -766,10 +995,124 @@ void Bind2Backend::doEmptyNonTerminals(BB2DomainInfo& bbd, bool nsec3zone, NSEC3
   }
 }
 
+//! pdnsutil launches us too, but it needs every zone parsed before it can do anything
+static bool servingQueries()
+{
+  return ::arg().parmIsset("receiver-threads");
+}
+
+//! counters for the bind-zones-* statistics
+uint64_t Bind2Backend::getLoadStat(const string& name)
+{
+  if(name == "bind-zones-queued")
+    return s_zonesQueued;
+  if(name == "bind-zones-parsed")
+    return s_zonesParsed;
+  return s_zonesFailed;
+}
+
+//! parses the zone, returns false and puts the reason in d_status if that fails. Does NOT add to s_state!
+bool Bind2Backend::loadZone(BB2DomainInfo& bbd, bool isNew)
+{
+  L<<Logger::Info<<d_logprefix<<" parsing '"<<bbd.d_name<<"' from file '"<<bbd.d_filename<<"'"<<endl;
+
+  bbd.d_queued=false;
+  try {
+    parseZoneFile(&bbd);
+    return true;
+  }
+  catch(PDNSException &ae) {
+    ostringstream msg;
+    msg<<" error at "+nowTime()+" parsing '"<<bbd.d_name<<"' from file '"<<bbd.d_filename<<"': "<<ae.reason;
+    bbd.d_status=msg.str();
+  }
+  catch(std::system_error &ae) {
+    ostringstream msg;
+    if (ae.code().value() == ENOENT && isNew && bbd.d_kind == DomainInfo::Slave)
+      msg<<" error at "+nowTime()<<" no file found for new slave domain '"<<bbd.d_name<<"'. Has not been AXFR'd yet";
+    else
+      msg<<" error at "+nowTime()+" parsing '"<<bbd.d_name<<"' from file '"<<bbd.d_filename<<"': "<<ae.what();
+    bbd.d_status=msg.str();
+  }
+  L<<Logger::Warning<<d_logprefix<<bbd.d_status<<endl;
+  return false;
+}
+
+/* Parses the queued zones with a pool of threads, each storing a zone in s_state as soon as it is
+   done with it. Every thread needs its own instance for the DNSSEC database, so this is static.
+   Returns the number of zones rejected. */
+unsigned int Bind2Backend::loadZones(const string& suffix, vector<QueuedZone>& zones, unsigned int threads, string *status)
+{
+  std::atomic<size_t> next(0);
+  std::atomic<unsigned int> rejected(0);
+  std::mutex statuslock;
+  DTime dt;
+  dt.set();
+  time_t lastReport = time(0);
+
+  auto worker = [&]() {
+    try {
+      Bind2Backend bb2(suffix, false);
+      for(size_t n = next++; n < zones.size(); n = next++) {
+        QueuedZone& qz = zones[n];
+        if(bb2.loadZone(qz.bbd, qz.isNew)) {
+          s_zonesParsed++;
+        }
+        else {
+          s_zonesFailed++;
+          rejected++;
+          if(status) {
+            std::lock_guard<std::mutex> l(statuslock);
+            *status+=qz.bbd.d_status;
+          }
+        }
+        safePutBBDomainInfo(qz.bbd);
+        s_zonesQueued--;
+
+        std::lock_guard<std::mutex> l(statuslock);
+        if(time(0) - lastReport >= 10) {
+          lastReport = time(0);
+          L<<Logger::Warning<<bb2.d_logprefix<<" Parsed "<<n+1<<" of "<<zones.size()<<" domain(s) in "<<dt.udiffNoReset()/1000000<<" s"<<endl;
+        }
+      }
+    }
+    catch(std::exception &e) {
+      L<<Logger::Error<<"[bind"<<suffix<<"backend] Zone loading thread failed: "<<e.what()<<endl;
+    }
+    catch(PDNSException &ae) {
+      L<<Logger::Error<<"[bind"<<suffix<<"backend] Zone loading thread failed: "<<ae.reason<<endl;
+    }
+  };
+
+  vector<std::thread> pool;
+  for(unsigned int n = 0; n < threads && n < zones.size(); ++n)
+    pool.emplace_back(worker);
+  for(auto& t : pool)
+    t.join();
+
+  return rejected;
+}
+
+//! the startup variant of loadZones: we are answering for the zones that are done while it runs
+void Bind2Backend::loadZonesInBackground(const string& suffix, vector<QueuedZone> zones, unsigned int threads)
+{
+  DTime dt;
+  dt.set();
+  unsigned int rejected = loadZones(suffix, zones, threads, nullptr);
+  s_loading = false;
+  L<<Logger::Error<<"[bind"<<suffix<<"backend] Done parsing domains in the background, "<<rejected<<" rejected, "<<zones.size()<<" parsed in "<<dt.udiff()/1000<<" ms"<<endl;
+}
+
 void Bind2Backend::loadConfig(string* status)
 {
   static int domain_id=1;
 
+  if(s_loading) {
+    if(status)
+      *status=" Still parsing the domains from startup, not rereading the configuration yet";
+    return;
+  }
+
   if(!getArg("config").empty()) {
     BindParser BP;
     try {
@@ -786,6 +1129,11 @@ void Bind2Backend::loadConfig(string* status)
     s_binddirectory=BP.getDirectory();
     //    ZP.setDirectory(d_binddirectory);
 
+    unsigned int threads=getArgAsNum("load-threads");
+    if(s_first && !servingQueries())
+      threads=0; // the load threads would wait for s_startup_lock, which we hold
+    vector<QueuedZone> queue;
+
     L<<Logger::Warning<<d_logprefix<<" Parsing "<<domains.size()<<" domain(s), will report when done"<<endl;
     
     set<DNSName> oldnames, newnames;
@@ -853,33 +1201,23 @@ void Bind2Backend::loadConfig(string* status)
 
         newnames.insert(bbd.d_name);
         if(filenameChanged || !bbd.d_loaded || !bbd.current()) {
-          L<<Logger::Info<<d_logprefix<<" parsing '"<<i->name<<"' from file '"<<i->filename<<"'"<<endl;
-
-          try {
-            parseZoneFile(&bbd);
+          if(threads) {
+            if(isNew) { // so it gets a SERVFAIL instead of a REFUSED while it waits
+              bbd.d_queued=true;
+              bbd.d_status="seen in named.conf, not parsed";
+              safePutBBDomainInfo(bbd);
+            }
+            queue.push_back({bbd, isNew});
+            s_zonesQueued++;
+            continue;
           }
-          catch(PDNSException &ae) {
-            ostringstream msg;
-            msg<<" error at "+nowTime()+" parsing '"<<i->name<<"' from file '"<<i->filename<<"': "<<ae.reason;
 
+          if(loadZone(bbd, isNew))
+            s_zonesParsed++;
+          else {
+            s_zonesFailed++;
             if(status)
-              *status+=msg.str();
-	    bbd.d_status=msg.str();
-
-            L<<Logger::Warning<<d_logprefix<<msg.str()<<endl;
-            rejected++;
-          }
-          catch(std::system_error &ae) {
-            ostringstream msg;
-            if (ae.code().value() == ENOENT && isNew && i->type == "slave")
-              msg<<" error at "+nowTime()<<" no file found for new slave domain '"<<i->name<<"'. Has not been AXFR'd yet";
-            else
-              msg<<" error at "+nowTime()+" parsing '"<<i->name<<"' from file '"<<i->filename<<"': "<<ae.what();
-
-            if(status)
-              *status+=msg.str();
-            bbd.d_status=msg.str();
-            L<<Logger::Warning<<d_logprefix<<msg.str()<<endl;
+              *status+=bbd.d_status;
             rejected++;
           }
 	  safePutBBDomainInfo(bbd);
@@ -901,7 +1239,15 @@ void Bind2Backend::loadConfig(string* status)
     newdomains=diff.size();
 
     ostringstream msg;
-    msg<<" Done parsing domains, "<<rejected<<" rejected, "<<newdomains<<" new, "<<remdomains<<" removed"; 
+    if(!queue.empty() && s_first) {
+      msg<<" Parsing "<<queue.size()<<" domain(s) in the background with "<<threads<<" thread(s), "<<rejected<<" rejected";
+      s_loading = true;
+      std::thread(loadZonesInBackground, d_suffix, std::move(queue), threads).detach();
+    }
+    else {
+      rejected += loadZones(d_suffix, queue, threads, status);
+      msg<<" Done parsing domains, "<<rejected<<" rejected, "<<newdomains<<" new, "<<remdomains<<" removed"; 
+    }
     if(status)
       *status=msg.str();
 
@@ -1351,6 +1697,7 @@ class Bind2Factory : public BackendFactory
          declare(suffix,"ignore-broken-records","Ignore records that are out-of-bound for the zone.","no");
          declare(suffix,"config","Location of named.conf","");
          declare(suffix,"check-interval","Interval for zonefile changes","0");
+         declare(suffix,"load-threads","Number of threads parsing zones, at startup in the background. 0 parses them before answering, one by one","0");
          declare(suffix,"supermaster-config","Location of (part of) named.conf where pdns can write zone-statements to","");
          declare(suffix,"supermasters","List of IP-addresses of supermasters","");
          declare(suffix,"supermaster-destdir","Destination directory for newly added slave zones",::arg()["config-dir"]);
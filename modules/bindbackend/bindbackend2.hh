@@ -26,6 +26,8 @@
 #include <string>
 #include <map>
 #include <set>
+#include <unordered_set>
+#include <atomic>
 #include <pthread.h>
 #include <time.h>
 #include <fstream>
@@ -162,6 +164,7 @@ public:
   DomainInfo::DomainKind d_kind; //!< the kind of domain
   string d_filename; //!< full absolute filename of the zone on disk
   string d_status; //!< message describing status of a domain, for human consumption
+  string d_nsec3param; //!< NSEC3PARAM the records were hashed with, empty if they were not
   vector<string> d_masters;     //!< IP address of the master of this domain
   set<string> d_also_notify; //!< IP list of hosts to also notify
   LookButDontTouch<recordstorage_t> d_records;  //!< the actual records belonging to this domain
@@ -172,6 +175,7 @@ public:
   mutable bool d_checknow; //!< if this domain has been flagged for a check
   bool d_loaded;  //!< if a domain is loaded
   bool d_wasRejectedLastReload{false}; //!< if the domain was rejected during Bind2Backend::queueReloadAndStore
+  bool d_queued{false}; //!< if the domain is waiting for a load thread to parse it
 
 private:
   time_t getCtime();
@@ -236,7 +240,13 @@ public:
   static pthread_rwlock_t s_state_lock;
 
   void parseZoneFile(BB2DomainInfo *bbd);
-  void insertRecord(BB2DomainInfo& bbd, const DNSName &qname, const QType &qtype, const string &content, int ttl, const std::string& hashed=string(), bool *auth=0);
+  static bool matchRecord(const recordstorage_t& previous, std::unordered_set<const Bind2DNSRecord*>& matched, const Bind2DNSRecord& bdr);
+  static string updateRecords(BB2DomainInfo& bbd, const recordstorage_t& previous, const std::unordered_set<const Bind2DNSRecord*>& matched, vector<Bind2DNSRecord>& added, bool nsec3zone, const NSEC3PARAMRecordContent& ns3pr, const string& nsec3param);
+  static bool applyDelta(BB2DomainInfo& bbd, const recordstorage_t& previous, const vector<const Bind2DNSRecord*>& removed, const vector<Bind2DNSRecord>& added, bool nsec3zone, const NSEC3PARAMRecordContent& ns3pr);
+  static bool makeRecord(const BB2DomainInfo& bb2, const DNSName &qname, const QType &qtype, const string &content, int ttl, Bind2DNSRecord& bdr);
+  static void insertRecord(BB2DomainInfo& bbd, const DNSName &qname, const QType &qtype, const string &content, int ttl, const std::string& hashed=string(), bool *auth=0);
+  static void fixupOrderAndAuth(BB2DomainInfo& bbd, bool nsec3zone, NSEC3PARAMRecordContent ns3pr);
+  static void doEmptyNonTerminals(BB2DomainInfo& bbd, bool nsec3zone, NSEC3PARAMRecordContent ns3pr);
   void rediscover(string *status=0) override;
 
   bool isMaster(const DNSName &name, const string &ip) override;
@@ -303,6 +313,7 @@ private:
   unique_ptr<SSqlStatement> d_getTSIGKeysQuery_stmt;
 
   string d_transaction_tmpname;
+  string d_suffix;
   string d_logprefix;
   set<string> alsoNotify; //!< this is used to store the also-notify list of interested peers.
   std::unique_ptr<ofstream> d_of;
@@ -311,8 +322,17 @@ private:
   static int s_first;                                  //!< this is raised on construction to prevent multiple instances of us being generated
   int d_transaction_id;
   static bool s_ignore_broken_records;
+  static std::atomic<bool> s_loading;                  //!< set while zones are being parsed in the background at startup
+  static std::atomic<uint64_t> s_zonesQueued, s_zonesParsed, s_zonesFailed; //!< progress of loadConfig, for the statistics
   bool d_hybrid;
 
+  //! a zone from named.conf that needs parsing, isNew is set if it was not in s_state before
+  struct QueuedZone
+  {
+    BB2DomainInfo bbd;
+    bool isNew;
+  };
+
   BB2DomainInfo createDomainEntry(const DNSName& domain, const string &filename); //!< does not insert in s_state
 
   void queueReloadAndStore(unsigned int id);
@@ -322,9 +342,11 @@ private:
   static string DLListRejectsHandler(const vector<string>&parts, Utility::pid_t ppid);
   static string DLReloadNowHandler(const vector<string>&parts, Utility::pid_t ppid);
   static string DLAddDomainHandler(const vector<string>&parts, Utility::pid_t ppid);
-  static void fixupOrderAndAuth(BB2DomainInfo& bbd, bool nsec3zone, NSEC3PARAMRecordContent ns3pr);
-  void doEmptyNonTerminals(BB2DomainInfo& bbd, bool nsec3zone, NSEC3PARAMRecordContent ns3pr);
   void loadConfig(string *status=0);
+  bool loadZone(BB2DomainInfo& bbd, bool isNew);
+  static unsigned int loadZones(const string& suffix, vector<QueuedZone>& zones, unsigned int threads, string *status);
+  static void loadZonesInBackground(const string& suffix, vector<QueuedZone> zones, unsigned int threads);
+  static uint64_t getLoadStat(const string& name);
   static void nukeZoneRecords(BB2DomainInfo *bbd);
 
 };
@@ -0,0 +1,259 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_MODULE unit
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <boost/test/unit_test.hpp>
+#include <boost/algorithm/string.hpp>
+
+#include "pdns/namespaces.hh"
+#include "pdns/arguments.hh"
+#include "pdns/dnsrecords.hh"
+#include "pdns/statbag.hh"
+#include "pdns/auth-packetcache.hh"
+#include "pdns/auth-querycache.hh"
+#include "pdns/auth-zoneindex.hh"
+#include "bindbackend2.hh"
+
+StatBag S;
+AuthPacketCache PC;
+AuthQueryCache QC;
+AuthZoneIndex g_zoneIndex;
+ArgvMap &arg()
+{
+  static ArgvMap arg;
+  return arg;
+};
+
+static const DNSName s_zone("example.com.");
+
+/* the records of a zone, relative to s_zone, as "name type content" */
+typedef vector<string> zone_t;
+
+static vector<DNSResourceRecord> makeRecords(const zone_t& zone)
+{
+  vector<DNSResourceRecord> ret;
+  for(const auto& line : zone) {
+    vector<string> parts;
+    stringtok(parts, line, " ");
+    DNSResourceRecord rr;
+    rr.qname = (parts.at(0) == "@" ? DNSName() : DNSName(parts.at(0))) + s_zone;
+    rr.qtype = parts.at(1);
+    rr.content = line.substr(parts.at(0).size() + parts.at(1).size() + 2);
+    rr.ttl = 3600;
+    ret.push_back(rr);
+  }
+  return ret;
+}
+
+static zone_t applyChanges(const zone_t& zone, const zone_t& removed, const zone_t& added)
+{
+  zone_t ret;
+  for(const auto& line : zone) {
+    if(std::find(removed.begin(), removed.end(), line) == removed.end())
+      ret.push_back(line);
+  }
+  ret.insert(ret.end(), added.begin(), added.end());
+  return ret;
+}
+
+/* what parseZoneFile() does when a zone is not loaded yet */
+static void fullLoad(BB2DomainInfo& bbd, const zone_t& zone, bool nsec3zone, const NSEC3PARAMRecordContent& ns3pr)
+{
+  bbd.d_records = shared_ptr<recordstorage_t>(new recordstorage_t());
+  for(const auto& rr : makeRecords(zone))
+    Bind2Backend::insertRecord(bbd, rr.qname, rr.qtype, rr.content, rr.ttl, "");
+  Bind2Backend::fixupOrderAndAuth(bbd, nsec3zone, ns3pr);
+  Bind2Backend::doEmptyNonTerminals(bbd, nsec3zone, ns3pr);
+  bbd.d_nsec3param = nsec3zone ? ns3pr.getZoneRepresentation() : string();
+}
+
+/* what parseZoneFile() does when a zone is reloaded */
+static string reload(BB2DomainInfo& bbd, const zone_t& zone, bool nsec3zone, const NSEC3PARAMRecordContent& ns3pr)
+{
+  const string nsec3param = nsec3zone ? ns3pr.getZoneRepresentation() : string();
+  shared_ptr<const recordstorage_t> previous = bbd.d_records.get();
+  std::unordered_set<const Bind2DNSRecord*> matched;
+  vector<Bind2DNSRecord> added;
+
+  for(const auto& rr : makeRecords(zone)) {
+    Bind2DNSRecord bdr;
+    BOOST_REQUIRE(Bind2Backend::makeRecord(bbd, rr.qname, rr.qtype, rr.content, rr.ttl, bdr));
+    if(!Bind2Backend::matchRecord(*previous, matched, bdr))
+      added.push_back(std::move(bdr));
+  }
+
+  const string how = Bind2Backend::updateRecords(bbd, *previous, matched, added, nsec3zone, ns3pr, nsec3param);
+  bbd.d_nsec3param = nsec3param;
+  return how;
+}
+
+static void checkSameRecords(const recordstorage_t& got, const recordstorage_t& expected)
+{
+  BOOST_CHECK_EQUAL(got.size(), expected.size());
+  auto iter = got.begin();
+  for(const auto& bdr : expected) {
+    if(iter == got.end()) {
+      BOOST_ERROR("missing "<<bdr.qname<<"|"<<QType(bdr.qtype).getName());
+      continue;
+    }
+    const string desc = bdr.qname.toString()+"|"+QType(bdr.qtype).getName()+"|"+bdr.content;
+    BOOST_CHECK_MESSAGE(iter->qname == bdr.qname && iter->qtype == bdr.qtype && iter->content == bdr.content && iter->ttl == bdr.ttl, "expected "<<desc<<", got "<<iter->qname<<"|"<<QType(iter->qtype).getName()<<"|"<<iter->content);
+    BOOST_CHECK_MESSAGE(iter->auth == bdr.auth, "auth of "<<desc);
+    BOOST_CHECK_MESSAGE(iter->nsec3hash == bdr.nsec3hash, "NSEC3 hash of "<<desc);
+    ++iter;
+  }
+}
+
+/* loads before, reloads it with the changes applied, and checks that the result is what a
+   full load of the new version of the zone gives, and that it was reloaded the expected way */
+static void checkReload(const zone_t& before, const zone_t& removed, const zone_t& added, const string& expectedHow, bool nsec3zone, const NSEC3PARAMRecordContent& ns3pr, const NSEC3PARAMRecordContent& newns3pr)
+{
+  const zone_t after = applyChanges(before, removed, added);
+
+  BB2DomainInfo bbd;
+  bbd.d_name = s_zone;
+  fullLoad(bbd, before, nsec3zone, ns3pr);
+
+  const string how = reload(bbd, after, nsec3zone, newns3pr);
+  BOOST_CHECK_MESSAGE(boost::starts_with(how, expectedHow), "zone was "<<how<<" instead of "<<expectedHow);
+
+  BB2DomainInfo expected;
+  expected.d_name = s_zone;
+  fullLoad(expected, after, nsec3zone, newns3pr);
+
+  checkSameRecords(*bbd.d_records.get(), *expected.d_records.get());
+}
+
+static const zone_t s_base = {
+  "@ SOA ns1.example.com. hostmaster.example.com. 1 3600 1800 1209600 300",
+  "@ NS ns1.example.com.",
+  "@ MX 10 mail.example.com.",
+  "ns1 A 192.0.2.1",
+  "www A 192.0.2.2",
+  "www AAAA 2001:db8::2",
+  "mail A 192.0.2.3",
+  "a.b.c A 192.0.2.4",
+  "y A 192.0.2.5",
+  "deep.x.y A 192.0.2.6",
+  "sub NS ns.sub.example.com.",
+  "ns.sub A 192.0.2.7",
+  "signed NS ns.example.net.",
+  "signed DS 12345 13 2 0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef",
+  "txt1 TXT \"1\"",
+  "txt2 TXT \"2\"",
+  "txt3 TXT \"3\"",
+  "txt4 TXT \"4\"",
+  "txt5 TXT \"5\"",
+  "txt6 TXT \"6\"",
+  "txt7 TXT \"7\"",
+  "txt8 TXT \"8\"",
+};
+
+struct ReloadCase
+{
+  string description;
+  zone_t removed;
+  zone_t added;
+  string how;
+};
+
+static const vector<ReloadCase> s_cases = {
+  { "added name", {}, { "new A 192.0.2.50" }, "incremental" },
+  { "added record to an existing name", {}, { "mail AAAA 2001:db8::3" }, "incremental" },
+  { "changed record", { "www A 192.0.2.2" }, { "www A 192.0.2.20" }, "incremental" },
+  { "removed name", { "mail A 192.0.2.3" }, {}, "incremental" },
+  { "ENT creation", {}, { "q.r.s A 192.0.2.51" }, "incremental" },
+  { "ENT creation below an existing ENT", {}, { "z.b.c A 192.0.2.52" }, "incremental" },
+  { "ENT removal", { "a.b.c A 192.0.2.4" }, {}, "incremental" },
+  { "ENT becoming a name", {}, { "b.c TXT \"not empty anymore\"" }, "incremental" },
+  { "record below a delegation", {}, { "host.sub A 192.0.2.53" }, "incremental" },
+  { "ENT below a delegation", {}, { "deeper.host.sub A 192.0.2.54" }, "incremental" },
+  { "name becoming an ENT", { "y A 192.0.2.5" }, {}, "rebuilt" },
+  { "added delegation", {}, { "sub2 NS ns.example.net." }, "rebuilt" },
+  { "removed delegation", { "sub NS ns.sub.example.com." }, {}, "rebuilt" },
+  { "changed DS", { "signed DS 12345 13 2 0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef" }, { "signed DS 54321 13 2 0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef" }, "rebuilt" },
+  { "more than half of the zone changed", { "txt1 TXT \"1\"", "txt2 TXT \"2\"", "txt3 TXT \"3\"", "txt4 TXT \"4\"", "txt5 TXT \"5\"", "txt6 TXT \"6\"", "txt7 TXT \"7\"", "txt8 TXT \"8\"" }, { "txt1 TXT \"one\"", "txt2 TXT \"two\"", "txt3 TXT \"three\"", "txt4 TXT \"four\"", "txt5 TXT \"five\"", "txt6 TXT \"six\"", "txt7 TXT \"seven\"", "txt8 TXT \"eight\"" }, "rebuilt" },
+};
+
+struct BindbackendSetup {
+  BindbackendSetup() {
+    ::arg().set("max-ent-entries")="100000";
+    reportAllTypes();
+  }
+};
+
+BOOST_GLOBAL_FIXTURE( BindbackendSetup );
+
+BOOST_AUTO_TEST_SUITE(bindbackend2_cc)
+
+BOOST_AUTO_TEST_CASE(test_reload_unchanged) {
+  const NSEC3PARAMRecordContent ns3pr("1 0 1 abcd");
+  BB2DomainInfo bbd;
+  bbd.d_name = s_zone;
+  fullLoad(bbd, s_base, false, ns3pr);
+  auto previous = bbd.d_records.get();
+
+  BOOST_CHECK_EQUAL(reload(bbd, s_base, false, ns3pr), "unchanged");
+  /* the records in memory are kept as they are */
+  BOOST_CHECK(bbd.d_records.get() == previous);
+}
+
+BOOST_AUTO_TEST_CASE(test_reload_changes) {
+  const NSEC3PARAMRecordContent ns3pr("1 0 1 abcd");
+  for(const auto& test : s_cases) {
+    BOOST_TEST_MESSAGE(test.description);
+    checkReload(s_base, test.removed, test.added, test.how, false, ns3pr, ns3pr);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_reload_changes_nsec3) {
+  const NSEC3PARAMRecordContent ns3pr("1 0 1 abcd");
+  for(const auto& test : s_cases) {
+    BOOST_TEST_MESSAGE(test.description);
+    checkReload(s_base, test.removed, test.added, test.how, true, ns3pr, ns3pr);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_reload_changes_nsec3_optout) {
+  /* with opt-out, empty non-terminals depend on their descendants so every change is rebuilt */
+  const NSEC3PARAMRecordContent ns3pr("1 1 1 abcd");
+  for(const auto& test : s_cases) {
+    BOOST_TEST_MESSAGE(test.description);
+    checkReload(s_base, test.removed, test.added, "rebuilt", true, ns3pr, ns3pr);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_reload_nsec3param_changed) {
+  const NSEC3PARAMRecordContent ns3pr("1 0 1 abcd");
+  const NSEC3PARAMRecordContent newns3pr("1 0 5 beef");
+
+  /* every hash has to be computed again, even when the records did not change */
+  checkReload(s_base, {}, {}, "rebuilt", true, ns3pr, newns3pr);
+  checkReload(s_base, {}, { "new A 192.0.2.50" }, "rebuilt", true, ns3pr, newns3pr);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
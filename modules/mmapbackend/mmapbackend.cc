@@ -0,0 +1,337 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <dirent.h>
+#include <sys/stat.h>
+#include "pdns/arguments.hh"
+#include "pdns/dnspacket.hh"
+#include "pdns/logger.hh"
+#include "pdns/misc.hh"
+#include "pdns/pdnsexception.hh"
+#include "mmapbackend.hh"
+
+static const string backendname="[MMapBackend]";
+
+GlobalStateHolder<MMapBackend::State> MMapBackend::s_state;
+std::mutex MMapBackend::s_loadLock;
+bool MMapBackend::s_loaded;
+
+MMapBackend::MMapBackend(const string& suffix) : d_state(s_state.getLocal())
+{
+  setArgPrefix("mmap"+suffix);
+  d_mustlog = ::arg().mustDo("query-logging");
+
+  std::lock_guard<std::mutex> l(s_loadLock);
+  if(!s_loaded) {
+    loadDirectory(getArg("directory"), nullptr);
+    s_loaded = true;
+  }
+}
+
+/* (re)opens the compiled zones in directory. Files that did not change since the last scan
+   keep their mapping, so a rediscover only costs a stat() per unchanged zone */
+void MMapBackend::loadDirectory(const string& directory, string* status)
+{
+  DIR* dir = opendir(directory.c_str());
+  if(!dir) {
+    throw PDNSException(backendname+" Unable to open directory '"+directory+"': "+stringerror());
+  }
+
+  vector<string> fnames;
+  struct dirent* entry;
+  while((entry = readdir(dir))) {
+    string fname(entry->d_name);
+    if(fname.size() > 4 && fname.compare(fname.size() - 4, 4, ".mmz") == 0) {
+      fnames.push_back(directory+"/"+fname);
+    }
+  }
+  closedir(dir);
+  sort(fnames.begin(), fnames.end());
+
+  State old = s_state.getCopy();
+  State state;
+  state.ids = old.ids;
+  state.nextId = old.nextId;
+
+  unsigned int opened = 0, failed = 0;
+  map<DNSName, string> seen;
+  for(const auto& fname : fnames) {
+    struct stat st;
+    if(stat(fname.c_str(), &st) < 0) {
+      L<<Logger::Error<<backendname<<" Unable to stat '"<<fname<<"': "<<stringerror()<<endl;
+      failed++;
+      continue;
+    }
+
+    ZoneFile zf;
+    auto known = old.files.find(fname);
+    if(known != old.files.end() && known->second.inode == st.st_ino && known->second.mtime == st.st_mtime && known->second.size == st.st_size) {
+      zf = known->second;
+    }
+    else {
+      try {
+        zf.zone = std::make_shared<const MMapZone>(fname);
+      }
+      catch(const PDNSException& e) {
+        L<<Logger::Error<<backendname<<" "<<e.reason<<endl;
+        failed++;
+        continue;
+      }
+      zf.inode = st.st_ino;
+      zf.mtime = st.st_mtime;
+      zf.size = st.st_size;
+      opened++;
+    }
+
+    const DNSName& zone = zf.zone->getZone();
+    auto dup = seen.find(zone);
+    if(dup != seen.end()) {
+      L<<Logger::Error<<backendname<<" Zone '"<<zone<<"' is in both '"<<dup->second<<"' and '"<<fname<<"', ignoring the latter"<<endl;
+      failed++;
+      continue;
+    }
+    seen[zone] = fname;
+
+    auto id = state.ids.find(zone);
+    if(id == state.ids.end()) {
+      id = state.ids.insert({zone, state.nextId++}).first;
+    }
+    state.zones[id->second] = zf.zone;
+    state.files[fname] = zf;
+  }
+
+  s_state.setState(state);
+
+  string msg = "Serving "+std::to_string(state.zones.size())+" compiled zones from '"+directory+"', opened "+std::to_string(opened)+", "+std::to_string(failed)+" failed";
+  L<<Logger::Warning<<backendname<<" "<<msg<<endl;
+  if(status) {
+    *status = msg;
+  }
+}
+
+void MMapBackend::rediscover(string* status)
+{
+  std::lock_guard<std::mutex> l(s_loadLock);
+  loadDirectory(getArg("directory"), status);
+}
+
+std::shared_ptr<const MMapZone> MMapBackend::findZone(const DNSName& zone, uint32_t& id)
+{
+  auto iter = d_state->ids.find(zone);
+  if(iter == d_state->ids.end()) {
+    return nullptr;
+  }
+  auto zonesIter = d_state->zones.find(iter->second);
+  if(zonesIter == d_state->zones.end()) {
+    return nullptr;
+  }
+  id = iter->second;
+  return zonesIter->second;
+}
+
+void MMapBackend::lookup(const QType& qtype, const DNSName& qname, DNSPacket* pkt_p, int zoneId)
+{
+  d_zone.reset();
+  d_list = false;
+  d_record = d_records = 0;
+
+  if(d_mustlog)
+    L<<Logger::Warning<<"Lookup for '"<<qtype.getName()<<"' of '"<<qname<<"' within zoneID "<<zoneId<<endl;
+
+  DNSName domain(qname);
+  uint32_t id = 0;
+  std::shared_ptr<const MMapZone> zone;
+  do {
+    zone = findZone(domain, id);
+  } while((!zone || (zoneId != -1 && zoneId != static_cast<int>(id))) && domain.chopOff());
+
+  if(!zone || (zoneId != -1 && zoneId != static_cast<int>(id))) {
+    if(d_mustlog)
+      L<<Logger::Warning<<"Found no authoritative zone for "<<qname<<endl;
+    return;
+  }
+
+  uint32_t index;
+  if(!zone->findName(qname.makeRelative(domain), index)) {
+    return;
+  }
+
+  const auto& entry = zone->getNameEntry(index);
+  d_zone = zone;
+  d_zoneId = id;
+  d_qname = qname;
+  d_qtype = qtype;
+  d_record = entry.firstRecord;
+  d_records = entry.firstRecord + entry.recordCount;
+}
+
+bool MMapBackend::list(const DNSName& target, int domain_id, bool include_disabled)
+{
+  d_zone.reset();
+  d_record = d_records = 0;
+
+  auto iter = d_state->zones.find(domain_id);
+  if(iter == d_state->zones.end()) {
+    return false;
+  }
+
+  d_zone = iter->second;
+  d_zoneId = domain_id;
+  d_qtype = QType::ANY;
+  d_list = true;
+  d_name = 0;
+  d_names = d_zone->getNameCount();
+  return true;
+}
+
+bool MMapBackend::get(DNSResourceRecord& rr)
+{
+  if(!d_zone) {
+    return false;
+  }
+
+  for(;;) {
+    while(d_list && d_record == d_records) {
+      if(d_name == d_names) {
+        d_zone.reset();
+        return false;
+      }
+      const auto& entry = d_zone->getNameEntry(d_name);
+      d_qname = d_zone->getName(d_name) + d_zone->getZone();
+      d_record = entry.firstRecord;
+      d_records = entry.firstRecord + entry.recordCount;
+      d_name++;
+    }
+    if(d_record == d_records) {
+      d_zone.reset();
+      return false;
+    }
+
+    d_zone->getRecord(d_record++, rr);
+    if(d_qtype.getCode() == QType::ANY || rr.qtype == d_qtype) {
+      break;
+    }
+  }
+
+  rr.qname = d_qname;
+  rr.domain_id = d_zoneId;
+  rr.qclass = QClass::IN;
+  rr.last_modified = 0;
+  rr.disabled = false;
+  return true;
+}
+
+//! the compiler stores the SOA as the first record of the apex
+static uint32_t getSerial(const MMapZone& zone)
+{
+  uint32_t index;
+  if(!zone.findName(g_rootdnsname, index) || !zone.getNameEntry(index).recordCount) {
+    return 0;
+  }
+
+  DNSResourceRecord rr;
+  zone.getRecord(zone.getNameEntry(index).firstRecord, rr);
+  if(rr.qtype != QType::SOA) {
+    return 0;
+  }
+  SOAData sd;
+  fillSOAData(rr.content, sd);
+  return sd.serial;
+}
+
+void MMapBackend::getAllDomains(vector<DomainInfo>* domains, bool include_disabled)
+{
+  for(const auto& zone : d_state->zones) {
+    DomainInfo di;
+    di.id = zone.first;
+    di.zone = zone.second->getZone();
+    di.kind = DomainInfo::Native;
+    di.backend = this;
+    di.serial = getSerial(*zone.second);
+    domains->push_back(di);
+  }
+}
+
+bool MMapBackend::getDomainInfo(const DNSName& domain, DomainInfo& di)
+{
+  uint32_t id;
+  auto zone = findZone(domain, id);
+  if(!zone) {
+    return false;
+  }
+
+  di.id = id;
+  di.zone = zone->getZone();
+  di.kind = DomainInfo::Native;
+  di.backend = this;
+  di.serial = getSerial(*zone);
+  return true;
+}
+
+bool MMapBackend::getBeforeAndAfterNamesAbsolute(uint32_t id, const DNSName& qname, DNSName& unhashed, DNSName& before, DNSName& after)
+{
+  auto iter = d_state->zones.find(id);
+  if(iter == d_state->zones.end()) {
+    return false;
+  }
+
+  const auto& zone = iter->second;
+  if(zone->isNSEC3()) {
+    return zone->getBeforeAndAfterHashed(qname, unhashed, before, after);
+  }
+  unhashed = qname;
+  return zone->getBeforeAndAfterUnhashed(qname, before, after);
+}
+
+class MMapFactory : public BackendFactory
+{
+public:
+  MMapFactory() : BackendFactory("mmap") {}
+
+  void declareArguments(const string& suffix="")
+  {
+    declare(suffix, "directory", "Directory holding the zones compiled by 'pdnsutil compile-zone', as .mmz files", "./");
+  }
+
+  DNSBackend* make(const string& suffix="")
+  {
+    return new MMapBackend(suffix);
+  }
+};
+
+class MMapLoader
+{
+public:
+  MMapLoader()
+  {
+    BackendMakers().report(new MMapFactory);
+    L << Logger::Info << "[mmapbackend] This is the mmap backend version " VERSION
+#ifndef REPRODUCIBLE
+      << " (" __DATE__ " " __TIME__ ")"
+#endif
+      << " reporting" << endl;
+  }
+};
+
+static MMapLoader mmaploader;
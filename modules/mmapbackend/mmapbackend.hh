@@ -0,0 +1,86 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+#include <map>
+#include <memory>
+#include <sys/types.h>
+#include "pdns/dnsbackend.hh"
+#include "pdns/mmapzone.hh"
+#include "pdns/sholder.hh"
+
+/** Serves zones compiled with 'pdnsutil compile-zone' from mmap()ed files, read only.
+
+    All instances share the zones through a GlobalStateHolder, so lookups never take a lock and
+    a rediscover swaps in new files while queries in flight keep using the old mappings. */
+class MMapBackend : public DNSBackend
+{
+public:
+  MMapBackend(const string& suffix="");
+
+  void lookup(const QType& qtype, const DNSName& qname, DNSPacket* pkt_p=0, int zoneId=-1) override;
+  bool get(DNSResourceRecord& rr) override;
+  bool list(const DNSName& target, int domain_id, bool include_disabled=false) override;
+  void getAllDomains(vector<DomainInfo>* domains, bool include_disabled=false) override;
+  bool getDomainInfo(const DNSName& domain, DomainInfo& di) override;
+  bool getBeforeAndAfterNamesAbsolute(uint32_t id, const DNSName& qname, DNSName& unhashed, DNSName& before, DNSName& after) override;
+  bool doesDNSSEC() override
+  {
+    return true;
+  }
+  void rediscover(string* status=0) override;
+
+private:
+  struct ZoneFile
+  {
+    std::shared_ptr<const MMapZone> zone;
+    ino_t inode;
+    time_t mtime;
+    off_t size;
+  };
+
+  struct State
+  {
+    std::map<string, ZoneFile> files;
+    std::map<DNSName, uint32_t> ids; //!< kept for zones that went away, so ids stay stable
+    std::map<uint32_t, std::shared_ptr<const MMapZone>> zones;
+    uint32_t nextId{1};
+  };
+
+  static void loadDirectory(const string& directory, string* status);
+  std::shared_ptr<const MMapZone> findZone(const DNSName& zone, uint32_t& id);
+
+  static GlobalStateHolder<State> s_state;
+  static std::mutex s_loadLock;
+  static bool s_loaded;
+
+  LocalStateHolder<State> d_state;
+  std::shared_ptr<const MMapZone> d_zone;
+  DNSName d_qname;
+  QType d_qtype;
+  uint32_t d_zoneId{0};
+  uint32_t d_name{0};
+  uint32_t d_names{0};
+  uint32_t d_record{0};
+  uint32_t d_records{0};
+  bool d_list{false};
+  bool d_mustlog;
+};
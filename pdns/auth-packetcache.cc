@@ -76,7 +76,6 @@ bool AuthPacketCache::get(DNSPacket *p, DNSPacket *cached)
   p->setHash(hash);
 
   string value;
-  bool haveSomething;
   time_t now = time(nullptr);
   auto& mc = getMap(p->qdomain);
   {
@@ -86,10 +85,13 @@ bool AuthPacketCache::get(DNSPacket *p, DNSPacket *cached)
       return false;
     }
 
-    haveSomething = getEntryLocked(mc.d_map, hash, p->qdomain, p->qtype.getCode(), p->d_tcp, now, value);
+    const CacheEntry* entry = getEntryLocked(mc.d_map, hash, p->qdomain, p->qtype.getCode(), p->d_tcp, now);
+    if (entry) {
+      value = entry->value;
+    }
   }
 
-  if (!haveSomething) {
+  if (value.empty()) {
     (*d_statnummiss)++;
     return false;
   }
@@ -106,6 +108,204 @@ bool AuthPacketCache::get(DNSPacket *p, DNSPacket *cached)
   return true;
 }
 
+/* the answer is copied straight from the cache to buffer, and only its header
+   and question are patched to match the query, no DNSPacket is involved */
+size_t AuthPacketCache::getUDP(DNSPacket *p, char* buffer, size_t bufferSize)
+{
+  cleanupIfNeeded();
+
+  if(!d_ttl) {
+    (*d_statnummiss)++;
+    return 0;
+  }
+
+  const string& query = p->getString();
+  uint32_t hash;
+  size_t size = getRaw(query.c_str(), query.size(), p->qdomain, p->qtype.getCode(), p->d_tcp, hash, buffer, bufferSize);
+  p->setHash(hash);
+  return size;
+}
+
+size_t AuthPacketCache::getUDP(const char* query, size_t querySize, const DNSName& qname, uint16_t qtype, uint32_t& hash, char* buffer, size_t bufferSize)
+{
+  cleanupIfNeeded();
+
+  hash = 0;
+  if(!d_ttl) {
+    (*d_statnummiss)++;
+    return 0;
+  }
+
+  return getRaw(query, querySize, qname, qtype, false, hash, buffer, bufferSize);
+}
+
+size_t AuthPacketCache::getRaw(const char* query, size_t querySize, const DNSName& qname, uint16_t qtype, bool tcp, uint32_t& hash, char* buffer, size_t bufferSize)
+{
+  hash = canHashPacket(query, querySize, false);
+
+  time_t now = time(nullptr);
+  size_t size = 0;
+  if(d_fastEntries && !tcp) {
+    size = getFast(query, querySize, hash, qname, now, buffer, bufferSize);
+  }
+
+  if(size == 0) {
+    time_t ttd = 0;
+    /* a purge clearing the main cache after we read the answer from it bumps the generation afterwards */
+    const uint32_t generation = d_fastGeneration;
+    auto& mc = getMap(qname);
+    {
+      TryReadLock rl(&mc.d_mut);
+      if(!rl.gotIt()) {
+        S.inc("deferred-packetcache-lookup");
+        return 0;
+      }
+
+      const CacheEntry* entry = getEntryLocked(mc.d_map, hash, qname, qtype, tcp, now);
+      if(entry && entry->value.size() <= bufferSize) {
+        size = entry->value.size();
+        ttd = entry->ttd;
+        memcpy(buffer, entry->value.c_str(), size);
+      }
+    }
+
+    if(size == 0) {
+      (*d_statnummiss)++;
+      return 0;
+    }
+
+    if(d_fastEntries && !tcp) {
+      insertFast(query, querySize, hash, buffer, size, now, ttd, generation);
+    }
+  }
+
+  if(size < sizeof(dnsheader) + qname.wirelength()) {
+    (*d_statnummiss)++;
+    return 0;
+  }
+
+  (*d_statnumhit)++;
+  /* the ID, the flags and the question of the query and of the cached one are the same,
+     except for the ID and the case of the qname */
+  memcpy(buffer, query, 2);
+  memcpy(buffer + sizeof(dnsheader), query + sizeof(dnsheader), qname.wirelength());
+
+  return size;
+}
+
+size_t AuthPacketCache::getFast(const char* query, size_t querySize, uint32_t hash, const DNSName& qname, time_t now, char* buffer, size_t bufferSize) const
+{
+  const uint32_t generation = d_fastGeneration;
+  const size_t qnameEnd = sizeof(dnsheader) + qname.wirelength();
+
+  for(size_t probe = 0; probe < s_fastProbes; ++probe) {
+    const FastEntry& entry = d_fastEntries[(hash + probe) & d_fastMask];
+
+    const uint32_t seq = entry.seq.load(std::memory_order_acquire);
+    if(seq & 1) {
+      continue;
+    }
+
+    if(entry.hash != hash || entry.generation != generation || entry.ttd < now) {
+      continue;
+    }
+
+    /* everything we read from the entry might be inconsistent until we have checked the sequence
+       number again, but never make us read outside of it */
+    const size_t entryQuerySize = entry.querySize;
+    const size_t responseSize = entry.responseSize;
+    if(entryQuerySize + 2 != querySize || entryQuerySize + responseSize > FastEntry::s_dataSize || responseSize > bufferSize) {
+      continue;
+    }
+
+    /* the flags and counts, the qname case insensitively, then the rest of the query */
+    if(memcmp(entry.data, query + 2, sizeof(dnsheader) - 2) != 0) {
+      continue;
+    }
+    bool match = true;
+    for(size_t pos = sizeof(dnsheader); pos < qnameEnd; ++pos) {
+      if(dns_tolower(entry.data[pos - 2]) != dns_tolower(query[pos])) {
+        match = false;
+        break;
+      }
+    }
+    if(!match || memcmp(entry.data + qnameEnd - 2, query + qnameEnd, querySize - qnameEnd) != 0) {
+      continue;
+    }
+
+    memcpy(buffer, entry.data + entryQuerySize, responseSize);
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if(entry.seq.load(std::memory_order_relaxed) != seq) {
+      continue;
+    }
+
+    return responseSize;
+  }
+
+  return 0;
+}
+
+void AuthPacketCache::insertFast(const char* query, size_t querySize, uint32_t hash, const char* response, size_t responseSize, time_t now, time_t ttd, uint32_t generation)
+{
+  if(querySize < sizeof(dnsheader) || querySize - 2 + responseSize > FastEntry::s_dataSize || d_fastGeneration != generation) {
+    return;
+  }
+
+  FastEntry* target = nullptr;
+  for(size_t probe = 0; probe < s_fastProbes; ++probe) {
+    FastEntry& entry = d_fastEntries[(hash + probe) & d_fastMask];
+    /* we don't bother checking the sequence number, the worst case is a slightly worse choice */
+    if(entry.hash == hash || entry.generation != generation || entry.ttd < now) {
+      target = &entry;
+      break;
+    }
+    if(!target || entry.ttd < target->ttd) {
+      target = &entry;
+    }
+  }
+
+  uint32_t seq = target->seq.load(std::memory_order_relaxed);
+  if((seq & 1) || !target->seq.compare_exchange_strong(seq, seq + 1, std::memory_order_acquire)) {
+    S.inc("deferred-packetcache-inserts");
+    return;
+  }
+  std::atomic_thread_fence(std::memory_order_release);
+
+  /* the answer is from before a purge, don't bother. Should a purge happen from now on, the
+     entry is stored with the generation that purge leaves behind */
+  if(d_fastGeneration != generation) {
+    target->seq.store(seq + 2, std::memory_order_release);
+    return;
+  }
+
+  target->hash = hash;
+  target->generation = generation;
+  target->ttd = ttd;
+  target->querySize = querySize - 2;
+  target->responseSize = responseSize;
+  memcpy(target->data, query + 2, querySize - 2);
+  memcpy(target->data + querySize - 2, response, responseSize);
+
+  target->seq.store(seq + 2, std::memory_order_release);
+}
+
+void AuthPacketCache::setFastEntries(size_t entries)
+{
+  if(entries == 0) {
+    d_fastEntries.reset();
+    d_fastMask = 0;
+    return;
+  }
+
+  size_t size = 1;
+  while(size < entries) {
+    size <<= 1;
+  }
+  d_fastEntries = std::unique_ptr<FastEntry[]>(new FastEntry[size]);
+  d_fastMask = size - 1;
+}
+
 void AuthPacketCache::insert(DNSPacket *q, DNSPacket *r, unsigned int maxTTL)
 {
   cleanupIfNeeded();
@@ -124,6 +324,7 @@ void AuthPacketCache::insert(DNSPacket *q, DNSPacket *r, unsigned int maxTTL)
 
   uint32_t hash = q->getHash();
   time_t now = time(nullptr);
+  const uint32_t generation = d_fastGeneration; // the answer might be from before a purge that is running
   CacheEntry entry;
   entry.hash = hash;
   entry.created = now;
@@ -152,16 +353,22 @@ void AuthPacketCache::insert(DNSPacket *q, DNSPacket *r, unsigned int maxTTL)
       iter->value = entry.value;
       iter->ttd = now + ourttl;
       iter->created = now;
-      return;
+      break;
     }
 
-    /* no existing entry found to refresh */
-    mc.d_map.insert(entry);
-    (*d_statnumentries)++;
+    if(iter == range.second) {
+      /* no existing entry found to refresh */
+      mc.d_map.insert(entry);
+      (*d_statnumentries)++;
+    }
+  }
+
+  if(d_fastEntries && !entry.tcp) {
+    insertFast(q->getString().c_str(), q->getString().size(), hash, entry.value.c_str(), entry.value.size(), now, entry.ttd, generation);
   }
 }
 
-bool AuthPacketCache::getEntryLocked(cmap_t& map, uint32_t hash, const DNSName &qname, uint16_t qtype, bool tcp, time_t now, string& value)
+const AuthPacketCache::CacheEntry* AuthPacketCache::getEntryLocked(cmap_t& map, uint32_t hash, const DNSName &qname, uint16_t qtype, bool tcp, time_t now)
 {
   auto& idx = map.get<HashTag>();
   auto range = idx.equal_range(hash);
@@ -173,25 +380,28 @@ bool AuthPacketCache::getEntryLocked(cmap_t& map, uint32_t hash, const DNSName &
     if (iter->tcp != tcp || iter->qtype != qtype || iter->qname != qname)
       continue;
 
-    value = iter->value;
-    return true;
+    return &(*iter);
   }
 
-  return false;
+  return nullptr;
 }
 
-/* clears the entire cache. */
+/* clears the entire cache. The lock-free table is invalidated once the main cache is empty,
+   so that an answer that was read from the main cache before cannot be stored in it again */
 uint64_t AuthPacketCache::purge()
 {
   d_statnumentries->store(0);
+  uint64_t delcount = purgeLockedCollectionsVector(d_maps);
+  d_fastGeneration++;
 
-  return purgeLockedCollectionsVector(d_maps);
+  return delcount;
 }
 
 uint64_t AuthPacketCache::purgeExact(const DNSName& qname)
 {
   auto& mc = getMap(qname);
   uint64_t delcount = purgeExactLockedCollection(mc, qname);
+  d_fastGeneration++;
 
   *d_statnumentries -= delcount;
 
@@ -206,6 +416,7 @@ uint64_t AuthPacketCache::purge(const string &match)
   if(ends_with(match, "$")) {
     delcount = purgeLockedCollectionsVector(d_maps, match);
     *d_statnumentries -= delcount;
+    d_fastGeneration++;
   }
   else {
     delcount = purgeExact(DNSName(match));
@@ -22,6 +22,8 @@
 #ifndef AUTH_PACKETCACHE_HH
 #define AUTH_PACKETCACHE_HH
 
+#include <atomic>
+#include <memory>
 #include <string>
 #include <map>
 #include "dns.hh"
@@ -44,6 +46,12 @@ using namespace ::boost::multi_index;
 
     The cache itself is protected by a read/write lock. Because deleting is a two step process, which 
     first marks and then sweeps, a second lock is present to prevent simultaneous inserts and deletes.
+
+    Small UDP answers can also be stored in a flat, open-addressed table of fixed-size entries, each
+    protected by a sequence lock. A lookup in that table never writes to shared memory: it copies the
+    entry optimistically, then checks that no writer touched it in the meantime. Purging only bumps
+    the generation of the table, invalidating all its entries at once, since everything in it can
+    still be found in the main cache.
 */
 
 class AuthPacketCache : public PacketCache
@@ -55,6 +63,8 @@ public:
   void insert(DNSPacket *q, DNSPacket *r, uint32_t maxTTL);  //!< We copy the contents of *p into our cache. Do not needlessly call this to insert questions already in the cache as it wastes resources
 
   bool get(DNSPacket *p, DNSPacket *q); //!< We return a dynamically allocated copy out of our cache. You need to delete it. You also need to spoof in the right ID with the DNSPacket.spoofID() method.
+  size_t getUDP(DNSPacket *p, char* buffer, size_t bufferSize); //!< Copies the answer into buffer, with the ID and qname case of p already set, returns its size or 0 on a miss.
+  size_t getUDP(const char* query, size_t querySize, const DNSName& qname, uint16_t qtype, uint32_t& hash, char* buffer, size_t bufferSize); //!< Same, straight from the wire format of a UDP query. hash is set for a later insert()
 
   void cleanup(); //!< force the cache to preen itself from expired packets
   uint64_t purge();
@@ -71,6 +81,7 @@ public:
   {
     d_ttl = ttl;
   }  
+  void setFastEntries(size_t entries); //!< size of the lock-free table for small UDP answers, rounded up to a power of two. 0 disables it
 private:
 
   struct CacheEntry
@@ -109,9 +120,31 @@ private:
     return d_maps[name.hash() % d_maps.size()];
   }
 
-  bool getEntryLocked(cmap_t& map, uint32_t hash, const DNSName &qname, uint16_t qtype, bool tcp, time_t now, string& entry);
+  struct FastEntry
+  {
+    static const size_t s_dataSize = 1000;
+
+    std::atomic<uint32_t> seq{0}; // odd while a writer is updating the entry
+    uint32_t hash{0};
+    uint32_t generation{0};
+    uint16_t querySize{0}; // the query, minus its ID, is stored first in data
+    uint16_t responseSize{0};
+    time_t ttd{0};
+    char data[s_dataSize];
+  };
+
+  size_t getRaw(const char* query, size_t querySize, const DNSName& qname, uint16_t qtype, bool tcp, uint32_t& hash, char* buffer, size_t bufferSize);
+  size_t getFast(const char* query, size_t querySize, uint32_t hash, const DNSName& qname, time_t now, char* buffer, size_t bufferSize) const;
+  void insertFast(const char* query, size_t querySize, uint32_t hash, const char* response, size_t responseSize, time_t now, time_t ttd, uint32_t generation);
+
+  const CacheEntry* getEntryLocked(cmap_t& map, uint32_t hash, const DNSName &qname, uint16_t qtype, bool tcp, time_t now);
   void cleanupIfNeeded();
 
+  std::unique_ptr<FastEntry[]> d_fastEntries;
+  size_t d_fastMask{0};
+  std::atomic<uint32_t> d_fastGeneration{0};
+  static const size_t s_fastProbes=4;
+
   AtomicCounter d_ops{0};
   AtomicCounter *d_statnumhit;
   AtomicCounter *d_statnummiss;
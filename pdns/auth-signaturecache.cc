@@ -0,0 +1,209 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "auth-signaturecache.hh"
+
+const time_t AuthSignatureCache::s_renewWindow;
+
+AuthSignatureCache::AuthSignatureCache(uint64_t maxEntries, size_t shardsCount): d_shards(shardsCount)
+{
+  for(auto& shard : d_shards) {
+    pthread_rwlock_init(&shard.d_mut, 0);
+  }
+  d_maxShardEntries = std::max(maxEntries / shardsCount, static_cast<uint64_t>(1));
+}
+
+AuthSignatureCache::~AuthSignatureCache()
+{
+  for(auto& shard : d_shards) {
+    pthread_rwlock_destroy(&shard.d_mut);
+  }
+}
+
+// the second half of the key is an MD5 sum, as good a hash as any
+size_t AuthSignatureCache::KeyHash::operator()(const key_t& key) const
+{
+  size_t ret;
+  if(key.second.size() < sizeof(ret))
+    return std::hash<string>()(key.second);
+  memcpy(&ret, key.second.c_str(), sizeof(ret));
+  return ret;
+}
+
+AuthSignatureCache::Shard& AuthSignatureCache::getShard(const key_t& key)
+{
+  uint32_t ret = 0;
+  if(key.second.size() >= sizeof(size_t) + sizeof(ret)) // use other bits than the ones KeyHash uses
+    memcpy(&ret, key.second.c_str() + sizeof(size_t), sizeof(ret));
+  else
+    ret = std::hash<string>()(key.second);
+  return d_shards[ret % d_shards.size()];
+}
+
+bool AuthSignatureCache::lookup(Shard& shard, const key_t& key, string& signature, time_t now, time_t rollover, bool& renew)
+{
+  renew = false;
+  ReadLock rl(&shard.d_mut);
+  auto iter = shard.d_index.find(key);
+  if(iter == shard.d_index.end())
+    return false;
+
+  const CacheEntry& entry = shard.d_entries[iter->second];
+  signature = entry.signature;
+  entry.referenced.store(true, std::memory_order_relaxed);
+
+  if(now < rollover && !entry.renewed.load(std::memory_order_relaxed)) {
+    time_t renewAt = rollover - s_renewWindow + KeyHash()(key) % s_renewWindow;
+    if(now >= renewAt && !entry.renewed.exchange(true))
+      renew = true;
+  }
+  return true;
+}
+
+bool AuthSignatureCache::get(const key_t& key, string& signature, time_t now, time_t rollover, bool& renew)
+{
+  if(lookup(getShard(key), key, signature, now, rollover, renew)) {
+    d_hits++;
+    return true;
+  }
+  d_misses++;
+  return false;
+}
+
+bool AuthSignatureCache::getOrClaim(const key_t& key, string& signature, time_t now, time_t rollover, bool& renew)
+{
+  auto& shard = getShard(key);
+  if(lookup(shard, key, signature, now, rollover, renew)) {
+    d_hits++;
+    return true;
+  }
+
+  // release() takes this mutex after inserting, so the claim cannot go away unnoticed between the lookup and the wait
+  std::unique_lock<std::mutex> lock(shard.d_claimsMutex);
+  bool waited = false;
+  for(;;) {
+    if(lookup(shard, key, signature, now, rollover, renew)) {
+      if(waited)
+        d_waits++;
+      else
+        d_hits++;
+      return true;
+    }
+    if(shard.d_claims.insert(key).second) {
+      d_misses++;
+      return false;
+    }
+    waited = true;
+    shard.d_claimsCond.wait(lock);
+  }
+}
+
+void AuthSignatureCache::release(Shard& shard, const key_t& key)
+{
+  std::lock_guard<std::mutex> lock(shard.d_claimsMutex);
+  if(shard.d_claims.erase(key))
+    shard.d_claimsCond.notify_all();
+}
+
+void AuthSignatureCache::abandon(const key_t& key)
+{
+  release(getShard(key), key);
+}
+
+void AuthSignatureCache::insert(const key_t& key, const string& signature, time_t week, time_t currentWeek)
+{
+  auto& shard = getShard(key);
+  store(shard, key, signature, week, currentWeek);
+  release(shard, key);
+}
+
+/* moves the last entry over each entry of a past week, the order does not matter to CLOCK */
+void AuthSignatureCache::dropPastWeeks(Shard& shard)
+{
+  size_t pos = 0;
+  while(pos < shard.d_entries.size()) {
+    CacheEntry& entry = shard.d_entries[pos];
+    if(entry.week >= shard.d_currentWeek) {
+      ++pos;
+      continue;
+    }
+
+    shard.d_index.erase(entry.key);
+    CacheEntry& last = shard.d_entries.back();
+    if(&last != &entry) {
+      entry.key = last.key;
+      entry.signature = std::move(last.signature);
+      entry.week = last.week;
+      entry.referenced = last.referenced.load();
+      entry.renewed = last.renewed.load();
+      shard.d_index[entry.key] = pos;
+    }
+    shard.d_entries.pop_back();
+    d_size--;
+  }
+  if(shard.d_hand >= shard.d_entries.size())
+    shard.d_hand = 0;
+}
+
+void AuthSignatureCache::store(Shard& shard, const key_t& key, const string& signature, time_t week, time_t currentWeek)
+{
+  WriteLock wl(&shard.d_mut);
+  if(currentWeek > shard.d_currentWeek) {
+    shard.d_currentWeek = currentWeek;
+    dropPastWeeks(shard);
+  }
+
+  auto iter = shard.d_index.find(key);
+  if(iter != shard.d_index.end()) {
+    shard.d_entries[iter->second].signature = signature;
+    shard.d_entries[iter->second].week = week;
+    return;
+  }
+
+  if(shard.d_entries.size() < d_maxShardEntries) {
+    shard.d_entries.emplace_back(key, signature, week);
+    shard.d_index[key] = shard.d_entries.size() - 1;
+    d_size++;
+    return;
+  }
+
+  // every entry passed loses its flag, so this ends within two rounds
+  for(;;) {
+    CacheEntry& entry = shard.d_entries[shard.d_hand];
+    size_t pos = shard.d_hand;
+    shard.d_hand = (shard.d_hand + 1) % shard.d_entries.size();
+    if(entry.referenced.exchange(false))
+      continue;
+
+    shard.d_index.erase(entry.key);
+    entry.key = key;
+    entry.signature = signature;
+    entry.week = week;
+    entry.renewed = false;
+    shard.d_index[key] = pos;
+    d_evictions++;
+    return;
+  }
+}
@@ -0,0 +1,127 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef AUTH_SIGNATURECACHE_HH
+#define AUTH_SIGNATURECACHE_HH
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <boost/utility.hpp>
+
+#include "lock.hh"
+#include "misc.hh"
+#include "namespaces.hh"
+
+/** This class caches the signatures made while signing online. An RRset that does not change only
+    needs signing again when the inception and expiration of its RRSIGs move, once a week.
+
+    The cache is split in shards, each with its own lock. Entries are evicted with the CLOCK
+    algorithm: a hit only sets a flag while holding the read lock, and an insert into a full shard
+    sweeps its entries from where the previous sweep stopped, clearing the flags it passes and
+    replacing the first entry that was not flagged. Signatures for the previous week are never hit
+    again, so each entry carries the week it is valid for and the first insert into a shard after
+    the rollover drops the ones of past weeks, even when the cache is far from full.
+
+    So that not every RRset needs signing at the moment the week changes, RRsets that are hit
+    during the last s_renewWindow seconds before it are signed for the next week ahead of time.
+    Each entry gets its own moment in that window, derived from its key, to spread the work.
+
+    Threads that miss on the same key at the same time, like two outgoing AXFRs of a zone walking
+    it side by side, do not all sign it: the first one claims the key with getOrClaim(), the others
+    wait for its insert() and get a hit.
+*/
+class AuthSignatureCache : public boost::noncopyable
+{
+public:
+  typedef pair<string, string> key_t; //!< hash of the public key, MD5 of the data that was signed
+
+  AuthSignatureCache(uint64_t maxEntries, size_t shardsCount=64);
+  ~AuthSignatureCache();
+
+  /* Returns true and sets signature on a hit. renew is set on at most one hit per entry, when now
+     is that entry's moment to be signed for the week starting at rollover */
+  bool get(const key_t& key, string& signature, time_t now, time_t rollover, bool& renew);
+  /* Like get(), but a miss claims the key for the caller, who then has to insert() its signature,
+     or abandon() if that fails. Callers missing on a claimed key wait for that instead */
+  bool getOrClaim(const key_t& key, string& signature, time_t now, time_t rollover, bool& renew);
+  /* week is the start of the week the signature is valid for, currentWeek the start of the
+     current one. Entries for weeks before currentWeek are dropped */
+  void insert(const key_t& key, const string& signature, time_t week, time_t currentWeek);
+  void abandon(const key_t& key);
+
+  uint64_t size() const { return d_size; } //!< number of entries in the cache
+
+  AtomicCounter d_hits{0};
+  AtomicCounter d_misses{0};
+  AtomicCounter d_evictions{0};
+  AtomicCounter d_waits{0}; //!< hits after waiting for the signature another thread claimed
+  AtomicCounter d_renewals{0}; //!< maintained by the caller, which does the actual signing
+
+  static const time_t s_renewWindow=86400;
+private:
+  struct KeyHash
+  {
+    size_t operator()(const key_t& key) const;
+  };
+
+  struct CacheEntry
+  {
+    CacheEntry(const key_t& key_, const string& signature_, time_t week_): key(key_), signature(signature_), week(week_)
+    {
+    }
+
+    key_t key;
+    string signature;
+    time_t week;
+    mutable std::atomic<bool> referenced{false};
+    mutable std::atomic<bool> renewed{false};
+  };
+
+  struct Shard
+  {
+    pthread_rwlock_t d_mut;
+    std::unordered_map<key_t, size_t, KeyHash> d_index; // position in d_entries
+    std::deque<CacheEntry> d_entries; // a deque never moves its entries, which we could not copy
+    size_t d_hand{0};
+    time_t d_currentWeek{0};
+    std::mutex d_claimsMutex;
+    std::condition_variable d_claimsCond;
+    std::unordered_set<key_t, KeyHash> d_claims; // keys being signed by a getOrClaim() caller
+  };
+
+  Shard& getShard(const key_t& key);
+  bool lookup(Shard& shard, const key_t& key, string& signature, time_t now, time_t rollover, bool& renew);
+  void store(Shard& shard, const key_t& key, const string& signature, time_t week, time_t currentWeek);
+  void dropPastWeeks(Shard& shard);
+  void release(Shard& shard, const key_t& key);
+
+  vector<Shard> d_shards;
+  std::atomic<uint64_t> d_size{0};
+  size_t d_maxShardEntries;
+};
+
+#endif /* AUTH_SIGNATURECACHE_HH */
@@ -0,0 +1,103 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "auth-zoneindex.hh"
+#include "statbag.hh"
+
+extern StatBag S;
+
+AuthZoneIndex::AuthZoneIndex()
+{
+  pthread_rwlock_init(&d_lock, 0);
+
+  S.declare("zone-index-size", "Number of zones in the zone apex index");
+  S.declare("zone-index-refresh-usec", "Number of microseconds spent on the last refresh of the zone apex index");
+
+  d_statnumentries=S.getPointer("zone-index-size");
+  d_statrefreshusec=S.getPointer("zone-index-refresh-usec");
+}
+
+AuthZoneIndex::~AuthZoneIndex()
+{
+  pthread_rwlock_destroy(&d_lock);
+}
+
+void AuthZoneIndex::replace(const std::vector<DNSName>& zones, uint64_t durationUsec)
+{
+  SuffixMatchTree<DNSName> tree;
+  size_t count = 0;
+  for(const auto& zone : zones) {
+    auto existing = tree.lookup(zone);
+    if(existing && *existing == zone) {
+      continue;
+    }
+    tree.add(zone, zone);
+    ++count;
+  }
+
+  {
+    WriteLock wl(&d_lock);
+    std::swap(d_tree, tree);
+    *d_statnumentries = count;
+  }
+
+  *d_statrefreshusec = durationUsec;
+  d_lastRefresh = time(nullptr);
+  d_invalidated = false;
+  d_loaded = true;
+}
+
+void AuthZoneIndex::add(const DNSName& zone)
+{
+  WriteLock wl(&d_lock);
+  auto existing = d_tree.lookup(zone);
+  if(existing && *existing == zone) {
+    return;
+  }
+  d_tree.add(zone, zone);
+  ++(*d_statnumentries);
+}
+
+void AuthZoneIndex::remove(const DNSName& zone)
+{
+  WriteLock wl(&d_lock);
+  auto existing = d_tree.lookup(zone);
+  if(!existing || *existing != zone) {
+    return;
+  }
+  d_tree.remove(zone);
+  --(*d_statnumentries);
+}
+
+bool AuthZoneIndex::getApex(const DNSName& qname, DNSName& apex) const
+{
+  ReadLock rl(&d_lock);
+  auto found = d_tree.lookup(qname);
+  if(!found) {
+    return false;
+  }
+  apex = *found;
+  return true;
+}
@@ -0,0 +1,100 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef AUTH_ZONEINDEX_HH
+#define AUTH_ZONEINDEX_HH
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <boost/utility.hpp>
+
+#include "dnsname.hh"
+#include "lock.hh"
+#include "misc.hh"
+
+/* Process-wide index of the apex of every zone served by the backends. When it has been
+   loaded, UeberBackend::getAuth() looks up the closest enclosing zone of a name here instead
+   of asking every backend about every label of that name. The index is refreshed every
+   zone-index-refresh-interval seconds, and updated right away when a zone is added or removed
+   via the API, a supermaster or a NOTIFY.
+*/
+class AuthZoneIndex : public boost::noncopyable
+{
+public:
+  AuthZoneIndex();
+  ~AuthZoneIndex();
+
+  //! replaces the content of the index with these zones, marks it as loaded
+  void replace(const std::vector<DNSName>& zones, uint64_t durationUsec);
+  void add(const DNSName& zone);
+  void remove(const DNSName& zone);
+  //! sets apex to the closest zone enclosing qname (or qname itself), false if there is none
+  bool getApex(const DNSName& qname, DNSName& apex) const;
+
+  //! the index is only used once it has been loaded, and as long as refreshes succeed
+  bool isEnabled() const
+  {
+    return d_loaded;
+  }
+  //! stop using the index until the next successful refresh
+  void disable()
+  {
+    d_loaded = false;
+    d_invalidated = false;
+    d_lastRefresh = time(nullptr);
+  }
+  //! request a refresh from the backends as soon as possible
+  void invalidate()
+  {
+    d_invalidated = true;
+  }
+  bool needsRefresh(time_t now) const
+  {
+    return d_refreshInterval > 0 && (d_invalidated || now >= d_lastRefresh + d_refreshInterval);
+  }
+  void setRefreshInterval(uint32_t interval)
+  {
+    d_refreshInterval = interval;
+  }
+  uint32_t getRefreshInterval() const
+  {
+    return d_refreshInterval;
+  }
+
+  size_t size() const
+  {
+    return *d_statnumentries;
+  }
+
+private:
+  mutable pthread_rwlock_t d_lock;
+  SuffixMatchTree<DNSName> d_tree;
+  AtomicCounter* d_statnumentries;
+  AtomicCounter* d_statrefreshusec;
+  std::atomic<time_t> d_lastRefresh{0};
+  std::atomic<uint32_t> d_refreshInterval{0};
+  std::atomic<bool> d_loaded{false};
+  std::atomic<bool> d_invalidated{false};
+};
+
+#endif /* AUTH_ZONEINDEX_HH */
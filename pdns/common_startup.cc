@@ -42,6 +42,7 @@ ArgvMap theArg;
 StatBag S;  //!< Statistics are gathered across PDNS via the StatBag class S
 AuthPacketCache PC; //!< This is the main PacketCache, shared across all threads
 AuthQueryCache QC;
+AuthZoneIndex g_zoneIndex;
 DNSProxy *DP;
 DynListener *dl;
 CommunicatorClass Communicator;
@@ -76,6 +77,7 @@ void declareArguments()
   ::arg().set("query-local-address","Source IP address for sending queries")="0.0.0.0";
   ::arg().set("query-local-address6","Source IPv6 address for sending queries")="::";
   ::arg().set("overload-queue-length","Maximum queuelength moving to packetcache only")="0";
+  ::arg().set("overload-queue-delay","Maximum number of milliseconds questions wait for a backend thread before moving to packetcache only")="0";
   ::arg().set("max-queue-length","Maximum queuelength before considering situation lost")="5000";
 
   ::arg().set("retrieval-threads", "Number of AXFR-retrieval threads for slave operation")="2";
@@ -168,6 +170,7 @@ void declareArguments()
   ::arg().set("max-tcp-transactions-per-conn")="0";
   ::arg().set("max-tcp-connection-duration")="0";
   ::arg().set("tcp-idle-timeout")="5";
+  ::arg().set("tcp-receiver-threads","Number of threads handling the TCP connections")="1";
 
   ::arg().setSwitch("no-shuffle","Set this to prevent random shuffling of answers - for regression testing")="off";
 
@@ -176,8 +179,11 @@ void declareArguments()
 
   ::arg().set("max-cache-entries", "Maximum number of entries in the query cache")="1000000";
   ::arg().set("max-packet-cache-entries", "Maximum number of entries in the packet cache")="1000000";
+  ::arg().set("udp-batch-size", "Maximum number of UDP queries received, and of packet cache hits sent, in one go by each receiver thread")="16";
+  ::arg().set("packet-cache-fast-entries", "Number of small UDP answers also kept in a lock-free table in front of the packet cache, 0 to disable")="0";
   ::arg().set("max-signature-cache-entries", "Maximum number of signatures cache entries")="";
   ::arg().set("max-ent-entries", "Maximum number of empty non-terminals in a zone")="100000";
+  ::arg().set("zone-index-refresh-interval", "Seconds between two refreshes of the zone apex index, 0 to disable it")="0";
   ::arg().set("entropy-source", "If set, read entropy from this file")="/dev/urandom";
 
   ::arg().set("lua-prequery-script", "Lua script with prequery handler (DO NOT USE)")="";
@@ -286,6 +292,11 @@ void declareStats(void)
     
 
   S.declare("qsize-q","Number of questions waiting for database attention", getQCount);
+  S.declare("queue-wait0-1","Number of questions that waited less than 1ms for a backend thread");
+  S.declare("queue-wait1-10","Number of questions that waited between 1 and 10ms for a backend thread");
+  S.declare("queue-wait10-100","Number of questions that waited between 10 and 100ms for a backend thread");
+  S.declare("queue-wait100-1000","Number of questions that waited between 100 and 1000ms for a backend thread");
+  S.declare("queue-wait-slow","Number of questions that waited more than 1s for a backend thread");
 
   S.declare("dnsupdate-queries", "DNS update packets received.");
   S.declare("dnsupdate-answers", "DNS update packets successfully answered.");
@@ -309,6 +320,11 @@ void declareStats(void)
   S.declare("meta-cache-size", "Number of entries in the metadata cache", DNSSECKeeper::dbdnssecCacheSizes);
   S.declare("key-cache-size", "Number of entries in the key cache", DNSSECKeeper::dbdnssecCacheSizes);
   S.declare("signature-cache-size", "Number of entries in the signature cache", signatureCacheSize);
+  S.declare("signature-cache-hit", "Number of hits on the signature cache", signatureCacheStats);
+  S.declare("signature-cache-miss", "Number of misses on the signature cache", signatureCacheStats);
+  S.declare("signature-cache-evictions", "Number of entries evicted from the signature cache to make room", signatureCacheStats);
+  S.declare("signature-cache-waits", "Number of signatures not made because another thread was already making them", signatureCacheStats);
+  S.declare("signature-cache-renewals", "Number of signatures made ahead of the weekly rollover for RRsets hit in the signature cache", signatureCacheStats);
 
   S.declare("servfail-packets","Number of times a server-failed packet was sent out");
   S.declare("latency","Average number of microseconds needed to answer a question", getLatency);
@@ -353,7 +369,11 @@ try
   int num = (int)(unsigned long)number;
   g_distributors[num] = distributor;
   DNSPacket question(true);
-  DNSPacket cached(false);
+  size_t batchSize = std::min(std::max(static_cast<size_t>(::arg().asNum("udp-batch-size")), static_cast<size_t>(1)), UDPNameserver::s_maxBatchSize);
+  vector<UDPNameserver::Message> queries(batchSize), answers(batchSize);
+  for(auto& answer : answers) {
+    answer.data.resize(65535);
+  }
 
   AtomicCounter &numreceived=*S.getPointer("udp-queries");
   AtomicCounter &numreceiveddo=*S.getPointer("udp-do-queries");
@@ -378,70 +398,116 @@ try
     NS = N;
   }
 
-  for(;;) {
-    if(!(P=NS->receive(&question))) { // receive a packet         inline
-      continue;                    // packet was broken, try again
-    }
-
-    numreceived++;
+  DNSName qname;
+  uint16_t qtype;
+  bool dnssecOk;
+  uint32_t hash;
 
-    if(P->d_remote.getSocklen()==sizeof(sockaddr_in))
-      numreceived4++;
-    else
-      numreceived6++;
+  for(;;) {
+    size_t count = NS->receive(queries); // receive as many packets as are waiting, up to batchSize
+    size_t answered = 0;
 
-    if(P->d_dnssecOk)
-      numreceiveddo++;
+    for(size_t idx = 0; idx < count; ++idx) {
+      auto& query = queries[idx];
+      auto& answer = answers[answered];
 
-     if(P->d.qr)
-       continue;
+      numreceived++;
 
-    S.ringAccount("queries", P->qdomain.toLogString()+"/"+P->qtype.getName());
-    S.ringAccount("remotes",P->d_remote);
-    if(logDNSQueries) {
-      string remote;
-      if(P->hasEDNSSubnet()) 
-        remote = P->getRemote().toString() + "<-" + P->getRealRemote().toString();
+      if(query.remote.getSocklen()==sizeof(sockaddr_in))
+        numreceived4++;
       else
-        remote = P->getRemote().toString();
-      L << Logger::Notice<<"Remote "<< remote <<" wants '" << P->qdomain<<"|"<<P->qtype.getName() << 
-            "', do = " <<P->d_dnssecOk <<", bufsize = "<< P->getMaxReplyLen()<<": ";
-    }
+        numreceived6++;
+
+      /* plain queries are looked up in the packet cache straight from the wire,
+         we only build a DNSPacket out of them on a miss */
+      if(!logDNSQueries && DNSPacket::couldBeCached(&query.data[0], query.length, qname, qtype, dnssecOk)) {
+        if(dnssecOk)
+          numreceiveddo++;
+
+        S.ringAccount("queries", qname.toLogString()+"/"+QType(qtype).getName());
+        S.ringAccount("remotes", query.remote);
+
+        size_t cachedSize = PC.getUDP(&query.data[0], query.length, qname, qtype, hash, &answer.data[0], answer.data.size());
+        if(cachedSize > 0) {
+          answer.remote = query.remote;
+          answer.local = query.local;
+          answer.socket = query.socket;
+          answer.length = cachedSize;
+          answered++;
+          g_rs.submitResponse(qname, qtype, query.remote, &answer.data[0], cachedSize, true);
+          diff=query.dt.udiff();
+          avg_latency=(int)(0.999*avg_latency+0.001*diff); // 'EWMA'
+          continue;
+        }
+
+        if(!NS->parse(query, &question)) {
+          continue;                    // packet was broken, try again
+        }
+        P = &question;
+        P->setHash(hash);
+      }
+      else {
+        if(!NS->parse(query, &question)) {
+          continue;                    // packet was broken, try again
+        }
+        P = &question;
+
+        if(P->d_dnssecOk)
+          numreceiveddo++;
+
+        if(P->d.qr)
+          continue;
+
+        S.ringAccount("queries", P->qdomain.toLogString()+"/"+P->qtype.getName());
+        S.ringAccount("remotes",P->d_remote);
+        if(logDNSQueries) {
+          string remote;
+          if(P->hasEDNSSubnet()) 
+            remote = P->getRemote().toString() + "<-" + P->getRealRemote().toString();
+          else
+            remote = P->getRemote().toString();
+          L << Logger::Notice<<"Remote "<< remote <<" wants '" << P->qdomain<<"|"<<P->qtype.getName() << 
+                "', do = " <<P->d_dnssecOk <<", bufsize = "<< P->getMaxReplyLen()<<": ";
+        }
+
+        if((P->d.opcode != Opcode::Notify && P->d.opcode != Opcode::Update) && P->couldBeCached()) {
+          size_t cachedSize=PC.getUDP(P, &answer.data[0], answer.data.size()); // does the PacketCache recognize this question?
+          if (cachedSize > 0) {
+            if(logDNSQueries)
+              L<<"packetcache HIT"<<endl;
+            answer.remote = P->d_remote;
+            answer.local = P->d_anyLocal;
+            answer.socket = P->getSocket();
+            answer.length = cachedSize;
+            answered++;
+            g_rs.submitResponse(P->qdomain, P->qtype.getCode(), P->d_remote, &answer.data[0], cachedSize, true); // ID and qname case already match the question
+            diff=P->d_dt.udiff();
+            avg_latency=(int)(0.999*avg_latency+0.001*diff); // 'EWMA'
+            continue;
+          }
+        }
+      }
 
-    if((P->d.opcode != Opcode::Notify && P->d.opcode != Opcode::Update) && P->couldBeCached()) {
-      bool haveSomething=PC.get(P, &cached); // does the PacketCache recognize this question?
-      if (haveSomething) {
-        if(logDNSQueries)
-          L<<"packetcache HIT"<<endl;
-        cached.setRemote(&P->d_remote);  // inlined
-        cached.setSocket(P->getSocket());                               // inlined
-        cached.d_anyLocal = P->d_anyLocal;
-        cached.setMaxReplyLen(P->getMaxReplyLen());
-        cached.d.rd=P->d.rd; // copy in recursion desired bit
-        cached.d.id=P->d.id;
-        cached.commitD(); // commit d to the packet                        inlined
-        NS->send(&cached); // answer it then                              inlined
-        diff=P->d_dt.udiff();
-        avg_latency=(int)(0.999*avg_latency+0.001*diff); // 'EWMA'
+      if(distributor->isOverloaded()) {
+        if(logDNSQueries) 
+          L<<"Dropped query, backends are overloaded"<<endl;
+        overloadDrops++;
         continue;
       }
-    }
-
-    if(distributor->isOverloaded()) {
-      if(logDNSQueries) 
-        L<<"Dropped query, backends are overloaded"<<endl;
-      overloadDrops++;
-      continue;
-    }
         
-    if(logDNSQueries) 
-      L<<"packetcache MISS"<<endl;
+      if(logDNSQueries) 
+        L<<"packetcache MISS"<<endl;
 
-    try {
-      distributor->question(P, &sendout); // otherwise, give to the distributor
+      try {
+        distributor->question(P, &sendout); // otherwise, give to the distributor
+      }
+      catch(DistributorFatal& df) { // when this happens, we have leaked loads of memory. Bailing out time.
+        _exit(1);
+      }
     }
-    catch(DistributorFatal& df) { // when this happens, we have leaked loads of memory. Bailing out time.
-      _exit(1);
+
+    if(answered > 0) {
+      NS->send(answers, answered); // the packet cache hits of this batch, in one go
     }
   }
   return 0;
@@ -452,6 +518,38 @@ catch(PDNSException& pe)
   _exit(1);
 }
 
+static void* zoneIndexThread(void *)
+{
+  UeberBackend B;
+  for(;;) {
+    if(g_zoneIndex.needsRefresh(time(nullptr))) {
+      try {
+        DTime dt;
+        dt.set();
+        vector<DomainInfo> domains;
+        B.getAllDomains(&domains, false);
+
+        vector<DNSName> zones;
+        zones.reserve(domains.size());
+        for(const auto& di : domains) {
+          zones.push_back(di.zone);
+        }
+        g_zoneIndex.replace(zones, dt.udiff());
+      }
+      catch(PDNSException& ae) {
+        L<<Logger::Error<<"Unable to refresh the zone apex index, disabling it until the next refresh: "<<ae.reason<<endl;
+        g_zoneIndex.disable();
+      }
+      catch(std::exception& e) {
+        L<<Logger::Error<<"Unable to refresh the zone apex index, disabling it until the next refresh: "<<e.what()<<endl;
+        g_zoneIndex.disable();
+      }
+    }
+    sleep(1);
+  }
+  return 0;
+}
+
 static void* dummyThread(void *)
 {
   void* ignore=0;
@@ -485,7 +583,9 @@ void mainthread()
 
    PC.setTTL(::arg().asNum("cache-ttl"));
    PC.setMaxEntries(::arg().asNum("max-packet-cache-entries"));
+   PC.setFastEntries(::arg().asNum("packet-cache-fast-entries"));
    QC.setMaxEntries(::arg().asNum("max-cache-entries"));
+   g_zoneIndex.setRefreshInterval(::arg().asNum("zone-index-refresh-interval"));
 
    stubParseResolveConf();
 
@@ -561,6 +661,9 @@ void mainthread()
 
   pthread_create(&qtid,0,carbonDumpThread, 0); // runs even w/o carbon, might change @ runtime    
 
+  if(g_zoneIndex.getRefreshInterval() > 0)
+    pthread_create(&qtid,0,zoneIndexThread, 0); // keeps the zone apex index up to date
+
 #ifdef HAVE_SYSTEMD
   /* If we are here, notify systemd that we are ay-ok! This might have some
    * timing issues with the backend-threads. e.g. if the initial MySQL connection
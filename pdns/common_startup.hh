@@ -24,6 +24,7 @@
 
 #include "auth-packetcache.hh"
 #include "auth-querycache.hh"
+#include "auth-zoneindex.hh"
 #include "utility.hh"
 #include "arguments.hh"
 #include "communicator.hh"
@@ -40,6 +41,7 @@ extern ArgvMap theArg;
 extern StatBag S;  //!< Statistics are gathered across PDNS via the StatBag class S
 extern AuthPacketCache PC; //!< This is the main PacketCache, shared across all threads
 extern AuthQueryCache QC;
+extern AuthZoneIndex g_zoneIndex; //!< Apexes of all the zones we serve, shared across all threads
 extern DNSProxy *DP;
 extern DynListener *dl;
 extern CommunicatorClass Communicator;
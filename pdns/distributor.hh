@@ -27,6 +27,7 @@
 #include <queue>
 #include <vector>
 #include <pthread.h>
+#include <time.h>
 #include <unistd.h>
 #include "logger.hh"
 #include "dns.hh"
@@ -35,6 +36,7 @@
 #include "arguments.hh"
 #include <atomic>
 #include "statbag.hh"
+#include "mpmcqueue.hh"
 
 extern StatBag S;
 
@@ -42,6 +44,13 @@ extern StatBag S;
     processes. 
     
     Questions are posed to the Distributor, which returns the answer via a callback.
+    The callback is called exactly once per question, with a null answer when the
+    question waited longer than queue-limit and was dropped.
+
+    With more than one thread, all questions go into a single lock-free queue from which
+    any idle thread takes the next one, so a slow backend query only delays the thread
+    answering it. Idle threads sleep on a semaphore, which is only posted when one of them
+    is actually waiting.
 
     The Distributor spawns sufficient backends, and if they thrown an exception,
     it will cycle the backend but drop the query that was active during the exception.
@@ -97,20 +106,48 @@ public:
     Question *Q;
     callback_t callback;
     int id;
+    DTime queued; //!< when the question entered the queue
   };
 
   bool isOverloaded() override
   {
-    return d_overloadQueueLength && (d_queued > d_overloadQueueLength);
+    if(d_overloadQueueLength && (d_queued > d_overloadQueueLength))
+      return true;
+    return d_overloadQueueDelay && d_queued && getQueueDelay() > d_overloadQueueDelay * 1000;
+  }
+
+  //! estimate, in microseconds, of how long a question waits in the queue before a thread picks it up
+  uint64_t getQueueDelay()
+  {
+    /* when no question has been taken from the queue for a while, the one in front has been
+       waiting for at least that long, even if the ones before it did not wait much */
+    const uint64_t lastDequeue = d_lastDequeue; // before the clock, a thread might store a later one meanwhile
+    const uint64_t now = nowUsec();
+    const uint64_t stalled = now > lastDequeue ? now - lastDequeue : 0;
+    return std::max(static_cast<uint64_t>(d_queueWait), stalled);
   }
-  
+
 private:
+  //! monotonic, so that the wall clock stepping back does not look like a stalled queue
+  static uint64_t nowUsec()
+  {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+  }
+
+  void accountQueueWait(int usec);
+
   int nextid;
   time_t d_last_started;
-  unsigned int d_overloadQueueLength, d_maxQueueLength;
+  unsigned int d_overloadQueueLength, d_overloadQueueDelay, d_maxQueueLength;
   int d_num_threads;
-  std::atomic<unsigned int> d_queued{0}, d_running{0};
-  std::vector<std::pair<int,int>> d_pipes;
+  std::atomic<unsigned int> d_queued{0}, d_running{0}, d_idle{0};
+  std::atomic<unsigned int> d_queueWait{0}; // moving average of the time spent in the queue, in microseconds
+  std::atomic<uint64_t> d_lastDequeue{0};
+  std::unique_ptr<MPMCQueue<QuestionData*>> d_queue;
+  Semaphore d_wakeup;
+  AtomicCounter* d_queueWaitCounters[5];
 };
 
 //template<class Answer, class Question, class Backend>::nextid;
@@ -142,20 +179,22 @@ template<class Answer, class Question, class Backend>MultiThreadDistributor<Answ
 {
   d_num_threads=n;
   d_overloadQueueLength=::arg().asNum("overload-queue-length");
+  d_overloadQueueDelay=::arg().asNum("overload-queue-delay");
   d_maxQueueLength=::arg().asNum("max-queue-length");
   nextid=0;
   d_last_started=time(0);
 
   pthread_t tid;
-  
 
-  for(int i=0; i < n; ++i) {
-    int fds[2];
-    if(pipe(fds) < 0)
-      unixDie("Creating pipe");
-    d_pipes.push_back({fds[0],fds[1]});
-  }
-  
+  // room for the question that goes over max-queue-length, triggering the respawn
+  d_queue=std::unique_ptr<MPMCQueue<QuestionData*>>(new MPMCQueue<QuestionData*>(d_maxQueueLength + 1));
+
+  d_queueWaitCounters[0]=S.getPointer("queue-wait0-1");
+  d_queueWaitCounters[1]=S.getPointer("queue-wait1-10");
+  d_queueWaitCounters[2]=S.getPointer("queue-wait10-100");
+  d_queueWaitCounters[3]=S.getPointer("queue-wait100-1000");
+  d_queueWaitCounters[4]=S.getPointer("queue-wait-slow");
+
   if (n<1) {
     L<<Logger::Error<<"Asked for fewer than 1 threads, nothing to do"<<endl;
     _exit(1);
@@ -175,7 +214,7 @@ template<class Answer, class Question, class Backend>void *MultiThreadDistributo
 {
   pthread_detach(pthread_self());
   MultiThreadDistributor *us=static_cast<MultiThreadDistributor *>(p);
-  int ournum=us->d_running++;
+  us->d_running++;
 
   try {
     Backend *b=new Backend(); // this will answer our questions
@@ -184,15 +223,28 @@ template<class Answer, class Question, class Backend>void *MultiThreadDistributo
     for(;;) {
     
       QuestionData* QD;
-      if(read(us->d_pipes[ournum].first, &QD, sizeof(QD)) != sizeof(QD))
-	unixDie("read");
+      if(!us->d_queue->pop(QD)) {
+        us->d_idle++;
+        // pairs with the fence in question(), so that either we see the new question or it sees us idle
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(!us->d_queue->pop(QD)) {
+          us->d_wakeup.wait();
+          us->d_idle--;
+          continue;
+        }
+        us->d_idle--;
+      }
       --us->d_queued;
+      us->d_lastDequeue=nowUsec();
+      us->accountQueueWait(QD->queued.udiffNoReset());
       Answer *a; 
 
       if(queuetimeout && QD->Q->d_dt.udiff()>queuetimeout*1000) {
         delete QD->Q;
-	delete QD;
         S.inc("timedout-packets");
+        // no answer, but the caller still needs to know this question is done
+        QD->callback(nullptr);
+        delete QD;
         continue;
       }        
 
@@ -307,26 +359,54 @@ retry:
 
 struct DistributorFatal{};
 
+template<class Answer, class Question, class Backend>void MultiThreadDistributor<Answer,Question,Backend>::accountQueueWait(int usec)
+{
+  d_queueWait = (7 * static_cast<uint64_t>(d_queueWait) + std::max(usec, 0)) / 8;
+
+  if(usec < 1000)
+    (*d_queueWaitCounters[0])++;
+  else if(usec < 10000)
+    (*d_queueWaitCounters[1])++;
+  else if(usec < 100000)
+    (*d_queueWaitCounters[2])++;
+  else if(usec < 1000000)
+    (*d_queueWaitCounters[3])++;
+  else
+    (*d_queueWaitCounters[4])++;
+}
+
 template<class Answer, class Question, class Backend>int MultiThreadDistributor<Answer,Question,Backend>::question(Question* q, callback_t callback)
 {
   q=new Question(*q);
 
-  // this is passed to other process over pipe and released there
+  // this is passed to a backend thread through the queue and released there
   auto QD=new QuestionData();
   QD->Q=q;
-  auto ret = QD->id = nextid++; // might be deleted after write!
+  auto ret = QD->id = nextid++; // might be deleted after push!
   QD->callback=callback;
-  
-  if(write(d_pipes[QD->id % d_pipes.size()].second, &QD, sizeof(QD)) != sizeof(QD))
-    unixDie("write");
+  QD->queued.set();
 
-  d_queued++;
+  if(d_queued++ == 0) {
+    // the queue was empty, it has not been stalled until now
+    d_lastDequeue=nowUsec();
+  }
 
+  if(!d_queue->push(QD)) {
+    d_queued--;
+    delete QD->Q;
+    delete QD;
+    L<<Logger::Error<<"Question queue is full, more than "<<d_maxQueueLength<<" questions waiting for database/backend attention, respawning"<<endl;
+    throw DistributorFatal();
+  }
 
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if(d_idle > 0) {
+    d_wakeup.post();
+  }
 
   if(d_queued > d_maxQueueLength) {
     L<<Logger::Error<< d_queued <<" questions waiting for database/backend attention. Limit is "<<::arg().asNum("max-queue-length")<<", respawning"<<endl;
-    // this will leak the entire contents of all pipes, nothing will be freed. Respawn when this happens!
+    // this will leak the entire contents of the queue, nothing will be freed. Respawn when this happens!
     throw DistributorFatal();
   }
    
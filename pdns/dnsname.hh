@@ -317,7 +317,41 @@ struct SuffixMatchTree
       return 0;
     }
     labels.pop_back();
-    return child->lookup(labels);
+    auto result = child->lookup(labels);
+    if(result) {
+      return result;
+    }
+    // the child only leads to more specific entries, we are the best match
+    if(endNode)
+      return &d_value;
+    return 0;
+  }
+
+  void remove(const DNSName& name) const
+  {
+    remove(name.getRawLabels());
+  }
+
+  /* Removes the end node for these labels, and prunes the
+     intermediary nodes that no longer lead anywhere */
+  void remove(std::vector<std::string> labels) const
+  {
+    if(labels.empty()) { // this allows removal of the root
+      endNode=false;
+      return;
+    }
+
+    SuffixMatchTree smt(*labels.rbegin());
+    auto child = children.find(smt);
+    if(child == children.end()) {
+      return;
+    }
+
+    labels.pop_back();
+    child->remove(labels);
+    if(!child->endNode && child->children.empty()) {
+      children.erase(child);
+    }
   }
 
 };
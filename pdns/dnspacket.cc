@@ -245,6 +245,53 @@ bool DNSPacket::couldBeCached()
   return d_ednsping.empty() && !d_wantsnsid && qclass==QClass::IN && !d_havetsig;
 }
 
+bool DNSPacket::couldBeCached(const char* mesg, size_t length, DNSName& qname, uint16_t& qtype, bool& dnssecOk)
+try
+{
+  if(length < sizeof(dnsheader))
+    return false;
+
+  const struct dnsheader* dh = reinterpret_cast<const struct dnsheader*>(mesg);
+  if(dh->qr || dh->opcode != Opcode::Query || ntohs(dh->qdcount) != 1 || dh->ancount || dh->nscount || ntohs(dh->arcount) > 1)
+    return false;
+
+  uint16_t qclass;
+  unsigned int consumed;
+  qname = DNSName(mesg, length, sizeof(dnsheader), false, &qtype, &qclass, &consumed);
+  if(qclass != QClass::IN)
+    return false;
+
+  size_t pos = sizeof(dnsheader) + consumed + 4;
+  dnssecOk = false;
+  if(!dh->arcount)
+    return pos == length;
+
+  /* the only additional record we accept is an OPT one: root name (1), type (2), class (2),
+     TTL (4) holding the extended rcode, the version and the flags, then the rdata length (2) */
+  const unsigned char* opt = reinterpret_cast<const unsigned char*>(mesg) + pos;
+  if(pos + 11 > length || opt[0] != 0 || opt[1] * 256 + opt[2] != QType::OPT)
+    return false;
+  dnssecOk = opt[7] & 0x80;
+  size_t rdlength = opt[9] * 256 + opt[10];
+  pos += 11;
+  if(pos + rdlength != length)
+    return false;
+
+  /* the NSID and PING options need a tailored answer */
+  while(pos + 4 <= length) {
+    const unsigned char* option = reinterpret_cast<const unsigned char*>(mesg) + pos;
+    uint16_t code = option[0] * 256 + option[1];
+    if(code == 3 || code == 5) // 'EDNS NSID', 'EDNS PING'
+      return false;
+    pos += 4 + option[2] * 256 + option[3];
+  }
+
+  return pos == length;
+}
+catch(std::exception& e) {
+  return false;
+}
+
 unsigned int DNSPacket::getMinTTL()
 {
   unsigned int minttl = UINT_MAX;
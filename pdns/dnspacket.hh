@@ -120,6 +120,8 @@ public:
   void setMaxReplyLen(int bytes); //!< set the max reply len (used when retrieving from the packet cache, and this changed)
 
   bool couldBeCached(); //!< returns 0 if this query should bypass the packet cache
+  //! same for a query that has not been parsed yet, only plain queries with at most an OPT record qualify. Sets qname, qtype and dnssecOk if it does
+  static bool couldBeCached(const char* mesg, size_t length, DNSName& qname, uint16_t& qtype, bool& dnssecOk);
   bool hasEDNSSubnet();
   bool hasEDNS();
   uint8_t getEDNSVersion() const { return d_ednsversion; };
@@ -39,6 +39,11 @@
 #include <openssl/sha.h>
 #include <boost/assign/std/vector.hpp> // for 'operator+=()'
 #include <boost/assign/list_inserter.hpp>
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/composite_key.hpp>
+#include <boost/multi_index/hashed_index.hpp>
+#include <boost/multi_index/member.hpp>
+#include <boost/multi_index/sequenced_index.hpp>
 #include "base64.hh"
 #include "namespaces.hh"
 #ifdef HAVE_P11KIT1
@@ -498,6 +503,55 @@ string hashQNameWithSalt(const std::string& salt, unsigned int iterations, const
   return toHash;
 }
 
+struct NSEC3HashCacheEntry
+{
+  DNSName d_qname;
+  std::string d_salt;
+  unsigned int d_iterations;
+  std::string d_hash;
+};
+
+typedef boost::multi_index::multi_index_container<
+  NSEC3HashCacheEntry,
+  boost::multi_index::indexed_by<
+    boost::multi_index::hashed_unique<
+      boost::multi_index::composite_key<
+        NSEC3HashCacheEntry,
+        boost::multi_index::member<NSEC3HashCacheEntry, DNSName, &NSEC3HashCacheEntry::d_qname>,
+        boost::multi_index::member<NSEC3HashCacheEntry, std::string, &NSEC3HashCacheEntry::d_salt>,
+        boost::multi_index::member<NSEC3HashCacheEntry, unsigned int, &NSEC3HashCacheEntry::d_iterations>
+      >
+    >,
+    boost::multi_index::sequenced<>
+  >
+> nsec3hashcache_t;
+
+static const size_t s_maxNSEC3HashCacheEntries = 10000;
+static thread_local nsec3hashcache_t t_nsec3HashCache;
+
+string hashQNameWithSaltCached(const NSEC3PARAMRecordContent& ns3prc, const DNSName& qname)
+{
+  return hashQNameWithSaltCached(ns3prc.d_salt, ns3prc.d_iterations, qname);
+}
+
+string hashQNameWithSaltCached(const std::string& salt, unsigned int iterations, const DNSName& qname)
+{
+  /* DNSName comparisons and hashes are case-insensitive, just like the NSEC3 hash */
+  auto& sidx = t_nsec3HashCache.get<1>();
+  auto it = t_nsec3HashCache.find(boost::make_tuple(qname, salt, iterations));
+  if (it != t_nsec3HashCache.end()) {
+    sidx.relocate(sidx.end(), t_nsec3HashCache.project<1>(it));
+    return it->d_hash;
+  }
+
+  string hash = hashQNameWithSalt(salt, iterations, qname);
+  sidx.push_back({qname, salt, iterations, hash});
+  if (t_nsec3HashCache.size() > s_maxNSEC3HashCacheEntries) {
+    sidx.pop_front();
+  }
+  return hash;
+}
+
 void incrementHash(std::string& raw) // I wonder if this is correct, cmouse? ;-)
 {
   if(raw.empty())
@@ -157,6 +157,11 @@ uint32_t getStartOfWeek();
 
 string hashQNameWithSalt(const NSEC3PARAMRecordContent& ns3prc, const DNSName& qname);
 string hashQNameWithSalt(const std::string& salt, unsigned int iterations, const DNSName& qname);
+/* Same as hashQNameWithSalt(), but the most recently used hashes are kept in a
+   per-thread cache. To be used where the same names are hashed again and again,
+   like when generating or validating NSEC3 denial proofs. */
+string hashQNameWithSaltCached(const NSEC3PARAMRecordContent& ns3prc, const DNSName& qname);
+string hashQNameWithSaltCached(const std::string& salt, unsigned int iterations, const DNSName& qname);
 
 void incrementHash(std::string& raw);
 void decrementHash(std::string& raw);
@@ -167,4 +172,5 @@ void addTSIG(DNSPacketWriter& pw, TSIGRecordContent& trc, const DNSName& tsigkey
 bool validateTSIG(const std::string& packet, size_t sigPos, const TSIGTriplet& tt, const TSIGRecordContent& trc, const std::string& previousMAC, const std::string& theirMAC, bool timersOnly, unsigned int dnsHeaderOffset=0);
 
 uint64_t signatureCacheSize(const std::string& str);
+uint64_t signatureCacheStats(const std::string& str);
 #endif
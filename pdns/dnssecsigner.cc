@@ -27,16 +27,17 @@
 
 #include "md5.hh"
 #include "dnsseckeeper.hh"
-#include "dns_random.hh"
 #include "lock.hh"
 #include "arguments.hh"
 #include "statbag.hh"
+#include "auth-signaturecache.hh"
 extern StatBag S;
 
-static pthread_rwlock_t g_signatures_lock = PTHREAD_RWLOCK_INITIALIZER;
-typedef map<pair<string, string>, string> signaturecache_t;
-static signaturecache_t g_signatures;
-static int g_cacheweekno;
+static AuthSignatureCache& getSignatureCache()
+{
+  static AuthSignatureCache cache(::arg().asNum("max-signature-cache-entries", INT_MAX));
+  return cache;
+}
 
 AtomicCounter* g_signatureCount;
 
@@ -51,35 +52,36 @@ static void fillOutRRSIG(DNSSECPrivateKey& dpk, const DNSName& signQName, RRSIGR
   rrc.d_algorithm = drc.d_algorithm;
 
   string msg=getMessageForRRSET(signQName, rrc, toSign); // this is what we will hash & sign
-  pair<string, string> lookup(rc->getPubKeyHash(), pdns_md5sum(msg));  // this hash is a memory saving exercise
-
-  bool doCache=1;
-  if(doCache)
-  {
-    ReadLock l(&g_signatures_lock);
-    signaturecache_t::const_iterator iter = g_signatures.find(lookup);
-    if(iter != g_signatures.end()) {
-      rrc.d_signature=iter->second;
-      return;
+  AuthSignatureCache::key_t lookup(rc->getPubKeyHash(), pdns_md5sum(msg));  // this hash is a memory saving exercise
+
+  auto& cache = getSignatureCache();
+  uint32_t startOfWeek = getStartOfWeek();
+  uint32_t rollover = startOfWeek + 7*86400;
+  bool renew;
+  if(cache.getOrClaim(lookup, rrc.d_signature, time(0), rollover, renew)) {
+    if(renew) {
+      /* sign this hot RRset for next week now, instead of together with everything else at the rollover.
+         Its inception and expiration move by a week, see getRRSIGsForRRSET */
+      RRSIGRecordContent next(rrc);
+      next.d_siginception += 7*86400;
+      next.d_sigexpire += 7*86400;
+      string nextmsg=getMessageForRRSET(signQName, next, toSign);
+      cache.insert(AuthSignatureCache::key_t(lookup.first, pdns_md5sum(nextmsg)), rc->sign(nextmsg), rollover, startOfWeek);
+      (*g_signatureCount)++;
+      cache.d_renewals++;
     }
-    // else cerr<<"Miss!"<<endl;
+    return;
   }
 
-  rrc.d_signature = rc->sign(msg);
-  (*g_signatureCount)++;
-  if(doCache) {
-    /* we add some jitter here so not all your slaves start pruning their caches at the very same millisecond */
-    int weekno = (time(0) - dns_random(3600)) / (86400*7);  // we just spent milliseconds doing a signature, microsecond more won't kill us
-    const static int maxcachesize=::arg().asNum("max-signature-cache-entries", INT_MAX);
-
-    WriteLock l(&g_signatures_lock);
-    if(g_cacheweekno < weekno || g_signatures.size() >= (uint) maxcachesize) {  // blunt but effective (C) Habbie, mind04
-      L<<Logger::Warning<<"Cleared signature cache."<<endl;
-      g_signatures.clear();
-      g_cacheweekno = weekno;
-    }
-    g_signatures[lookup] = rrc.d_signature;
+  try {
+    rrc.d_signature = rc->sign(msg);
+  }
+  catch(...) {
+    cache.abandon(lookup); // or whoever is waiting for this signature waits forever
+    throw;
   }
+  (*g_signatureCount)++;
+  cache.insert(lookup, rrc.d_signature, startOfWeek, startOfWeek);
 }
 
 /* this is where the RRSIGs begin, keys are retrieved,
@@ -155,8 +157,21 @@ static void addSignature(DNSSECKeeper& dk, UeberBackend& db, const DNSName& sign
 
 uint64_t signatureCacheSize(const std::string& str)
 {
-  ReadLock l(&g_signatures_lock);
-  return g_signatures.size();
+  return getSignatureCache().size();
+}
+
+uint64_t signatureCacheStats(const std::string& str)
+{
+  auto& cache = getSignatureCache();
+  if(str == "signature-cache-hit")
+    return cache.d_hits;
+  if(str == "signature-cache-miss")
+    return cache.d_misses;
+  if(str == "signature-cache-evictions")
+    return cache.d_evictions;
+  if(str == "signature-cache-waits")
+    return cache.d_waits;
+  return cache.d_renewals;
 }
 
 static bool rrsigncomp(const DNSZoneRecord& a, const DNSZoneRecord& b)
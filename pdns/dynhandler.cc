@@ -330,6 +330,7 @@ string DLRediscoverHandler(const vector<string>&parts, Utility::pid_t ppid)
     L<<Logger::Error<<"Rediscovery was requested"<<endl;
     string status="Ok";
     B.rediscover(&status);
+    g_zoneIndex.invalidate();
     return status;
   }
   catch(PDNSException &ae) {
@@ -342,6 +343,7 @@ string DLReloadHandler(const vector<string>&parts, Utility::pid_t ppid)
 {
   UeberBackend B;
   B.reload();
+  g_zoneIndex.invalidate();
   L<<Logger::Error<<"Reload was requested"<<endl;
   return "Ok";
 }
@@ -20,6 +20,7 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <algorithm>
 #include <cinttypes>
 #include <iostream>
 
@@ -27,10 +28,678 @@
 #include "namespaces.hh"
 #include "dnsrecords.hh"
 
+std::atomic<uint64_t> DNSFilterEngine::Zone::ChangeLog::s_lastId{0};
+
+namespace {
+
+struct ZonePolicy
+{
+  size_t d_zoneIdx;
+  DNSFilterEngine::Policy d_pol;
+};
+
+/* sorted by zone index */
+typedef std::vector<ZonePolicy> ZonePolicies;
+
+/* sets the policy of zoneIdx, or removes it if pol is null */
+void setZonePolicy(ZonePolicies& policies, size_t zoneIdx, const DNSFilterEngine::Policy* pol)
+{
+  auto it = std::lower_bound(policies.begin(), policies.end(), zoneIdx, [](const ZonePolicy& zp, size_t idx) { return zp.d_zoneIdx < idx; });
+  if (it != policies.end() && it->d_zoneIdx == zoneIdx) {
+    if (pol) {
+      it->d_pol = *pol;
+    }
+    else {
+      policies.erase(it);
+    }
+  }
+  else if (pol) {
+    policies.insert(it, ZonePolicy{zoneIdx, *pol});
+  }
+}
+
+/* Read-only label trie holding the name triggers of all zones. The children of a node
+   are stored contiguously and in canonical order, so a lookup is one binary search per
+   label. Labels are kept lower-cased in a single buffer, policies in a single vector. */
+class CompiledNameTree
+{
+public:
+  typedef std::vector<std::pair<DNSName, ZonePolicy>> entries_t;
+
+  explicit CompiledNameTree(entries_t& entries): d_namesCount(0)
+  {
+    sortEntries(entries);
+    d_nodes.push_back(Node());
+    if (!entries.empty()) {
+      build(entries, 0, entries.size(), 0, 0);
+    }
+  }
+
+  bool empty() const
+  {
+    return d_nodes.size() == 1 && d_nodes[0].d_policiesCount == 0;
+  }
+
+  size_t getNamesCount() const
+  {
+    return d_namesCount;
+  }
+
+  static uint32_t getRoot()
+  {
+    return 0;
+  }
+
+  bool findChild(uint32_t parent, const char* label, uint8_t labelLen, uint32_t& child) const
+  {
+    const Node& node = d_nodes[parent];
+    uint32_t first = node.d_firstChild;
+    uint32_t count = node.d_childrenCount;
+
+    while (count > 0) {
+      uint32_t step = count / 2;
+      uint32_t middle = first + step;
+      int res = compareLabel(d_nodes[middle], label, labelLen);
+      if (res == 0) {
+        child = middle;
+        return true;
+      }
+      if (res < 0) {
+        first = middle + 1;
+        count -= step + 1;
+      }
+      else {
+        count = step;
+      }
+    }
+    return false;
+  }
+
+  std::pair<const ZonePolicy*, const ZonePolicy*> getPolicies(uint32_t nodeIdx) const
+  {
+    const Node& node = d_nodes[nodeIdx];
+    const ZonePolicy* begin = d_policies.data() + node.d_firstPolicy;
+    return std::make_pair(begin, begin + node.d_policiesCount);
+  }
+
+  /* exact match only */
+  ZonePolicies find(const DNSName& name) const
+  {
+    uint8_t positions[128];
+    const auto& storage = name.getStorage();
+    size_t count = getLabelPositions(storage, positions);
+    uint32_t node = getRoot();
+
+    while (count > 0) {
+      count--;
+      uint8_t pos = positions[count];
+      if (!findChild(node, &storage[pos + 1], storage[pos], node)) {
+        return ZonePolicies();
+      }
+    }
+    const auto policies = getPolicies(node);
+    return ZonePolicies(policies.first, policies.second);
+  }
+
+  static size_t getLabelPositions(const DNSName::string_t& storage, uint8_t positions[128])
+  {
+    size_t count = 0;
+    for (size_t pos = 0; pos < storage.size() && storage[pos] != 0 && count < 128; pos += static_cast<uint8_t>(storage[pos]) + 1) {
+      positions[count++] = pos;
+    }
+    return count;
+  }
+
+private:
+  struct Node
+  {
+    uint32_t d_labelPos{0};
+    uint32_t d_firstChild{0};
+    uint32_t d_childrenCount{0};
+    uint32_t d_firstPolicy{0};
+    uint32_t d_policiesCount{0};
+    uint8_t d_labelLen{0};
+  };
+
+  int compareLabel(const Node& node, const char* label, uint8_t labelLen) const
+  {
+    const char* ours = &d_labels[node.d_labelPos];
+    uint8_t len = std::min(node.d_labelLen, labelLen);
+    for (uint8_t idx = 0; idx < len; idx++) {
+      unsigned char a = ours[idx];
+      unsigned char b = dns_tolower(label[idx]);
+      if (a != b) {
+        return a < b ? -1 : 1;
+      }
+    }
+    if (node.d_labelLen == labelLen) {
+      return 0;
+    }
+    return node.d_labelLen < labelLen ? -1 : 1;
+  }
+
+  /* Sorts in canonical order, then by zone. Comparing flat keys is a lot faster than
+     canonCompare() on millions of names: the lower-cased labels from the root down,
+     each followed by "\0\0", with "\0" in labels escaped as "\0\1". */
+  static void sortEntries(entries_t& entries)
+  {
+    std::vector<std::pair<std::string, size_t>> keys;
+    keys.reserve(entries.size());
+    for (size_t idx = 0; idx < entries.size(); idx++) {
+      uint8_t positions[128];
+      const auto& storage = entries[idx].first.getStorage();
+      size_t count = getLabelPositions(storage, positions);
+      std::string key;
+      key.reserve(storage.size() + count);
+      while (count > 0) {
+        count--;
+        const uint8_t pos = positions[count];
+        for (uint8_t offset = 1; offset <= static_cast<uint8_t>(storage[pos]); offset++) {
+          const char c = dns_tolower(storage[pos + offset]);
+          key.push_back(c);
+          if (c == 0) {
+            key.push_back(1);
+          }
+        }
+        key.push_back(0);
+        key.push_back(0);
+      }
+      keys.push_back({std::move(key), idx});
+    }
+
+    std::sort(keys.begin(), keys.end(), [&entries](const std::pair<std::string, size_t>& a, const std::pair<std::string, size_t>& b) {
+        int res = a.first.compare(b.first);
+        return res < 0 || (res == 0 && entries[a.second].second.d_zoneIdx < entries[b.second].second.d_zoneIdx);
+      });
+
+    entries_t sorted;
+    sorted.reserve(entries.size());
+    for (const auto& key : keys) {
+      sorted.push_back(std::move(entries[key.second]));
+    }
+    entries.swap(sorted);
+  }
+
+  /* returns the label of name at depth (0 being the TLD), false if it has fewer labels */
+  static bool getLabel(const DNSName& name, size_t depth, const char*& label, uint8_t& labelLen)
+  {
+    uint8_t positions[128];
+    const auto& storage = name.getStorage();
+    size_t count = getLabelPositions(storage, positions);
+    if (depth >= count) {
+      return false;
+    }
+    uint8_t pos = positions[count - 1 - depth];
+    label = &storage[pos + 1];
+    labelLen = storage[pos];
+    return true;
+  }
+
+  /* the entries in [begin, end) share their first depth labels, those of nodeIdx */
+  void build(const entries_t& entries, size_t begin, size_t end, size_t depth, uint32_t nodeIdx)
+  {
+    const char* label;
+    uint8_t labelLen;
+    size_t idx = begin;
+
+    /* in canonical order, the entries for this node itself come first */
+    d_nodes[nodeIdx].d_firstPolicy = d_policies.size();
+    while (idx < end && !getLabel(entries[idx].first, depth, label, labelLen)) {
+      d_policies.push_back(entries[idx].second);
+      idx++;
+    }
+    d_nodes[nodeIdx].d_policiesCount = d_policies.size() - d_nodes[nodeIdx].d_firstPolicy;
+    if (d_nodes[nodeIdx].d_policiesCount > 0) {
+      d_namesCount++;
+    }
+
+    std::vector<std::pair<size_t, size_t>> groups;
+    while (idx < end) {
+      getLabel(entries[idx].first, depth, label, labelLen);
+      size_t groupEnd = idx + 1;
+      while (groupEnd < end) {
+        const char* other;
+        uint8_t otherLen;
+        getLabel(entries[groupEnd].first, depth, other, otherLen);
+        if (otherLen != labelLen || !std::equal(label, label + labelLen, other, [](char a, char b) { return dns_tolower(a) == dns_tolower(b); })) {
+          break;
+        }
+        groupEnd++;
+      }
+
+      Node child;
+      child.d_labelPos = d_labels.size();
+      child.d_labelLen = labelLen;
+      for (uint8_t pos = 0; pos < labelLen; pos++) {
+        d_labels.push_back(dns_tolower(label[pos]));
+      }
+      if (groups.empty()) {
+        d_nodes[nodeIdx].d_firstChild = d_nodes.size();
+      }
+      d_nodes.push_back(child);
+      groups.push_back({idx, groupEnd});
+      idx = groupEnd;
+    }
+    d_nodes[nodeIdx].d_childrenCount = groups.size();
+
+    const uint32_t firstChild = d_nodes[nodeIdx].d_firstChild;
+    for (size_t groupIdx = 0; groupIdx < groups.size(); groupIdx++) {
+      build(entries, groups[groupIdx].first, groups[groupIdx].second, depth + 1, firstChild + groupIdx);
+    }
+  }
+
+  std::vector<Node> d_nodes;
+  std::vector<ZonePolicy> d_policies;
+  std::string d_labels;
+  size_t d_namesCount;
+};
+
+typedef NetmaskTree<ZonePolicies> CompiledAddrTree;
+
+/* Every netmask of the combined tree carries, for each zone, the policy of the most
+   specific netmask of that zone covering it. A single best match lookup therefore
+   returns the matching policies of all zones. */
+std::shared_ptr<const CompiledAddrTree> compileAddrTree(std::vector<std::pair<Netmask, ZonePolicy>>& entries)
+{
+  std::sort(entries.begin(), entries.end(), [](const std::pair<Netmask, ZonePolicy>& a, const std::pair<Netmask, ZonePolicy>& b) {
+      return a.first.getBits() < b.first.getBits() || (a.first.getBits() == b.first.getBits() && a.second.d_zoneIdx < b.second.d_zoneIdx);
+    });
+
+  auto tree = std::make_shared<CompiledAddrTree>();
+  for (const auto& entry : entries) {
+    ZonePolicies inherited;
+    if (const auto parent = tree->lookup(entry.first)) {
+      inherited = parent->second;
+    }
+    auto& node = tree->insert(entry.first);
+    node.second = std::move(inherited);
+    setZonePolicy(node.second, entry.second.d_zoneIdx, &entry.second.d_pol);
+  }
+  return tree;
+}
+
+template<typename F>
+const ZonePolicy* getFirstEnabled(const ZonePolicy* begin, const ZonePolicy* end, const F& isEnabled)
+{
+  for (; begin != end; ++begin) {
+    if (isEnabled(begin->d_zoneIdx)) {
+      return begin;
+    }
+  }
+  return nullptr;
+}
+
+}
+
+class DNSFilterEngine::Index
+{
+public:
+  /* name updates go to an overlay, which is folded into a freshly compiled tree once
+     it holds more than this many names plus 1/16th of the compiled ones */
+  static const size_t s_minOverlayCompactionSize = 1024;
+
+  struct NameTriggers
+  {
+    bool needsCompaction() const
+    {
+      return d_overlay.size() > s_minOverlayCompactionSize + (d_compiled->getNamesCount() / 16);
+    }
+
+    /* complete policy lists overriding the ones of d_compiled, empty if the name has been removed */
+    std::unordered_map<DNSName, ZonePolicies> d_overlay;
+    std::shared_ptr<const CompiledNameTree> d_compiled;
+  };
+
+  template<typename F>
+  static bool findName(const NameTriggers& triggers, const DNSName& qname, const F& isEnabled, size_t& zoneIdx, Policy& pol)
+  {
+    /* for www.powerdns.com, in every zone, we need to check:
+       www.powerdns.com.
+         *.powerdns.com.
+                  *.com.
+                      *.
+       the first zone with a match wins, within a zone the most specific match wins.
+       We walk from the root down, so a later match in the same zone replaces an earlier one.
+    */
+    const ZonePolicy* best = nullptr;
+    auto consider = [&best,&isEnabled](const ZonePolicy* begin, const ZonePolicy* end) {
+      const ZonePolicy* candidate = getFirstEnabled(begin, end, isEnabled);
+      if (candidate && (!best || candidate->d_zoneIdx <= best->d_zoneIdx)) {
+        best = candidate;
+      }
+    };
+
+    uint8_t positions[128];
+    const auto& storage = qname.getStorage();
+    const size_t count = CompiledNameTree::getLabelPositions(storage, positions);
+
+    /* the overlay is usually empty, otherwise fetch its lists for all the candidates first */
+    const bool hasOverlay = !triggers.d_overlay.empty();
+    const ZonePolicies* overlayed[129];
+    if (hasOverlay) {
+      DNSName s(qname);
+      size_t depth = count;
+      auto it = triggers.d_overlay.find(qname);
+      overlayed[count] = it != triggers.d_overlay.end() ? &it->second : nullptr;
+      while (s.chopOff() && depth > 0) {
+        depth--;
+        it = triggers.d_overlay.find(g_wildcarddnsname + s);
+        overlayed[depth] = it != triggers.d_overlay.end() ? &it->second : nullptr;
+      }
+    }
+
+    const CompiledNameTree& tree = *triggers.d_compiled;
+    bool inTree = !tree.empty();
+    uint32_t node = CompiledNameTree::getRoot();
+
+    for (size_t depth = 0; depth <= count; depth++) {
+      if (depth == count) {
+        if (hasOverlay && overlayed[depth]) {
+          consider(overlayed[depth]->data(), overlayed[depth]->data() + overlayed[depth]->size());
+        }
+        else if (inTree) {
+          const auto policies = tree.getPolicies(node);
+          consider(policies.first, policies.second);
+        }
+        break;
+      }
+
+      /* qname is below this node, so the wildcard applies */
+      if (hasOverlay && overlayed[depth]) {
+        consider(overlayed[depth]->data(), overlayed[depth]->data() + overlayed[depth]->size());
+      }
+      else if (inTree) {
+        uint32_t wildcard;
+        if (tree.findChild(node, "*", 1, wildcard)) {
+          const auto policies = tree.getPolicies(wildcard);
+          consider(policies.first, policies.second);
+        }
+      }
+
+      if (inTree) {
+        const uint8_t pos = positions[count - 1 - depth];
+        inTree = tree.findChild(node, &storage[pos + 1], storage[pos], node);
+      }
+      if (!inTree && !hasOverlay) {
+        break;
+      }
+    }
+
+    if (best) {
+      zoneIdx = best->d_zoneIdx;
+      pol = best->d_pol;
+      return true;
+    }
+    return false;
+  }
+
+  template<typename F>
+  static bool findAddr(const CompiledAddrTree& tree, const ComboAddress& addr, const F& isEnabled, size_t& zoneIdx, Policy& pol)
+  {
+    if (const auto fnd = tree.lookup(addr)) {
+      if (const auto first = getFirstEnabled(fnd->second.data(), fnd->second.data() + fnd->second.size(), isEnabled)) {
+        zoneIdx = first->d_zoneIdx;
+        pol = first->d_pol;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static void updateName(NameTriggers& triggers, const DNSName& name, size_t zoneIdx, const NamePolicyMap& polmap)
+  {
+    ZonePolicies policies;
+    const auto it = triggers.d_overlay.find(name);
+    if (it != triggers.d_overlay.end()) {
+      policies = it->second;
+    }
+    else {
+      policies = triggers.d_compiled->find(name);
+    }
+
+    setZonePolicy(policies, zoneIdx, polmap.find(name));
+    triggers.d_overlay[name] = std::move(policies);
+  }
+
+  /* (id, generation) of the zones this index has been built from */
+  std::vector<std::pair<uint64_t, uint64_t>> d_zoneStates;
+  NameTriggers d_qnames;
+  NameTriggers d_nsnames;
+  std::shared_ptr<const CompiledAddrTree> d_clientAddrs;
+  std::shared_ptr<const CompiledAddrTree> d_nsAddrs;
+  std::shared_ptr<const CompiledAddrTree> d_responseAddrs;
+};
+
 DNSFilterEngine::DNSFilterEngine()
 {
 }
 
+static void collectNames(CompiledNameTree::entries_t& entries, size_t zoneIdx, const DNSFilterEngine::NamePolicyMap& polmap)
+{
+  entries.reserve(entries.size() + polmap.size());
+  polmap.visit([&entries,zoneIdx](const DNSName& name, const DNSFilterEngine::Policy& pol) {
+      entries.push_back({name, ZonePolicy{zoneIdx, pol}});
+    });
+}
+
+static void collectAddrs(std::vector<std::pair<Netmask, ZonePolicy>>& entries, size_t zoneIdx, const NetmaskTree<DNSFilterEngine::Policy>& tree)
+{
+  for (const auto node : tree) {
+    entries.push_back({node->first, ZonePolicy{zoneIdx, node->second}});
+  }
+}
+
+void DNSFilterEngine::compile()
+{
+  auto index = std::make_shared<Index>();
+  CompiledNameTree::entries_t qnames, nsnames;
+  std::vector<std::pair<Netmask, ZonePolicy>> clientAddrs, nsAddrs, responseAddrs;
+
+  for (size_t zoneIdx = 0; zoneIdx < d_zones.size(); zoneIdx++) {
+    const auto& zone = d_zones[zoneIdx];
+    if (!zone) {
+      index->d_zoneStates.push_back({0, 0});
+      continue;
+    }
+    index->d_zoneStates.push_back({zone->d_changes.d_id, zone->d_changes.d_generation});
+    collectNames(qnames, zoneIdx, zone->d_qpolName);
+    collectNames(nsnames, zoneIdx, zone->d_propolName);
+    collectAddrs(clientAddrs, zoneIdx, *zone->d_qpolAddr);
+    collectAddrs(nsAddrs, zoneIdx, *zone->d_propolNSAddr);
+    collectAddrs(responseAddrs, zoneIdx, *zone->d_postpolAddr);
+  }
+
+  index->d_qnames.d_compiled = std::make_shared<CompiledNameTree>(qnames);
+  index->d_nsnames.d_compiled = std::make_shared<CompiledNameTree>(nsnames);
+  index->d_clientAddrs = compileAddrTree(clientAddrs);
+  index->d_nsAddrs = compileAddrTree(nsAddrs);
+  index->d_responseAddrs = compileAddrTree(responseAddrs);
+  d_index = index;
+}
+
+bool DNSFilterEngine::isCompiled() const
+{
+  if (!d_index || d_index->d_zoneStates.size() != d_zones.size()) {
+    return false;
+  }
+
+  for (size_t zoneIdx = 0; zoneIdx < d_zones.size(); zoneIdx++) {
+    const auto& zone = d_zones[zoneIdx];
+    const auto& state = d_index->d_zoneStates[zoneIdx];
+    if (zone ? (state.first != zone->d_changes.d_id || state.second != zone->d_changes.d_generation) : state.first != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void DNSFilterEngine::setZone(size_t zoneIdx, std::shared_ptr<Zone> newZone)
+{
+  if (!newZone) {
+    return;
+  }
+
+  const bool wasCompiled = isCompiled();
+  assureZones(zoneIdx);
+  const auto oldZone = d_zones[zoneIdx];
+  d_zones[zoneIdx] = newZone;
+
+  if (!wasCompiled) {
+    /* never compiled, or modified in place since, lookups are walking the zones anyway */
+    if (d_index) {
+      compile();
+    }
+    return;
+  }
+
+  const auto& changes = newZone->d_changes;
+  if (!oldZone || !changes.tracking() || changes.d_baseId != oldZone->d_changes.d_id || changes.d_baseGeneration != oldZone->d_changes.d_generation) {
+    compile();
+    return;
+  }
+
+  /* copy the small overlays, share the compiled parts */
+  auto index = std::make_shared<Index>(*d_index);
+  index->d_zoneStates.resize(d_zones.size(), {0, 0});
+  index->d_zoneStates[zoneIdx] = {changes.d_id, changes.d_generation};
+
+  for (const auto& name : changes.d_qnames) {
+    Index::updateName(index->d_qnames, name, zoneIdx, newZone->d_qpolName);
+  }
+  for (const auto& name : changes.d_nsnames) {
+    Index::updateName(index->d_nsnames, name, zoneIdx, newZone->d_propolName);
+  }
+
+  const bool compactQNames = index->d_qnames.needsCompaction();
+  const bool compactNSNames = index->d_nsnames.needsCompaction();
+  if (compactQNames || compactNSNames || changes.d_addrs) {
+    CompiledNameTree::entries_t qnames, nsnames;
+    std::vector<std::pair<Netmask, ZonePolicy>> clientAddrs, nsAddrs, responseAddrs;
+    for (size_t idx = 0; idx < d_zones.size(); idx++) {
+      const auto& zone = d_zones[idx];
+      if (!zone) {
+        continue;
+      }
+      if (compactQNames) {
+        collectNames(qnames, idx, zone->d_qpolName);
+      }
+      if (compactNSNames) {
+        collectNames(nsnames, idx, zone->d_propolName);
+      }
+      if (changes.d_addrs) {
+        collectAddrs(clientAddrs, idx, *zone->d_qpolAddr);
+        collectAddrs(nsAddrs, idx, *zone->d_propolNSAddr);
+        collectAddrs(responseAddrs, idx, *zone->d_postpolAddr);
+      }
+    }
+
+    if (compactQNames) {
+      index->d_qnames.d_compiled = std::make_shared<CompiledNameTree>(qnames);
+      index->d_qnames.d_overlay.clear();
+    }
+    if (compactNSNames) {
+      index->d_nsnames.d_compiled = std::make_shared<CompiledNameTree>(nsnames);
+      index->d_nsnames.d_overlay.clear();
+    }
+    if (changes.d_addrs) {
+      /* IP triggers are rarely numerous enough to warrant an overlay */
+      index->d_clientAddrs = compileAddrTree(clientAddrs);
+      index->d_nsAddrs = compileAddrTree(nsAddrs);
+      index->d_responseAddrs = compileAddrTree(responseAddrs);
+    }
+  }
+
+  d_index = index;
+}
+
+void DNSFilterEngine::NamePolicyMap::set(const DNSName& name, const Policy& pol)
+{
+  if (d_base.unique()) {
+    applyOverlay(*d_base);
+    auto res = d_base->insert({name, pol});
+    if (res.second) {
+      d_size++;
+    }
+    else {
+      res.first->second = pol;
+    }
+    return;
+  }
+
+  if (!find(name)) {
+    d_size++;
+  }
+  d_overlay[name] = pol;
+  foldIfNeeded();
+}
+
+void DNSFilterEngine::NamePolicyMap::erase(const DNSName& name)
+{
+  if (d_base.unique()) {
+    applyOverlay(*d_base);
+    d_size -= d_base->erase(name);
+    return;
+  }
+
+  if (!find(name)) {
+    return;
+  }
+  d_size--;
+  if (d_base->count(name)) {
+    d_overlay[name] = boost::none;
+  }
+  else {
+    d_overlay.erase(name);
+  }
+  foldIfNeeded();
+}
+
+void DNSFilterEngine::NamePolicyMap::applyOverlay(map_t& base)
+{
+  for (const auto& pair : d_overlay) {
+    if (pair.second) {
+      base[pair.first] = *pair.second;
+    }
+    else {
+      base.erase(pair.first);
+    }
+  }
+  d_overlay.clear();
+}
+
+void DNSFilterEngine::NamePolicyMap::foldIfNeeded()
+{
+  if (d_overlay.size() <= 1024 + d_base->size() / 16) {
+    return;
+  }
+
+  auto base = std::make_shared<map_t>(*d_base);
+  applyOverlay(*base);
+  d_base = base;
+}
+
+NetmaskTree<DNSFilterEngine::Policy>& DNSFilterEngine::Zone::getForWrite(std::shared_ptr<NetmaskTree<Policy>>& tree)
+{
+  if (!tree.unique()) {
+    tree = std::make_shared<NetmaskTree<Policy>>(*tree);
+  }
+  return *tree;
+}
+
+void DNSFilterEngine::Zone::nameChanged(std::vector<DNSName>& names, const DNSName& name)
+{
+  d_changes.d_generation++;
+  if (d_changes.tracking()) {
+    names.push_back(name);
+  }
+}
+
+void DNSFilterEngine::Zone::addrChanged()
+{
+  d_changes.d_generation++;
+  d_changes.d_addrs = true;
+}
+
 bool DNSFilterEngine::Zone::findQNamePolicy(const DNSName& qname, DNSFilterEngine::Policy& pol) const
 {
   return findNamedPolicy(d_qpolName, qname, pol);
@@ -43,7 +712,7 @@ bool DNSFilterEngine::Zone::findNSPolicy(const DNSName& qname, DNSFilterEngine::
 
 bool DNSFilterEngine::Zone::findNSIPPolicy(const ComboAddress& addr, DNSFilterEngine::Policy& pol) const
 {
-  if (const auto fnd = d_propolNSAddr.lookup(addr)) {
+  if (const auto fnd = d_propolNSAddr->lookup(addr)) {
     pol = fnd->second;
     return true;
   }
@@ -52,7 +721,7 @@ bool DNSFilterEngine::Zone::findNSIPPolicy(const ComboAddress& addr, DNSFilterEn
 
 bool DNSFilterEngine::Zone::findResponsePolicy(const ComboAddress& addr, DNSFilterEngine::Policy& pol) const
 {
-  if (const auto fnd = d_postpolAddr.lookup(addr)) {
+  if (const auto fnd = d_postpolAddr->lookup(addr)) {
     pol = fnd->second;
     return true;
   }
@@ -61,14 +730,14 @@ bool DNSFilterEngine::Zone::findResponsePolicy(const ComboAddress& addr, DNSFilt
 
 bool DNSFilterEngine::Zone::findClientPolicy(const ComboAddress& addr, DNSFilterEngine::Policy& pol) const
 {
-  if (const auto fnd = d_qpolAddr.lookup(addr)) {
+  if (const auto fnd = d_qpolAddr->lookup(addr)) {
     pol = fnd->second;
     return true;
   }
   return false;
 }
 
-bool DNSFilterEngine::Zone::findNamedPolicy(const std::unordered_map<DNSName, DNSFilterEngine::Policy>& polmap, const DNSName& qname, DNSFilterEngine::Policy& pol) const
+bool DNSFilterEngine::Zone::findNamedPolicy(const NamePolicyMap& polmap, const DNSName& qname, DNSFilterEngine::Policy& pol) const
 {
   /* for www.powerdns.com, we need to check:
      www.powerdns.com.
@@ -77,19 +746,18 @@ bool DNSFilterEngine::Zone::findNamedPolicy(const std::unordered_map<DNSName, DN
                     *.
    */
 
-  std::unordered_map<DNSName, DNSFilterEngine::Policy>::const_iterator iter;
-  iter = polmap.find(qname);
+  const Policy* found = polmap.find(qname);
 
-  if(iter != polmap.end()) {
-    pol=iter->second;
+  if(found) {
+    pol=*found;
     return true;
   }
 
   DNSName s(qname);
   while(s.chopOff()){
-    iter = polmap.find(g_wildcarddnsname+s);
-    if(iter != polmap.end()) {
-      pol=iter->second;
+    found = polmap.find(g_wildcarddnsname+s);
+    if(found) {
+      pol=*found;
       return true;
     }
   }
@@ -100,6 +768,12 @@ DNSFilterEngine::Policy DNSFilterEngine::getProcessingPolicy(const DNSName& qnam
 {
   //  cout<<"Got question for nameserver name "<<qname<<endl;
   Policy pol;
+  if (isCompiled()) {
+    size_t zoneIdx;
+    Index::findName(d_index->d_nsnames, qname, [this,&discardedPolicies](size_t idx) { return !isDiscarded(idx, discardedPolicies); }, zoneIdx, pol);
+    return pol;
+  }
+
   for(const auto& z : d_zones) {
     const auto zoneName = z->getName();
     if(zoneName && discardedPolicies.find(*zoneName) != discardedPolicies.end()) {
@@ -118,6 +792,12 @@ DNSFilterEngine::Policy DNSFilterEngine::getProcessingPolicy(const ComboAddress&
 {
   Policy pol;
   //  cout<<"Got question for nameserver IP "<<address.toString()<<endl;
+  if (isCompiled()) {
+    size_t zoneIdx;
+    Index::findAddr(*d_index->d_nsAddrs, address, [this,&discardedPolicies](size_t idx) { return !isDiscarded(idx, discardedPolicies); }, zoneIdx, pol);
+    return pol;
+  }
+
   for(const auto& z : d_zones) {
     const auto zoneName = z->getName();
     if(zoneName && discardedPolicies.find(*zoneName) != discardedPolicies.end()) {
@@ -136,6 +816,19 @@ DNSFilterEngine::Policy DNSFilterEngine::getQueryPolicy(const DNSName& qname, co
 {
   //  cout<<"Got question for "<<qname<<" from "<<ca.toString()<<endl;
   Policy pol;
+  if (isCompiled()) {
+    /* within the same zone, the qname trigger wins */
+    auto isEnabled = [this,&discardedPolicies](size_t idx) { return !isDiscarded(idx, discardedPolicies); };
+    size_t nameZoneIdx, addrZoneIdx;
+    Policy addrPol;
+    bool nameFound = Index::findName(d_index->d_qnames, qname, isEnabled, nameZoneIdx, pol);
+    bool addrFound = Index::findAddr(*d_index->d_clientAddrs, ca, isEnabled, addrZoneIdx, addrPol);
+    if (addrFound && (!nameFound || addrZoneIdx < nameZoneIdx)) {
+      return addrPol;
+    }
+    return pol;
+  }
+
   for(const auto& z : d_zones) {
     const auto zoneName = z->getName();
     if(zoneName && discardedPolicies.find(*zoneName) != discardedPolicies.end()) {
@@ -176,6 +869,14 @@ DNSFilterEngine::Policy DNSFilterEngine::getPostPolicy(const vector<DNSRecord>&
     else
       continue;
 
+    if (isCompiled()) {
+      size_t zoneIdx;
+      if (Index::findAddr(*d_index->d_responseAddrs, ca, [this,&discardedPolicies](size_t idx) { return !isDiscarded(idx, discardedPolicies); }, zoneIdx, pol)) {
+        return pol;
+      }
+      continue;
+    }
+
     for(const auto& z : d_zones) {
       const auto zoneName = z->getName();
       if(zoneName && discardedPolicies.find(*zoneName) != discardedPolicies.end()) {
@@ -200,64 +901,74 @@ void DNSFilterEngine::Zone::addClientTrigger(const Netmask& nm, Policy pol)
 {
   pol.d_name = d_name;
   pol.d_type = PolicyType::ClientIP;
-  d_qpolAddr.insert(nm).second=pol;
+  getForWrite(d_qpolAddr).insert(nm).second=pol;
+  addrChanged();
 }
 
 void DNSFilterEngine::Zone::addResponseTrigger(const Netmask& nm, Policy pol)
 {
   pol.d_name = d_name;
   pol.d_type = PolicyType::ResponseIP;
-  d_postpolAddr.insert(nm).second=pol;
+  getForWrite(d_postpolAddr).insert(nm).second=pol;
+  addrChanged();
 }
 
 void DNSFilterEngine::Zone::addQNameTrigger(const DNSName& n, Policy pol)
 {
   pol.d_name = d_name;
   pol.d_type = PolicyType::QName;
-  d_qpolName[n]=pol;
+  d_qpolName.set(n, pol);
+  nameChanged(d_changes.d_qnames, n);
 }
 
 void DNSFilterEngine::Zone::addNSTrigger(const DNSName& n, Policy pol)
 {
   pol.d_name = d_name;
   pol.d_type = PolicyType::NSDName;
-  d_propolName[n]=pol;
+  d_propolName.set(n, pol);
+  nameChanged(d_changes.d_nsnames, n);
 }
 
 void DNSFilterEngine::Zone::addNSIPTrigger(const Netmask& nm, Policy pol)
 {
   pol.d_name = d_name;
   pol.d_type = PolicyType::NSIP;
-  d_propolNSAddr.insert(nm).second = pol;
+  getForWrite(d_propolNSAddr).insert(nm).second = pol;
+  addrChanged();
 }
 
 bool DNSFilterEngine::Zone::rmClientTrigger(const Netmask& nm, Policy pol)
 {
-  d_qpolAddr.erase(nm);
+  getForWrite(d_qpolAddr).erase(nm);
+  addrChanged();
   return true;
 }
 
 bool DNSFilterEngine::Zone::rmResponseTrigger(const Netmask& nm, Policy pol)
 {
-  d_postpolAddr.erase(nm);
+  getForWrite(d_postpolAddr).erase(nm);
+  addrChanged();
   return true;
 }
 
 bool DNSFilterEngine::Zone::rmQNameTrigger(const DNSName& n, Policy pol)
 {
   d_qpolName.erase(n); // XXX verify we had identical policy?
+  nameChanged(d_changes.d_qnames, n);
   return true;
 }
 
 bool DNSFilterEngine::Zone::rmNSTrigger(const DNSName& n, Policy pol)
 {
   d_propolName.erase(n); // XXX verify policy matched? =pol;
+  nameChanged(d_changes.d_nsnames, n);
   return true;
 }
 
 bool DNSFilterEngine::Zone::rmNSIPTrigger(const Netmask& nm, Policy pol)
 {
-  d_propolNSAddr.erase(nm);
+  getForWrite(d_propolNSAddr).erase(nm);
+  addrChanged();
   return true;
 }
 
@@ -396,23 +1107,23 @@ void DNSFilterEngine::Zone::dump(FILE* fp) const
   auto soa = DNSRecordContent::mastermake(QType::SOA, QClass::IN, "fake.RPZ. hostmaster.fake.RPZ. " + std::to_string(d_serial) + " " + std::to_string(d_refresh) + " 600 3600000 604800");
   fprintf(fp, "%s IN SOA %s\n", d_domain.toString().c_str(), soa->getZoneRepresentation().c_str());
 
-  for (const auto& pair : d_qpolName) {
-    dumpNamedPolicy(fp, pair.first + d_domain, pair.second);
-  }
+  d_qpolName.visit([this,fp](const DNSName& name, const Policy& pol) {
+      dumpNamedPolicy(fp, name + d_domain, pol);
+    });
 
-  for (const auto& pair : d_propolName) {
-    dumpNamedPolicy(fp, pair.first + DNSName("rpz-nsdname.") + d_domain, pair.second);
-  }
+  d_propolName.visit([this,fp](const DNSName& name, const Policy& pol) {
+      dumpNamedPolicy(fp, name + DNSName("rpz-nsdname.") + d_domain, pol);
+    });
 
-  for (const auto pair : d_qpolAddr) {
+  for (const auto pair : *d_qpolAddr) {
     dumpAddrPolicy(fp, pair->first, DNSName("rpz-client-ip.") + d_domain, pair->second);
   }
 
-  for (const auto pair : d_propolNSAddr) {
+  for (const auto pair : *d_propolNSAddr) {
     dumpAddrPolicy(fp, pair->first, DNSName("rpz-nsip.") + d_domain, pair->second);
   }
 
-  for (const auto pair : d_postpolAddr) {
+  for (const auto pair : *d_postpolAddr) {
     dumpAddrPolicy(fp, pair->first, DNSName("rpz-ip.") + d_domain, pair->second);
   }
 }
@@ -24,8 +24,10 @@
 #include "dns.hh"
 #include "dnsname.hh"
 #include "dnsparser.hh"
+#include <atomic>
 #include <map>
 #include <unordered_map>
+#include <boost/optional.hpp>
 
 /* This class implements a filtering policy that is able to fully implement RPZ, but is not bound to it.
    In other words, it is generic enough to support RPZ, but could get its data from other places.
@@ -88,20 +90,96 @@ public:
     int32_t d_ttl;
   };
 
+  /* Name to policy map that is cheap to copy: copies share an immutable base, and each
+     copy records its own changes in a small overlay. Once the overlay gets larger than
+     1/16th of the base, it is folded into a new base. A map that does not share its
+     base with any other is modified in place. */
+  class NamePolicyMap
+  {
+  public:
+    NamePolicyMap(): d_base(std::make_shared<map_t>())
+    {
+    }
+
+    const Policy* find(const DNSName& name) const
+    {
+      if (!d_overlay.empty()) {
+        const auto it = d_overlay.find(name);
+        if (it != d_overlay.end()) {
+          return it->second ? &(*it->second) : nullptr;
+        }
+      }
+      const auto it = d_base->find(name);
+      return it != d_base->end() ? &it->second : nullptr;
+    }
+    void set(const DNSName& name, const Policy& pol);
+    void erase(const DNSName& name);
+    void clear()
+    {
+      d_base = std::make_shared<map_t>();
+      d_overlay.clear();
+      d_size = 0;
+    }
+    void reserve(size_t entriesCount)
+    {
+      if (d_base.unique()) {
+        d_base->reserve(entriesCount);
+      }
+    }
+    size_t size() const
+    {
+      return d_size;
+    }
+    size_t getOverlaySize() const
+    {
+      return d_overlay.size();
+    }
+    template<typename F> void visit(const F& f) const
+    {
+      for (const auto& pair : *d_base) {
+        if (d_overlay.empty() || d_overlay.count(pair.first) == 0) {
+          f(pair.first, pair.second);
+        }
+      }
+      for (const auto& pair : d_overlay) {
+        if (pair.second) {
+          f(pair.first, *pair.second);
+        }
+      }
+    }
+
+  private:
+    typedef std::unordered_map<DNSName, Policy> map_t;
+
+    void applyOverlay(map_t& base);
+    void foldIfNeeded();
+
+    std::shared_ptr<map_t> d_base;
+    /* boost::none marks a removal */
+    std::unordered_map<DNSName, boost::optional<Policy>> d_overlay;
+    size_t d_size{0};
+  };
+
   class Zone {
   public:
     void clear()
     {
-      d_qpolAddr.clear();
-      d_postpolAddr.clear();
+      d_qpolAddr = std::make_shared<NetmaskTree<Policy>>();
+      d_postpolAddr = std::make_shared<NetmaskTree<Policy>>();
       d_propolName.clear();
-      d_propolNSAddr.clear();
+      d_propolNSAddr = std::make_shared<NetmaskTree<Policy>>();
       d_qpolName.clear();
+      d_changes.d_generation++;
+      d_changes.d_full = true;
     }
     void reserve(size_t entriesCount)
     {
       d_qpolName.reserve(entriesCount);
     }
+    size_t size() const
+    {
+      return d_qpolName.size() + d_propolName.size() + d_qpolAddr->size() + d_propolNSAddr->size() + d_postpolAddr->size();
+    }
     void setName(const std::string& name)
     {
       d_name = std::make_shared<std::string>(name);
@@ -143,16 +221,63 @@ public:
     bool findClientPolicy(const ComboAddress& addr, DNSFilterEngine::Policy& pol) const;
 
   private:
+    friend class DNSFilterEngine;
+
+    /* Keeps track of the triggers modified since this zone was copied from another one,
+       so the engine can update its index instead of rebuilding it. Copying a zone
+       starts a new, empty, log. */
+    struct ChangeLog
+    {
+      ChangeLog(): d_id(++s_lastId)
+      {
+      }
+      ChangeLog(const ChangeLog& rhs): d_id(++s_lastId), d_baseId(rhs.d_id), d_baseGeneration(rhs.d_generation)
+      {
+      }
+      ChangeLog& operator=(const ChangeLog& rhs)
+      {
+        d_id = ++s_lastId;
+        d_baseId = rhs.d_id;
+        d_baseGeneration = rhs.d_generation;
+        d_generation = 0;
+        d_qnames.clear();
+        d_nsnames.clear();
+        d_addrs = false;
+        d_full = false;
+        return *this;
+      }
+      bool tracking() const
+      {
+        return d_baseId != 0 && !d_full;
+      }
+
+      std::vector<DNSName> d_qnames;
+      std::vector<DNSName> d_nsnames;
+      uint64_t d_id;
+      uint64_t d_baseId{0};
+      uint64_t d_generation{0};
+      uint64_t d_baseGeneration{0};
+      bool d_addrs{false};
+      bool d_full{false};
+
+      static std::atomic<uint64_t> s_lastId;
+    };
+
+    void nameChanged(std::vector<DNSName>& names, const DNSName& name);
+    void addrChanged();
     static DNSName maskToRPZ(const Netmask& nm);
-    bool findNamedPolicy(const std::unordered_map<DNSName, DNSFilterEngine::Policy>& polmap, const DNSName& qname, DNSFilterEngine::Policy& pol) const;
+    static NetmaskTree<Policy>& getForWrite(std::shared_ptr<NetmaskTree<Policy>>& tree);
+    bool findNamedPolicy(const NamePolicyMap& polmap, const DNSName& qname, DNSFilterEngine::Policy& pol) const;
     void dumpNamedPolicy(FILE* fp, const DNSName& name, const Policy& pol) const;
     void dumpAddrPolicy(FILE* fp, const Netmask& nm, const DNSName& name, const Policy& pol) const;
 
-    std::unordered_map<DNSName, Policy> d_qpolName;   // QNAME trigger (RPZ)
-    NetmaskTree<Policy> d_qpolAddr;         // Source address
-    std::unordered_map<DNSName, Policy> d_propolName; // NSDNAME (RPZ)
-    NetmaskTree<Policy> d_propolNSAddr;     // NSIP (RPZ)
-    NetmaskTree<Policy> d_postpolAddr;      // IP trigger (RPZ)
+    /* the netmask trees are shared between copies of a zone until one of them is modified */
+    NamePolicyMap d_qpolName;   // QNAME trigger (RPZ)
+    std::shared_ptr<NetmaskTree<Policy>> d_qpolAddr{std::make_shared<NetmaskTree<Policy>>()};         // Source address
+    NamePolicyMap d_propolName; // NSDNAME (RPZ)
+    std::shared_ptr<NetmaskTree<Policy>> d_propolNSAddr{std::make_shared<NetmaskTree<Policy>>()};     // NSIP (RPZ)
+    std::shared_ptr<NetmaskTree<Policy>> d_postpolAddr{std::make_shared<NetmaskTree<Policy>>()};      // IP trigger (RPZ)
+    ChangeLog d_changes;
     DNSName d_domain;
     std::shared_ptr<std::string> d_name;
     uint32_t d_serial{0};
@@ -165,6 +290,7 @@ public:
     for(auto& z : d_zones) {
       z->clear();
     }
+    d_index.reset();
   }
   const std::shared_ptr<Zone> getZone(size_t zoneIdx) const
   {
@@ -189,13 +315,13 @@ public:
     d_zones.push_back(newZone);
     return (d_zones.size() - 1);
   }
-  void setZone(size_t zoneIdx, std::shared_ptr<Zone> newZone)
-  {
-    if (newZone) {
-      assureZones(zoneIdx);
-      d_zones[zoneIdx] = newZone;
-    }
-  }
+  /* If the index is up to date and newZone is a modified copy of the zone it replaces,
+     the index is updated with the changes only */
+  void setZone(size_t zoneIdx, std::shared_ptr<Zone> newZone);
+  /* Builds the index merging the triggers of all zones. Until it is called, and
+     whenever a zone has been modified in place since, lookups walk every zone instead. */
+  void compile();
+  bool isCompiled() const;
 
   Policy getQueryPolicy(const DNSName& qname, const ComboAddress& nm, const std::unordered_map<std::string,bool>& discardedPolicies) const;
   Policy getProcessingPolicy(const DNSName& qname, const std::unordered_map<std::string,bool>& discardedPolicies) const;
@@ -206,6 +332,18 @@ public:
     return d_zones.size();
   }
 private:
+  class Index;
+
   void assureZones(size_t zone);
+  bool isDiscarded(size_t zoneIdx, const std::unordered_map<std::string,bool>& discardedPolicies) const
+  {
+    if (discardedPolicies.empty()) {
+      return false;
+    }
+    const auto zoneName = d_zones[zoneIdx]->getName();
+    return zoneName && discardedPolicies.find(*zoneName) != discardedPolicies.end();
+  }
+
   vector<std::shared_ptr<Zone>> d_zones;
+  std::shared_ptr<const Index> d_index{nullptr};
 };
@@ -353,6 +353,8 @@ RecursorLua4::RecursorLua4(const std::string& fname)
   d_lw->registerMember("udpAnswer", &DNSQuestion::udpAnswer);
   d_lw->registerMember("udpQueryDest", &DNSQuestion::udpQueryDest);
   d_lw->registerMember("udpCallback", &DNSQuestion::udpCallback);
+  d_lw->registerMember("localQueryPath", &DNSQuestion::localQueryPath);
+  d_lw->registerMember("followupTimeout", &DNSQuestion::followupTimeout);
   d_lw->registerMember("appliedPolicy", &DNSQuestion::appliedPolicy);
   d_lw->registerMember<DNSFilterEngine::Policy, std::string>("policyName",
     [](const DNSFilterEngine::Policy& pol) -> std::string {
@@ -600,14 +602,17 @@ bool RecursorLua4::preoutquery(const ComboAddress& ns, const ComboAddress& reque
 
 bool RecursorLua4::ipfilter(const ComboAddress& remote, const ComboAddress& local, const struct dnsheader& dh)
 {
-  if(d_ipfilter)
+  if(d_ipfilter) {
+    LatencyTimer luaTimer(LatencyPhase::Lua);
     return d_ipfilter(remote, local, dh);
+  }
   return false; // don't block
 }
 
 unsigned int RecursorLua4::gettag(const ComboAddress& remote, const Netmask& ednssubnet, const ComboAddress& local, const DNSName& qname, uint16_t qtype, std::vector<std::string>* policyTags, LuaContext::LuaObject& data, const std::map<uint16_t, EDNSOptionView>& ednsOptions, bool tcp, std::string& requestorId, std::string& deviceId)
 {
   if(d_gettag) {
+    LatencyTimer luaTimer(LatencyPhase::Lua);
     auto ret = d_gettag(remote, ednssubnet, local, qname, qtype, ednsOptions, tcp);
 
     if (policyTags) {
@@ -640,6 +645,8 @@ bool RecursorLua4::genhook(luacall_t& func, DNSQuestion& dq, int& ret)
   if(!func)
     return false;
 
+  LatencyTimer luaTimer(LatencyPhase::Lua, dq.latencyTrace);
+
   if (dq.currentRecords) {
     dq.records = *dq.currentRecords;
   } else {
@@ -652,9 +659,19 @@ bool RecursorLua4::genhook(luacall_t& func, DNSQuestion& dq, int& ret)
   dq.udpQuery.clear();
   dq.udpAnswer.clear();
   dq.udpCallback.clear();
+  dq.localQueryPath.clear();
+  dq.followupTimeout = 0;
 
   dq.rcode = ret;
   bool handled=func(&dq);
+  /* only the time spent running Lua code is counted, not the one spent in the
+     followups below, which might yield this MThread while waiting for the network */
+  luaTimer.suspend();
+
+  /* the network followups below yield this MThread until the answer comes in,
+     and share a single budget of followupTimeout milliseconds per hook call */
+  DTime followupTime;
+  bool followupStarted = false;
 
   if(handled) {
 loop:;
@@ -670,14 +687,39 @@ loop:;
       else if(dq.followupFunction=="getFakePTRRecords") {
         ret=getFakePTRRecords(dq.followupName, dq.followupPrefix, dq.records);
       }
-      else if(dq.followupFunction=="udpQueryResponse") {
-        dq.udpAnswer = GenUDPQueryResponse(dq.udpQueryDest, dq.udpQuery);
+      else if(dq.followupFunction=="udpQueryResponse" || dq.followupFunction=="tcpQueryResponse" || dq.followupFunction=="localQueryResponse") {
+        if(!followupStarted) {
+          followupTime.set();
+          followupStarted = true;
+        }
+        /* 0 lets the query functions fall back to network-timeout for each query */
+        unsigned int timeout = 0;
+        bool expired = false;
+        if(dq.followupTimeout) {
+          unsigned int elapsed = followupTime.udiffNoReset() / 1000;
+          expired = elapsed >= dq.followupTimeout;
+          timeout = expired ? 0 : dq.followupTimeout - elapsed;
+        }
+        dq.udpAnswer.clear();
+        if(!expired) {
+          if(dq.followupFunction=="udpQueryResponse") {
+            dq.udpAnswer = GenUDPQueryResponse(dq.udpQueryDest, dq.udpQuery, timeout);
+          }
+          else if(dq.followupFunction=="tcpQueryResponse") {
+            dq.udpAnswer = GenTCPQueryResponse(dq.udpQueryDest, string(), dq.udpQuery, timeout);
+          }
+          else {
+            dq.udpAnswer = GenTCPQueryResponse(dq.udpQueryDest, dq.localQueryPath, dq.udpQuery, timeout);
+          }
+        }
         auto cbFunc = d_lw->readVariable<boost::optional<luacall_t>>(dq.udpCallback).get_value_or(0);
         if(!cbFunc) {
-          theL()<<Logger::Error<<"Attempted callback for Lua UDP Query/Response which could not be found"<<endl;
+          theL()<<Logger::Error<<"Attempted callback for Lua Query/Response which could not be found"<<endl;
           return false;
         }
+        luaTimer.resume();
         bool result=cbFunc(&dq);
+        luaTimer.suspend();
         if(!result) {
           return false;
         }
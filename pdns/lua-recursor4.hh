@@ -34,8 +34,10 @@
 #include "filterpo.hh"
 #include "ednsoptions.hh"
 #include "validate.hh"
+#include "rec-latency.hh"
 
-string GenUDPQueryResponse(const ComboAddress& dest, const string& query);
+string GenUDPQueryResponse(const ComboAddress& dest, const string& query, unsigned int timeoutMsec);
+string GenTCPQueryResponse(const ComboAddress& dest, const string& path, const string& query, unsigned int timeoutMsec);
 unsigned int getRecursorThreadId();
 
 class LuaContext;
@@ -72,6 +74,7 @@ public:
     DNSFilterEngine::Policy* appliedPolicy{nullptr};
     std::vector<std::string>* policyTags{nullptr};
     std::unordered_map<std::string,bool>* discardedPolicies{nullptr};
+    LatencyTrace* latencyTrace{nullptr};
     std::string requestorId;
     std::string deviceId;
     vState validationState{Indeterminate};
@@ -101,6 +104,8 @@ public:
     ComboAddress udpQueryDest;
     string udpAnswer;
     string udpCallback;
+    string localQueryPath;
+    unsigned int followupTimeout{0};
     
     LuaContext::LuaObject data;
     DNSName followupName;
@@ -47,6 +47,9 @@
 #include <boost/algorithm/string.hpp>
 #include "validate-recursor.hh"
 #include "ednssubnet.hh"
+#include "mplexer.hh"
+
+extern thread_local FDMultiplexer* t_fdm;
 
 #ifdef HAVE_PROTOBUF
 
@@ -86,6 +89,268 @@ static void logIncomingResponse(std::shared_ptr<RemoteLogger> outgoingLogger, bo
 }
 #endif /* HAVE_PROTOBUF */
 
+unsigned int TCPOutConnectionManager::s_maxIdleMsec;
+unsigned int TCPOutConnectionManager::s_maxQueries;
+unsigned int TCPOutConnectionManager::s_maxIdlePerThread;
+unsigned int TCPOutConnectionManager::s_maxPipelined;
+unsigned int TCPOutConnectionManager::s_timeoutMsec;
+thread_local std::multimap<ComboAddress, TCPOutConnectionManager::connection_t> TCPOutConnectionManager::t_connections;
+
+/* Returns the connection to remote with the fewest outstanding queries, as long as it can take
+   one more and none of them uses qid. Returns an empty pointer if there is no such connection */
+TCPOutConnectionManager::connection_t TCPOutConnectionManager::get(const ComboAddress& remote, uint16_t qid, const struct timeval& now)
+{
+  connection_t result;
+  auto range = t_connections.equal_range(remote);
+  for (auto it = range.first; it != range.second; ++it) {
+    const auto& conn = it->second;
+    if (!conn->d_usable || conn->d_pending.size() >= s_maxPipelined || conn->d_pending.count(qid)) {
+      continue;
+    }
+    /* idle for too long, cleanup() will close it */
+    if (conn->d_pending.empty() && makeFloat(now - conn->d_lastUsed) * 1000 > s_maxIdleMsec) {
+      continue;
+    }
+    if (!result || conn->d_pending.size() < result->d_pending.size()) {
+      result = conn;
+    }
+  }
+  return result;
+}
+
+TCPOutConnectionManager::connection_t TCPOutConnectionManager::create(const ComboAddress& remote)
+{
+  auto conn = std::make_shared<Connection>();
+  conn->d_remote = remote;
+  conn->d_socket = std::unique_ptr<Socket>(new Socket(remote.sin4.sin_family, SOCK_STREAM));
+  conn->d_socket->setNonBlocking();
+  conn->d_socket->bind(getQueryLocalAddress(remote.sin4.sin_family, 0));
+  conn->d_socket->connect(remote);
+  /* when reuse is disabled, the connection is closed as soon as its query has been answered */
+  conn->d_usable = s_maxIdleMsec > 0;
+  t_connections.insert({remote, conn});
+  return conn;
+}
+
+int TCPOutConnectionManager::query(const ComboAddress& remote, uint16_t qid, const std::string& query, std::string& answer, const struct timeval& now)
+{
+  auto conn = get(remote, qid, now);
+  if (!conn) {
+    return sendAndWait(create(remote), qid, query, answer);
+  }
+
+  if (!conn->d_pending.empty()) {
+    g_stats.tcpOutQueriesPipelined++;
+  }
+  int ret = sendAndWait(conn, qid, query, answer);
+  if (ret == -1) {
+    /* the remote end might have closed the connection before getting our query, try once more on a new one */
+    return sendAndWait(create(remote), qid, query, answer);
+  }
+  if (ret > 0) {
+    g_stats.tcpOutConnectionsReused++;
+  }
+  return ret;
+}
+
+int TCPOutConnectionManager::sendAndWait(const connection_t& conn, uint16_t qid, const std::string& query, std::string& answer)
+{
+  const uint16_t len = htons(query.size());
+  conn->d_output.append(reinterpret_cast<const char*>(&len), sizeof(len));
+  conn->d_output.append(query);
+  conn->d_pending.insert(qid);
+  conn->d_queries++;
+  if (s_maxQueries && conn->d_queries >= s_maxQueries) {
+    conn->d_usable = false;
+  }
+  updateWatch(conn);
+
+  /* the answer is handed to us by handleReadable(), or an empty one if the connection failed */
+  PacketID pident;
+  pident.sock = conn->d_socket.get();
+  pident.id = qid;
+  answer.clear();
+  int ret = getMT()->waitEvent(pident, &answer, s_timeoutMsec);
+  if (ret == 0 || ret == -1) {
+    /* the answer might still come later, don't send any new query over this connection */
+    conn->d_pending.erase(qid);
+    conn->d_usable = false;
+    release(conn);
+    return ret;
+  }
+
+  if (answer.empty()) {
+    return -1;
+  }
+  return 1;
+}
+
+void TCPOutConnectionManager::handleReadable(int fd, boost::any& var)
+{
+  /* a copy, since answering a query can change what the multiplexer holds for this fd */
+  auto conn = *boost::any_cast<connection_t>(&var);
+  char buffer[4096];
+  ssize_t got = recv(fd, buffer, sizeof(buffer), 0);
+  if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+    return;
+  }
+  if (got <= 0) {
+    fail(conn);
+    return;
+  }
+  conn->d_input.append(buffer, got);
+
+  size_t pos = 0;
+  /* answering a query runs the code waiting for it, which might close the connection */
+  while (conn->d_socket && conn->d_input.size() - pos >= 2) {
+    const uint16_t len = (static_cast<uint8_t>(conn->d_input.at(pos)) << 8) + static_cast<uint8_t>(conn->d_input.at(pos + 1));
+    if (conn->d_input.size() - pos - 2 < len) {
+      break;
+    }
+    if (len < sizeof(struct dnsheader)) {
+      fail(conn);
+      return;
+    }
+
+    string answer = conn->d_input.substr(pos + 2, len);
+    pos += 2 + len;
+    const uint16_t id = reinterpret_cast<const struct dnsheader*>(answer.c_str())->id;
+    /* not pending anymore means that query timed out */
+    if (conn->d_pending.erase(id)) {
+      PacketID pident;
+      pident.sock = conn->d_socket.get();
+      pident.id = id;
+      getMT()->sendEvent(pident, &answer);
+    }
+  }
+  conn->d_input.erase(0, pos);
+
+  release(conn);
+}
+
+void TCPOutConnectionManager::handleWritable(int fd, boost::any& var)
+{
+  auto conn = *boost::any_cast<connection_t>(&var);
+  ssize_t sent = send(fd, conn->d_output.c_str(), conn->d_output.size(), 0);
+  if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+    return;
+  }
+  if (sent <= 0) {
+    fail(conn);
+    return;
+  }
+
+  conn->d_output.erase(0, sent);
+  updateWatch(conn);
+}
+
+/* we watch a connection for writes as long as we have queries to send over it, and for
+   reads otherwise, even when idle, so we notice when the remote end closes it */
+void TCPOutConnectionManager::updateWatch(const connection_t& conn)
+{
+  setWatch(conn, conn->d_output.empty() ? Connection::Watch::Read : Connection::Watch::Write);
+}
+
+void TCPOutConnectionManager::setWatch(const connection_t& conn, Connection::Watch watch)
+{
+  if (conn->d_watch == watch) {
+    return;
+  }
+
+  const int fd = conn->d_socket->getHandle();
+  if (conn->d_watch == Connection::Watch::Read) {
+    t_fdm->removeReadFD(fd);
+  }
+  else if (conn->d_watch == Connection::Watch::Write) {
+    t_fdm->removeWriteFD(fd);
+  }
+
+  if (watch == Connection::Watch::Read) {
+    t_fdm->addReadFD(fd, handleReadable, conn);
+  }
+  else if (watch == Connection::Watch::Write) {
+    t_fdm->addWriteFD(fd, handleWritable, conn);
+  }
+  conn->d_watch = watch;
+}
+
+/* once a connection has no outstanding query left, it is either closed or kept for later */
+void TCPOutConnectionManager::release(const connection_t& conn)
+{
+  if (!conn->d_socket || !conn->d_pending.empty()) {
+    return;
+  }
+
+  size_t idle = 0;
+  for (const auto& entry : t_connections) {
+    if (entry.second != conn && entry.second->d_pending.empty()) {
+      idle++;
+    }
+  }
+
+  if (!conn->d_usable || idle >= s_maxIdlePerThread) {
+    close(conn);
+    return;
+  }
+  Utility::gettimeofday(&conn->d_lastUsed, nullptr);
+}
+
+/* the outstanding queries get an empty answer, meaning that the connection failed */
+void TCPOutConnectionManager::fail(const connection_t& conn)
+{
+  std::set<uint16_t> pending;
+  pending.swap(conn->d_pending);
+  /* the waiters are keyed on the socket, it has to outlive them */
+  auto sock = close(conn);
+  for (const auto id : pending) {
+    PacketID pident;
+    pident.sock = sock.get();
+    pident.id = id;
+    string empty;
+    getMT()->sendEvent(pident, &empty);
+  }
+}
+
+/* removes the connection from the pool, the socket being closed once the returned pointer goes away */
+std::unique_ptr<Socket> TCPOutConnectionManager::close(const connection_t& conn)
+{
+  conn->d_usable = false;
+  if (!conn->d_socket) {
+    return nullptr;
+  }
+
+  setWatch(conn, Connection::Watch::None);
+  auto range = t_connections.equal_range(conn->d_remote);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (it->second == conn) {
+      t_connections.erase(it);
+      break;
+    }
+  }
+  return std::move(conn->d_socket);
+}
+
+/* closes the connections that have been idle for too long */
+void TCPOutConnectionManager::cleanup(const struct timeval& now)
+{
+  std::vector<connection_t> expired;
+  for (const auto& entry : t_connections) {
+    const auto& conn = entry.second;
+    if (conn->d_pending.empty() && makeFloat(now - conn->d_lastUsed) * 1000 > s_maxIdleMsec) {
+      expired.push_back(conn);
+    }
+  }
+
+  for (const auto& conn : expired) {
+    close(conn);
+  }
+}
+
+size_t TCPOutConnectionManager::size()
+{
+  return t_connections.size();
+}
+
 //! returns -2 for OS limits error, -1 for permanent error that has to do with remote **transport**, 0 for timeout, 1 for success
 /** lwr is only filled out in case 1 was returned, and even when returning 1 for 'success', lwr might contain DNS errors
     Never throws! 
@@ -166,42 +431,20 @@ int asyncresolve(const ComboAddress& ip, const DNSName& domain, int type, bool d
   }
   else {
     try {
-      Socket s(ip.sin4.sin_family, SOCK_STREAM);
-
-      s.setNonBlocking();
-      ComboAddress local = getQueryLocalAddress(ip.sin4.sin_family, 0);
-
-      s.bind(local);
-        
-      s.connect(ip);
-      
-      uint16_t tlen=htons(vpacket.size());
-      char *lenP=(char*)&tlen;
       const char *msgP=(const char*)&*vpacket.begin();
-      string packet=string(lenP, lenP+2)+string(msgP, msgP+vpacket.size());
-      
-      ret=asendtcp(packet, &s);
-      if(!(ret>0))           
-        return ret;
-      
-      packet.clear();
-      ret=arecvtcp(packet, 2, &s, false);
-      if(!(ret > 0))
-        return ret;
-      
-      memcpy(&tlen, packet.c_str(), sizeof(tlen));
-      len=ntohs(tlen); // switch to the 'len' shared with the rest of the function
-      
-      ret=arecvtcp(packet, len, &s, false);
+      string answer;
+
+      ret=TCPOutConnectionManager::query(ip, qid, string(msgP, msgP+vpacket.size()), answer, *now);
       if(!(ret > 0))
         return ret;
-      
+
+      len=answer.size();
       if(len > bufsize) {
         bufsize=len;
         scoped_array<unsigned char> narray(new unsigned char[bufsize]);
         buf.swap(narray);
       }
-      memcpy(buf.get(), packet.c_str(), len);
+      memcpy(buf.get(), answer.c_str(), len);
 
       ret=1;
     }
@@ -21,8 +21,12 @@
  */
 #ifndef PDNS_LWRES_HH
 #define PDNS_LWRES_HH
+#include <map>
+#include <memory>
+#include <set>
 #include <string>
 #include <vector>
+#include <boost/any.hpp>
 #include <sys/types.h>
 #include "misc.hh"
 #include "iputils.hh"
@@ -67,5 +71,58 @@ public:
   bool d_haveEDNS{false};
 };
 
+class Socket;
+
+/* Per-thread pool of outgoing TCP connections, keyed by remote address.
+   Up to s_maxPipelined queries can be outstanding on a connection at the same time,
+   their answers being matched to them by ID, in whatever order they arrive.
+   A connection without outstanding queries is kept open for s_maxIdleMsec, so the
+   next TCP queries to the same server can use it. */
+class TCPOutConnectionManager
+{
+public:
+  /* sends query, without its length prefix, and waits for the answer with the same qid
+     -1 is error, 0 is timeout, 1 is success. Throws a NetworkError if no connection could be set up */
+  static int query(const ComboAddress& remote, uint16_t qid, const std::string& query, std::string& answer, const struct timeval& now);
+  static void cleanup(const struct timeval& now);
+  static size_t size();
+
+  static unsigned int s_maxIdleMsec;
+  static unsigned int s_maxQueries;
+  static unsigned int s_maxIdlePerThread;
+  static unsigned int s_maxPipelined;
+  static unsigned int s_timeoutMsec;
+
+private:
+  struct Connection
+  {
+    enum class Watch { None, Read, Write };
+
+    ComboAddress d_remote;
+    std::unique_ptr<Socket> d_socket;
+    std::string d_output; // queries not sent yet, with their length prefix
+    std::string d_input; // what we read of the answers not complete yet
+    std::set<uint16_t> d_pending; // IDs of the queries waiting for their answer
+    struct timeval d_lastUsed{0, 0};
+    size_t d_queries{0};
+    Watch d_watch{Watch::None};
+    bool d_usable{true}; // false once no new query should be sent over it
+  };
+  typedef std::shared_ptr<Connection> connection_t;
+
+  static connection_t get(const ComboAddress& remote, uint16_t qid, const struct timeval& now);
+  static connection_t create(const ComboAddress& remote);
+  static int sendAndWait(const connection_t& conn, uint16_t qid, const std::string& query, std::string& answer);
+  static void handleReadable(int fd, boost::any& var);
+  static void handleWritable(int fd, boost::any& var);
+  static void updateWatch(const connection_t& conn);
+  static void setWatch(const connection_t& conn, Connection::Watch watch);
+  static void release(const connection_t& conn);
+  static void fail(const connection_t& conn);
+  static std::unique_ptr<Socket> close(const connection_t& conn);
+
+  static thread_local std::multimap<ComboAddress, connection_t> t_connections;
+};
+
 int asyncresolve(const ComboAddress& ip, const DNSName& domain, int type, bool doTCP, bool sendRDQuery, int EDNS0Level, struct timeval* now, boost::optional<Netmask>& srcmask, boost::optional<const ResolveContext&> context, std::shared_ptr<RemoteLogger> outgoingLogger, LWResult* res);
 #endif // PDNS_LWRES_HH
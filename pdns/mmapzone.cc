@@ -0,0 +1,540 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <set>
+#include <tuple>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "mmapzone.hh"
+#include "base32.hh"
+#include "dnssecinfra.hh"
+#include "logger.hh"
+#include "misc.hh"
+#include "pdnsexception.hh"
+
+static const char s_magic[8] = { 'P', 'D', 'N', 'S', '-', 'M', 'M', 'Z' };
+static const uint32_t s_byteOrder = 0x01020304;
+
+const uint32_t MMapZone::s_version;
+const uint32_t MMapZone::s_flagNSEC3;
+const uint8_t MMapZone::s_flagNSEC;
+
+MMapZone::MMapZone(const std::string& fname) : d_filename(fname)
+{
+  int fd = open(fname.c_str(), O_RDONLY);
+  if(fd < 0) {
+    throw PDNSException("Unable to open compiled zone '"+fname+"': "+stringerror());
+  }
+
+  struct stat st;
+  if(fstat(fd, &st) < 0) {
+    int err = errno;
+    close(fd);
+    throw PDNSException("Unable to stat compiled zone '"+fname+"': "+strerror(err));
+  }
+  d_size = st.st_size;
+  if(d_size < sizeof(Header)) {
+    close(fd);
+    throw PDNSException("Compiled zone '"+fname+"' is too short");
+  }
+
+  void* data = mmap(nullptr, d_size, PROT_READ, MAP_SHARED, fd, 0);
+  int err = errno;
+  close(fd);
+  if(data == MAP_FAILED) {
+    throw PDNSException("Unable to map compiled zone '"+fname+"': "+strerror(err));
+  }
+  d_data = static_cast<const char*>(data);
+  /* lookups jump all over the file, reading ahead would only evict useful pages */
+  madvise(data, d_size, MADV_RANDOM);
+
+  try {
+    d_header = reinterpret_cast<const Header*>(d_data);
+    if(memcmp(d_header->magic, s_magic, sizeof(s_magic)) != 0) {
+      throw PDNSException("'"+fname+"' is not a compiled zone");
+    }
+    if(d_header->byteOrder != s_byteOrder) {
+      throw PDNSException("Compiled zone '"+fname+"' was written on a host with another byte order");
+    }
+    if(d_header->version != s_version) {
+      throw PDNSException("Compiled zone '"+fname+"' has version "+std::to_string(d_header->version)+", expected "+std::to_string(s_version));
+    }
+
+    const Header& h = *d_header;
+    if(h.namesOffset % 8 || h.namesOffset > d_size || h.nameCount > (d_size - h.namesOffset) / sizeof(NameEntry) ||
+       h.hashesOffset % 4 || h.hashesOffset > d_size || h.hashCount > (d_size - h.hashesOffset) / sizeof(uint32_t) ||
+       h.recordsOffset % 8 || h.recordsOffset > d_size || h.recordCount > (d_size - h.recordsOffset) / sizeof(RecordEntry) ||
+       h.stringsOffset > d_size || h.stringsSize > d_size - h.stringsOffset) {
+      throw PDNSException("Compiled zone '"+fname+"' is corrupt");
+    }
+    d_names = reinterpret_cast<const NameEntry*>(d_data + h.namesOffset);
+    d_hashes = reinterpret_cast<const uint32_t*>(d_data + h.hashesOffset);
+    d_records = reinterpret_cast<const RecordEntry*>(d_data + h.recordsOffset);
+    d_strings = d_data + h.stringsOffset;
+
+    const char* labels = getString(h.zoneOffset, h.zoneLength);
+    for(uint64_t pos = 0; pos < h.zoneLength; pos += 1 + static_cast<uint8_t>(labels[pos])) {
+      if(pos + 1 + static_cast<uint8_t>(labels[pos]) > h.zoneLength) {
+        throw PDNSException("Compiled zone '"+fname+"' is corrupt");
+      }
+      d_zone.appendRawLabel(labels + pos + 1, static_cast<uint8_t>(labels[pos]));
+    }
+    if(d_zone.empty()) {
+      d_zone = g_rootdnsname;
+    }
+  }
+  catch(...) {
+    munmap(const_cast<char*>(d_data), d_size);
+    throw;
+  }
+}
+
+MMapZone::~MMapZone()
+{
+  munmap(const_cast<char*>(d_data), d_size);
+}
+
+const char* MMapZone::getString(uint64_t offset, uint64_t length) const
+{
+  if(offset > d_header->stringsSize || length > d_header->stringsSize - offset) {
+    throw PDNSException("Compiled zone '"+d_filename+"' is corrupt");
+  }
+  return d_strings + offset;
+}
+
+const MMapZone::NameEntry& MMapZone::getNameEntry(uint32_t index) const
+{
+  if(index >= d_header->nameCount) {
+    throw PDNSException("Compiled zone '"+d_filename+"' is corrupt");
+  }
+  return d_names[index];
+}
+
+const MMapZone::RecordEntry& MMapZone::getRecordEntry(uint32_t index) const
+{
+  if(index >= d_header->recordCount) {
+    throw PDNSException("Compiled zone '"+d_filename+"' is corrupt");
+  }
+  return d_records[index];
+}
+
+int MMapZone::compareKey(uint32_t index, const std::string& key) const
+{
+  const NameEntry& entry = getNameEntry(index);
+  const char* ours = getString(entry.keyOffset, entry.keyLength);
+  int ret = memcmp(ours, key.c_str(), std::min(static_cast<size_t>(entry.keyLength), key.size()));
+  if(ret != 0) {
+    return ret;
+  }
+  return entry.keyLength < key.size() ? -1 : (entry.keyLength > key.size() ? 1 : 0);
+}
+
+std::string MMapZone::getHash(uint32_t index) const
+{
+  const NameEntry& entry = getNameEntry(index);
+  return std::string(getString(entry.hashOffset, entry.hashLength), entry.hashLength);
+}
+
+uint32_t MMapZone::getHashedName(uint32_t position) const
+{
+  if(position >= d_header->hashCount) {
+    throw PDNSException("Compiled zone '"+d_filename+"' is corrupt");
+  }
+  return d_hashes[position];
+}
+
+std::string MMapZone::canonicalKey(const DNSName& qname)
+{
+  /* labels from the root down, each byte lowercased, ended by a 0. Bytes 0 and 1 are
+     escaped as 1 1 and 1 2, so that a 0 always sorts a label before the longer ones it
+     is a prefix of */
+  std::string key;
+  const auto labels = qname.getRawLabels();
+  for(auto label = labels.rbegin(); label != labels.rend(); ++label) {
+    for(const auto c : *label) {
+      const char lc = dns_tolower(c);
+      if(lc == 0 || lc == 1) {
+        key.append(1, 1);
+        key.append(1, lc + 1);
+      }
+      else {
+        key.append(1, lc);
+      }
+    }
+    key.append(1, 0);
+  }
+  return key;
+}
+
+bool MMapZone::findName(const DNSName& qname, uint32_t& index) const
+{
+  const std::string key = canonicalKey(qname);
+  uint32_t lo = 0, hi = d_header->nameCount;
+  while(lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    int cmp = compareKey(mid, key);
+    if(cmp == 0) {
+      index = mid;
+      return true;
+    }
+    if(cmp < 0) {
+      lo = mid + 1;
+    }
+    else {
+      hi = mid;
+    }
+  }
+  return false;
+}
+
+DNSName MMapZone::getName(uint32_t index) const
+{
+  const NameEntry& entry = getNameEntry(index);
+  const char* labels = getString(entry.labelsOffset, entry.labelsLength);
+  DNSName ret(g_rootdnsname);
+  for(size_t pos = 0; pos < entry.labelsLength; pos += 1 + static_cast<uint8_t>(labels[pos])) {
+    if(pos + 1 + static_cast<uint8_t>(labels[pos]) > entry.labelsLength) {
+      throw PDNSException("Compiled zone '"+d_filename+"' is corrupt");
+    }
+    ret.appendRawLabel(labels + pos + 1, static_cast<uint8_t>(labels[pos]));
+  }
+  return ret;
+}
+
+void MMapZone::getRecord(uint32_t index, DNSResourceRecord& rr) const
+{
+  const RecordEntry& entry = getRecordEntry(index);
+  rr.content.assign(getString(entry.contentOffset, entry.contentLength), entry.contentLength);
+  rr.qtype = entry.qtype;
+  rr.ttl = entry.ttl;
+  rr.auth = entry.auth;
+}
+
+bool MMapZone::getBeforeAndAfterUnhashed(const DNSName& qname, DNSName& before, DNSName& after) const
+{
+  const uint32_t count = d_header->nameCount;
+  if(!count) {
+    return false;
+  }
+
+  const std::string key = canonicalKey(qname);
+  uint32_t lo = 0, hi = count;
+  while(lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if(compareKey(mid, key) <= 0) {
+      lo = mid + 1;
+    }
+    else {
+      hi = mid;
+    }
+  }
+
+  uint32_t beforeIdx = lo;
+  if(beforeIdx != 0) {
+    --beforeIdx;
+  }
+  while(!(getNameEntry(beforeIdx).flags & s_flagNSEC)) {
+    if(beforeIdx == 0) {
+      return false;
+    }
+    --beforeIdx;
+  }
+
+  uint32_t afterIdx = lo;
+  if(afterIdx == count) {
+    afterIdx = 0;
+  }
+  else {
+    while(!(getNameEntry(afterIdx).flags & s_flagNSEC)) {
+      if(++afterIdx == count) {
+        afterIdx = 0;
+        break;
+      }
+    }
+  }
+
+  before = getName(beforeIdx);
+  after = getName(afterIdx);
+  return true;
+}
+
+bool MMapZone::getBeforeAndAfterHashed(const DNSName& hashed, DNSName& unhashed, DNSName& before, DNSName& after) const
+{
+  const uint32_t count = d_header->hashCount;
+  if(!count) {
+    return false;
+  }
+
+  const std::string hash = hashed.toStringNoDot();
+  uint32_t lo = 0, hi = count;
+  while(lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if(getHash(getHashedName(mid)) <= hash) {
+      lo = mid + 1;
+    }
+    else {
+      hi = mid;
+    }
+  }
+
+  uint32_t afterPos = lo == count ? 0 : lo;
+  uint32_t beforePos = lo == 0 ? count - 1 : lo - 1;
+
+  before = DNSName(getHash(getHashedName(beforePos)));
+  after = DNSName(getHash(getHashedName(afterPos)));
+  unhashed = getName(getHashedName(beforePos)) + d_zone;
+  return true;
+}
+
+namespace {
+struct CompiledRecord
+{
+  DNSName qname;
+  std::string content;
+  uint32_t ttl;
+  uint16_t qtype;
+  bool auth;
+  bool hashed;
+
+  bool operator<(const CompiledRecord& rhs) const
+  {
+    if(qtype == QType::SOA && rhs.qtype != QType::SOA)
+      return true;
+    if(rhs.qtype == QType::SOA && qtype != QType::SOA)
+      return false;
+    return std::tie(qtype, content, ttl) < std::tie(rhs.qtype, rhs.content, rhs.ttl);
+  }
+};
+
+struct CompiledName
+{
+  DNSName qname;
+  std::vector<CompiledRecord> records;
+  std::string hash;
+  bool nsec{false};
+};
+}
+
+void MMapZone::compile(const DNSName& zone, const std::vector<DNSResourceRecord>& records, const std::string& fname, bool nsec3, const NSEC3PARAMRecordContent& ns3pr, bool narrow, uint32_t maxENTs)
+{
+  const bool hashing = nsec3 && !narrow;
+  std::vector<CompiledRecord> recs;
+  std::set<DNSName> qnames, nssets, dssets;
+
+  recs.reserve(records.size());
+  for(const auto& rr : records) {
+    if(!rr.qtype.getCode()) {
+      continue;
+    }
+    if(!rr.qname.isPartOf(zone)) {
+      throw PDNSException("Record '"+rr.qname.toLogString()+"' is not part of zone '"+zone.toLogString()+"'");
+    }
+    CompiledRecord rec;
+    rec.qname = rr.qname.makeRelative(zone);
+    rec.content = rr.content;
+    rec.ttl = rr.ttl;
+    rec.qtype = rr.qtype.getCode();
+    rec.auth = true;
+    rec.hashed = false;
+    qnames.insert(rec.qname);
+    if(!rec.qname.isRoot() && rec.qtype == QType::NS)
+      nssets.insert(rec.qname);
+    else if(rec.qtype == QType::DS)
+      dssets.insert(rec.qname);
+    recs.push_back(std::move(rec));
+  }
+
+  /* what the BIND backend does in fixupOrderAndAuth(): anything below a delegation is
+     not authoritative, nor is the delegation itself, apart from its DS records */
+  for(auto& rec : recs) {
+    bool skip = false;
+    DNSName shorter(rec.qname);
+    while(shorter.chopOff()) {
+      if(nssets.count(shorter)) {
+        skip = true;
+        break;
+      }
+    }
+    rec.auth = !skip && (rec.qtype == QType::DS || rec.qtype == QType::RRSIG || !nssets.count(rec.qname));
+    rec.hashed = hashing && !skip && rec.qtype != QType::RRSIG && (rec.auth || (rec.qtype == QType::NS && !ns3pr.d_flags) || dssets.count(rec.qname));
+  }
+
+  /* and in doEmptyNonTerminals() */
+  std::map<DNSName, bool> nonterm;
+  bool tooManyENTs = false;
+  for(const auto& rec : recs) {
+    bool auth = rec.auth;
+    if(!rec.auth && rec.qtype == QType::NS)
+      auth = (!nsec3 || !ns3pr.d_flags);
+
+    DNSName shorter(rec.qname);
+    while(!tooManyENTs && shorter.chopOff()) {
+      if(qnames.count(shorter))
+        continue;
+      auto it = nonterm.find(shorter);
+      if(it == nonterm.end()) {
+        if(!maxENTs) {
+          L<<Logger::Error<<"Zone '"<<zone<<"' has too many empty non terminals."<<endl;
+          tooManyENTs = true;
+          nonterm.clear();
+          break;
+        }
+        nonterm.insert({shorter, auth});
+        --maxENTs;
+      }
+      else if(auth)
+        it->second = true;
+    }
+  }
+  for(const auto& nt : nonterm) {
+    CompiledRecord rec;
+    rec.qname = nt.first;
+    rec.ttl = 0;
+    rec.qtype = 0;
+    rec.auth = nt.second;
+    rec.hashed = hashing && nt.second;
+    recs.push_back(std::move(rec));
+  }
+
+  std::map<std::string, CompiledName> names;
+  for(auto& rec : recs) {
+    auto& name = names[canonicalKey(rec.qname)];
+    if(name.qname.empty())
+      name.qname = rec.qname;
+    if(rec.qtype && (rec.auth || rec.qtype == QType::NS))
+      name.nsec = true;
+    if(rec.hashed && name.hash.empty())
+      name.hash = toBase32Hex(hashQNameWithSalt(ns3pr, rec.qname + zone));
+    name.records.push_back(std::move(rec));
+  }
+  recs.clear();
+
+  Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, s_magic, sizeof(s_magic));
+  header.version = s_version;
+  header.byteOrder = s_byteOrder;
+  header.flags = hashing ? s_flagNSEC3 : 0;
+
+  std::string strings;
+  auto addString = [&strings](const std::string& str) {
+    uint64_t offset = strings.size();
+    strings.append(str);
+    return offset;
+  };
+  auto rawLabels = [](const DNSName& qname) {
+    std::string ret;
+    for(const auto& label : qname.getRawLabels()) {
+      ret.append(1, static_cast<char>(label.size()));
+      ret.append(label);
+    }
+    return ret;
+  };
+
+  const std::string zoneLabels = rawLabels(zone);
+  header.zoneOffset = addString(zoneLabels);
+  header.zoneLength = zoneLabels.size();
+
+  std::vector<NameEntry> nameEntries;
+  std::vector<RecordEntry> recordEntries;
+  std::vector<std::pair<std::string, uint32_t>> hashed;
+  nameEntries.reserve(names.size());
+  for(auto& name : names) {
+    NameEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    const std::string labels = rawLabels(name.second.qname);
+    entry.labelsOffset = addString(labels);
+    entry.labelsLength = labels.size();
+    entry.keyOffset = addString(name.first);
+    entry.keyLength = name.first.size();
+    entry.hashOffset = addString(name.second.hash);
+    entry.hashLength = name.second.hash.size();
+    entry.flags = name.second.nsec ? s_flagNSEC : 0;
+    entry.firstRecord = recordEntries.size();
+    entry.recordCount = name.second.records.size();
+
+    if(!name.second.hash.empty()) {
+      hashed.push_back({name.second.hash, static_cast<uint32_t>(nameEntries.size())});
+    }
+
+    std::sort(name.second.records.begin(), name.second.records.end());
+    for(const auto& rec : name.second.records) {
+      RecordEntry record;
+      memset(&record, 0, sizeof(record));
+      record.contentOffset = addString(rec.content);
+      record.contentLength = rec.content.size();
+      record.ttl = rec.ttl;
+      record.qtype = rec.qtype;
+      record.auth = rec.auth;
+      recordEntries.push_back(record);
+    }
+    nameEntries.push_back(entry);
+  }
+  std::sort(hashed.begin(), hashed.end());
+
+  header.nameCount = nameEntries.size();
+  header.hashCount = hashed.size();
+  header.recordCount = recordEntries.size();
+  header.namesOffset = sizeof(Header);
+  header.hashesOffset = header.namesOffset + nameEntries.size() * sizeof(NameEntry);
+  header.recordsOffset = header.hashesOffset + hashed.size() * sizeof(uint32_t);
+  const uint64_t hashesPadding = (8 - header.recordsOffset % 8) % 8;
+  header.recordsOffset += hashesPadding;
+  header.stringsOffset = header.recordsOffset + recordEntries.size() * sizeof(RecordEntry);
+  header.stringsSize = strings.size();
+
+  const std::string tmpname = fname + ".tmp";
+  {
+    std::ofstream ofs(tmpname, std::ios::binary | std::ios::trunc);
+    if(!ofs) {
+      throw PDNSException("Unable to open '"+tmpname+"' for writing: "+stringerror());
+    }
+    ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    ofs.write(reinterpret_cast<const char*>(nameEntries.data()), nameEntries.size() * sizeof(NameEntry));
+    for(const auto& entry : hashed) {
+      ofs.write(reinterpret_cast<const char*>(&entry.second), sizeof(entry.second));
+    }
+    const char padding[8] = { 0 };
+    ofs.write(padding, hashesPadding);
+    ofs.write(reinterpret_cast<const char*>(recordEntries.data()), recordEntries.size() * sizeof(RecordEntry));
+    ofs.write(strings.c_str(), strings.size());
+    ofs.close();
+    if(!ofs) {
+      unlink(tmpname.c_str());
+      throw PDNSException("Error writing '"+tmpname+"': "+stringerror());
+    }
+  }
+
+  if(rename(tmpname.c_str(), fname.c_str()) < 0) {
+    int err = errno;
+    unlink(tmpname.c_str());
+    throw PDNSException("Unable to rename '"+tmpname+"' to '"+fname+"': "+strerror(err));
+  }
+}
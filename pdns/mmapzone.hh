@@ -0,0 +1,157 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+#include <string>
+#include <vector>
+#include "dns.hh"
+#include "dnsname.hh"
+#include "dnsrecords.hh"
+
+/** A zone compiled into an immutable file, which is mmap()ed and served as is: opening
+    one only validates its header, and the pages are shared between all processes serving it.
+
+    The file starts with a Header, followed by:
+    - the names of the zone, relative to the apex, as NameEntry items sorted in canonical order,
+      including the empty non-terminals;
+    - when NSEC3 ordering is present, the indexes of the hashed names sorted by their hash;
+    - the records, as RecordEntry items, grouped per name with the SOA first;
+    - a blob holding the labels of all names, their canonical sort keys, NSEC3 hashes and the
+      record contents in zone file format.
+
+    Authoritative flags, empty non-terminals and NSEC3 hashes are computed once, when compiling,
+    the same way the BIND backend does when loading a zone file. All integers are in host byte
+    order, files are refused on a host with another one.
+*/
+class MMapZone
+{
+public:
+  static const uint32_t s_version = 1;
+
+  struct Header
+  {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t flags;
+    uint32_t nameCount;
+    uint32_t hashCount;
+    uint32_t recordCount;
+    uint64_t namesOffset;
+    uint64_t hashesOffset;
+    uint64_t recordsOffset;
+    uint64_t stringsOffset;
+    uint64_t stringsSize;
+    uint64_t zoneOffset;
+    uint64_t zoneLength;
+  };
+
+  struct NameEntry
+  {
+    uint64_t labelsOffset;
+    uint64_t keyOffset;
+    uint64_t hashOffset;
+    uint32_t firstRecord;
+    uint32_t recordCount;
+    uint16_t labelsLength;
+    uint16_t keyLength;
+    uint8_t hashLength;
+    uint8_t flags;
+    uint8_t padding[2];
+  };
+
+  struct RecordEntry
+  {
+    uint64_t contentOffset;
+    uint32_t contentLength;
+    uint32_t ttl;
+    uint16_t qtype;
+    uint8_t auth;
+    uint8_t padding[5];
+  };
+
+  static const uint32_t s_flagNSEC3 = 1; //!< Header: names carry an NSEC3 hash
+  static const uint8_t s_flagNSEC = 1; //!< NameEntry: the name is part of the NSEC chain
+
+  explicit MMapZone(const std::string& fname); //!< throws a PDNSException if fname is not a valid compiled zone
+  ~MMapZone();
+  MMapZone(const MMapZone&) = delete;
+  MMapZone& operator=(const MMapZone&) = delete;
+
+  const DNSName& getZone() const
+  {
+    return d_zone;
+  }
+  const std::string& getFilename() const
+  {
+    return d_filename;
+  }
+  bool isNSEC3() const
+  {
+    return d_header->flags & s_flagNSEC3;
+  }
+  uint32_t getNameCount() const
+  {
+    return d_header->nameCount;
+  }
+  uint32_t getRecordCount() const
+  {
+    return d_header->recordCount;
+  }
+
+  //! index of qname, relative to the zone, false if there is no such name
+  bool findName(const DNSName& qname, uint32_t& index) const;
+  const NameEntry& getNameEntry(uint32_t index) const;
+  //! the name at index, relative to the zone
+  DNSName getName(uint32_t index) const;
+  //! fills in the content, type, TTL and auth flag of a record, leaving its name alone
+  void getRecord(uint32_t index, DNSResourceRecord& rr) const;
+
+  //! names around qname, relative to the zone, in the NSEC chain
+  bool getBeforeAndAfterUnhashed(const DNSName& qname, DNSName& before, DNSName& after) const;
+  //! NSEC3 hashes around hashed, and the absolute name the one before it belongs to
+  bool getBeforeAndAfterHashed(const DNSName& hashed, DNSName& unhashed, DNSName& before, DNSName& after) const;
+
+  //! sort key of a name relative to the zone: comparing keys with memcmp() gives the canonical order
+  static std::string canonicalKey(const DNSName& qname);
+
+  /** writes the records of zone to fname, through a temporary file renamed into place. Records
+      with a type of 0 are ignored, empty non-terminals are added here. With nsec3 set and narrow
+      unset, names get the hash ns3pr gives them. */
+  static void compile(const DNSName& zone, const std::vector<DNSResourceRecord>& records, const std::string& fname, bool nsec3, const NSEC3PARAMRecordContent& ns3pr, bool narrow, uint32_t maxENTs);
+
+private:
+  const char* getString(uint64_t offset, uint64_t length) const;
+  const RecordEntry& getRecordEntry(uint32_t index) const;
+  int compareKey(uint32_t index, const std::string& key) const;
+  std::string getHash(uint32_t index) const;
+  uint32_t getHashedName(uint32_t position) const;
+
+  std::string d_filename;
+  DNSName d_zone;
+  const char* d_data{nullptr};
+  size_t d_size{0};
+  const Header* d_header{nullptr};
+  const NameEntry* d_names{nullptr};
+  const uint32_t* d_hashes{nullptr};
+  const RecordEntry* d_records{nullptr};
+  const char* d_strings{nullptr};
+};
@@ -0,0 +1,129 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+#include <atomic>
+#include <memory>
+
+/** A bounded queue any number of threads can push to and pop from, without taking
+    a lock. Each cell carries a sequence number telling whether it is ready to be
+    written or read for the current lap around the ring, so producers and consumers
+    only ever contend on the position they claim with a compare-and-swap.
+
+    The capacity is rounded up to a power of two. push() fails when the queue is full,
+    and pop() when it is empty, neither ever blocks: waiting for work is left to the user.
+*/
+template<typename T>
+class MPMCQueue
+{
+public:
+  explicit MPMCQueue(size_t capacity) : d_mask(roundUp(capacity) - 1), d_cells(new Cell[d_mask + 1])
+  {
+    for(size_t idx = 0; idx <= d_mask; ++idx) {
+      d_cells[idx].seq.store(idx, std::memory_order_relaxed);
+    }
+  }
+
+  MPMCQueue(const MPMCQueue&) = delete;
+  MPMCQueue& operator=(const MPMCQueue&) = delete;
+
+  bool push(const T& value)
+  {
+    Cell* cell;
+    size_t pos = d_enqueuePos.load(std::memory_order_relaxed);
+    for(;;) {
+      cell = &d_cells[pos & d_mask];
+      size_t seq = cell->seq.load(std::memory_order_acquire);
+      intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+      if(diff == 0) {
+        if(d_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      }
+      else if(diff < 0) {
+        return false; // full
+      }
+      else {
+        pos = d_enqueuePos.load(std::memory_order_relaxed);
+      }
+    }
+
+    cell->data = value;
+    cell->seq.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool pop(T& value)
+  {
+    Cell* cell;
+    size_t pos = d_dequeuePos.load(std::memory_order_relaxed);
+    for(;;) {
+      cell = &d_cells[pos & d_mask];
+      size_t seq = cell->seq.load(std::memory_order_acquire);
+      intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+      if(diff == 0) {
+        if(d_dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      }
+      else if(diff < 0) {
+        return false; // empty
+      }
+      else {
+        pos = d_dequeuePos.load(std::memory_order_relaxed);
+      }
+    }
+
+    value = std::move(cell->data);
+    cell->seq.store(pos + d_mask + 1, std::memory_order_release);
+    return true;
+  }
+
+  size_t capacity() const
+  {
+    return d_mask + 1;
+  }
+
+private:
+  static size_t roundUp(size_t capacity)
+  {
+    size_t result = 2;
+    while(result < capacity) {
+      result <<= 1;
+    }
+    return result;
+  }
+
+  struct Cell
+  {
+    std::atomic<size_t> seq;
+    T data;
+  };
+
+  const size_t d_mask;
+  std::unique_ptr<Cell[]> d_cells;
+  /* keep the producers and the consumers positions on different cache lines */
+  char d_pad0[64];
+  std::atomic<size_t> d_enqueuePos{0};
+  char d_pad1[64];
+  std::atomic<size_t> d_dequeuePos{0};
+  char d_pad2[64];
+};
@@ -268,10 +268,16 @@ template<class Key, class Val>void MTasker<Key,Val>::makeThread(tfunc_t *start,
   auto uc=std::make_shared<pdns_ucontext_t>();
   
   uc->uc_link = &d_kernel; // come back to kernel after dying
-  uc->uc_stack.resize (d_stacksize);
+  if (!d_cachedStacks.empty()) {
+    uc->uc_stack = std::move(d_cachedStacks.back());
+    d_cachedStacks.pop_back();
+  }
+  else {
+    uc->uc_stack = std::unique_ptr<MThreadStack>(new MThreadStack(d_stacksize));
+  }
 #ifdef PDNS_USE_VALGRIND
-  uc->valgrind_id = VALGRIND_STACK_REGISTER(&uc->uc_stack[0],
-                                            &uc->uc_stack[uc->uc_stack.size()]);
+  uc->valgrind_id = VALGRIND_STACK_REGISTER(uc->uc_stack->data(),
+                                            uc->uc_stack->data() + uc->uc_stack->size());
 #endif /* PDNS_USE_VALGRIND */
 
   auto& thread = d_threads[d_maxtid];
@@ -290,6 +296,22 @@ template<class Key, class Val>void MTasker<Key,Val>::makeThread(tfunc_t *start,
 }
 
 
+//! keeps the stack of a dead thread around to be reused, unless we already have enough of them
+template<class Key, class Val>void MTasker<Key,Val>::releaseStack(std::unique_ptr<MThreadStack>& stack)
+{
+  if (!stack) {
+    return;
+  }
+
+  if (d_cachedStacks.size() < d_maxCachedStacks) {
+    d_cachedStacks.push_back(std::move(stack));
+  }
+  else {
+    d_releasedStacksHighWaterMark = std::max(d_releasedStacksHighWaterMark, stack->getHighWaterMark());
+    stack.reset();
+  }
+}
+
 //! needs to be called periodically so threads can run and housekeeping can be performed
 /** The kernel should call this function every once in a while. It makes sense
     to call this function if you:
@@ -315,7 +337,11 @@ template<class Key, class Val>bool MTasker<Key,Val>::schedule(struct timeval*  n
     return true;
   }
   if(!d_zombiesQueue.empty()) {
-    d_threads.erase(d_zombiesQueue.front());
+    auto zombie = d_threads.find(d_zombiesQueue.front());
+    if (zombie != d_threads.end()) {
+      releaseStack(zombie->second.context->uc_stack);
+      d_threads.erase(zombie);
+    }
     d_zombiesQueue.pop();
     return true;
   }
@@ -399,6 +425,24 @@ template<class Key, class Val>unsigned int MTasker<Key,Val>::getMaxStackUsage()
   return d_threads[d_tid].startOfStack - d_threads[d_tid].highestStackSeen;
 }
 
+//! Returns the maximum stack usage so far of all the MThreads, based on the pages of their stacks that have been touched
+/** Unlike getMaxStackUsage(), this is not limited to the points where a thread waited for an event, but
+    it has a page granularity and requires a system call per stack, so it should not be called too often.
+*/
+template<class Key, class Val>size_t MTasker<Key,Val>::getStacksHighWaterMark() const
+{
+  size_t result = d_releasedStacksHighWaterMark;
+  for (const auto& stack : d_cachedStacks) {
+    result = std::max(result, stack->getHighWaterMark());
+  }
+  for (const auto& thread : d_threads) {
+    if (thread.second.context && thread.second.context->uc_stack) {
+      result = std::max(result, thread.second.context->uc_stack->getHighWaterMark());
+    }
+  }
+  return result;
+}
+
 //! Returns the maximum stack usage so far of this MThread
 template<class Key, class Val>unsigned int MTasker<Key,Val>::getUsec()
 {
@@ -71,6 +71,10 @@ private:
   int d_tid;
   int d_maxtid;
   size_t d_stacksize;
+  /* stacks of dead MThreads, kept to be reused for new ones */
+  std::vector<std::unique_ptr<MThreadStack>> d_cachedStacks;
+  size_t d_maxCachedStacks;
+  size_t d_releasedStacksHighWaterMark{0};
 
   EventVal d_waitval;
   enum waitstatusenum {Error=-1,TimeOut=0,Answer} d_waitstatus;
@@ -109,8 +113,9 @@ public:
   /** Constructor with a small default stacksize. If any of your threads exceeds this stack, your application will crash. 
       This limit applies solely to the stack, the heap is not limited in any way. If threads need to allocate a lot of data,
       the use of new/delete is suggested. 
+      Up to stackCacheSize stacks of threads that have exited are kept to be reused by new threads.
    */
-  MTasker(size_t stacksize=8192) : d_tid(0), d_maxtid(0), d_stacksize(stacksize), d_waitstatus(Error)
+  MTasker(size_t stacksize=8192, size_t stackCacheSize=100) : d_tid(0), d_maxtid(0), d_stacksize(stacksize), d_maxCachedStacks(stackCacheSize), d_waitstatus(Error)
   {
     initMainStackBounds();
   }
@@ -126,9 +131,16 @@ public:
   unsigned int numProcesses() const;
   int getTid() const;
   unsigned int getMaxStackUsage();
+  size_t getStacksHighWaterMark() const;
+  size_t getCachedStacksCount() const
+  {
+    return d_cachedStacks.size();
+  }
   unsigned int getUsec();
 
 private:
+  void releaseStack(std::unique_ptr<MThreadStack>& stack);
+
   EventKey d_eventkey;   // for waitEvent, contains exact key it was awoken for
 };
 #include "mtasker.cc"
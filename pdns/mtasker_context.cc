@@ -28,3 +28,71 @@
 #else
 #include "mtasker_ucontext.cc"
 #endif
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+static size_t getPageSize()
+{
+  static const size_t pageSize = sysconf(_SC_PAGESIZE);
+  return pageSize;
+}
+
+MThreadStack::MThreadStack(size_t size)
+{
+  const size_t pageSize = getPageSize();
+  d_size = ((size + pageSize - 1) / pageSize) * pageSize;
+  d_mappingSize = d_size + pageSize;
+
+  int flags = MAP_PRIVATE | MAP_ANON;
+#ifdef MAP_STACK
+  flags |= MAP_STACK;
+#endif
+  void* mapping = mmap(nullptr, d_mappingSize, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (mapping == MAP_FAILED) {
+    throw std::runtime_error("Unable to allocate a stack of " + std::to_string(d_size) + " bytes for an MThread: " + std::string(strerror(errno)));
+  }
+  d_mapping = static_cast<char*>(mapping);
+
+  /* the guard page, at the lowest address */
+  if (mprotect(d_mapping, pageSize, PROT_NONE) != 0) {
+    int err = errno;
+    munmap(d_mapping, d_mappingSize);
+    throw std::runtime_error("Unable to protect the guard page of an MThread stack: " + std::string(strerror(err)));
+  }
+  d_base = d_mapping + pageSize;
+}
+
+MThreadStack::~MThreadStack()
+{
+  munmap(d_mapping, d_mappingSize);
+}
+
+size_t MThreadStack::getHighWaterMark() const
+{
+  const size_t pageSize = getPageSize();
+  const size_t pages = d_size / pageSize;
+  /* the stack grows downwards from d_base + d_size, and fresh pages are only
+     made resident when they are written to, so the lowest resident page
+     tells us how deep the stack has ever been */
+#ifdef __linux__
+  std::vector<unsigned char> resident(pages);
+#else
+  std::vector<char> resident(pages);
+#endif
+  if (mincore(d_base, d_size, resident.data()) != 0) {
+    return 0;
+  }
+
+  for (size_t idx = 0; idx < pages; idx++) {
+    if (resident[idx] & 1) {
+      return (pages - idx) * pageSize;
+    }
+  }
+  return 0;
+}
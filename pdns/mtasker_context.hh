@@ -22,11 +22,44 @@
 #ifndef MTASKER_CONTEXT_HH
 #define MTASKER_CONTEXT_HH
 
-#include "lazy_allocator.hh"
 #include <boost/function.hpp>
-#include <vector>
+#include <boost/utility.hpp>
+#include <memory>
 #include <exception>
 
+/* The stack of an MThread. It is mmap()'ed with a guard page right below it,
+   since stacks grow downwards on all the platforms we support, so that an
+   overflow results in a crash instead of silently corrupting whatever
+   happens to be allocated next to it. */
+class MThreadStack : public boost::noncopyable
+{
+public:
+  explicit MThreadStack(size_t size);
+  ~MThreadStack();
+
+  char* data()
+  {
+    return d_base;
+  }
+
+  size_t size() const
+  {
+    return d_size;
+  }
+
+  /* returns how much of this stack has been used since it was allocated,
+     in bytes and with a page granularity, based on which pages have been
+     touched. This is cheap enough to be called once in a while, but not
+     on every context switch. */
+  size_t getHighWaterMark() const;
+
+private:
+  char* d_mapping{nullptr};
+  size_t d_mappingSize{0};
+  char* d_base{nullptr};
+  size_t d_size{0};
+};
+
 struct pdns_ucontext_t {
     pdns_ucontext_t ();
     pdns_ucontext_t (pdns_ucontext_t const&) = delete;
@@ -35,7 +68,7 @@ struct pdns_ucontext_t {
 
     void* uc_mcontext;
     pdns_ucontext_t* uc_link;
-    std::vector<char, lazy_allocator<char>> uc_stack;
+    std::unique_ptr<MThreadStack> uc_stack;
     std::exception_ptr exception;
 #ifdef PDNS_USE_VALGRIND
     int valgrind_id;
@@ -214,15 +214,15 @@ void
 pdns_makecontext
 (pdns_ucontext_t& ctx, boost::function<void(void)>& start) {
     assert (ctx.uc_link);
-    assert (ctx.uc_stack.size() >= 8192);
+    assert (ctx.uc_stack && ctx.uc_stack->size() >= 8192);
     assert (!ctx.uc_mcontext);
-    ctx.uc_mcontext = make_fcontext (&ctx.uc_stack[ctx.uc_stack.size()],
-                                     ctx.uc_stack.size(), &threadWrapper);
+    ctx.uc_mcontext = make_fcontext (ctx.uc_stack->data() + ctx.uc_stack->size(),
+                                     ctx.uc_stack->size(), &threadWrapper);
     args_t args;
     args.self = &ctx;
     args.work = &start;
     /* jumping to threadwrapper */
-    notifyStackSwitch(&ctx.uc_stack[ctx.uc_stack.size()], ctx.uc_stack.size());
+    notifyStackSwitch(ctx.uc_stack->data() + ctx.uc_stack->size(), ctx.uc_stack->size());
 #if BOOST_VERSION < 106100
     jump_fcontext (reinterpret_cast<fcontext_t*>(&args.prev_ctx),
                    static_cast<fcontext_t>(ctx.uc_mcontext),
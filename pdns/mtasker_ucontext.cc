@@ -125,7 +125,7 @@ void
 pdns_makecontext
 (pdns_ucontext_t& ctx, boost::function<void(void)>& start) {
     assert (ctx.uc_link);
-    assert (ctx.uc_stack.size());
+    assert (ctx.uc_stack && ctx.uc_stack->size());
 
     auto const mcp = static_cast<ucontext_t*>(ctx.uc_mcontext);
     auto const next = static_cast<ucontext_t*>(ctx.uc_link->uc_mcontext);
@@ -133,8 +133,8 @@ pdns_makecontext
         throw_errno ("getcontext() failed");
     }
     mcp->uc_link = next;
-    mcp->uc_stack.ss_sp = ctx.uc_stack.data();
-    mcp->uc_stack.ss_size = ctx.uc_stack.size();
+    mcp->uc_stack.ss_sp = ctx.uc_stack->data();
+    mcp->uc_stack.ss_size = ctx.uc_stack->size();
     mcp->uc_stack.ss_flags = 0;
 
     auto ctxarg = splitPointer (&ctx);
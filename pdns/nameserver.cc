@@ -303,21 +303,69 @@ void UDPNameserver::send(DNSPacket *p)
     L<<Logger::Error<<"Error sending reply with sendmsg (socket="<<p->getSocket()<<", dest="<<p->d_remote.toStringWithPort()<<"): "<<strerror(errno)<<endl;
 }
 
-DNSPacket *UDPNameserver::receive(DNSPacket *prefilled)
+const size_t UDPNameserver::s_maxBatchSize;
+
+void UDPNameserver::send(vector<Message>& answers, size_t count)
 {
-  ComboAddress remote;
-  extern StatBag S;
-  ssize_t len=-1;
-  char mesg[DNSPacket::s_udpTruncationThreshold];
-  Utility::sock_t sock=-1;
+  count = std::min(count, s_maxBatchSize);
+#if defined(HAVE_SENDMMSG)
+  struct mmsghdr msgvec[s_maxBatchSize];
+  struct iovec iovs[s_maxBatchSize];
+#endif
 
-  struct msghdr msgh;
-  struct iovec iov;
-  char cbuf[256];
+  for(size_t idx = 0; idx < count; ++idx) {
+    auto& answer = answers[idx];
+#if defined(HAVE_SENDMMSG)
+    struct msghdr& msgh = msgvec[idx].msg_hdr;
+    struct iovec& iov = iovs[idx];
+    msgvec[idx].msg_len = 0;
+#else
+    struct msghdr msgh;
+    struct iovec iov;
+#endif
 
-  remote.sin6.sin6_family=AF_INET6; // make sure it is big enough
-  fillMSGHdr(&msgh, &iov, cbuf, sizeof(cbuf), mesg, sizeof(mesg), &remote);
-  
+    fillMSGHdr(&msgh, &iov, answer.cbuf, 0, &answer.data[0], answer.length, &answer.remote);
+    msgh.msg_control=NULL;
+    if(answer.local) {
+      addCMsgSrcAddr(&msgh, answer.cbuf, answer.local.get_ptr(), 0);
+    }
+    DLOG(L<<Logger::Notice<<"Sending a packet to "<< answer.remote.toString() <<" ("<< answer.length <<" octets)"<<endl);
+
+#if !defined(HAVE_SENDMMSG)
+    if(sendmsg(answer.socket, &msgh, 0) < 0)
+      L<<Logger::Error<<"Error sending reply with sendmsg (socket="<<answer.socket<<", dest="<<answer.remote.toStringWithPort()<<"): "<<strerror(errno)<<endl;
+#endif
+  }
+
+#if defined(HAVE_SENDMMSG)
+  /* sendmmsg() only handles a single socket, so we send the answers
+     in runs of consecutive ones going out of the same socket */
+  size_t first = 0;
+  while(first < count) {
+    size_t last = first + 1;
+    while(last < count && answers[last].socket == answers[first].socket) {
+      ++last;
+    }
+
+    size_t pos = first;
+    while(pos < last) {
+      int sent = sendmmsg(answers[first].socket, &msgvec[pos], last - pos, 0);
+      if(sent <= 0) {
+        /* the answer at pos could not be sent, skip it */
+        L<<Logger::Error<<"Error sending reply with sendmmsg (socket="<<answers[pos].socket<<", dest="<<answers[pos].remote.toStringWithPort()<<"): "<<strerror(errno)<<endl;
+        ++pos;
+      }
+      else {
+        pos += sent;
+      }
+    }
+    first = last;
+  }
+#endif
+}
+
+size_t UDPNameserver::receive(vector<Message>& queries)
+{
   int err;
   vector<struct pollfd> rfds= d_rfds;
 
@@ -334,58 +382,107 @@ DNSPacket *UDPNameserver::receive(DNSPacket *prefilled)
       goto retry;
     unixDie("Unable to poll for new UDP events");
   }
-    
+
+  Utility::sock_t sock=-1;
   for(auto &pfd :  rfds) {
     if(pfd.revents & POLLIN) {
-      sock=pfd.fd;        
-      if((len=recvmsg(sock, &msgh, 0)) < 0 ) {
-        if(errno != EAGAIN)
-          L<<Logger::Error<<"recvfrom gave error, ignoring: "<<strerror(errno)<<endl;
-        return 0;
-      }
+      sock=pfd.fd;
       break;
     }
   }
   if(sock==-1)
     throw PDNSException("poll betrayed us! (should not happen)");
-  
-  DLOG(L<<"Received a packet " << len <<" bytes long from "<< remote.toString()<<endl);
 
-  BOOST_STATIC_ASSERT(offsetof(sockaddr_in, sin_port) == offsetof(sockaddr_in6, sin6_port));
+  size_t wanted = std::min(std::max(queries.size(), static_cast<size_t>(1)), s_maxBatchSize);
+  queries.resize(std::max(queries.size(), wanted));
+#if defined(HAVE_RECVMMSG)
+  struct mmsghdr msgvec[s_maxBatchSize];
+  struct iovec iovs[s_maxBatchSize];
+#else
+  wanted = 1;
+  struct msghdr msgh;
+  struct iovec iov;
+#endif
+
+  for(size_t idx = 0; idx < wanted; ++idx) {
+    auto& query = queries[idx];
+    if(query.data.size() < DNSPacket::s_udpTruncationThreshold) {
+      query.data.resize(DNSPacket::s_udpTruncationThreshold);
+    }
+    query.remote.sin6.sin6_family=AF_INET6; // make sure it is big enough
+#if defined(HAVE_RECVMMSG)
+    fillMSGHdr(&msgvec[idx].msg_hdr, &iovs[idx], query.cbuf, sizeof(query.cbuf), &query.data[0], query.data.size(), &query.remote);
+    msgvec[idx].msg_len = 0;
+#else
+    fillMSGHdr(&msgh, &iov, query.cbuf, sizeof(query.cbuf), &query.data[0], query.data.size(), &query.remote);
+#endif
+  }
 
-  if(remote.sin4.sin_port == 0) // would generate error on responding. sin4 also works for ipv6
+#if defined(HAVE_RECVMMSG)
+  int received = recvmmsg(sock, msgvec, wanted, MSG_DONTWAIT, nullptr);
+#else
+  ssize_t len = recvmsg(sock, &msgh, 0);
+  int received = len < 0 ? -1 : 1;
+#endif
+  if(received < 0) {
+    if(errno != EAGAIN)
+      L<<Logger::Error<<"recvfrom gave error, ignoring: "<<strerror(errno)<<endl;
     return 0;
-  
-  DNSPacket *packet;
-  if(prefilled)  // they gave us a preallocated packet
-    packet=prefilled;
-  else
-    packet=new DNSPacket(true); // don't forget to free it!
-
-  packet->setSocket(sock);
-  packet->setRemote(&remote);
-
-  ComboAddress dest;
-  if(HarvestDestinationAddress(&msgh, &dest)) {
-//    cerr<<"Setting d_anyLocal to '"<<dest.toString()<<"'"<<endl;
-    packet->d_anyLocal = dest;
-  }            
-
-  struct timeval recvtv;
-  if(HarvestTimestamp(&msgh, &recvtv)) {
-    packet->d_dt.setTimeval(recvtv);
   }
-  else
-    packet->d_dt.set(); // timing    
 
-  if(packet->parse(mesg, (size_t) len)<0) {
+  BOOST_STATIC_ASSERT(offsetof(sockaddr_in, sin_port) == offsetof(sockaddr_in6, sin6_port));
+
+  size_t count = 0;
+  for(int idx = 0; idx < received; ++idx) {
+#if defined(HAVE_RECVMMSG)
+    struct msghdr& hdr = msgvec[idx].msg_hdr;
+    size_t length = msgvec[idx].msg_len;
+#else
+    struct msghdr& hdr = msgh;
+    size_t length = len;
+#endif
+    auto& query = queries[idx];
+    DLOG(L<<"Received a packet " << length <<" bytes long from "<< query.remote.toString()<<endl);
+
+    if(query.remote.sin4.sin_port == 0) // would generate error on responding. sin4 also works for ipv6
+      continue;
+
+    query.socket = sock;
+    query.length = length;
+    query.local = boost::none;
+    ComboAddress dest;
+    if(HarvestDestinationAddress(&hdr, &dest)) {
+      query.local = dest;
+    }
+
+    struct timeval recvtv;
+    if(HarvestTimestamp(&hdr, &recvtv)) {
+      query.dt.setTimeval(recvtv);
+    }
+    else
+      query.dt.set(); // timing
+
+    if(static_cast<size_t>(idx) != count) {
+      std::swap(queries[count], query);
+    }
+    ++count;
+  }
+
+  return count;
+}
+
+bool UDPNameserver::parse(const Message& query, DNSPacket* packet)
+{
+  packet->setSocket(query.socket);
+  packet->setRemote(&query.remote);
+  packet->d_anyLocal = query.local;
+  packet->d_dt = query.dt;
+
+  if(packet->parse(&query.data[0], query.length)<0) {
     S.inc("corrupt-packets");
     S.ringAccount("remotes-corrupt", packet->d_remote);
-
-    if(!prefilled)
-      delete packet;
-    return 0; // unable to parse
+    return false; // unable to parse
   }
-  
-  return packet;
+
+  return true;
 }
@@ -38,7 +38,8 @@
 #include "responsestats.hh"
 
 /** This is the main class. It opens a socket on udp port 53 and waits for packets. Those packets can 
-    be retrieved with the receive() member function, which returns a DNSPacket.
+    be retrieved with the receive() member function, several at once when possible, and turned into a
+    DNSPacket with parse().
 
     Some sample code in main():
     \code
@@ -58,11 +59,15 @@
     {
       DNSDistributor *D=static_cast<DNSDistributor *>(p);
     
-      DNSPacket *P;
+      vector<UDPNameserver::Message> queries(16);
     
-      while((P=N->receive())) // receive a packet
-      {
-         D->question(P); // and give to the distributor, they will delete it
+      for(;;) {
+        size_t count=N->receive(queries); // receive up to 16 packets
+        for(size_t idx=0; idx < count; ++idx) {
+          DNSPacket *P=new DNSPacket(true);
+          if(N->parse(queries[idx], P))
+            D->question(P); // and give to the distributor, they will delete it
+        }
       }
       return 0;
     }
@@ -80,9 +85,25 @@
 class UDPNameserver
 {
 public:
+  //! a query as received from the network, or an answer in wire format to send back
+  struct Message
+  {
+    ComboAddress remote;
+    boost::optional<ComboAddress> local;
+    DTime dt;
+    Utility::sock_t socket{-1};
+    size_t length{0};
+    vector<char> data;
+    char cbuf[256];
+  };
+
   UDPNameserver( bool additional_socket = false );  //!< Opens the socket
-  DNSPacket *receive(DNSPacket *prefilled=0); //!< call this in a while or for(;;) loop to get packets
+  size_t receive(vector<Message>& queries); //!< waits for queries, and receives as many as are available in one go, up to queries.size()
+  bool parse(const Message& query, DNSPacket* packet); //!< turns a received query into packet, false if it is corrupt
   void send(DNSPacket *); //!< send a DNSPacket. Will call DNSPacket::truncate() if over 512 bytes
+  void send(vector<Message>& answers, size_t count); //!< sends the first count answers, in one go when possible
+  static const size_t s_maxBatchSize = 64; //!< maximum number of messages received or sent in one go
+
   inline bool canReusePort() {
 #ifdef SO_REUSEPORT
     return d_can_reuseport;
@@ -30,20 +30,28 @@ class PacketCache : public boost::noncopyable
 {
 protected:
   static uint32_t canHashPacket(const std::string& packet, bool skipECS=true)
+  {
+    return canHashPacket(packet.c_str(), packet.size(), skipECS);
+  }
+
+  static uint32_t canHashPacket(const char* packet, size_t packetSize, bool skipECS=true)
   {
     uint32_t ret = 0;
-    ret=burtle((const unsigned char*)packet.c_str() + 2, 10, ret); // rest of dnsheader, skip id
-    size_t packetSize = packet.size();
+    ret=burtle((const unsigned char*)packet + 2, 10, ret); // rest of dnsheader, skip id
     size_t pos = 12;
-    const char* end = packet.c_str() + packetSize;
-    const char* p = packet.c_str() + pos;
+    const char* end = packet + packetSize;
+    const char* p = packet + pos;
 
-    for(; p < end && *p; ++p) { // XXX if you embed a 0 in your qname we'll stop lowercasing there
-      const unsigned char l = dns_tolower(*p); // label lengths can safely be lower cased
-      ret=burtle(&l, 1, ret);
+    /* the qname is lowercased into a buffer first, hashing it byte per byte
+       would cost more than everything else a packet cache hit requires */
+    unsigned char qname[256];
+    size_t qnameLen = 0;
+    for(; p < end && *p && qnameLen < sizeof(qname); ++p) { // XXX if you embed a 0 in your qname we'll stop lowercasing there
+      qname[qnameLen++] = dns_tolower(*p); // label lengths can safely be lower cased
     }                           // XXX the embedded 0 in the qname will break the subnet stripping
+    ret=burtle(qname, qnameLen, ret);
 
-    struct dnsheader* dh = (struct dnsheader*)packet.c_str();
+    struct dnsheader* dh = (struct dnsheader*)packet;
     const char* skipBegin = p;
     const char* skipEnd = p;
     /* we need at least 1 (final empty label) + 2 (QTYPE) + 2 (QCLASS)
@@ -29,6 +29,7 @@
 
 #include "ws-recursor.hh"
 #include <pthread.h>
+#include <thread>
 #include "recpacketcache.hh"
 #include "utility.hh"
 #include "dns_random.hh"
@@ -42,6 +43,7 @@
 #include <map>
 #include <set>
 #include "recursor_cache.hh"
+#include "cache-snapshot.hh"
 #include "cachecleaner.hh"
 #include <stdio.h>
 #include <signal.h>
@@ -84,6 +86,8 @@
 #include "rec-lua-conf.hh"
 #include "ednsoptions.hh"
 #include "gettime.hh"
+#include "inflight.hh"
+#include "rec-latency.hh"
 
 #include "rec-protobuf.hh"
 #include "rec-snmp.hh"
@@ -103,13 +107,14 @@ static thread_local std::unique_ptr<tcpClientCounts_t> t_tcpClientCounts;
 
 thread_local std::unique_ptr<MT_t> MT; // the big MTasker
 thread_local std::unique_ptr<MemRecursorCache> t_RC;
-thread_local std::unique_ptr<RecursorPacketCache> t_packetCache;
+std::unique_ptr<RecursorPacketCache> g_packetCache;
 thread_local FDMultiplexer* t_fdm{nullptr};
 thread_local std::unique_ptr<addrringbuf_t> t_remotes, t_servfailremotes, t_largeanswerremotes;
 thread_local std::unique_ptr<boost::circular_buffer<pair<DNSName, uint16_t> > > t_queryring, t_servfailqueryring;
 thread_local std::shared_ptr<NetmaskGroup> t_allowFrom;
 #ifdef HAVE_PROTOBUF
 thread_local std::unique_ptr<boost::uuids::random_generator> t_uuidGenerator;
+static thread_local uint32_t t_latencyTraceCounter;
 #endif
 __thread struct timeval g_now; // timestamp, updated (too) frequently
 
@@ -154,7 +159,13 @@ static bool g_reusePort{false};
 static bool g_useOneSocketPerThread;
 static bool g_gettagNeedsEDNSOptions{false};
 static time_t g_statisticsInterval;
+static time_t g_cacheSnapshotInterval;
+static string g_cacheSnapshotFile;
 static bool g_useIncomingECS;
+static unsigned int g_coalesceWaitMsec;
+static std::unique_ptr<InFlightResolutions> g_inFlightResolutions;
+static std::unique_ptr<InFlightWakeups> g_inFlightWakeups;
+static thread_local uint16_t t_coalesceWaiterId;
 std::atomic<uint32_t> g_maxCacheEntries, g_maxPacketCacheEntries;
 
 RecursorControlChannel s_rcc; // only active in thread 0
@@ -246,8 +257,8 @@ int getMTaskerTID()
 
 static void handleTCPClientWritable(int fd, FDMultiplexer::funcparam_t& var);
 
-// -1 is error, 0 is timeout, 1 is success
-int asendtcp(const string& data, Socket* sock)
+// -1 is error, 0 is timeout, 1 is success. A timeoutMsec of 0 means network-timeout
+int asendtcp(const string& data, Socket* sock, unsigned int timeoutMsec)
 {
   PacketID pident;
   pident.sock=sock;
@@ -256,7 +267,7 @@ int asendtcp(const string& data, Socket* sock)
   t_fdm->addWriteFD(sock->getHandle(), handleTCPClientWritable, pident);
   string packet;
 
-  int ret=MT->waitEvent(pident, &packet, g_networkTimeoutMsec);
+  int ret=MT->waitEvent(pident, &packet, timeoutMsec ? timeoutMsec : g_networkTimeoutMsec);
 
   if(!ret || ret==-1) { // timeout
     t_fdm->removeWriteFD(sock->getHandle());
@@ -269,8 +280,8 @@ int asendtcp(const string& data, Socket* sock)
 
 static void handleTCPClientReadable(int fd, FDMultiplexer::funcparam_t& var);
 
-// -1 is error, 0 is timeout, 1 is success
-int arecvtcp(string& data, size_t len, Socket* sock, bool incompleteOkay)
+// -1 is error, 0 is timeout, 1 is success. A timeoutMsec of 0 means network-timeout
+int arecvtcp(string& data, size_t len, Socket* sock, bool incompleteOkay, unsigned int timeoutMsec)
 {
   data.clear();
   PacketID pident;
@@ -279,7 +290,7 @@ int arecvtcp(string& data, size_t len, Socket* sock, bool incompleteOkay)
   pident.inIncompleteOkay=incompleteOkay;
   t_fdm->addReadFD(sock->getHandle(), handleTCPClientReadable, pident);
 
-  int ret=MT->waitEvent(pident,&data, g_networkTimeoutMsec);
+  int ret=MT->waitEvent(pident,&data, timeoutMsec ? timeoutMsec : g_networkTimeoutMsec);
   if(!ret || ret==-1) { // timeout
     t_fdm->removeReadFD(sock->getHandle());
   }
@@ -306,7 +317,8 @@ static void handleGenUDPQueryResponse(int fd, FDMultiplexer::funcparam_t& var)
     //    cerr<<"Had some kind of error: "<<ret<<", "<<strerror(errno)<<endl;
   }
 }
-string GenUDPQueryResponse(const ComboAddress& dest, const string& query)
+
+string GenUDPQueryResponse(const ComboAddress& dest, const string& query, unsigned int timeoutMsec)
 {
   Socket s(dest.sin4.sin_family, SOCK_DGRAM);
   s.setNonBlocking();
@@ -323,7 +335,7 @@ string GenUDPQueryResponse(const ComboAddress& dest, const string& query)
 
   string data;
  
-  int ret=MT->waitEvent(pident,&data, g_networkTimeoutMsec);
+  int ret=MT->waitEvent(pident,&data, timeoutMsec ? timeoutMsec : g_networkTimeoutMsec);
  
   if(!ret || ret==-1) { // timeout
     t_fdm->removeReadFD(s.getHandle());
@@ -335,6 +347,99 @@ string GenUDPQueryResponse(const ComboAddress& dest, const string& query)
   return data;
 }
 
+/* Reads the answer to a Lua stream query until the remote end closes the connection.
+   Only a clean EOF delivers what we got so far, a read error, a reset or an answer
+   larger than inNeeded bytes is conveyed as an empty answer. */
+static void handleGenTCPQueryResponse(int fd, FDMultiplexer::funcparam_t& var)
+{
+  PacketID* pident=any_cast<PacketID>(&var);
+  char buffer[4096];
+
+  ssize_t ret=recv(fd, buffer, sizeof(buffer), 0);
+  if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+    return;
+  }
+  if(ret > 0) {
+    pident->inMSG.append(buffer, static_cast<size_t>(ret));
+    if(pident->inMSG.size() <= pident->inNeeded) {
+      return;
+    }
+  }
+
+  PacketID tmp=*pident;
+  t_fdm->removeReadFD(fd); // pident is invalid from now on
+  string data;
+  if(ret == 0) {
+    data = std::move(tmp.inMSG);
+  }
+  MT->sendEvent(tmp, &data);
+}
+
+/* Sends query over a stream connection and reads until the remote end closes it,
+   yielding this MThread while waiting. If path is not empty we connect to that UNIX
+   socket, otherwise to dest over TCP. timeoutMsec covers the whole exchange.
+   Returns an empty string on timeout or error. */
+string GenTCPQueryResponse(const ComboAddress& dest, const string& path, const string& query, unsigned int timeoutMsec)
+{
+  static const size_t maxAnswerSize = 65535;
+
+  if (!timeoutMsec) {
+    timeoutMsec = g_networkTimeoutMsec;
+  }
+
+  try {
+    DTime dt;
+    dt.set();
+
+    std::unique_ptr<Socket> s;
+    if (!path.empty()) {
+      struct sockaddr_un addr;
+      if (makeUNsockaddr(path, &addr) != 0) {
+        throw NetworkError("Invalid UNIX socket path '"+path+"'");
+      }
+      s = std::unique_ptr<Socket>(new Socket(AF_UNIX, SOCK_STREAM, 0));
+      s->setNonBlocking();
+      if (::connect(s->getHandle(), reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0 && errno != EINPROGRESS) {
+        throw NetworkError("While connecting to "+path+": "+string(strerror(errno)));
+      }
+    }
+    else {
+      s = std::unique_ptr<Socket>(new Socket(dest.sin4.sin_family, SOCK_STREAM, 0));
+      s->setNonBlocking();
+      ComboAddress local = getQueryLocalAddress(dest.sin4.sin_family, 0);
+      s->bind(local);
+      s->connect(dest);
+    }
+
+    // asendtcp waits for the connection to be established
+    if (asendtcp(query, s.get(), timeoutMsec) != 1) {
+      return string();
+    }
+
+    unsigned int elapsed = dt.udiffNoReset() / 1000;
+    if (elapsed >= timeoutMsec) {
+      return string();
+    }
+
+    PacketID pident;
+    pident.sock=s.get();
+    pident.inNeeded=maxAnswerSize;
+    t_fdm->addReadFD(s->getHandle(), handleGenTCPQueryResponse, pident);
+
+    string answer;
+    int ret=MT->waitEvent(pident, &answer, timeoutMsec - elapsed);
+    if(!ret || ret==-1) { // timeout
+      t_fdm->removeReadFD(s->getHandle());
+      return string();
+    }
+    return answer;
+  }
+  catch(const NetworkError& e) {
+    L<<Logger::Warning<<"Error in Lua stream query/response to "<<(path.empty() ? dest.toStringWithPort() : path)<<": "<<e.what()<<endl;
+    return string();
+  }
+}
+
 //! pick a random query local address
 ComboAddress getQueryLocalAddress(int family, uint16_t port)
 {
@@ -675,6 +780,23 @@ static void protobufLogResponse(const std::shared_ptr<RemoteLogger>& logger, con
   message.serialize(str);
   logger->queueData(str);
 }
+
+static void addLatencyTrace(RecProtoBufMessage& message, const LatencyTrace& trace, const struct timeval& queryTime)
+{
+  struct timeval now;
+  Utility::gettimeofday(&now, nullptr);
+  const struct timeval spent = now - queryTime;
+
+  for (size_t idx = 0; idx < s_latencyPhasesCount; idx++) {
+    const auto phase = static_cast<LatencyPhase>(idx);
+    if (phase == LatencyPhase::Total) {
+      message.addLatencyPhase(latencyPhaseToString(phase), spent.tv_sec * 1000000 + spent.tv_usec);
+    }
+    else if (trace.d_usec[idx] > 0) {
+      message.addLatencyPhase(latencyPhaseToString(phase), trace.d_usec[idx]);
+    }
+  }
+}
 #endif
 
 /**
@@ -723,6 +845,63 @@ static bool addRecordToPacket(DNSPacketWriter& pw, const DNSRecord& rec, uint32_
   return true;
 }
 
+static PacketID getCoalescedWaiterKey(const DNSName& qname, uint16_t qtype, uint16_t id)
+{
+  // the remote stays unset, so this can never be mistaken for, or chained to, an outgoing query
+  PacketID pident;
+  pident.domain = qname;
+  pident.type = qtype;
+  pident.id = id;
+  return pident;
+}
+
+/* If an identical query is already being resolved, by this thread or another one, we wait for
+   it to finish (or for coalesce-wait-timeout) and our own resolution is then answered from the cache.
+   Otherwise we register ourselves, so identical queries can wait for us until we go away. */
+class InFlightResolutionGuard : public boost::noncopyable
+{
+public:
+  InFlightResolutionGuard(SyncRes& sr, const DNSName& qname, uint16_t qtype, bool rd): d_qname(qname), d_qtype(qtype)
+  {
+    if(!g_inFlightResolutions || !rd) {
+      return;
+    }
+
+    d_ecs = sr.getECSSourceSubnet();
+    InFlightResolutions::Waiter waiter{t_id, t_coalesceWaiterId++};
+    if(g_inFlightResolutions->startOrWait(d_qname, d_qtype, d_ecs, waiter)) {
+      d_resolving = true;
+      return;
+    }
+
+    g_stats.coalescedQueries++;
+    PacketID pident = getCoalescedWaiterKey(d_qname, d_qtype, waiter.d_id);
+    string unused;
+    if(MT->waitEvent(pident, &unused, g_coalesceWaitMsec) <= 0) {
+      g_inFlightResolutions->removeWaiter(d_qname, d_qtype, d_ecs, waiter);
+      g_stats.coalesceTimeouts++;
+    }
+
+    struct timeval now;
+    Utility::gettimeofday(&now, nullptr);
+    sr.setNow(now);
+  }
+
+  ~InFlightResolutionGuard()
+  {
+    if(d_resolving) {
+      // even when a waiter is on our own thread, the event has to be sent from outside of any MThread
+      g_inFlightWakeups->wake(d_qname, d_qtype, g_inFlightResolutions->done(d_qname, d_qtype, d_ecs));
+    }
+  }
+
+private:
+  const DNSName& d_qname;
+  Netmask d_ecs;
+  uint16_t d_qtype;
+  bool d_resolving{false};
+};
+
 static void startDoResolve(void *p)
 {
   DNSComboWriter* dc=(DNSComboWriter *)p;
@@ -828,6 +1007,7 @@ static void startDoResolve(void *p)
     dq.ednsOptions = &dc->d_ednsOpts;
     dq.tag = dc->d_tag;
     dq.discardedPolicies = &sr.d_discardedPolicies;
+    dq.latencyTrace = &sr.d_latencyTrace;
     dq.policyTags = &dc->d_policyTags;
     dq.appliedPolicy = &appliedPolicy;
     dq.currentRecords = &ret;
@@ -915,6 +1095,7 @@ static void startDoResolve(void *p)
 
       // Query got not handled for QNAME Policy reasons, now actually go out to find an answer
       try {
+        InFlightResolutionGuard inFlight(sr, dc->d_mdp.d_qname, dc->d_mdp.d_qtype, dc->d_mdp.d_header.rd);
         res = sr.beginResolve(dc->d_mdp.d_qname, QType(dc->d_mdp.d_qtype), dc->d_mdp.d_qclass, ret);
         shouldNotValidate = sr.wasOutOfBand();
       }
@@ -1175,7 +1356,16 @@ static void startDoResolve(void *p)
       pbMessage.setQueryTime(dc->d_now.tv_sec, dc->d_now.tv_usec);
       pbMessage.setRequestorId(dq.requestorId);
       pbMessage.setDeviceId(dq.deviceId);
-      protobufLogResponse(luaconfsLocal->protobufServer, pbMessage);
+      if (luaconfsLocal->protobufLatencyTraceRate > 0 && (t_latencyTraceCounter++ % luaconfsLocal->protobufLatencyTraceRate) == 0) {
+        /* this message is about to be stored in the packet cache along with the response,
+           we don't want the timings of this query to be sent for the cache hits as well */
+        RecProtoBufMessage tracedMessage(pbMessage);
+        addLatencyTrace(tracedMessage, sr.d_latencyTrace, dc->d_now);
+        protobufLogResponse(luaconfsLocal->protobufServer, tracedMessage);
+      }
+      else {
+        protobufLogResponse(luaconfsLocal->protobufServer, pbMessage);
+      }
     }
 #endif
     if(!dc->d_tcp) {
@@ -1191,7 +1381,7 @@ static void startDoResolve(void *p)
       if(sendmsg(dc->d_socket, &msgh, 0) < 0 && g_logCommonErrors) 
         L<<Logger::Warning<<"Sending UDP reply to client "<<dc->d_remote.toStringWithPort()<<" failed with: "<<strerror(errno)<<endl;
       if(!SyncRes::s_nopacketcache && !variableAnswer && !sr.wasVariable() ) {
-        t_packetCache->insertResponsePacket(dc->d_tag, dc->d_qhash, dc->d_mdp.d_qname, dc->d_mdp.d_qtype, dc->d_mdp.d_qclass,
+        g_packetCache->insertResponsePacket(dc->d_tag, dc->d_qhash, dc->d_mdp.d_qname, dc->d_mdp.d_qtype, dc->d_mdp.d_qclass,
                                             string((const char*)&*packet.begin(), packet.size()),
                                             g_now.tv_sec,
                                             pw.getHeader()->rcode == RCode::ServFail ? SyncRes::s_packetcacheservfailttl :
@@ -1270,6 +1460,7 @@ static void startDoResolve(void *p)
       g_stats.answersSlow++;
 
     uint64_t newLat=(uint64_t)(spent*1000000);
+    t_latencyHistograms.add(LatencyPhase::Total, newLat, getLatencyClockSeconds());
     newLat = min(newLat,(uint64_t)(((uint64_t) g_networkTimeoutMsec)*1000)); // outliers of several minutes exist..
     g_stats.avgLatencyUsec=(1-1.0/g_latencyStatSize)*g_stats.avgLatencyUsec + (float)newLat/g_latencyStatSize;
     // no worries, we do this for packet cache hits elsewhere
@@ -1689,11 +1880,14 @@ static string* doProcessUDPQuestion(const std::string& question, const ComboAddr
     }
 #endif /* HAVE_PROTOBUF */
 
-    if (qnameParsed) {
-      cacheHit = (!SyncRes::s_nopacketcache && t_packetCache->getResponsePacket(ctag, question, qname, qtype, qclass, g_now.tv_sec, &response, &age, &qhash, &pbMessage));
-    }
-    else {
-      cacheHit = (!SyncRes::s_nopacketcache && t_packetCache->getResponsePacket(ctag, question, g_now.tv_sec, &response, &age, &qhash, &pbMessage));
+    if (!SyncRes::s_nopacketcache) {
+      LatencyTimer packetCacheTimer(LatencyPhase::PacketCache);
+      if (qnameParsed) {
+        cacheHit = g_packetCache->getResponsePacket(ctag, question, qname, qtype, qclass, g_now.tv_sec, &response, &age, &qhash, &pbMessage);
+      }
+      else {
+        cacheHit = g_packetCache->getResponsePacket(ctag, question, g_now.tv_sec, &response, &age, &qhash, &pbMessage);
+      }
     }
 
     if (cacheHit) {
@@ -2098,8 +2292,8 @@ static void doStats(void)
     //L<<Logger::Notice<<"stats: "<<g_stats.ednsPingMatches<<" ping matches, "<<g_stats.ednsPingMismatches<<" mismatches, "<<
       //g_stats.noPingOutQueries<<" outqueries w/o ping, "<< g_stats.noEdnsOutQueries<<" w/o EDNS"<<endl;
 
-    L<<Logger::Notice<<"stats: " <<  broadcastAccFunction<uint64_t>(pleaseGetPacketCacheSize) <<
-    " packet cache entries, "<<(int)(100.0*broadcastAccFunction<uint64_t>(pleaseGetPacketCacheHits)/SyncRes::s_queries) << "% packet cache hits"<<endl;
+    L<<Logger::Notice<<"stats: " <<  g_packetCache->size() <<
+    " packet cache entries, "<<(int)(100.0*g_packetCache->d_hits/SyncRes::s_queries) << "% packet cache hits"<<endl;
 
     time_t now = time(0);
     if(lastOutputTime && lastQueryCount && now != lastOutputTime) {
@@ -2114,9 +2308,134 @@ static void doStats(void)
   statsWanted=false;
 }
 
+static string getCacheSnapshotFileName()
+{
+  // the caches are per thread, and so are the snapshots
+  return g_cacheSnapshotFile + "." + std::to_string(t_id);
+}
+
+static void loadThreadCacheSnapshot()
+{
+  if(g_cacheSnapshotFile.empty())
+    return;
+
+  const string fname = getCacheSnapshotFileName();
+  try {
+    DTime dt;
+    dt.set();
+    uint64_t count = loadCacheSnapshot(fname);
+    if(count)
+      L<<Logger::Warning<<"Loaded "<<count<<" cache entries from snapshot '"<<fname<<"' in "<<dt.udiff()/1000<<" ms"<<endl;
+  }
+  catch(const std::exception& e) {
+    L<<Logger::Error<<e.what()<<endl;
+  }
+}
+
+static uint64_t saveThreadCacheSnapshot()
+{
+  if(g_cacheSnapshotFile.empty())
+    return 0;
+
+  const string fname = getCacheSnapshotFileName();
+  try {
+    DTime dt;
+    dt.set();
+    uint64_t count = saveCacheSnapshot(fname);
+    L<<Logger::Info<<"Saved "<<count<<" cache entries to snapshot '"<<fname<<"' in "<<dt.udiff()/1000<<" ms"<<endl;
+    return count;
+  }
+  catch(const std::exception& e) {
+    L<<Logger::Error<<"Error saving the cache snapshot: "<<e.what()<<endl;
+  }
+  catch(const PDNSException& e) {
+    L<<Logger::Error<<"Error saving the cache snapshot: "<<e.reason<<endl;
+  }
+  return 0;
+}
+
+/* A periodic save of the caches of this thread. Only encoding the snapshot needs this thread,
+   as it owns the caches. Writing it to disk, which can take much longer, is left to a separate
+   thread so we can go on answering queries, the two of them going through a bounded queue. */
+struct CacheSnapshotSave
+{
+  ~CacheSnapshotSave()
+  {
+    if(d_writer.joinable())
+      d_writer.join();
+  }
+
+  CacheSnapshotChunks d_chunks;
+  std::thread d_writer;
+  std::atomic<bool> d_writing{true};
+};
+
+static thread_local std::unique_ptr<CacheSnapshotSave> t_snapshotSave;
+
+/* waits for the previous periodic save of this thread to be written to disk, if any */
+static void joinThreadCacheSnapshotWriter()
+{
+  t_snapshotSave.reset();
+}
+
+static void saveThreadCacheSnapshotInBackground()
+{
+  if(g_cacheSnapshotFile.empty())
+    return;
+
+  if(t_snapshotSave && t_snapshotSave->d_writing) {
+    L<<Logger::Warning<<"The previous cache snapshot of thread "<<t_id<<" is still being written, skipping this one"<<endl;
+    return;
+  }
+  joinThreadCacheSnapshotWriter();
+
+  const string fname = getCacheSnapshotFileName();
+  auto save = new CacheSnapshotSave();
+  t_snapshotSave = std::unique_ptr<CacheSnapshotSave>(save);
+  try {
+    save->d_writer = std::thread([save, fname]() {
+        try {
+          DTime wdt;
+          wdt.set();
+          writeCacheSnapshot(fname, save->d_chunks);
+          L<<Logger::Info<<"Wrote the cache snapshot '"<<fname<<"' in "<<wdt.udiff()/1000<<" ms"<<endl;
+        }
+        catch(const std::exception& e) {
+          L<<Logger::Error<<"Error writing the cache snapshot: "<<e.what()<<endl;
+        }
+        save->d_writing = false;
+      });
+  }
+  catch(const std::exception& e) {
+    L<<Logger::Error<<"Error starting the cache snapshot writer: "<<e.what()<<endl;
+    t_snapshotSave.reset();
+    return;
+  }
+
+  try {
+    DTime dt;
+    dt.set();
+    uint64_t count = encodeCacheSnapshot(save->d_chunks);
+    L<<Logger::Info<<"Encoded "<<count<<" cache entries to snapshot '"<<fname<<"' in "<<dt.udiff()/1000<<" ms"<<endl;
+  }
+  catch(const std::exception& e) {
+    L<<Logger::Error<<"Error saving the cache snapshot: "<<e.what()<<endl;
+  }
+  catch(const PDNSException& e) {
+    L<<Logger::Error<<"Error saving the cache snapshot: "<<e.reason<<endl;
+  }
+}
+
+uint64_t* pleaseSaveCacheSnapshot()
+{
+  // a periodic save might still be writing to the same file
+  joinThreadCacheSnapshotWriter();
+  return new uint64_t(saveThreadCacheSnapshot());
+}
+
 static void houseKeeping(void *)
 {
-  static thread_local time_t last_stat, last_rootupdate, last_prune, last_secpoll;
+  static thread_local time_t last_stat, last_rootupdate, last_prune, last_secpoll, last_snapshot, last_pcprune;
   static thread_local int cleanCounter=0;
   static thread_local bool s_running;  // houseKeeping can get suspended in secpoll, and be restarted, which makes us do duplicate work
   try {
@@ -2131,9 +2450,10 @@ static void houseKeeping(void *)
       DTime dt;
       dt.setTimeval(now);
       t_RC->doPrune(g_maxCacheEntries / g_numThreads); // this function is local to a thread, so fine anyhow
-      t_packetCache->doPruneTo(g_maxPacketCacheEntries / g_numWorkerThreads);
 
       SyncRes::pruneNegCache(g_maxCacheEntries / (g_numWorkerThreads * 10));
+      SyncRes::pruneAggressiveNSECCache(AggressiveNSECCache::s_maxEntries / g_numWorkerThreads);
+      TCPOutConnectionManager::cleanup(now);
 
       if(!((cleanCounter++)%40)) {  // this is a full scan!
 	time_t limit=now.tv_sec-300;
@@ -2142,6 +2462,16 @@ static void houseKeeping(void *)
       last_prune=time(0);
     }
 
+    if(g_cacheSnapshotInterval > 0) {
+      if(!last_snapshot) {
+        last_snapshot=now.tv_sec;
+      }
+      else if(now.tv_sec - last_snapshot >= g_cacheSnapshotInterval) {
+        saveThreadCacheSnapshotInBackground();
+        last_snapshot=time(0);
+      }
+    }
+
     if(now.tv_sec - last_rootupdate > 7200) {
       int res = SyncRes::getRootNS(g_now, nullptr);
       if (!res)
@@ -2149,6 +2479,11 @@ static void houseKeeping(void *)
     }
 
     if(!t_id) {
+      if(now.tv_sec - last_pcprune > 5) {
+        g_packetCache->doPruneTo(g_maxPacketCacheEntries); // shared by all threads, so pruned by only one of them
+        last_pcprune=time(0);
+      }
+
       if(g_statisticsInterval > 0 && now.tv_sec - last_stat >= g_statisticsInterval) {
 	doStats();
 	last_stat=time(0);
@@ -2289,6 +2624,14 @@ static void handlePipeRequest(int fd, FDMultiplexer::funcparam_t& var)
   delete tmsg;
 }
 
+static void handleCoalescedWakeups(int fd, FDMultiplexer::funcparam_t& var)
+{
+  string unused;
+  for(const auto& wakeup : g_inFlightWakeups->take(t_id)) {
+    MT->sendEvent(getCoalescedWaiterKey(wakeup.d_qname, wakeup.d_qtype, wakeup.d_id), &unused);
+  }
+}
+
 template<class T> void *voider(const boost::function<T*()>& func)
 {
   return func();
@@ -2312,6 +2655,12 @@ vector<pair<DNSName, uint16_t> >& operator+=(vector<pair<DNSName, uint16_t> >&a,
   return a;
 }
 
+vector<uint64_t>& operator+=(vector<uint64_t>&a, const vector<uint64_t>& b)
+{
+  a.insert(a.end(), b.begin(), b.end());
+  return a;
+}
+
 
 template<class T> T broadcastAccFunction(const boost::function<T*()>& func, bool skipSelf)
 {
@@ -2357,6 +2706,8 @@ template string broadcastAccFunction(const boost::function<string*()>& fun, bool
 template uint64_t broadcastAccFunction(const boost::function<uint64_t*()>& fun, bool skipSelf); // explicit instantiation
 template vector<ComboAddress> broadcastAccFunction(const boost::function<vector<ComboAddress> *()>& fun, bool skipSelf); // explicit instantiation
 template vector<pair<DNSName,uint16_t> > broadcastAccFunction(const boost::function<vector<pair<DNSName, uint16_t> > *()>& fun, bool skipSelf); // explicit instantiation
+template vector<uint64_t> broadcastAccFunction(const boost::function<vector<uint64_t> *()>& fun, bool skipSelf); // explicit instantiation
+template LatencyHistogram broadcastAccFunction(const boost::function<LatencyHistogram*()>& fun, bool skipSelf); // explicit instantiation
 
 static void handleRCC(int fd, FDMultiplexer::funcparam_t& var)
 {
@@ -2882,9 +3233,11 @@ static int serviceMain(int argc, char*argv[])
 
   g_dnssecLogBogus = ::arg().mustDo("dnssec-log-bogus");
   g_maxNSEC3Iterations = ::arg().asNum("nsec3-max-iterations");
+  g_signatureVerificationCache.setMaxEntries(::arg().asNum("signature-cache-size"));
 
   g_maxCacheEntries = ::arg().asNum("max-cache-entries");
   g_maxPacketCacheEntries = ::arg().asNum("max-packetcache-entries");
+  g_packetCache = std::unique_ptr<RecursorPacketCache>(new RecursorPacketCache());
   
   try {
     loadRecursorLuaConfig(::arg()["lua-config-file"], ::arg().mustDo("daemon"));
@@ -2939,6 +3292,14 @@ static int serviceMain(int argc, char*argv[])
 
   SyncRes::s_maxnegttl=::arg().asNum("max-negative-ttl");
   SyncRes::s_maxcachettl=max(::arg().asNum("max-cache-ttl"), 15);
+  MemRecursorCache::s_maxStaleTTL=::arg().asNum("max-stale-ttl");
+  MemRecursorCache::s_staleAnswerTTL=::arg().asNum("stale-answer-ttl");
+  AggressiveNSECCache::s_maxEntries=::arg().asNum("aggressive-nsec-cache-size");
+  TCPOutConnectionManager::s_maxIdleMsec=::arg().asNum("tcp-out-max-idle-ms");
+  TCPOutConnectionManager::s_maxQueries=::arg().asNum("tcp-out-max-queries");
+  TCPOutConnectionManager::s_maxIdlePerThread=::arg().asNum("tcp-out-max-idle-per-thread");
+  TCPOutConnectionManager::s_maxPipelined=std::max(::arg().asNum("tcp-out-max-pipelined"), 1);
+  TCPOutConnectionManager::s_timeoutMsec=::arg().asNum("network-timeout");
   SyncRes::s_packetcachettl=::arg().asNum("packetcache-ttl");
   // Cap the packetcache-servfail-ttl to the packetcache-ttl
   uint32_t packetCacheServFailTTL = ::arg().asNum("packetcache-servfail-ttl");
@@ -2988,6 +3349,11 @@ static int serviceMain(int argc, char*argv[])
 
   g_networkTimeoutMsec = ::arg().asNum("network-timeout");
 
+  g_coalesceWaitMsec = ::arg().asNum("coalesce-wait-timeout");
+  if(g_coalesceWaitMsec > 0) {
+    g_inFlightResolutions = std::unique_ptr<InFlightResolutions>(new InFlightResolutions());
+  }
+
   g_initialDomainMap = parseAuthAndForwards();
 
   g_latencyStatSize=::arg().asNum("latency-statistic-size");
@@ -3009,10 +3375,20 @@ static int serviceMain(int argc, char*argv[])
   g_numThreads = g_numWorkerThreads + g_weDistributeQueries;
   g_maxMThreads = ::arg().asNum("max-mthreads");
 
+  /* the record cache is per-thread */
+  MemRecursorCache::s_maxECSEntries = ::arg().asNum("max-ecs-cache-entries") / g_numThreads;
+  if (::arg().asNum("max-ecs-cache-entries") > 0 && MemRecursorCache::s_maxECSEntries == 0) {
+    MemRecursorCache::s_maxECSEntries = 1;
+  }
+  MemRecursorCache::s_maxECSEntriesPerName = ::arg().asNum("max-ecs-cache-entries-per-name");
+
   g_gettagNeedsEDNSOptions = ::arg().mustDo("gettag-needs-edns-options");
 
   g_statisticsInterval = ::arg().asNum("statistics-interval");
 
+  g_cacheSnapshotFile = ::arg()["cache-snapshot-file"];
+  g_cacheSnapshotInterval = ::arg().asNum("cache-snapshot-interval");
+
 #ifdef SO_REUSEPORT
   g_reusePort = ::arg().mustDo("reuseport");
 #endif
@@ -3097,6 +3473,9 @@ static int serviceMain(int argc, char*argv[])
   Utility::dropUserPrivs(newuid);
 
   makeThreadPipes();
+  if(g_inFlightResolutions) {
+    g_inFlightWakeups = std::unique_ptr<InFlightWakeups>(new InFlightWakeups(g_numThreads));
+  }
 
   g_tcpTimeout=::arg().asNum("client-tcp-timeout");
   g_maxTCPPerClient=::arg().asNum("max-tcp-per-client");
@@ -3144,13 +3523,13 @@ try
   t_tcpClientCounts = std::unique_ptr<tcpClientCounts_t>(new tcpClientCounts_t());
   primeHints();
 
-  t_packetCache = std::unique_ptr<RecursorPacketCache>(new RecursorPacketCache());
-
 #ifdef HAVE_PROTOBUF
   t_uuidGenerator = std::unique_ptr<boost::uuids::random_generator>(new boost::uuids::random_generator());
 #endif
   L<<Logger::Warning<<"Done priming cache with root hints"<<endl;
 
+  loadThreadCacheSnapshot();
+
   try {
     if(!::arg()["lua-dns-script"].empty()) {
       t_pdl = std::make_shared<RecursorLua4>(::arg()["lua-dns-script"]);
@@ -3180,7 +3559,7 @@ try
     t_servfailqueryring->set_capacity(ringsize);
   }
 
-  MT=std::unique_ptr<MTasker<PacketID,string> >(new MTasker<PacketID,string>(::arg().asNum("stack-size")));
+  MT=std::unique_ptr<MTasker<PacketID,string> >(new MTasker<PacketID,string>(::arg().asNum("stack-size"), ::arg().asNum("stack-cache-size")));
 
   PacketID pident;
 
@@ -3200,6 +3579,9 @@ try
   }
 
   t_fdm->addReadFD(g_pipes[t_id].readToThread, handlePipeRequest);
+  if(g_inFlightWakeups) {
+    t_fdm->addReadFD(g_inFlightWakeups->getDescriptor(t_id), handleCoalescedWakeups);
+  }
 
   if(g_useOneSocketPerThread) {
     for(deferredAdd_t::const_iterator i = deferredAdds[t_id].cbegin(); i != deferredAdds[t_id].cend(); ++i) {
@@ -3306,6 +3688,7 @@ int main(int argc, char **argv)
 
   try {
     ::arg().set("stack-size","stack size per mthread")="200000";
+    ::arg().set("stack-cache-size","Number of stacks of finished mthreads kept per thread to be reused")="100";
     ::arg().set("soa-minimum-ttl","Don't change")="0";
     ::arg().set("no-shuffle","Don't change")="off";
     ::arg().set("local-port","port to listen on")="53";
@@ -3324,6 +3707,7 @@ int main(int argc, char **argv)
     ::arg().set("setgid","If set, change group id to this gid for more security")="";
     ::arg().set("setuid","If set, change user id to this uid for more security")="";
     ::arg().set("network-timeout", "Wait this number of milliseconds for network i/o")="1500";
+    ::arg().set("coalesce-wait-timeout", "Wait at most this number of milliseconds for an identical query being resolved, 0 to disable")="1500";
     ::arg().set("threads", "Launch this number of threads")="2";
     ::arg().set("processes", "Launch this number of processes (EXPERIMENTAL, DO NOT CHANGE)")="1"; // if we un-experimental this, need to fix openssl rand seeding for multiple PIDs!
     ::arg().set("config-name","Name of this virtual configuration - will rename the binary image")="";
@@ -3352,14 +3736,23 @@ int main(int argc, char **argv)
     ::arg().set("query-local-address","Source IP address for sending queries")="0.0.0.0";
     ::arg().set("query-local-address6","Source IPv6 address for sending queries. IF UNSET, IPv6 WILL NOT BE USED FOR OUTGOING QUERIES")="";
     ::arg().set("client-tcp-timeout","Timeout in seconds when talking to TCP clients")="2";
+    ::arg().set("tcp-out-max-idle-ms", "Time in milliseconds an idle outgoing TCP connection is kept for reuse ( 0 => disabled )")="10000";
+    ::arg().set("tcp-out-max-queries", "Maximum number of queries sent over a single outgoing TCP connection ( 0 => unlimited )")="0";
+    ::arg().set("tcp-out-max-idle-per-thread", "Maximum number of idle outgoing TCP connections kept per thread")="100";
+    ::arg().set("tcp-out-max-pipelined", "Maximum number of queries waiting for an answer at the same time on a single outgoing TCP connection")="10";
     ::arg().set("max-mthreads", "Maximum number of simultaneous Mtasker threads")="2048";
     ::arg().set("max-tcp-clients","Maximum number of simultaneous TCP clients")="128";
     ::arg().set("server-down-max-fails","Maximum number of consecutive timeouts (and unreachables) to mark a server as down ( 0 => disabled )")="64";
     ::arg().set("server-down-throttle-time","Number of seconds to throttle all queries to a server after being marked as down")="60";
     ::arg().set("hint-file", "If set, load root hints from this file")="";
     ::arg().set("max-cache-entries", "If set, maximum number of entries in the main cache")="1000000";
+    ::arg().set("aggressive-nsec-cache-size", "The number of records to cache in the aggressive cache of validated NSEC(3) records ( 0 => disabled )")="100000";
     ::arg().set("max-negative-ttl", "maximum number of seconds to keep a negative cached entry in memory")="3600";
     ::arg().set("max-cache-ttl", "maximum number of seconds to keep a cached entry in memory")="86400";
+    ::arg().set("max-stale-ttl", "maximum number of seconds past expiry an entry may be served stale when resolving fails ( 0 => disabled )")="0";
+    ::arg().set("stale-answer-ttl", "TTL of stale answers")="30";
+    ::arg().set("cache-snapshot-file", "If set, save the caches to this file on 'quit-nicely' and load them back on startup")="";
+    ::arg().set("cache-snapshot-interval", "Number of seconds between periodic saves of the cache snapshot ( 0 => only on 'quit-nicely' )")="0";
     ::arg().set("packetcache-ttl", "maximum number of seconds to keep a cached entry in packetcache")="3600";
     ::arg().set("max-packetcache-entries", "maximum number of entries to keep in the packetcache")="500000";
     ::arg().set("packetcache-servfail-ttl", "maximum number of seconds to keep a cached servfail entry in packetcache")="60";
@@ -3391,6 +3784,8 @@ int main(int argc, char **argv)
     ::arg().set("ecs-ipv6-bits", "Number of bits of IPv6 address to pass for EDNS Client Subnet")="56";
     ::arg().set("edns-subnet-whitelist", "List of netmasks and domains that we should enable EDNS subnet for")="";
     ::arg().set("ecs-scope-zero-address", "Address to send to whitelisted authoritative servers for incoming queries with ECS prefix-length source of 0")="";
+    ::arg().set("max-ecs-cache-entries", "If set, maximum number of EDNS Client Subnet specific entries in the main cache")="0";
+    ::arg().set("max-ecs-cache-entries-per-name", "If set, maximum number of EDNS Client Subnet specific entries in the main cache for a given name and type")="0";
     ::arg().setSwitch( "use-incoming-edns-subnet", "Pass along received EDNS Client Subnet information")="no";
     ::arg().setSwitch( "pdns-distributes-queries", "If PowerDNS itself should distribute queries over threads")="yes";
     ::arg().setSwitch( "root-nx-trust", "If set, believe that an NXDOMAIN from the root means the TLD does not exist")="yes";
@@ -3414,6 +3809,7 @@ int main(int argc, char **argv)
 
     ::arg().set("tcp-fast-open", "Enable TCP Fast Open support on the listening sockets, using the supplied numerical value as the queue size")="0";
     ::arg().set("nsec3-max-iterations", "Maximum number of iterations allowed for an NSEC3 record")="2500";
+    ::arg().set("signature-cache-size", "Maximum number of signature verification results to cache ( 0 => disabled )")="100000";
 
     ::arg().set("cpu-map", "Thread to CPU mapping, space separated thread-id=cpu1,cpu2..cpuN pairs")="";
 
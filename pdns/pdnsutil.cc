@@ -16,6 +16,8 @@
 #include "arguments.hh"
 #include "auth-packetcache.hh"
 #include "auth-querycache.hh"
+#include "auth-zoneindex.hh"
+#include "mmapzone.hh"
 #include "zoneparser-tng.hh"
 #include "signingpipe.hh"
 #include "dns_random.hh"
@@ -33,6 +35,7 @@
 StatBag S;
 AuthPacketCache PC;
 AuthQueryCache QC;
+AuthZoneIndex g_zoneIndex;
 
 namespace po = boost::program_options;
 po::variables_map g_vm;
@@ -765,6 +768,47 @@ int listZone(const DNSName &zone) {
   return EXIT_SUCCESS;
 }
 
+int compileZone(DNSSECKeeper& dk, const DNSName &zone, const string& fname) {
+  UeberBackend B;
+  DomainInfo di;
+
+  if (! B.getDomainInfo(zone, di)) {
+    cerr<<"Domain '"<<zone<<"' not found!"<<endl;
+    return EXIT_FAILURE;
+  }
+  if (! di.backend->list(zone, di.id)) {
+    cerr<<"Unable to list zone '"<<zone<<"'"<<endl;
+    return EXIT_FAILURE;
+  }
+
+  vector<DNSResourceRecord> records;
+  DNSResourceRecord rr;
+  bool haveSOA = false;
+  while(di.backend->get(rr)) {
+    if(rr.qtype.getCode() == QType::SOA && rr.qname == zone)
+      haveSOA = true;
+    records.push_back(rr);
+  }
+  if(!haveSOA) {
+    cerr<<"Zone '"<<zone<<"' has no SOA record"<<endl;
+    return EXIT_FAILURE;
+  }
+
+  NSEC3PARAMRecordContent ns3pr;
+  bool narrow;
+  bool haveNSEC3 = dk.getNSEC3PARAM(zone, &ns3pr, &narrow);
+
+  try {
+    MMapZone::compile(zone, records, fname, haveNSEC3, ns3pr, narrow, ::arg().asNum("max-ent-entries"));
+  }
+  catch(const PDNSException& e) {
+    cerr<<"Unable to compile zone '"<<zone<<"': "<<e.reason<<endl;
+    return EXIT_FAILURE;
+  }
+  cout<<"Compiled "<<records.size()<<" records of zone '"<<zone<<"' into '"<<fname<<"'"<<endl;
+  return EXIT_SUCCESS;
+}
+
 // lovingly copied from http://stackoverflow.com/questions/1798511/how-to-avoid-press-enter-with-any-getchar
 int read1char(){   
     int c;   
@@ -1886,6 +1930,7 @@ try
     cout<<"check-all-zones [exit-on-error]    Check all zones for correctness. Set exit-on-error to exit immediately"<<endl;
     cout<<"                                   after finding an error in a zone."<<endl;
     cout<<"clear-zone ZONE                    Clear all records of a zone, but keep everything else"<<endl;
+    cout<<"compile-zone ZONE FILE             Compile ZONE into FILE, to be served by the mmap backend"<<endl;
     cout<<"create-bind-db FNAME               Create DNSSEC db for BIND backend (bind-dnssec-db)"<<endl;
     cout<<"create-slave-zone ZONE master-ip [master-ip..]"<<endl;
     cout<<"                                   Create slave zone ZONE with master IP address master-ip"<<endl;
@@ -2295,6 +2340,16 @@ try
 
     exit(listZone(DNSName(cmds[1])));
   }
+  else if(cmds[0] == "compile-zone") {
+    if(cmds.size() != 3) {
+      cerr<<"Syntax: pdnsutil compile-zone ZONE FILE"<<endl;
+      return 0;
+    }
+    if(cmds[1]==".")
+      cmds[1].clear();
+
+    exit(compileZone(dk, DNSName(cmds[1]), cmds[2]));
+  }
   else if(cmds[0] == "edit-zone") {
     if(cmds.size() != 2) {
       cerr<<"Syntax: pdnsutil edit-zone ZONE"<<endl;
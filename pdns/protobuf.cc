@@ -110,6 +110,24 @@ void DNSProtoBufMessage::addTag(const std::string& strValue)
 #endif /* HAVE_PROTOBUF */
 }
 
+void DNSProtoBufMessage::addLatencyPhase(const std::string& phase, uint64_t usec)
+{
+#ifdef HAVE_PROTOBUF
+
+  PBDNSMessage_DNSResponse* response = d_message.mutable_response();
+  if (!response)
+    return;
+
+  PBDNSMessage_DNSResponse_LatencyPhase* latencyPhase = response->add_latencyphases();
+  if (!latencyPhase)
+    return;
+
+  latencyPhase->set_name(phase);
+  latencyPhase->set_usec(usec);
+
+#endif /* HAVE_PROTOBUF */
+}
+
 void DNSProtoBufMessage::addRR(const DNSName& qname, uint16_t uType, uint16_t uClass, uint32_t uTTL, const std::string& strBlob)
 {
 #ifdef HAVE_PROTOBUF
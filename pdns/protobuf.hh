@@ -72,6 +72,7 @@ public:
   void setDeviceId(const std::string& deviceId);
   std::string toDebugString() const;
   void addTag(const std::string& strValue);
+  void addLatencyPhase(const std::string& phase, uint64_t usec);
   void addRR(const DNSName& qame, uint16_t utype, uint16_t uClass, uint32_t uTTl, const std::string& strBlob);
 
 #ifdef HAVE_PROTOBUF
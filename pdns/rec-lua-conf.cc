@@ -262,7 +262,7 @@ void loadRecursorLuaConfig(const std::string& fname, bool checkOnly)
     });
 
 #if HAVE_PROTOBUF
-  Lua.writeFunction("protobufServer", [&lci, checkOnly](const string& server_, const boost::optional<uint16_t> timeout, const boost::optional<uint64_t> maxQueuedEntries, const boost::optional<uint8_t> reconnectWaitTime, const boost::optional<uint8_t> maskV4, boost::optional<uint8_t> maskV6, boost::optional<bool> asyncConnect, boost::optional<bool> taggedOnly) {
+  Lua.writeFunction("protobufServer", [&lci, checkOnly](const string& server_, const boost::optional<uint16_t> timeout, const boost::optional<uint64_t> maxQueuedEntries, const boost::optional<uint8_t> reconnectWaitTime, const boost::optional<uint8_t> maskV4, boost::optional<uint8_t> maskV6, boost::optional<bool> asyncConnect, boost::optional<bool> taggedOnly, boost::optional<uint32_t> latencyTraceRate) {
       try {
 	ComboAddress server(server_);
         if (!lci.protobufServer) {
@@ -279,6 +279,9 @@ void loadRecursorLuaConfig(const std::string& fname, bool checkOnly)
           if (taggedOnly) {
             lci.protobufTaggedOnly = *taggedOnly;
           }
+          if (latencyTraceRate) {
+            lci.protobufLatencyTraceRate = *latencyTraceRate;
+          }
         }
         else {
           theL()<<Logger::Error<<"Only one protobuf server can be configured, we already have "<<lci.protobufServer->toString()<<endl;
@@ -315,6 +318,8 @@ void loadRecursorLuaConfig(const std::string& fname, bool checkOnly)
 
   try {
     Lua.executeCode(ifs);
+    /* all RPZ zones have been loaded by now */
+    lci.dfe.compile();
     g_luaconfs.setState(lci);
   }
   catch(const LuaContext::ExecutionErrorException& e) {
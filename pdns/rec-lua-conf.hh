@@ -39,6 +39,7 @@ public:
   uint8_t protobufMaskV4{32};
   uint8_t protobufMaskV6{128};
   bool protobufTaggedOnly{false};
+  uint32_t protobufLatencyTraceRate{0};
 };
 
 extern GlobalStateHolder<LuaConfigItems> g_luaconfs;
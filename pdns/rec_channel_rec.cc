@@ -191,7 +191,7 @@ static uint64_t dumpNegCache(NegCache& negcache, int fd)
 
 static uint64_t* pleaseDump(int fd)
 {
-  return new uint64_t(t_RC->doDump(fd) + dumpNegCache(SyncRes::t_sstorage.negcache, fd) + t_packetCache->doDump(fd));
+  return new uint64_t(t_RC->doDump(fd) + dumpNegCache(SyncRes::t_sstorage.negcache, fd));
 }
 
 static uint64_t* pleaseDumpNSSpeeds(int fd)
@@ -245,6 +245,9 @@ string doDumpCache(T begin, T end)
   uint64_t total = 0;
   try {
     total = broadcastAccFunction<uint64_t>(boost::bind(pleaseDump, fd));
+    if (g_packetCache) {
+      total += g_packetCache->doDump(fd);
+    }
   }
   catch(...){}
   
@@ -315,15 +318,17 @@ uint64_t* pleaseWipeCache(const DNSName& canon, bool subtree)
   return new uint64_t(t_RC->doWipeCache(canon, subtree));
 }
 
-uint64_t* pleaseWipePacketCache(const DNSName& canon, bool subtree)
+uint64_t wipePacketCache(const DNSName& canon, bool subtree)
 {
-  return new uint64_t(t_packetCache->doWipePacketCache(canon,0xffff, subtree));
+  return g_packetCache ? g_packetCache->doWipePacketCache(canon, 0xffff, subtree) : 0;
 }
 
 
+
 uint64_t* pleaseWipeAndCountNegCache(const DNSName& canon, bool subtree)
 {
   uint64_t ret = SyncRes::wipeNegCache(canon, subtree);
+  SyncRes::wipeAggressiveNSECCache(canon, subtree);
   return new uint64_t(ret);
 }
 
@@ -352,7 +357,7 @@ string doWipeCache(T begin, T end)
   int count=0, pcount=0, countNeg=0;
   for (auto wipe : toWipe) {
     count+= broadcastAccFunction<uint64_t>(boost::bind(pleaseWipeCache, wipe.first, wipe.second));
-    pcount+= broadcastAccFunction<uint64_t>(boost::bind(pleaseWipePacketCache, wipe.first, wipe.second));
+    pcount+= wipePacketCache(wipe.first, wipe.second);
     countNeg+=broadcastAccFunction<uint64_t>(boost::bind(pleaseWipeAndCountNegCache, wipe.first, wipe.second));
   }
 
@@ -440,7 +445,7 @@ string doAddNTA(T begin, T end)
   g_luaconfs.modify([who, why](LuaConfigItems& lci) {
       lci.negAnchors[who] = why;
       });
-  broadcastAccFunction<uint64_t>(boost::bind(pleaseWipePacketCache, who, true));
+  wipePacketCache(who, true);
   return "Added Negative Trust Anchor for " + who.toLogString() + " with reason '" + why + "'\n";
 }
 
@@ -486,7 +491,7 @@ string doClearNTA(T begin, T end)
     g_luaconfs.modify([entry](LuaConfigItems& lci) {
         lci.negAnchors.erase(entry);
       });
-    broadcastAccFunction<uint64_t>(boost::bind(pleaseWipePacketCache, entry, true));
+    wipePacketCache(entry, true);
     if (!first) {
       first = false;
       removed += ",";
@@ -541,7 +546,7 @@ string doAddTA(T begin, T end)
       auto ds = unique_ptr<DSRecordContent>(dynamic_cast<DSRecordContent*>(DSRecordContent::make(what)));
       lci.dsAnchors[who].insert(*ds);
       });
-    broadcastAccFunction<uint64_t>(boost::bind(pleaseWipePacketCache, who, true));
+    wipePacketCache(who, true);
     L<<Logger::Warning<<endl;
     return "Added Trust Anchor for " + who.toStringRootDot() + " with data " + what + "\n";
   }
@@ -585,7 +590,7 @@ string doClearTA(T begin, T end)
     g_luaconfs.modify([entry](LuaConfigItems& lci) {
         lci.dsAnchors.erase(entry);
       });
-    broadcastAccFunction<uint64_t>(boost::bind(pleaseWipePacketCache, entry, true));
+    wipePacketCache(entry, true);
     if (!first) {
       first = false;
       removed += ",";
@@ -710,6 +715,21 @@ uint64_t getNegCacheSize()
   return broadcastAccFunction<uint64_t>(pleaseGetNegCacheSize);
 }
 
+static uint64_t* pleaseGetAggressiveNSECCacheSize()
+{
+  return new uint64_t(SyncRes::getAggressiveNSECCacheSize());
+}
+
+static uint64_t getAggressiveNSECCacheSize()
+{
+  return broadcastAccFunction<uint64_t>(pleaseGetAggressiveNSECCacheSize);
+}
+
+static uint64_t getSignatureCacheSize()
+{
+  return g_signatureVerificationCache.size();
+}
+
 uint64_t* pleaseGetFailedHostsSize()
 {
   uint64_t tmp=(SyncRes::getThrottledServersSize());
@@ -740,6 +760,27 @@ static uint64_t getConcurrentQueries()
   return broadcastAccFunction<uint64_t>(pleaseGetConcurrentQueries);
 }
 
+static uint64_t* pleaseGetMThreadStackCacheSize()
+{
+  return new uint64_t(getMT() ? getMT()->getCachedStacksCount() : 0);
+}
+
+static uint64_t getMThreadStackCacheSize()
+{
+  return broadcastAccFunction<uint64_t>(pleaseGetMThreadStackCacheSize);
+}
+
+static vector<uint64_t>* pleaseGetMThreadStacksHighWaterMark()
+{
+  return new vector<uint64_t>({getMT() ? getMT()->getStacksHighWaterMark() : 0});
+}
+
+static uint64_t getMThreadStacksHighWaterMark()
+{
+  const auto marks = broadcastAccFunction<vector<uint64_t> >(pleaseGetMThreadStacksHighWaterMark);
+  return marks.empty() ? 0 : *std::max_element(marks.begin(), marks.end());
+}
+
 uint64_t* pleaseGetCacheSize()
 {
   return new uint64_t(t_RC ? t_RC->size() : 0);
@@ -767,6 +808,36 @@ uint64_t doGetCacheBytes()
   return broadcastAccFunction<uint64_t>(pleaseGetCacheBytes);
 }
 
+uint64_t* pleaseGetECSCacheSize()
+{
+  return new uint64_t(t_RC ? t_RC->ecsEntriesCount() : 0);
+}
+
+uint64_t doGetECSCacheSize()
+{
+  return broadcastAccFunction<uint64_t>(pleaseGetECSCacheSize);
+}
+
+uint64_t* pleaseGetECSIndexSize()
+{
+  return new uint64_t(t_RC ? t_RC->ecsIndexSize() : 0);
+}
+
+uint64_t doGetECSIndexSize()
+{
+  return broadcastAccFunction<uint64_t>(pleaseGetECSIndexSize);
+}
+
+uint64_t* pleaseGetECSCacheEvictions()
+{
+  return new uint64_t(t_RC ? t_RC->ecsEvictions : 0);
+}
+
+uint64_t doGetECSCacheEvictions()
+{
+  return broadcastAccFunction<uint64_t>(pleaseGetECSCacheEvictions);
+}
+
 uint64_t* pleaseGetCacheHits()
 {
   return new uint64_t(t_RC ? t_RC->cacheHits : 0);
@@ -787,47 +858,37 @@ uint64_t doGetCacheMisses()
   return broadcastAccFunction<uint64_t>(pleaseGetCacheMisses);
 }
 
-
-uint64_t* pleaseGetPacketCacheSize()
+static LatencyHistogram* pleaseGetLatencyHistogram(LatencyPhase phase)
 {
-  return new uint64_t(t_packetCache ? t_packetCache->size() : 0);
+  /* an idle thread has not decayed its histograms in a while */
+  t_latencyHistograms.decay(getLatencyClockSeconds());
+  return new LatencyHistogram(t_latencyHistograms.get(phase));
 }
 
-uint64_t* pleaseGetPacketCacheBytes()
+static uint64_t doGetLatencyPercentile(LatencyPhase phase, double percentile)
 {
-  return new uint64_t(t_packetCache ? t_packetCache->bytes() : 0);
+  return broadcastAccFunction<LatencyHistogram>(boost::bind(pleaseGetLatencyHistogram, phase)).getPercentile(percentile);
 }
 
 
 uint64_t doGetPacketCacheSize()
 {
-  return broadcastAccFunction<uint64_t>(pleaseGetPacketCacheSize);
+  return g_packetCache ? g_packetCache->size() : 0;
 }
 
 uint64_t doGetPacketCacheBytes()
 {
-  return broadcastAccFunction<uint64_t>(pleaseGetPacketCacheBytes);
-}
-
-
-uint64_t* pleaseGetPacketCacheHits()
-{
-  return new uint64_t(t_packetCache ? t_packetCache->d_hits : 0);
+  return g_packetCache ? g_packetCache->bytes() : 0;
 }
 
 uint64_t doGetPacketCacheHits()
 {
-  return broadcastAccFunction<uint64_t>(pleaseGetPacketCacheHits);
-}
-
-uint64_t* pleaseGetPacketCacheMisses()
-{
-  return new uint64_t(t_packetCache ? t_packetCache->d_misses : 0);
+  return g_packetCache ? g_packetCache->d_hits.load() : 0;
 }
 
 uint64_t doGetPacketCacheMisses()
 {
-  return broadcastAccFunction<uint64_t>(pleaseGetPacketCacheMisses);
+  return g_packetCache ? g_packetCache->d_misses.load() : 0;
 }
 
 uint64_t doGetMallocated()
@@ -905,6 +966,16 @@ void registerAllStats()
 
   addGetStat("qa-latency", doGetAvgLatencyUsec);
   addGetStat("x-our-latency", []() { return g_stats.avgLatencyOursUsec; });
+
+  for (size_t idx = 0; idx < s_latencyPhasesCount; idx++) {
+    const auto phase = static_cast<LatencyPhase>(idx);
+    const std::string prefix = "latency-" + latencyPhaseToString(phase) + "-";
+    addGetStat(prefix + "p50", boost::bind(doGetLatencyPercentile, phase, 50.0));
+    addGetStat(prefix + "p90", boost::bind(doGetLatencyPercentile, phase, 90.0));
+    addGetStat(prefix + "p99", boost::bind(doGetLatencyPercentile, phase, 99.0));
+    addGetStat(prefix + "p999", boost::bind(doGetLatencyPercentile, phase, 99.9));
+  }
+
   addGetStat("unexpected-packets", &g_stats.unexpectedCount);
   addGetStat("case-mismatches", &g_stats.caseMismatchCount);
   addGetStat("spoof-prevents", &g_stats.spoofCount);
@@ -918,6 +989,8 @@ void registerAllStats()
   addGetStat("dlg-only-drops", &SyncRes::s_nodelegated);
   addGetStat("ignored-packets", &g_stats.ignoredCount);
   addGetStat("max-mthread-stack", &g_stats.maxMThreadStackUsage);
+  addGetStat("max-mthread-stack-touched", getMThreadStacksHighWaterMark);
+  addGetStat("mthread-stack-cache-entries", getMThreadStackCacheSize);
   
   addGetStat("negcache-entries", boost::bind(getNegCacheSize));
   addGetStat("throttle-entries", boost::bind(getThrottleSize)); 
@@ -931,6 +1004,8 @@ void registerAllStats()
   addGetStat("outgoing4-timeouts", &SyncRes::s_outgoing4timeouts);
   addGetStat("outgoing6-timeouts", &SyncRes::s_outgoing6timeouts);
   addGetStat("tcp-outqueries", &SyncRes::s_tcpoutqueries);
+  addGetStat("tcp-out-connections-reused", &g_stats.tcpOutConnectionsReused);
+  addGetStat("tcp-out-queries-pipelined", &g_stats.tcpOutQueriesPipelined);
   addGetStat("all-outqueries", &SyncRes::s_outqueries);
   addGetStat("ipv6-outqueries", &g_stats.ipv6queries);
   addGetStat("throttled-outqueries", &SyncRes::s_throttledqueries);
@@ -939,7 +1014,19 @@ void registerAllStats()
   addGetStat("unreachables", &SyncRes::s_unreachables);
   addGetStat("ecs-queries", &SyncRes::s_ecsqueries);
   addGetStat("ecs-responses", &SyncRes::s_ecsresponses);
+  addGetStat("ecs-cache-entries", doGetECSCacheSize);
+  addGetStat("ecs-cache-evictions", doGetECSCacheEvictions);
+  addGetStat("ecs-index-entries", doGetECSIndexSize);
+  addGetStat("stale-answers", &SyncRes::s_staleanswers);
+  addGetStat("aggressive-nsec-cache-entries", boost::bind(getAggressiveNSECCacheSize));
+  addGetStat("aggressive-nsec-synthesized-nxdomain", &SyncRes::s_aggressivensecnxdomains);
+  addGetStat("aggressive-nsec-synthesized-nodata", &SyncRes::s_aggressivensecnodata);
+  addGetStat("signature-cache-entries", boost::bind(getSignatureCacheSize));
+  addGetStat("signature-cache-hits", &g_signatureVerificationCache.d_hits);
+  addGetStat("signature-cache-misses", &g_signatureVerificationCache.d_misses);
   addGetStat("chain-resends", &g_stats.chainResends);
+  addGetStat("coalesced-queries", &g_stats.coalescedQueries);
+  addGetStat("coalesce-timeouts", &g_stats.coalesceTimeouts);
   addGetStat("tcp-clients", boost::bind(TCPConnection::getCurrentConnections));
 
 #ifdef __linux__
@@ -983,6 +1070,10 @@ void registerAllStats()
   addGetStat("policy-result-nodata", &g_stats.policyResults[DNSFilterEngine::PolicyKind::NODATA]);
   addGetStat("policy-result-truncate", &g_stats.policyResults[DNSFilterEngine::PolicyKind::Truncate]);
   addGetStat("policy-result-custom", &g_stats.policyResults[DNSFilterEngine::PolicyKind::Custom]);
+
+  addGetStat("rpz-updates", &g_stats.rpzUpdates);
+  addGetStat("rpz-update-usec", &g_stats.rpzUpdateUsec);
+  addGetStat("rpz-last-update-usec", &g_stats.rpzLastUpdateUsec);
 }
 
 static void doExitGeneric(bool nicely)
@@ -1007,6 +1098,7 @@ static void doExit()
 
 static void doExitNicely()
 {
+  broadcastAccFunction<uint64_t>(pleaseSaveCacheSnapshot);
   doExitGeneric(true);
 }
 
@@ -1,11 +1,11 @@
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
+#include <algorithm>
 #include <iostream>
 #include <cinttypes>
 
 #include "recpacketcache.hh"
-#include "cachecleaner.hh"
 #include "dns.hh"
 #include "dnsparser.hh"
 #include "namespaces.hh"
@@ -13,80 +13,252 @@
 #include "dnswriter.hh"
 #include "ednsoptions.hh"
 
-RecursorPacketCache::RecursorPacketCache()
+RecursorPacketCache::RecursorPacketCache(size_t shardsCount)
 {
-  d_hits = d_misses = 0;
+  /* the shard is selected from the low bits of the slot hash, so we need a power of two */
+  while ((static_cast<size_t>(1) << d_shardBits) < shardsCount) {
+    d_shardBits++;
+  }
+
+  d_shards = std::vector<Shard>(static_cast<size_t>(1) << d_shardBits);
+  for(auto& shard : d_shards) {
+    pthread_mutex_init(&shard.d_mutex, 0);
+    shard.d_slots = std::vector<Slot>(s_initialSlotsPerShard);
+  }
+  pthread_rwlock_init(&d_wipesLock, 0);
 }
 
-int RecursorPacketCache::doWipePacketCache(const DNSName& name, uint16_t qtype, bool subtree)
+RecursorPacketCache::~RecursorPacketCache()
 {
-  int count=0;
-  auto& idx = d_packetCache.get<NameTag>();
-  for(auto iter = idx.lower_bound(name); iter != idx.end(); ) {
-    if(subtree) {
-      if(!iter->d_name.isPartOf(name)) {   // this is case insensitive
-	break;
-      }
+  for(auto& shard : d_shards) {
+    pthread_mutex_destroy(&shard.d_mutex);
+  }
+  pthread_rwlock_destroy(&d_wipesLock);
+}
+
+uint32_t RecursorPacketCache::getSlotHash(unsigned int tag, uint32_t qhash)
+{
+  /* fmix32 from MurmurHash3, so that entries differing only by their tag don't end up next to each other */
+  uint32_t h = qhash ^ (static_cast<uint32_t>(tag) * 0x9e3779b1U);
+  h ^= h >> 16;
+  h *= 0x85ebca6bU;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35U;
+  h ^= h >> 16;
+  return h;
+}
+
+RecursorPacketCache::Shard& RecursorPacketCache::getShard(uint32_t slotHash)
+{
+  return d_shards[slotHash & (d_shards.size() - 1)];
+}
+
+size_t RecursorPacketCache::getSlotPosition(const Shard& shard, uint32_t slotHash) const
+{
+  return (slotHash >> d_shardBits) & (shard.d_slots.size() - 1);
+}
+
+bool RecursorPacketCache::wipeMatches(const Wipe& wipe, const Entry& entry)
+{
+  if (wipe.d_qtype != 0xffff && wipe.d_qtype != entry.d_type) {
+    return false;
+  }
+
+  if (wipe.d_subtree) {
+    return entry.d_name.isPartOf(wipe.d_name); // this is case insensitive
+  }
+
+  return entry.d_name == wipe.d_name;
+}
+
+/* must be called with the lock of the shard holding this entry */
+bool RecursorPacketCache::isWiped(Entry& entry)
+{
+  const uint32_t generation = d_generation.load();
+  if (entry.d_generation == generation) {
+    return false;
+  }
+
+  ReadLock rl(&d_wipesLock);
+  for (const auto& wipe : d_pendingWipes) {
+    if (wipe.d_generation > entry.d_generation && wipeMatches(wipe, entry)) {
+      return true;
     }
-    else {
-      if(iter->d_name != name)
-	break;
+  }
+
+  /* no need to look at these wipes again for this entry */
+  entry.d_generation = generation;
+  return false;
+}
+
+/* backward-shift deletion, so we don't need tombstones */
+void RecursorPacketCache::eraseSlot(Shard& shard, size_t pos)
+{
+  const size_t mask = shard.d_slots.size() - 1;
+
+  shard.d_slots[pos].d_entry.reset();
+  shard.d_entries--;
+
+  size_t hole = pos;
+  for (size_t next = (pos + 1) & mask; shard.d_slots[next].d_entry; next = (next + 1) & mask) {
+    const size_t home = getSlotPosition(shard, getSlotHash(shard.d_slots[next].d_tag, shard.d_slots[next].d_qhash));
+    /* the entry can be moved to the hole if its ideal position is not between the hole and where it currently is */
+    if (((next - home) & mask) >= ((next - hole) & mask)) {
+      shard.d_slots[hole] = std::move(shard.d_slots[next]);
+      hole = next;
     }
+  }
+}
 
-    if(qtype==0xffff || iter->d_type == qtype) {
-      iter=idx.erase(iter);
-      count++;
+void RecursorPacketCache::growShard(Shard& shard)
+{
+  std::vector<Slot> old(shard.d_slots.size() * 2);
+  old.swap(shard.d_slots);
+
+  const size_t mask = shard.d_slots.size() - 1;
+  for (auto& slot : old) {
+    if (!slot.d_entry) {
+      continue;
+    }
+    size_t pos = getSlotPosition(shard, getSlotHash(slot.d_tag, slot.d_qhash));
+    while (shard.d_slots[pos].d_entry) {
+      pos = (pos + 1) & mask;
+    }
+    shard.d_slots[pos] = std::move(slot);
+  }
+  shard.d_hand = 0;
+}
+
+size_t RecursorPacketCache::applyPendingWipes()
+{
+  std::vector<Wipe> wipes;
+  uint32_t generation;
+  {
+    ReadLock rl(&d_wipesLock);
+    if (d_pendingWipes.empty()) {
+      return 0;
     }
-    else
-      ++iter;
+    wipes = d_pendingWipes;
+    generation = d_generation.load();
   }
+
+  /* we can't hold the wipes lock while taking the shard ones, getResponsePacket() takes them in the opposite order */
+  size_t count = 0;
+  for (auto& shard : d_shards) {
+    Lock l(&shard.d_mutex);
+    for (size_t pos = 0; pos < shard.d_slots.size(); ) {
+      auto& entry = shard.d_slots[pos].d_entry;
+      if (!entry || entry->d_generation >= generation) {
+        ++pos;
+        continue;
+      }
+
+      bool wiped = false;
+      for (const auto& wipe : wipes) {
+        if (wipe.d_generation > entry->d_generation && wipeMatches(wipe, *entry)) {
+          wiped = true;
+          break;
+        }
+      }
+
+      if (wiped) {
+        /* another entry might have been shifted into this slot */
+        eraseSlot(shard, pos);
+        count++;
+      }
+      else {
+        entry->d_generation = generation;
+        ++pos;
+      }
+    }
+  }
+
+  /* every entry is now either gone or stamped with at least this generation */
+  WriteLock wl(&d_wipesLock);
+  d_pendingWipes.erase(std::remove_if(d_pendingWipes.begin(), d_pendingWipes.end(), [generation](const Wipe& wipe) { return wipe.d_generation <= generation; }), d_pendingWipes.end());
+
   return count;
 }
 
+int RecursorPacketCache::doWipePacketCache(const DNSName& name, uint16_t qtype, bool subtree)
+{
+  bool tooManyPending;
+  {
+    WriteLock wl(&d_wipesLock);
+    d_pendingWipes.push_back({name, ++d_generation, qtype, subtree});
+    tooManyPending = d_pendingWipes.size() > s_maxPendingWipes;
+  }
+
+  if (tooManyPending) {
+    return applyPendingWipes();
+  }
+
+  return 0;
+}
+
 static bool qrMatch(const DNSName& qname, uint16_t qtype, uint16_t qclass, const DNSName& rname, uint16_t rtype, uint16_t rclass)
 {
   // this ignores checking on the EDNS subnet flags! 
   return qname==rname && rtype == qtype && rclass == qclass;
 }
 
-bool RecursorPacketCache::checkResponseMatches(std::pair<packetCache_t::index<HashTag>::type::iterator, packetCache_t::index<HashTag>::type::iterator> range, const std::string& queryPacket, const DNSName& qname, uint16_t qtype, uint16_t qclass, time_t now, std::string* responsePacket, uint32_t* age, RecProtoBufMessage* protobufMessage)
+bool RecursorPacketCache::lookup(unsigned int tag, uint32_t qhash, const std::string& queryPacket, const DNSName& qname, uint16_t qtype, uint16_t qclass, time_t now, std::string* responsePacket, uint32_t* age, RecProtoBufMessage* protobufMessage)
 {
-  for(auto iter = range.first ; iter != range.second ; ++ iter) {
+  const uint32_t slotHash = getSlotHash(tag, qhash);
+  auto& shard = getShard(slotHash);
+  Lock l(&shard.d_mutex);
+
+  const size_t mask = shard.d_slots.size() - 1;
+  for (size_t pos = getSlotPosition(shard, slotHash); shard.d_slots[pos].d_entry; pos = (pos + 1) & mask) {
+    const auto& slot = shard.d_slots[pos];
+    if (slot.d_qhash != qhash || slot.d_tag != tag) {
+      continue;
+    }
+
+    auto& entry = *slot.d_entry;
     // the possibility is VERY real that we get hits that are not right - birthday paradox
-    if(!qrMatch(qname, qtype, qclass, iter->d_name, iter->d_type, iter->d_class))
+    if (!qrMatch(qname, qtype, qclass, entry.d_name, entry.d_type, entry.d_class)) {
       continue;
-    if(now < iter->d_ttd) { // it is right, it is fresh!
-      *age = static_cast<uint32_t>(now - iter->d_creation);
-      *responsePacket = iter->d_packet;
-      responsePacket->replace(0, 2, queryPacket.c_str(), 2);
-    
-      string::size_type i=sizeof(dnsheader);
-      
-      for(;;) {
-        unsigned int labellen = (unsigned char)queryPacket[i];
-        if(!labellen || i + labellen > responsePacket->size()) break;
-        i++;
-        responsePacket->replace(i, labellen, queryPacket, i, labellen);
-        i = i + labellen;
-      }
+    }
 
-      d_hits++;
-      moveCacheItemToBack(d_packetCache, iter);
-#ifdef HAVE_PROTOBUF
-      if (protobufMessage) {
-        *protobufMessage = iter->d_protobufMessage;
-      }
-#endif
-      
-      return true;
+    if (isWiped(entry)) {
+      eraseSlot(shard, pos);
+      break;
     }
-    else {
-      moveCacheItemToFront(d_packetCache, iter); 
-      d_misses++;
+
+    if (now >= entry.d_ttd) {
+      /* first in line for eviction */
+      entry.d_referenced = false;
       break;
     }
+
+    // it is right, it is fresh!
+    *age = static_cast<uint32_t>(now - entry.d_creation);
+    *responsePacket = entry.d_packet;
+    responsePacket->replace(0, 2, queryPacket.c_str(), 2);
+
+    string::size_type i=sizeof(dnsheader);
+
+    for(;;) {
+      unsigned int labellen = (unsigned char)queryPacket[i];
+      if(!labellen || i + labellen > responsePacket->size()) break;
+      i++;
+      responsePacket->replace(i, labellen, queryPacket, i, labellen);
+      i = i + labellen;
+    }
+
+    d_hits++;
+    entry.d_referenced = true;
+#ifdef HAVE_PROTOBUF
+    if (protobufMessage && entry.d_protobufMessage) {
+      *protobufMessage = *entry.d_protobufMessage;
+    }
+#endif
+
+    return true;
   }
 
+  d_misses++;
   return false;
 }
 
@@ -106,33 +278,18 @@ bool RecursorPacketCache::getResponsePacket(unsigned int tag, const std::string&
                                             std::string* responsePacket, uint32_t* age, uint32_t* qhash, RecProtoBufMessage* protobufMessage)
 {
   *qhash = canHashPacket(queryPacket, true);
-  const auto& idx = d_packetCache.get<HashTag>();
-  auto range = idx.equal_range(tie(tag,*qhash));
-
-  if(range.first == range.second) {
-    d_misses++;
-    return false;
-  }
-
-  return checkResponseMatches(range, queryPacket, qname, qtype, qclass, now, responsePacket, age, protobufMessage);
+  return lookup(tag, *qhash, queryPacket, qname, qtype, qclass, now, responsePacket, age, protobufMessage);
 }
 
 bool RecursorPacketCache::getResponsePacket(unsigned int tag, const std::string& queryPacket, time_t now,
                                             std::string* responsePacket, uint32_t* age, uint32_t* qhash, RecProtoBufMessage* protobufMessage)
 {
   *qhash = canHashPacket(queryPacket, true);
-  const auto& idx = d_packetCache.get<HashTag>();
-  auto range = idx.equal_range(tie(tag,*qhash));
-
-  if(range.first == range.second) {
-    d_misses++;
-    return false;
-  }
 
   uint16_t qtype, qclass;
   DNSName qname(queryPacket.c_str(), queryPacket.length(), sizeof(dnsheader), false, &qtype, &qclass, 0);
 
-  return checkResponseMatches(range, queryPacket, qname, qtype, qclass, now, responsePacket, age, protobufMessage);
+  return lookup(tag, *qhash, queryPacket, qname, qtype, qclass, now, responsePacket, age, protobufMessage);
 }
 
 
@@ -143,63 +300,134 @@ void RecursorPacketCache::insertResponsePacket(unsigned int tag, uint32_t qhash,
 
 void RecursorPacketCache::insertResponsePacket(unsigned int tag, uint32_t qhash, const DNSName& qname, uint16_t qtype, uint16_t qclass, const std::string& responsePacket, time_t now, uint32_t ttl, const RecProtoBufMessage* protobufMessage)
 {
-  auto& idx = d_packetCache.get<HashTag>();
-  auto range = idx.equal_range(tie(tag,qhash));
-  auto iter = range.first;
+  const uint32_t slotHash = getSlotHash(tag, qhash);
+  auto& shard = getShard(slotHash);
+  Lock l(&shard.d_mutex);
 
-  for( ; iter != range.second ; ++iter)  {
-    if(iter->d_type != qtype || iter->d_class != qclass || iter->d_name != qname)
+  /* keep the load factor under 1/2, linear probing gets slow past that */
+  if ((shard.d_entries + 1) * 2 > shard.d_slots.size()) {
+    growShard(shard);
+  }
+
+  const size_t mask = shard.d_slots.size() - 1;
+  size_t pos = getSlotPosition(shard, slotHash);
+  for (; shard.d_slots[pos].d_entry; pos = (pos + 1) & mask) {
+    const auto& slot = shard.d_slots[pos];
+    if (slot.d_qhash != qhash || slot.d_tag != tag) {
       continue;
+    }
 
-    moveCacheItemToBack(d_packetCache, iter);
-    iter->d_packet = responsePacket;
-    iter->d_ttd = now + ttl;
-    iter->d_creation = now;
-#ifdef HAVE_PROTOBUF
-    if (protobufMessage) {
-      iter->d_protobufMessage = *protobufMessage;
+    auto& entry = *slot.d_entry;
+    if (entry.d_type != qtype || entry.d_class != qclass || entry.d_name != qname) {
+      continue;
     }
-#endif
 
-    break;
-  }
-  
-  if(iter == range.second) { // nothing to refresh
-    struct Entry e;
-    e.d_packet = responsePacket;
-    e.d_name = qname;
-    e.d_qhash = qhash;
-    e.d_type = qtype;
-    e.d_class = qclass;
-    e.d_ttd = now+ttl;
-    e.d_creation = now;
-    e.d_tag = tag;
+    entry.d_packet = responsePacket;
+    entry.d_ttd = now + ttl;
+    entry.d_creation = now;
+    entry.d_generation = d_generation.load();
+    entry.d_referenced = true;
 #ifdef HAVE_PROTOBUF
     if (protobufMessage) {
-      e.d_protobufMessage = *protobufMessage;
+      entry.d_protobufMessage = std::unique_ptr<RecProtoBufMessage>(new RecProtoBufMessage(*protobufMessage));
     }
 #endif
-    d_packetCache.insert(e);
+    return;
   }
+
+  /* nothing to refresh, pos is the first free slot */
+  std::unique_ptr<Entry> entry(new Entry);
+  entry->d_name = qname;
+  entry->d_packet = responsePacket;
+#ifdef HAVE_PROTOBUF
+  if (protobufMessage) {
+    entry->d_protobufMessage = std::unique_ptr<RecProtoBufMessage>(new RecProtoBufMessage(*protobufMessage));
+  }
+#endif
+  entry->d_ttd = now + ttl;
+  entry->d_creation = now;
+  entry->d_generation = d_generation.load();
+  entry->d_type = qtype;
+  entry->d_class = qclass;
+  entry->d_referenced = false;
+
+  auto& slot = shard.d_slots[pos];
+  slot.d_qhash = qhash;
+  slot.d_tag = tag;
+  slot.d_entry = std::move(entry);
+  shard.d_entries++;
 }
 
 uint64_t RecursorPacketCache::size()
 {
-  return d_packetCache.size();
+  uint64_t count = 0;
+  for (auto& shard : d_shards) {
+    Lock l(&shard.d_mutex);
+    count += shard.d_entries;
+  }
+  return count;
 }
 
 uint64_t RecursorPacketCache::bytes()
 {
-  uint64_t sum=0;
-  for(const auto& e :  d_packetCache) {
-    sum += sizeof(e) + e.d_packet.length() + 4;
+  uint64_t sum = 0;
+  for (auto& shard : d_shards) {
+    Lock l(&shard.d_mutex);
+    sum += shard.d_slots.size() * sizeof(Slot);
+    for (const auto& slot : shard.d_slots) {
+      if (slot.d_entry) {
+        sum += sizeof(Entry) + slot.d_entry->d_packet.length() + slot.d_entry->d_name.getStorage().size();
+      }
+    }
   }
   return sum;
 }
 
+/* CLOCK: move the hand until enough entries without the referenced bit have been evicted,
+   clearing that bit on the way. Otherwise, look at a small part of the shard for expired entries. */
+size_t RecursorPacketCache::pruneShard(Shard& shard, size_t maxEntries, time_t now)
+{
+  size_t erased = 0;
+  size_t lookAt = shard.d_entries > maxEntries ? 0 : shard.d_slots.size() / 1000;
+
+  while (shard.d_entries > maxEntries || lookAt > 0) {
+    if (shard.d_hand >= shard.d_slots.size()) {
+      shard.d_hand = 0;
+    }
+
+    auto& entry = shard.d_slots[shard.d_hand].d_entry;
+    if (entry && (entry->d_ttd < now || (shard.d_entries > maxEntries && !entry->d_referenced))) {
+      /* don't move the hand, an entry might have been shifted here */
+      eraseSlot(shard, shard.d_hand);
+      erased++;
+      continue;
+    }
+
+    if (entry) {
+      entry->d_referenced = false;
+    }
+    shard.d_hand++;
+    if (lookAt > 0) {
+      lookAt--;
+    }
+  }
+
+  return erased;
+}
+
 void RecursorPacketCache::doPruneTo(unsigned int maxCached)
 {
-  pruneCollection(*this, d_packetCache, maxCached);
+  applyPendingWipes();
+
+  const time_t now = time(nullptr);
+  const size_t perShard = maxCached / d_shards.size();
+  const size_t remainder = maxCached % d_shards.size();
+
+  for (size_t idx = 0; idx < d_shards.size(); idx++) {
+    auto& shard = d_shards[idx];
+    Lock l(&shard.d_mutex);
+    pruneShard(shard, perShard + (idx < remainder ? 1 : 0), now);
+  }
 }
 
 uint64_t RecursorPacketCache::doDump(int fd)
@@ -208,18 +436,24 @@ uint64_t RecursorPacketCache::doDump(int fd)
   if(!fp) { // dup probably failed
     return 0;
   }
-  fprintf(fp, "; main packet cache dump from thread follows\n;\n");
-  const auto& sidx=d_packetCache.get<1>();
+  fprintf(fp, "; main packet cache dump follows\n;\n");
 
   uint64_t count=0;
   time_t now=time(0);
-  for(auto i=sidx.cbegin(); i != sidx.cend(); ++i) {
-    count++;
-    try {
-      fprintf(fp, "%s %" PRId64 " %s  ; tag %d\n", i->d_name.toString().c_str(), static_cast<int64_t>(i->d_ttd - now), DNSRecordContent::NumberToType(i->d_type).c_str(), i->d_tag);
-    }
-    catch(...) {
-      fprintf(fp, "; error printing '%s'\n", i->d_name.empty() ? "EMPTY" : i->d_name.toString().c_str());
+  for (auto& shard : d_shards) {
+    Lock l(&shard.d_mutex);
+    for (const auto& slot : shard.d_slots) {
+      if (!slot.d_entry) {
+        continue;
+      }
+      const auto& entry = *slot.d_entry;
+      count++;
+      try {
+        fprintf(fp, "%s %" PRId64 " %s  ; tag %d\n", entry.d_name.toString().c_str(), static_cast<int64_t>(entry.d_ttd - now), DNSRecordContent::NumberToType(entry.d_type).c_str(), slot.d_tag);
+      }
+      catch(...) {
+        fprintf(fp, "; error printing '%s'\n", entry.d_name.empty() ? "EMPTY" : entry.d_name.toString().c_str());
+      }
     }
   }
   fclose(fp);
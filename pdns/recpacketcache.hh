@@ -22,16 +22,15 @@
 #ifndef PDNS_RECPACKETCACHE_HH
 #define PDNS_RECPACKETCACHE_HH
 #include <string>
-#include <set>
+#include <vector>
+#include <atomic>
+#include <memory>
 #include <inttypes.h>
+#include <pthread.h>
 #include "dns.hh"
+#include "dnsname.hh"
 #include "namespaces.hh"
 #include <iostream>
-#include <boost/multi_index_container.hpp>
-#include <boost/multi_index/ordered_index.hpp>
-#include <boost/multi_index/hashed_index.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
-#include <boost/multi_index/sequenced_index.hpp>
 
 #include "packetcache.hh"
 
@@ -41,17 +40,27 @@
 #include "rec-protobuf.hh"
 
 
-using namespace ::boost::multi_index;
-
-//! Stores whole packets, ready for lobbing back at the client. Not threadsafe.
+//! Stores whole packets, ready for lobbing back at the client. Threadsafe, shared by all threads.
 /* Note: we store answers as value AND KEY, and with careful work, we make sure that
    you can use a query as a key too. But query and answer must compare as identical! 
    
-   This precludes doing anything smart with EDNS directly from the packet */
+   This precludes doing anything smart with EDNS directly from the packet.
+
+   The entries live in flat open-addressing tables (linear probing), split into shards that each
+   have their own lock. A slot only holds the (tag, hash) key and a pointer to the entry, so probing
+   does not touch the entries themselves until the key matches.
+   Eviction is done CLOCK-style: a hit sets the referenced bit of an entry, and the hand clears it
+   and moves on, evicting the first entry it finds without it.
+   Wiping by name does not walk the cache: the wipe is recorded with a new generation number, and
+   an entry stamped with an older generation is checked against the pending wipes the next time
+   it is hit. Pending wipes are applied to the whole cache by doPruneTo(), or once too many of them
+   have piled up.
+*/
 class RecursorPacketCache: public PacketCache
 {
 public:
-  RecursorPacketCache();
+  RecursorPacketCache(size_t shardsCount=64);
+  ~RecursorPacketCache();
   bool getResponsePacket(unsigned int tag, const std::string& queryPacket, time_t now, std::string* responsePacket, uint32_t* age, uint32_t* qhash);
   bool getResponsePacket(unsigned int tag, const std::string& queryPacket, time_t now, std::string* responsePacket, uint32_t* age, uint32_t* qhash, RecProtoBufMessage* protobufMessage);
   bool getResponsePacket(unsigned int tag, const std::string& queryPacket, const DNSName& qname, uint16_t qtype, uint16_t qclass, time_t now, std::string* responsePacket, uint32_t* age, uint32_t* qhash);
@@ -60,54 +69,73 @@ public:
   void insertResponsePacket(unsigned int tag, uint32_t qhash, const DNSName& qname, uint16_t qtype, uint16_t qclass, const std::string& responsePacket, time_t now, uint32_t ttl, const RecProtoBufMessage* protobufMessage);
   void doPruneTo(unsigned int maxSize=250000);
   uint64_t doDump(int fd);
+  /* the wipe is applied lazily, the returned count only covers the entries that were removed right away */
   int doWipePacketCache(const DNSName& name, uint16_t qtype=0xffff, bool subtree=false);
   
-  void prune();
-  uint64_t d_hits, d_misses;
+  std::atomic<uint64_t> d_hits{0};
+  std::atomic<uint64_t> d_misses{0};
   uint64_t size();
   uint64_t bytes();
 
 private:
-  struct HashTag {};
-  struct NameTag {};
-  struct Entry 
+  struct Entry
   {
-    mutable time_t d_ttd;
-    mutable time_t d_creation; // so we can 'age' our packets
     DNSName d_name;
-    uint16_t d_type;
-    uint16_t d_class;
-    mutable std::string d_packet; // "I know what I am doing"
+    std::string d_packet;
 #ifdef HAVE_PROTOBUF
-    mutable RecProtoBufMessage d_protobufMessage;
+    std::unique_ptr<RecProtoBufMessage> d_protobufMessage;
 #endif
-    uint32_t d_qhash;
-    uint32_t d_tag;
-    inline bool operator<(const struct Entry& rhs) const;
-    
-    time_t getTTD() const
-    {
-      return d_ttd;
-    }
+    time_t d_ttd;
+    time_t d_creation; // so we can 'age' our packets
+    uint32_t d_generation;
+    uint16_t d_type;
+    uint16_t d_class;
+    bool d_referenced;
   };
 
-  typedef multi_index_container<
-    Entry,
-    indexed_by  <
-      hashed_non_unique<tag<HashTag>, composite_key<Entry, member<Entry,uint32_t,&Entry::d_tag>, member<Entry,uint32_t,&Entry::d_qhash> > >,
-      sequenced<> ,
-      ordered_non_unique<tag<NameTag>, member<Entry,DNSName,&Entry::d_name>, CanonDNSNameCompare >
-      >
-  > packetCache_t;
-  
-  packetCache_t d_packetCache;
+  struct Slot
+  {
+    uint32_t d_qhash{0};
+    uint32_t d_tag{0};
+    std::unique_ptr<Entry> d_entry;
+  };
 
-  bool checkResponseMatches(std::pair<packetCache_t::index<HashTag>::type::iterator, packetCache_t::index<HashTag>::type::iterator> range, const std::string& queryPacket, const DNSName& qname, uint16_t qtype, uint16_t qclass, time_t now, std::string* responsePacket, uint32_t* age, RecProtoBufMessage* protobufMessage);
+  struct Shard
+  {
+    pthread_mutex_t d_mutex;
+    std::vector<Slot> d_slots;
+    size_t d_entries{0};
+    size_t d_hand{0};
+  };
 
-public:
-  void preRemoval(const Entry& entry)
+  struct Wipe
   {
-  }
+    DNSName d_name;
+    uint32_t d_generation;
+    uint16_t d_qtype;
+    bool d_subtree;
+  };
+
+  static const size_t s_initialSlotsPerShard = 16;
+  static const size_t s_maxPendingWipes = 128;
+
+  static uint32_t getSlotHash(unsigned int tag, uint32_t qhash);
+  static bool wipeMatches(const Wipe& wipe, const Entry& entry);
+  Shard& getShard(uint32_t slotHash);
+  size_t getSlotPosition(const Shard& shard, uint32_t slotHash) const;
+  bool isWiped(Entry& entry);
+  size_t applyPendingWipes();
+  void eraseSlot(Shard& shard, size_t pos);
+  void growShard(Shard& shard);
+  size_t pruneShard(Shard& shard, size_t maxEntries, time_t now);
+  bool lookup(unsigned int tag, uint32_t qhash, const std::string& queryPacket, const DNSName& qname, uint16_t qtype, uint16_t qclass, time_t now, std::string* responsePacket, uint32_t* age, RecProtoBufMessage* protobufMessage);
+
+  std::vector<Shard> d_shards;
+  unsigned int d_shardBits{0};
+
+  pthread_rwlock_t d_wipesLock;
+  std::vector<Wipe> d_pendingWipes;
+  std::atomic<uint32_t> d_generation{0};
 };
 
 #endif
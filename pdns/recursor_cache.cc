@@ -2,6 +2,7 @@
 #include "config.h"
 #endif
 
+#include <algorithm>
 #include <cinttypes>
 
 #include "recursor_cache.hh"
@@ -12,8 +13,14 @@
 #include "syncres.hh"
 #include "recursor_cache.hh"
 #include "cachecleaner.hh"
+#include "cache-snapshot.hh"
 #include "namespaces.hh"
 
+uint32_t MemRecursorCache::s_maxStaleTTL{0};
+uint32_t MemRecursorCache::s_staleAnswerTTL{30};
+uint32_t MemRecursorCache::s_maxECSEntriesPerName{0};
+uint64_t MemRecursorCache::s_maxECSEntries{0};
+
 unsigned int MemRecursorCache::size() const
 {
   return (unsigned int)d_cache.size();
@@ -24,44 +31,131 @@ size_t MemRecursorCache::ecsIndexSize() const
   return d_ecsIndex.size();
 }
 
+size_t MemRecursorCache::ecsEntriesCount() const
+{
+  return d_ecsEntries;
+}
+
+static void addSerializedContent(std::string& dest, const DNSName& qname, const std::shared_ptr<DNSRecordContent>& content)
+{
+  /* canonic, so that no name is compressed against the owner name */
+  const std::string serialized = content->serialize(qname, true);
+  if (serialized.size() > std::numeric_limits<uint16_t>::max()) {
+    throw std::runtime_error("Record content for '" + qname.toLogString() + "' is too large to be cached");
+  }
+  dest.reserve(dest.size() + 2 + serialized.size());
+  dest.append(1, static_cast<char>(serialized.size() >> 8));
+  dest.append(1, static_cast<char>(serialized.size() & 0xff));
+  dest.append(serialized);
+}
+
+/* calls func(data, len) for each of the record contents serialized in serialized */
+template<typename T> static void forEachSerializedContent(const std::string& serialized, const T& func)
+{
+  size_t pos = 0;
+  while (pos + 2 <= serialized.size()) {
+    const uint16_t len = (static_cast<uint8_t>(serialized.at(pos)) << 8) + static_cast<uint8_t>(serialized.at(pos + 1));
+    pos += 2;
+    if (pos + len > serialized.size()) {
+      throw std::runtime_error("Invalid serialized content in the record cache");
+    }
+    func(serialized.data() + pos, len);
+    pos += len;
+  }
+}
+
+static size_t countSerializedContents(const std::string& serialized)
+{
+  size_t count = 0;
+  forEachSerializedContent(serialized, [&count](const char*, uint16_t) { count++; });
+  return count;
+}
+
+static std::shared_ptr<DNSRecordContent> getSerializedContent(const DNSName& qname, uint16_t qtype, const char* data, uint16_t len)
+{
+  /* the content is in uncompressed wire format, so we can parse it directly without building a packet around it */
+  const vector<uint8_t> content(data, data + len);
+  PacketReader pr(content);
+  DNSRecord dr;
+  dr.d_name = qname;
+  dr.d_type = qtype;
+  dr.d_class = QClass::IN;
+  dr.d_clen = len;
+  dr.d_place = DNSResourceRecord::ANSWER;
+  return DNSRecordContent::mastermake(dr, pr);
+}
+
+/* returns the number of bytes allocated on the heap by str, if any */
+template<typename T> static size_t getHeapSize(const T& str)
+{
+  static const size_t inlineCapacity = T().capacity();
+  return str.capacity() > inlineCapacity ? str.capacity() + 1 : 0;
+}
+
 // this function is too slow to poll!
-unsigned int MemRecursorCache::bytes() const
+uint64_t MemRecursorCache::bytes() const
 {
-  unsigned int ret=0;
+  /* each element of a multi_index container with an ordered and a sequenced
+     index lives in a node holding 3 pointers for the first one and 2 for the
+     second one */
+  static const size_t nodeOverhead = 5 * sizeof(void*);
+  uint64_t ret = 0;
+
+  for (const auto& entry : d_cache) {
+    ret += sizeof(entry) + nodeOverhead;
+    ret += getHeapSize(entry.d_qname.getStorage());
+    ret += getHeapSize(entry.d_records);
+    ret += getHeapSize(entry.d_signatures);
+    ret += entry.d_authorityRecs.capacity() * sizeof(std::shared_ptr<DNSRecord>);
+    for (const auto& record : entry.d_authorityRecs) {
+      ret += sizeof(*record) + getHeapSize(record->d_name.getStorage());
+    }
+  }
 
-  for(cache_t::const_iterator i=d_cache.begin(); i!=d_cache.end(); ++i) {
-    ret+=sizeof(struct CacheEntry);
-    ret+=(unsigned int)i->d_qname.toString().length();
-    for(auto j=i->d_records.begin(); j!= i->d_records.end(); ++j)
-      ret+= sizeof(*j); // XXX WRONG we don't know the stored size! j->size();
+  for (const auto& entry : d_ecsIndex) {
+    ret += sizeof(entry) + nodeOverhead;
+    ret += getHeapSize(entry.d_qname.getStorage());
   }
+
   return ret;
 }
 
-int32_t MemRecursorCache::handleHit(cache_t::iterator entry, const DNSName& qname, const ComboAddress& who, vector<DNSRecord>* res, vector<std::shared_ptr<RRSIGRecordContent>>* signatures, std::vector<std::shared_ptr<DNSRecord>>* authorityRecs, bool* variable, vState* state, bool* wasAuth)
+int32_t MemRecursorCache::handleHit(time_t now, cache_t::iterator entry, const DNSName& qname, const ComboAddress& who, vector<DNSRecord>* res, vector<std::shared_ptr<RRSIGRecordContent>>* signatures, std::vector<std::shared_ptr<DNSRecord>>* authorityRecs, bool* variable, vState* state, bool* wasAuth)
 {
   int32_t ttd = entry->d_ttd;
 
+  if (entry->isStale(now)) {
+    /* we are serving a stale entry, hand it out with a short TTL */
+    ttd = now + s_staleAnswerTTL;
+    staleHits++;
+  }
+
   if(variable && !entry->d_netmask.empty()) {
     *variable = true;
   }
 
   // cerr<<"Looking at "<<entry->d_records.size()<<" records for this name"<<endl;
   if (res) {
-    for(const auto& k : entry->d_records) {
+    forEachSerializedContent(entry->d_records, [&](const char* data, uint16_t len) {
       DNSRecord dr;
       dr.d_name = qname;
       dr.d_type = entry->d_qtype;
       dr.d_class = QClass::IN;
-      dr.d_content = k;
-      dr.d_ttl = static_cast<uint32_t>(entry->d_ttd);
+      dr.d_content = getSerializedContent(entry->d_qname, entry->d_qtype, data, len);
+      dr.d_ttl = static_cast<uint32_t>(ttd);
       dr.d_place = DNSResourceRecord::ANSWER;
-      res->push_back(dr);
-    }
+      res->push_back(std::move(dr));
+    });
   }
 
   if(signatures) { // if you do an ANY lookup you are hosed XXXX
-    *signatures = entry->d_signatures;
+    signatures->clear();
+    forEachSerializedContent(entry->d_signatures, [&](const char* data, uint16_t len) {
+      auto signature = std::dynamic_pointer_cast<RRSIGRecordContent>(getSerializedContent(entry->d_qname, QType::RRSIG, data, len));
+      if (signature) {
+        signatures->push_back(signature);
+      }
+    });
   }
 
   if(authorityRecs) {
@@ -81,7 +175,7 @@ int32_t MemRecursorCache::handleHit(cache_t::iterator entry, const DNSName& qnam
   return ttd;
 }
 
-MemRecursorCache::cache_t::const_iterator MemRecursorCache::getEntryUsingECSIndex(time_t now, const DNSName &qname, uint16_t qtype, bool requireAuth, const ComboAddress& who)
+MemRecursorCache::cache_t::const_iterator MemRecursorCache::getEntryUsingECSIndex(time_t now, const DNSName &qname, uint16_t qtype, bool requireAuth, const ComboAddress& who, bool serveStale)
 {
   auto ecsIndexKey = tie(qname, qtype);
   auto ecsIndex = d_ecsIndex.find(ecsIndexKey);
@@ -106,13 +200,18 @@ MemRecursorCache::cache_t::const_iterator MemRecursorCache::getEntryUsingECSInde
         continue;
       }
 
-      if (entry->d_ttd > now) {
+      if (entry->d_ttd > now || (serveStale && entry->isServableStale(now))) {
         if (!requireAuth || entry->d_auth) {
           return entry;
         }
         /* we need auth data and the best match is not authoritative */
         return d_cache.end();
       }
+      else if (entry->isServableStale(now)) {
+        /* keep it in the index for when we are asked for stale entries, but we can't look past it
+           for a less specific one, so try the generic entry */
+        break;
+      }
       else {
         /* this netmask-specific entry has expired */
         moveCacheItemToFront(d_cache, entry);
@@ -129,7 +228,7 @@ MemRecursorCache::cache_t::const_iterator MemRecursorCache::getEntryUsingECSInde
   auto key = boost::make_tuple(qname, qtype, Netmask());
   auto entry = d_cache.find(key);
   if (entry != d_cache.end()) {
-    if (entry->d_ttd > now) {
+    if (entry->d_ttd > now || (serveStale && entry->isServableStale(now))) {
       if (!requireAuth || entry->d_auth) {
         return entry;
       }
@@ -169,7 +268,7 @@ bool MemRecursorCache::entryMatches(cache_t::const_iterator& entry, uint16_t qt,
 }
 
 // returns -1 for no hits
-int32_t MemRecursorCache::get(time_t now, const DNSName &qname, const QType& qt, bool requireAuth, vector<DNSRecord>* res, const ComboAddress& who, vector<std::shared_ptr<RRSIGRecordContent>>* signatures, std::vector<std::shared_ptr<DNSRecord>>* authorityRecs, bool* variable, vState* state, bool* wasAuth)
+int32_t MemRecursorCache::get(time_t now, const DNSName &qname, const QType& qt, bool requireAuth, vector<DNSRecord>* res, const ComboAddress& who, vector<std::shared_ptr<RRSIGRecordContent>>* signatures, std::vector<std::shared_ptr<DNSRecord>>* authorityRecs, bool* variable, vState* state, bool* wasAuth, bool serveStale)
 {
   time_t ttd=0;
   //  cerr<<"looking up "<< qname<<"|"+qt.getName()<<"\n";
@@ -184,13 +283,13 @@ int32_t MemRecursorCache::get(time_t now, const DNSName &qname, const QType& qt,
     if (qtype == QType::ADDR) {
       int32_t ret = -1;
 
-      auto entryA = getEntryUsingECSIndex(now, qname, QType::A, requireAuth, who);
+      auto entryA = getEntryUsingECSIndex(now, qname, QType::A, requireAuth, who, serveStale);
       if (entryA != d_cache.end()) {
-        ret = handleHit(entryA, qname, who, res, signatures, authorityRecs, variable, state, wasAuth);
+        ret = handleHit(now, entryA, qname, who, res, signatures, authorityRecs, variable, state, wasAuth);
       }
-      auto entryAAAA = getEntryUsingECSIndex(now, qname, QType::AAAA, requireAuth, who);
+      auto entryAAAA = getEntryUsingECSIndex(now, qname, QType::AAAA, requireAuth, who, serveStale);
       if (entryAAAA != d_cache.end()) {
-        int32_t ttdAAAA = handleHit(entryA, qname, who, res, signatures, authorityRecs, variable, state, wasAuth);
+        int32_t ttdAAAA = handleHit(now, entryA, qname, who, res, signatures, authorityRecs, variable, state, wasAuth);
         if (ret > 0) {
           ret = std::min(ret, ttdAAAA);
         } else {
@@ -200,9 +299,9 @@ int32_t MemRecursorCache::get(time_t now, const DNSName &qname, const QType& qt,
       return ret > 0 ? static_cast<int32_t>(ret-now) : ret;
     }
     else {
-      auto entry = getEntryUsingECSIndex(now, qname, qtype, requireAuth, who);
+      auto entry = getEntryUsingECSIndex(now, qname, qtype, requireAuth, who, serveStale);
       if (entry != d_cache.end()) {
-        return static_cast<int32_t>(handleHit(entry, qname, who, res, signatures, authorityRecs, variable, state, wasAuth) - now);
+        return static_cast<int32_t>(handleHit(now, entry, qname, who, res, signatures, authorityRecs, variable, state, wasAuth) - now);
       }
       return -1;
     }
@@ -213,7 +312,7 @@ int32_t MemRecursorCache::get(time_t now, const DNSName &qname, const QType& qt,
   if(entries.first!=entries.second) {
     for(cache_t::const_iterator i=entries.first; i != entries.second; ++i) {
 
-      if (i->d_ttd <= now) {
+      if (i->d_ttd <= now && !(serveStale && i->isServableStale(now))) {
         moveCacheItemToFront(d_cache, i);
         continue;
       }
@@ -221,7 +320,7 @@ int32_t MemRecursorCache::get(time_t now, const DNSName &qname, const QType& qt,
       if (!entryMatches(i, qtype, requireAuth, who))
         continue;
 
-      ttd = handleHit(i, qname, who, res, signatures, authorityRecs, variable, state, wasAuth);
+      ttd = handleHit(now, i, qname, who, res, signatures, authorityRecs, variable, state, wasAuth);
 
       if(qt.getCode()!=QType::ANY && qt.getCode()!=QType::ADDR) // normally if we have a hit, we are done
         break;
@@ -244,7 +343,7 @@ bool MemRecursorCache::attemptToRefreshNSTTL(const QType& qt, const vector<DNSRe
     //~ cerr<<"Not NS record"<<endl;
     return false;
   }
-  if(content.size()!=stored.d_records.size()) {
+  if(content.size()!=countSerializedContents(stored.d_records)) {
     //~ cerr<<"Not equal number of records"<<endl;
     return false;
   }
@@ -269,24 +368,34 @@ void MemRecursorCache::replace(time_t now, const DNSName &qname, const QType& qt
   bool isNew = false;
   cache_t::iterator stored = d_cache.find(key);
   if (stored == d_cache.end()) {
-    stored = d_cache.insert(CacheEntry(key, CacheEntry::records_t(), auth)).first;
-    isNew = true;
-
     /* don't bother building an ecsIndex if we don't have any netmask-specific entries */
     if (ednsmask && !ednsmask->empty()) {
       auto ecsIndexKey = boost::make_tuple(qname, qt.getCode());
       auto ecsIndex = d_ecsIndex.find(ecsIndexKey);
+      if (ecsIndex != d_ecsIndex.end() && s_maxECSEntriesPerName > 0 && ecsIndex->size() >= s_maxECSEntriesPerName) {
+        /* make room for the new entry, and for a few more so that we don't have to do that again on every insertion */
+        evictECSEntries(ecsIndex, now, ecsIndex->size() - s_maxECSEntriesPerName + 1 + s_maxECSEntriesPerName / 8);
+        /* the index entry might have been removed if we evicted everything */
+        ecsIndex = d_ecsIndex.find(ecsIndexKey);
+      }
       if (ecsIndex == d_ecsIndex.end()) {
         ecsIndex = d_ecsIndex.insert(ECSIndexEntry(qname, qt.getCode())).first;
       }
       ecsIndex->addMask(*ednsmask);
+      d_ecsEntries++;
     }
+
+    stored = d_cache.insert(CacheEntry(key, auth)).first;
+    isNew = true;
   }
 
   time_t maxTTD=std::numeric_limits<time_t>::max();
   CacheEntry ce=*stored; // this is a COPY
   ce.d_qtype=qt.getCode();
-  ce.d_signatures=signatures;
+  ce.d_signatures.clear();
+  for (const auto& signature : signatures) {
+    addSerializedContent(ce.d_signatures, qname, signature);
+  }
   ce.d_authorityRecs=authorityRecs;
   ce.d_state=state;
   
@@ -325,7 +434,7 @@ void MemRecursorCache::replace(time_t now, const DNSName &qname, const QType& qt
        prior to calling this function, so the TTL actually holds a TTD. */
     ce.d_ttd=min(maxTTD, static_cast<time_t>(i.d_ttl));   // XXX this does weird things if TTLs differ in the set
     //    cerr<<"To store: "<<i.d_content->getZoneRepresentation()<<" with ttl/ttd "<<i.d_ttl<<", capped at: "<<maxTTD<<endl;
-    ce.d_records.push_back(i.d_content);
+    addSerializedContent(ce.d_records, qname, i.d_content);
     // there was code here that did things with TTL and auth. Unsure if it was good. XXX
   }
 
@@ -353,6 +462,9 @@ int MemRecursorCache::doWipeCache(const DNSName& name, bool sub, uint16_t qtype)
     }
     for(cache_t::const_iterator i=range.first; i != range.second; ) {
       count++;
+      if (!i->d_netmask.empty()) {
+        d_ecsEntries--;
+      }
       d_cache.erase(i++);
     }
     for(auto i = ecsIndexRange.first; i != ecsIndexRange.second; ) {
@@ -365,6 +477,9 @@ int MemRecursorCache::doWipeCache(const DNSName& name, bool sub, uint16_t qtype)
 	break;
       if(iter->d_qtype == qtype || qtype == 0xffff) {
 	count++;
+        if (!iter->d_netmask.empty()) {
+          d_ecsEntries--;
+        }
 	d_cache.erase(iter++);
       }
       else 
@@ -417,7 +532,7 @@ bool MemRecursorCache::updateValidationStatus(time_t now, const DNSName &qname,
   bool updated = false;
   uint16_t qtype = qt.getCode();
   if (qtype != QType::ANY && qtype != QType::ADDR && !d_ecsIndex.empty()) {
-    auto entry = getEntryUsingECSIndex(now, qname, qtype, requireAuth, who);
+    auto entry = getEntryUsingECSIndex(now, qname, qtype, requireAuth, who, false);
     if (entry == d_cache.end()) {
       return false;
     }
@@ -453,34 +568,267 @@ uint64_t MemRecursorCache::doDump(int fd)
 
   uint64_t count=0;
   time_t now=time(0);
-  for(const auto i : sidx) {
-    for(const auto j : i.d_records) {
+  for(const auto& i : sidx) {
+    forEachSerializedContent(i.d_records, [&](const char* data, uint16_t len) {
       count++;
       try {
-        fprintf(fp, "%s %" PRId64 " IN %s %s ; (%s) auth=%i %s\n", i.d_qname.toString().c_str(), static_cast<int64_t>(i.d_ttd - now), DNSRecordContent::NumberToType(i.d_qtype).c_str(), j->getZoneRepresentation().c_str(), vStates[i.d_state], i.d_auth, i.d_netmask.empty() ? "" : i.d_netmask.toString().c_str());
+        fprintf(fp, "%s %" PRId64 " IN %s %s ; (%s) auth=%i %s\n", i.d_qname.toString().c_str(), static_cast<int64_t>(i.d_ttd - now), DNSRecordContent::NumberToType(i.d_qtype).c_str(), getSerializedContent(i.d_qname, i.d_qtype, data, len)->getZoneRepresentation().c_str(), vStates[i.d_state], i.d_auth, i.d_netmask.empty() ? "" : i.d_netmask.toString().c_str());
       }
       catch(...) {
         fprintf(fp, "; error printing '%s'\n", i.d_qname.empty() ? "EMPTY" : i.d_qname.toString().c_str());
       }
-    }
-    for(const auto &sig : i.d_signatures) {
+    });
+    forEachSerializedContent(i.d_signatures, [&](const char* data, uint16_t len) {
       count++;
       try {
-        fprintf(fp, "%s %" PRId64 " IN RRSIG %s ; %s\n", i.d_qname.toString().c_str(), static_cast<int64_t>(i.d_ttd - now), sig->getZoneRepresentation().c_str(), i.d_netmask.empty() ? "" : i.d_netmask.toString().c_str());
+        fprintf(fp, "%s %" PRId64 " IN RRSIG %s ; %s\n", i.d_qname.toString().c_str(), static_cast<int64_t>(i.d_ttd - now), getSerializedContent(i.d_qname, QType::RRSIG, data, len)->getZoneRepresentation().c_str(), i.d_netmask.empty() ? "" : i.d_netmask.toString().c_str());
       }
       catch(...) {
         fprintf(fp, "; error printing '%s'\n", i.d_qname.empty() ? "EMPTY" : i.d_qname.toString().c_str());
       }
-    }
+    });
   }
   fclose(fp);
   return count;
 }
 
+/*!
+ * Writes all the entries that have not expired yet (or can still be served stale)
+ * to writer, least recently used first so that loading them back preserves the order.
+ */
+uint64_t MemRecursorCache::saveSnapshot(CacheSnapshotWriter& writer) const
+{
+  const auto& sidx = d_cache.get<1>();
+  const time_t now = time(nullptr);
+  uint64_t count = 0;
+
+  for (const auto& entry : sidx) {
+    /* keep the entries that could still be served stale */
+    if (entry.d_ttd + s_maxStaleTTL <= now || entry.d_records.empty()) {
+      continue;
+    }
+
+    writer.writeTag(CacheSnapshotTag::Record);
+    writer.writeName(entry.d_qname);
+    writer.writeU16(entry.d_qtype);
+    writer.writeString(entry.d_netmask.empty() ? "" : entry.d_netmask.toString());
+    writer.writeU8(entry.d_state);
+    writer.writeU64(entry.d_ttd);
+    writer.writeU8(entry.d_auth);
+
+    /* the contents are already serialized */
+    auto writeContent = [&writer](const char* data, uint16_t len) {
+      writer.writeString(std::string(data, len));
+    };
+    writer.writeU32(countSerializedContents(entry.d_records));
+    forEachSerializedContent(entry.d_records, writeContent);
+    writer.writeU32(countSerializedContents(entry.d_signatures));
+    forEachSerializedContent(entry.d_signatures, writeContent);
+    writer.writeU32(entry.d_authorityRecs.size());
+    for (const auto& record : entry.d_authorityRecs) {
+      writer.writeRecord(*record);
+    }
+    count++;
+  }
+
+  return count;
+}
+
+/*!
+ * Reads one entry written by saveSnapshot() from reader, and inserts it
+ * unless it has expired in the meantime.
+ *
+ * \return true if the entry has been inserted
+ */
+bool MemRecursorCache::loadSnapshotEntry(CacheSnapshotReader& reader, time_t now)
+{
+  const DNSName qname = reader.readName();
+  const uint16_t qtype = reader.readU16();
+  const std::string netmask = reader.readString();
+  uint8_t state = reader.readU8();
+  const time_t ttd = reader.readU64();
+  const bool auth = reader.readU8();
+
+  vector<DNSRecord> content;
+  uint32_t count = reader.readU32();
+  for (uint32_t idx = 0; idx < count; idx++) {
+    DNSRecord dr;
+    dr.d_name = qname;
+    dr.d_type = qtype;
+    dr.d_class = QClass::IN;
+    dr.d_ttl = ttd;
+    dr.d_place = DNSResourceRecord::ANSWER;
+    dr.d_content = reader.readContent(qname, qtype);
+    content.push_back(std::move(dr));
+  }
+
+  vector<shared_ptr<RRSIGRecordContent>> signatures;
+  count = reader.readU32();
+  for (uint32_t idx = 0; idx < count; idx++) {
+    auto signature = std::dynamic_pointer_cast<RRSIGRecordContent>(reader.readContent(qname, QType::RRSIG));
+    if (signature) {
+      signatures.push_back(signature);
+    }
+  }
+
+  std::vector<std::shared_ptr<DNSRecord>> authorityRecs;
+  count = reader.readU32();
+  for (uint32_t idx = 0; idx < count; idx++) {
+    authorityRecs.push_back(std::make_shared<DNSRecord>(reader.readRecord()));
+  }
+
+  if (content.empty() || ttd + s_maxStaleTTL <= now) {
+    return false;
+  }
+
+  if (state > TA) {
+    state = Indeterminate;
+  }
+
+  boost::optional<Netmask> ednsmask;
+  if (!netmask.empty()) {
+    ednsmask = Netmask(netmask);
+  }
+
+  replace(now, qname, QType(qtype), content, signatures, authorityRecs, auth, ednsmask, static_cast<vState>(state));
+  return true;
+}
+
+/* removes the toRemove ECS-specific entries of that (qname, qtype) that are the least
+   likely to be useful: expired ones first, then the ones with the narrowest scope,
+   then the ones expiring first */
+void MemRecursorCache::evictECSEntries(ecsIndex_t::iterator ecsIndex, time_t now, size_t toRemove)
+{
+  struct Candidate
+  {
+    cache_t::iterator d_entry;
+    Netmask d_netmask;
+    time_t d_ttd;
+    bool d_expired;
+  };
+
+  const DNSName qname = ecsIndex->d_qname;
+  const uint16_t qtype = ecsIndex->d_qtype;
+
+  std::vector<Candidate> candidates;
+  candidates.reserve(ecsIndex->size());
+  for (const auto& node : ecsIndex->d_nmt) {
+    auto entry = d_cache.find(boost::make_tuple(qname, qtype, node->first));
+    if (entry == d_cache.end()) {
+      /* the index is not up-to-date, that one is free */
+      candidates.push_back({entry, node->first, 0, true});
+    }
+    else {
+      candidates.push_back({entry, node->first, entry->d_ttd, entry->d_ttd <= now});
+    }
+  }
+
+  toRemove = std::min(toRemove, candidates.size());
+  std::partial_sort(candidates.begin(), candidates.begin() + toRemove, candidates.end(), [](const Candidate& a, const Candidate& b) {
+      if (a.d_expired != b.d_expired) {
+        return a.d_expired;
+      }
+      if (a.d_netmask.getBits() != b.d_netmask.getBits()) {
+        return a.d_netmask.getBits() > b.d_netmask.getBits();
+      }
+      return a.d_ttd < b.d_ttd;
+    });
+
+  for (size_t idx = 0; idx < toRemove; idx++) {
+    const auto& candidate = candidates.at(idx);
+    if (candidate.d_entry != d_cache.end()) {
+      /* takes care of the ECS index */
+      preRemoval(*candidate.d_entry);
+      d_cache.erase(candidate.d_entry);
+      ecsEvictions++;
+    }
+    else {
+      ecsIndex->removeNetmask(candidate.d_netmask);
+    }
+  }
+
+  ecsIndex = d_ecsIndex.find(tie(qname, qtype));
+  if (ecsIndex != d_ecsIndex.end() && ecsIndex->isEmpty()) {
+    d_ecsIndex.erase(ecsIndex);
+  }
+}
+
+/* Brings the number of ECS-specific entries down to keep, if possible, by removing
+   the ones with the narrowest scope across all names. Only the entries present in
+   the ECS index are considered, the expired ones that have already been removed from
+   it are at the front of the expunge queue and will be removed by pruneCollection(). */
+void MemRecursorCache::pruneECSEntries(size_t keep)
+{
+  if (d_ecsEntries <= keep) {
+    return;
+  }
+
+  /* count the entries for each prefix length, so we know how far down we need to go */
+  std::vector<size_t> byBits(129, 0);
+  size_t indexed = 0;
+  for (const auto& ecsIndex : d_ecsIndex) {
+    for (const auto& node : ecsIndex.d_nmt) {
+      byBits.at(node->first.getBits())++;
+      indexed++;
+    }
+  }
+
+  size_t toRemove = std::min(d_ecsEntries - keep, indexed);
+  if (toRemove == 0) {
+    return;
+  }
+
+  /* every entry with more than 'threshold' bits goes, and 'atThreshold' of those with exactly 'threshold' bits */
+  size_t threshold = byBits.size() - 1;
+  size_t narrower = 0;
+  while (narrower + byBits.at(threshold) < toRemove) {
+    narrower += byBits.at(threshold);
+    threshold--;
+  }
+  size_t atThreshold = toRemove - narrower;
+
+  std::vector<boost::tuple<DNSName, uint16_t, Netmask>> victims;
+  victims.reserve(toRemove);
+  for (const auto& ecsIndex : d_ecsIndex) {
+    for (const auto& node : ecsIndex.d_nmt) {
+      const size_t bits = node->first.getBits();
+      if (bits > threshold || (bits == threshold && atThreshold > 0)) {
+        if (bits == threshold) {
+          atThreshold--;
+        }
+        victims.push_back(boost::make_tuple(ecsIndex.d_qname, ecsIndex.d_qtype, node->first));
+      }
+    }
+  }
+
+  for (const auto& victim : victims) {
+    auto entry = d_cache.find(victim);
+    if (entry != d_cache.end()) {
+      preRemoval(*entry);
+      d_cache.erase(entry);
+      ecsEvictions++;
+    }
+    else {
+      auto ecsIndex = d_ecsIndex.find(tie(victim.get<0>(), victim.get<1>()));
+      if (ecsIndex != d_ecsIndex.end()) {
+        ecsIndex->removeNetmask(victim.get<2>());
+        if (ecsIndex->isEmpty()) {
+          d_ecsIndex.erase(ecsIndex);
+        }
+      }
+    }
+  }
+}
+
 void MemRecursorCache::doPrune(unsigned int keep)
 {
   d_cachecachevalid=false;
 
+  /* trim the ECS-specific entries first, so that they don't push everything else out */
+  if (s_maxECSEntries > 0) {
+    pruneECSEntries(s_maxECSEntries);
+  }
+
   pruneCollection(*this, d_cache, keep);
 }
 
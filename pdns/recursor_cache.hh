@@ -46,46 +46,84 @@
 #include "namespaces.hh"
 using namespace ::boost::multi_index;
 
+class CacheSnapshotReader;
+class CacheSnapshotWriter;
+
 class MemRecursorCache : public boost::noncopyable //  : public RecursorCache
 {
 public:
   MemRecursorCache() : d_cachecachevalid(false)
   {
-    cacheHits = cacheMisses = 0;
+    cacheHits = cacheMisses = ecsEvictions = staleHits = 0;
   }
   unsigned int size() const;
-  unsigned int bytes() const;
+  uint64_t bytes() const;
   size_t ecsIndexSize() const;
+  size_t ecsEntriesCount() const;
 
-  int32_t get(time_t, const DNSName &qname, const QType& qt, bool requireAuth, vector<DNSRecord>* res, const ComboAddress& who, vector<std::shared_ptr<RRSIGRecordContent>>* signatures=nullptr, std::vector<std::shared_ptr<DNSRecord>>* authorityRecs=nullptr, bool* variable=nullptr, vState* state=nullptr, bool* wasAuth=nullptr);
+  int32_t get(time_t, const DNSName &qname, const QType& qt, bool requireAuth, vector<DNSRecord>* res, const ComboAddress& who, vector<std::shared_ptr<RRSIGRecordContent>>* signatures=nullptr, std::vector<std::shared_ptr<DNSRecord>>* authorityRecs=nullptr, bool* variable=nullptr, vState* state=nullptr, bool* wasAuth=nullptr, bool serveStale=false);
 
   void replace(time_t, const DNSName &qname, const QType& qt,  const vector<DNSRecord>& content, const vector<shared_ptr<RRSIGRecordContent>>& signatures, const std::vector<std::shared_ptr<DNSRecord>>& authorityRecs, bool auth, boost::optional<Netmask> ednsmask=boost::none, vState state=Indeterminate);
 
   void doPrune(unsigned int keep);
   uint64_t doDump(int fd);
+  uint64_t saveSnapshot(CacheSnapshotWriter& writer) const;
+  bool loadSnapshotEntry(CacheSnapshotReader& reader, time_t now);
 
   int doWipeCache(const DNSName& name, bool sub, uint16_t qtype=0xffff);
   bool doAgeCache(time_t now, const DNSName& name, uint16_t qtype, uint32_t newTTL);
   bool updateValidationStatus(time_t now, const DNSName &qname, const QType& qt, const ComboAddress& who, bool requireAuth, vState newState);
 
   uint64_t cacheHits, cacheMisses;
+  /* number of ECS-specific entries removed because of s_maxECSEntriesPerName or s_maxECSEntries */
+  uint64_t ecsEvictions;
+  /* number of stale entries handed out by get() */
+  uint64_t staleHits;
+
+  /* Expired entries are kept for s_maxStaleTTL seconds past their TTD, so that
+     they can still be served (with a TTL of s_staleAnswerTTL) when resolution
+     fails. 0 disables serve-stale. */
+  static uint32_t s_maxStaleTTL;
+  static uint32_t s_staleAnswerTTL;
+  /* Maximum number of ECS-specific entries for a given (qname, qtype), and in
+     the whole cache (enforced by doPrune()). When one of these limits is reached,
+     the entries with the narrowest scope go first, since they are the least
+     likely to be reused. 0 means no limit. */
+  static uint32_t s_maxECSEntriesPerName;
+  static uint64_t s_maxECSEntries;
 
 private:
 
   struct CacheEntry
   {
-    CacheEntry(const boost::tuple<DNSName, uint16_t, Netmask>& key, const vector<shared_ptr<DNSRecordContent>>& records, bool auth) : 
-      d_records(records), d_qname(key.get<0>()), d_netmask(key.get<2>()), d_state(Indeterminate), d_ttd(0), d_qtype(key.get<1>()), d_auth(auth)
+    CacheEntry(const boost::tuple<DNSName, uint16_t, Netmask>& key, bool auth) :
+      d_qname(key.get<0>()), d_netmask(key.get<2>()), d_state(Indeterminate), d_ttd(0), d_qtype(key.get<1>()), d_auth(auth)
     {}
 
-    typedef vector<std::shared_ptr<DNSRecordContent>> records_t;
     time_t getTTD() const
     {
-      return d_ttd;
+      /* used by the cleaner, expired entries are kept as long as we might serve them stale */
+      return d_ttd + s_maxStaleTTL;
+    }
+
+    bool isStale(time_t now) const
+    {
+      return d_ttd <= now;
     }
 
-    records_t d_records;
-    std::vector<std::shared_ptr<RRSIGRecordContent>> d_signatures;
+    bool isServableStale(time_t now) const
+    {
+      return s_maxStaleTTL > 0 && isStale(now) && getTTD() > now;
+    }
+
+    /* The contents of the records and of their signatures are not kept decoded,
+       but serialized back to back in a single string: for each record, its length
+       on 16 bits followed by its content in uncompressed wire format. Most RRsets
+       are a few small records, which then fit in the string itself instead of
+       needing a shared pointer, a control block and a decoded object each.
+       They are decoded when needed by a lookup. */
+    std::string d_records;
+    std::string d_signatures;
     std::vector<std::shared_ptr<DNSRecord>> d_authorityRecs;
     DNSName d_qname;
     Netmask d_netmask;
@@ -139,6 +177,11 @@ private:
       return d_nmt.empty();
     }
 
+    size_t size() const
+    {
+      return d_nmt.size();
+    }
+
     mutable NetmaskTree<bool> d_nmt;
     DNSName d_qname;
     uint16_t d_qtype;
@@ -176,13 +219,17 @@ private:
   ecsIndex_t d_ecsIndex;
   pair<cache_t::iterator, cache_t::iterator> d_cachecache;
   DNSName d_cachedqname;
+  /* number of ECS-specific entries in d_cache, expired or not */
+  size_t d_ecsEntries{0};
   bool d_cachecachevalid;
 
   bool attemptToRefreshNSTTL(const QType& qt, const vector<DNSRecord>& content, const CacheEntry& stored);
   bool entryMatches(cache_t::const_iterator& entry, uint16_t qt, bool requireAuth, const ComboAddress& who);
   std::pair<cache_t::const_iterator, cache_t::const_iterator> getEntries(const DNSName &qname, const QType& qt);
-  cache_t::const_iterator getEntryUsingECSIndex(time_t now, const DNSName &qname, uint16_t qtype, bool requireAuth, const ComboAddress& who);
-  int32_t handleHit(cache_t::iterator entry, const DNSName& qname, const ComboAddress& who, vector<DNSRecord>* res, vector<std::shared_ptr<RRSIGRecordContent>>* signatures, std::vector<std::shared_ptr<DNSRecord>>* authorityRecs, bool* variable, vState* state, bool* wasAuth);
+  cache_t::const_iterator getEntryUsingECSIndex(time_t now, const DNSName &qname, uint16_t qtype, bool requireAuth, const ComboAddress& who, bool serveStale);
+  void evictECSEntries(ecsIndex_t::iterator ecsIndex, time_t now, size_t toRemove);
+  void pruneECSEntries(size_t keep);
+  int32_t handleHit(time_t now, cache_t::iterator entry, const DNSName& qname, const ComboAddress& who, vector<DNSRecord>* res, vector<std::shared_ptr<RRSIGRecordContent>>* signatures, std::vector<std::shared_ptr<DNSRecord>>* authorityRecs, bool* variable, vState* state, bool* wasAuth);
 
 public:
   void preRemoval(const CacheEntry& entry)
@@ -191,6 +238,8 @@ public:
       return;
     }
 
+    d_ecsEntries--;
+
     auto key = tie(entry.d_qname, entry.d_qtype);
     auto ecsIndexEntry = d_ecsIndex.find(key);
     if (ecsIndexEntry != d_ecsIndex.end()) {
@@ -0,0 +1,427 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include "aggressive_nsec.hh"
+#include "base32.hh"
+#include "cachecleaner.hh"
+#include "dnssecinfra.hh"
+#include "misc.hh"
+
+uint64_t AggressiveNSECCache::s_maxEntries;
+
+/*!
+ * Stores the validated NSEC or NSEC3 records found in denial, along with the
+ * SOA of the zone they belong to. Records not signed by zone, NSEC records
+ * synthesized from a wildcard and opt-out NSEC3 records are skipped.
+ *
+ * \param zone   The name of the zone that sent the denial (signer of the records)
+ * \param soa    The SOA record of that zone and its RRSIGs
+ * \param denial The NSEC(3) records and their RRSIGs
+ * \param ttd    Timestamp when these entries should die
+ */
+void AggressiveNSECCache::insert(const DNSName& zone, const recordsAndSignatures& soa, const recordsAndSignatures& denial, uint32_t ttd)
+{
+  if (soa.records.empty() || soa.signatures.empty()) {
+    return;
+  }
+
+  for (const auto& rec : denial.records) {
+    if ((rec.d_type != QType::NSEC && rec.d_type != QType::NSEC3) || !rec.d_name.isPartOf(zone)) {
+      continue;
+    }
+
+    std::vector<DNSRecord> signatures;
+    bool wildcardExpanded = false;
+    for (const auto& sig : denial.signatures) {
+      auto rrsig = getRR<RRSIGRecordContent>(sig);
+      if (!rrsig || sig.d_name != rec.d_name || rrsig->d_type != rec.d_type || rrsig->d_signer != zone) {
+        continue;
+      }
+      if (rrsig->d_labels < rec.d_name.countLabels()) {
+        wildcardExpanded = true;
+      }
+      signatures.push_back(sig);
+    }
+
+    if (signatures.empty() || wildcardExpanded) {
+      continue;
+    }
+
+    bool nsec3 = rec.d_type == QType::NSEC3;
+    std::string salt;
+    uint16_t iterations = 0;
+    if (nsec3) {
+      auto content = getRR<NSEC3RecordContent>(rec);
+      /* opt-out NSEC3 records do not prove that an insecure delegation does not exist */
+      if (!content || (content->d_flags & 1) || rec.d_name.countLabels() != zone.countLabels() + 1) {
+        continue;
+      }
+      salt = content->d_salt;
+      iterations = content->d_iterations;
+    }
+    else if (!getRR<NSECRecordContent>(rec)) {
+      continue;
+    }
+
+    auto zoneIt = d_zones.find(zone);
+    if (zoneIt == d_zones.end()) {
+      zoneIt = d_zones.insert({zone, ZoneInfo()}).first;
+    }
+    else if (zoneIt->second.d_nsec3 != nsec3 || zoneIt->second.d_salt != salt || zoneIt->second.d_iterations != iterations) {
+      /* the zone switched from NSEC to NSEC3 or the NSEC3 parameters changed,
+         our existing entries are now useless */
+      eraseZone(zone);
+    }
+
+    ZoneInfo& zi = zoneIt->second;
+    zi.d_soa = soa;
+    zi.d_ttd = ttd;
+    zi.d_nsec3 = nsec3;
+    zi.d_salt = salt;
+    zi.d_iterations = iterations;
+
+    NSECEntry entry;
+    entry.d_zone = zone;
+    entry.d_owner = rec.d_name;
+    entry.d_record = rec;
+    entry.d_signatures = std::move(signatures);
+    entry.d_ttd = ttd;
+    replacing_insert(d_entries, entry);
+  }
+}
+
+/*!
+ * Finds the entry of zone whose owner name is the closest one preceding or equal to name
+ * in canonical order. If wrap is set and there is no such entry, the last entry of the
+ * zone is returned instead (NSEC3 chains wrap around).
+ */
+bool AggressiveNSECCache::getCovering(time_t now, const DNSName& zone, const DNSName& name, bool wrap, NSECEntry& entry)
+{
+  auto it = d_entries.upper_bound(boost::make_tuple(zone, name));
+  if (it == d_entries.begin() || (--it)->d_zone != zone) {
+    if (!wrap) {
+      return false;
+    }
+    it = d_entries.upper_bound(boost::make_tuple(zone));
+    if (it == d_entries.begin() || (--it)->d_zone != zone) {
+      return false;
+    }
+  }
+
+  if (it->d_ttd <= now) {
+    moveCacheItemToFront(d_entries, it);
+    return false;
+  }
+
+  for (const auto& sig : it->d_signatures) {
+    auto rrsig = getRR<RRSIGRecordContent>(sig);
+    if (!rrsig || !isRRSIGNotExpired(now, rrsig)) {
+      moveCacheItemToFront(d_entries, it);
+      return false;
+    }
+  }
+
+  entry = *it;
+  moveCacheItemToBack(d_entries, it);
+  return true;
+}
+
+static void addEntry(std::vector<AggressiveNSECCache::NSECEntry>& entries, const AggressiveNSECCache::NSECEntry& entry)
+{
+  for (const auto& existing : entries) {
+    if (existing.d_owner == entry.d_owner) {
+      return;
+    }
+  }
+  entries.push_back(entry);
+}
+
+bool AggressiveNSECCache::getNSECDenial(time_t now, const DNSName& zone, const DNSName& qname, std::vector<NSECEntry>& entries, bool& wantsNoDataProof)
+{
+  NSECEntry entry;
+  if (!getCovering(now, zone, qname, false, entry)) {
+    return false;
+  }
+
+  auto nsec = getRR<NSECRecordContent>(entry.d_record);
+  if (!nsec) {
+    return false;
+  }
+
+  /* RFC 6840 section 4.1: an NSEC at a delegation point (or a DNAME) does not say
+     anything about the names below it */
+  if (qname != entry.d_owner && qname.isPartOf(entry.d_owner) &&
+      ((nsec->d_set.count(QType::NS) && !nsec->d_set.count(QType::SOA)) || nsec->d_set.count(QType::DNAME))) {
+    return false;
+  }
+
+  addEntry(entries, entry);
+
+  if (entry.d_owner == qname) {
+    return true;
+  }
+
+  if (nsec->d_next != qname && nsec->d_next.isPartOf(qname)) {
+    /* qname is an empty non-terminal */
+    wantsNoDataProof = true;
+    return true;
+  }
+
+  /* we need the proof that no wildcard could have matched */
+  DNSName closestEncloser = qname.getCommonLabels(entry.d_owner);
+  DNSName nextCommon = qname.getCommonLabels(nsec->d_next);
+  if (nextCommon.countLabels() > closestEncloser.countLabels()) {
+    closestEncloser = nextCommon;
+  }
+
+  NSECEntry wildcard;
+  if (!getCovering(now, zone, g_wildcarddnsname + closestEncloser, false, wildcard)) {
+    return false;
+  }
+  addEntry(entries, wildcard);
+
+  return true;
+}
+
+bool AggressiveNSECCache::getNSEC3Denial(time_t now, const DNSName& zone, const ZoneInfo& zi, const DNSName& qname, std::vector<NSECEntry>& entries)
+{
+  if (g_maxNSEC3Iterations && zi.d_iterations > g_maxNSEC3Iterations) {
+    return false;
+  }
+
+  auto hashedName = [&zone, &zi](const DNSName& name) {
+    return DNSName(toBase32Hex(hashQNameWithSaltCached(zi.d_salt, zi.d_iterations, name))) + zone;
+  };
+
+  NSECEntry entry;
+  DNSName hashed = hashedName(qname);
+  if (getCovering(now, zone, hashed, true, entry) && entry.d_owner == hashed) {
+    addEntry(entries, entry);
+    return true;
+  }
+
+  /* look for the closest encloser */
+  DNSName closestEncloser(qname);
+  DNSName nextCloser(qname);
+  bool found = false;
+  while (closestEncloser != zone && closestEncloser.chopOff()) {
+    hashed = hashedName(closestEncloser);
+    if (getCovering(now, zone, hashed, true, entry) && entry.d_owner == hashed) {
+      found = true;
+      break;
+    }
+    nextCloser = closestEncloser;
+  }
+
+  if (!found) {
+    return false;
+  }
+
+  auto nsec3 = getRR<NSEC3RecordContent>(entry.d_record);
+  if (!nsec3) {
+    return false;
+  }
+
+  /* RFC 6840 section 4.1, the closest encloser can't be a delegation point (or a DNAME) */
+  if ((closestEncloser != zone && nsec3->d_set.count(QType::NS) && !nsec3->d_set.count(QType::SOA)) || nsec3->d_set.count(QType::DNAME)) {
+    return false;
+  }
+  addEntry(entries, entry);
+
+  NSECEntry covering;
+  if (!getCovering(now, zone, hashedName(nextCloser), true, covering)) {
+    return false;
+  }
+  addEntry(entries, covering);
+
+  NSECEntry wildcard;
+  if (!getCovering(now, zone, hashedName(g_wildcarddnsname + closestEncloser), true, wildcard)) {
+    return false;
+  }
+  addEntry(entries, wildcard);
+
+  return true;
+}
+
+/*!
+ * Tries to prove the non-existence of qname|qtype using the cached NSEC(3) records.
+ * If it succeeds, ret is filled with the SOA of the zone (and the NSEC(3) records
+ * and RRSIGs if doDNSSEC is set) and res is set to the right rcode.
+ *
+ * \return true if a secure denial has been synthesized, false otherwise
+ */
+bool AggressiveNSECCache::getDenial(time_t now, const DNSName& qname, const QType& qtype, std::vector<DNSRecord>& ret, int& res, bool doDNSSEC)
+{
+  DNSName zone(qname);
+  /* the DS lives on the parent side */
+  if (qtype == QType::DS && !zone.chopOff()) {
+    return false;
+  }
+
+  auto zoneIt = d_zones.end();
+  do {
+    zoneIt = d_zones.find(zone);
+  }
+  while (zoneIt == d_zones.end() && zone.chopOff());
+
+  if (zoneIt == d_zones.end() || zoneIt->second.d_ttd <= now) {
+    return false;
+  }
+
+  const ZoneInfo& zi = zoneIt->second;
+  std::vector<NSECEntry> entries;
+  bool wantsNoDataProof = false;
+  bool found = zi.d_nsec3 ? getNSEC3Denial(now, zone, zi, qname, entries) : getNSECDenial(now, zone, qname, entries, wantsNoDataProof);
+  if (!found) {
+    return false;
+  }
+
+  cspmap_t csp;
+  uint32_t ttd = zi.d_ttd;
+  for (const auto& entry : entries) {
+    auto& pair = csp[std::make_pair(entry.d_owner, entry.d_record.d_type)];
+    pair.records.push_back(entry.d_record.d_content);
+    for (const auto& sig : entry.d_signatures) {
+      if (auto rrsig = getRR<RRSIGRecordContent>(sig)) {
+        pair.signatures.push_back(rrsig);
+      }
+    }
+    ttd = std::min(ttd, entry.d_ttd);
+  }
+
+  dState denial = ::getDenial(csp, qname, qtype.getCode(), false, wantsNoDataProof);
+  if (denial == NXDOMAIN) {
+    res = RCode::NXDomain;
+  }
+  else if (denial == NXQTYPE) {
+    res = RCode::NoError;
+  }
+  else {
+    return false;
+  }
+
+  const uint32_t ttl = ttd - now;
+  auto addRecords = [&ret, ttl](const std::vector<DNSRecord>& records) {
+    for (const auto& rec : records) {
+      ret.push_back(rec);
+      ret.back().d_ttl = ttl;
+      ret.back().d_place = DNSResourceRecord::AUTHORITY;
+    }
+  };
+
+  addRecords(zi.d_soa.records);
+  if (doDNSSEC) {
+    addRecords(zi.d_soa.signatures);
+    for (const auto& entry : entries) {
+      addRecords({entry.d_record});
+      addRecords(entry.d_signatures);
+    }
+  }
+
+  return true;
+}
+
+uint64_t AggressiveNSECCache::eraseZone(const DNSName& zone)
+{
+  auto range = d_entries.equal_range(boost::make_tuple(zone));
+  uint64_t ret = std::distance(range.first, range.second);
+  d_entries.erase(range.first, range.second);
+  return ret;
+}
+
+/*!
+ * Remove the entries that could be used to deny the existence of name from the cache.
+ * If subtree is true, this also applies to all names underneath it.
+ * Since we can't locate the NSEC3 records related to a name without hashing all the
+ * names below it, the whole zone is wiped in that case.
+ *
+ * \param name    The DNSName of the entries to wipe
+ * \param subtree Should all entries under name be removed?
+ */
+uint64_t AggressiveNSECCache::wipe(const DNSName& name, bool subtree)
+{
+  uint64_t ret = 0;
+
+  for (auto zoneIt = d_zones.begin(); zoneIt != d_zones.end(); ) {
+    const DNSName& zone = zoneIt->first;
+    if (zone == name || (subtree && zone.isPartOf(name))) {
+      ret += eraseZone(zone);
+      zoneIt = d_zones.erase(zoneIt);
+      continue;
+    }
+
+    if (name.isPartOf(zone)) {
+      if (zoneIt->second.d_nsec3) {
+        ret += eraseZone(zone);
+        zoneIt = d_zones.erase(zoneIt);
+        continue;
+      }
+
+      /* the NSEC covering (or matching) name */
+      auto it = d_entries.upper_bound(boost::make_tuple(zone, name));
+      if (it != d_entries.begin() && std::prev(it)->d_zone == zone) {
+        d_entries.erase(std::prev(it));
+        ret++;
+      }
+
+      if (subtree) {
+        for (it = d_entries.lower_bound(boost::make_tuple(zone, name)); it != d_entries.end() && it->d_zone == zone && it->d_owner.isPartOf(name); ) {
+          it = d_entries.erase(it);
+          ret++;
+        }
+      }
+    }
+
+    ++zoneIt;
+  }
+
+  return ret;
+}
+
+/*!
+ * Clear the cache
+ */
+void AggressiveNSECCache::clear()
+{
+  d_entries.clear();
+  d_zones.clear();
+}
+
+/*!
+ * Perform some cleanup in the cache, removing stale entries
+ *
+ * \param maxEntries The maximum number of entries that may exist in the cache.
+ */
+void AggressiveNSECCache::prune(unsigned int maxEntries)
+{
+  pruneCollection(*this, d_entries, maxEntries, 200);
+
+  const time_t now = time(nullptr);
+  for (auto zoneIt = d_zones.begin(); zoneIt != d_zones.end(); ) {
+    if (zoneIt->second.d_ttd <= now) {
+      eraseZone(zoneIt->first);
+      zoneIt = d_zones.erase(zoneIt);
+    }
+    else {
+      ++zoneIt;
+    }
+  }
+}
@@ -0,0 +1,108 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/ordered_index.hpp>
+#include <boost/multi_index/sequenced_index.hpp>
+#include <boost/multi_index/key_extractors.hpp>
+#include "dnsname.hh"
+#include "dnsrecords.hh"
+#include "negcache.hh"
+#include "validate.hh"
+
+using namespace ::boost::multi_index;
+
+/* Aggressive use of the DNSSEC-validated cache, as described in RFC 8198.
+ *
+ * The NSEC and NSEC3 records from validated (Secure) negative answers are
+ * stored per zone, so that the non-existence of other names and types they
+ * cover can be proven without sending a query to the authoritative servers.
+ * Opt-out NSEC3 records and NSEC records resulting from a wildcard expansion
+ * are never stored.
+ */
+class AggressiveNSECCache : public boost::noncopyable {
+  public:
+    struct NSECEntry {
+      DNSName d_zone;                     // The zone (signer) this record belongs to
+      DNSName d_owner;                    // The owner name of the NSEC(3) record
+      DNSRecord d_record;                 // The NSEC or NSEC3 record itself
+      std::vector<DNSRecord> d_signatures; // The RRSIGs covering this record
+      uint32_t d_ttd;                     // Timestamp when this entry should die
+      uint32_t getTTD() const {
+        return d_ttd;
+      };
+    };
+
+    void insert(const DNSName& zone, const recordsAndSignatures& soa, const recordsAndSignatures& denial, uint32_t ttd);
+    bool getDenial(time_t now, const DNSName& qname, const QType& qtype, std::vector<DNSRecord>& ret, int& res, bool doDNSSEC);
+    uint64_t wipe(const DNSName& name, bool subtree = false);
+    void prune(unsigned int maxEntries);
+    void clear();
+
+    uint64_t size() const {
+      return d_entries.size();
+    };
+
+    void preRemoval(const NSECEntry& entry)
+    {
+    }
+
+    static uint64_t s_maxEntries;
+
+  private:
+    struct ZoneInfo {
+      recordsAndSignatures d_soa;         // The SOA record and RRSIGs of the zone
+      std::string d_salt;                 // NSEC3 salt, if d_nsec3 is set
+      uint32_t d_ttd{0};                  // Timestamp after which the SOA can no longer be used
+      uint16_t d_iterations{0};           // NSEC3 iterations, if d_nsec3 is set
+      bool d_nsec3{false};
+    };
+
+    typedef boost::multi_index_container <
+      NSECEntry,
+      indexed_by <
+        ordered_unique <
+          composite_key <
+            NSECEntry,
+            member<NSECEntry, DNSName, &NSECEntry::d_zone>,
+            member<NSECEntry, DNSName, &NSECEntry::d_owner>
+          >,
+          composite_key_compare <
+            CanonDNSNameCompare, CanonDNSNameCompare
+          >
+        >,
+        sequenced<>
+      >
+    > nsec_t;
+
+    // Required for the cachecleaner
+    typedef nsec_t::nth_index<1>::type nsec_sequence_t;
+
+    bool getCovering(time_t now, const DNSName& zone, const DNSName& name, bool wrap, NSECEntry& entry);
+    bool getNSECDenial(time_t now, const DNSName& zone, const DNSName& qname, std::vector<NSECEntry>& entries, bool& wantsNoDataProof);
+    bool getNSEC3Denial(time_t now, const DNSName& zone, const ZoneInfo& zi, const DNSName& qname, std::vector<NSECEntry>& entries);
+    uint64_t eraseZone(const DNSName& zone);
+
+    nsec_t d_entries;
+    std::map<DNSName, ZoneInfo, CanonDNSNameCompare> d_zones;
+};
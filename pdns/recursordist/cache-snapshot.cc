@@ -0,0 +1,444 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <arpa/inet.h>
+
+#include "cache-snapshot.hh"
+#include "misc.hh"
+#include "recursor_cache.hh"
+#include "syncres.hh"
+
+static const char s_snapshotMagic[] = { 'P', 'D', 'N', 'S', 'R', 'S', 'N', 'P' };
+static const uint16_t s_snapshotVersion = 1;
+
+const size_t CacheSnapshotChunks::s_chunkSize;
+const size_t CacheSnapshotChunks::s_maxChunks;
+
+void CacheSnapshotChunks::push(std::string&& chunk)
+{
+  std::unique_lock<std::mutex> lock(d_lock);
+  d_cond.wait(lock, [this]() { return d_aborted || d_chunks.size() < s_maxChunks; });
+  if (d_aborted) {
+    throw std::runtime_error("The cache snapshot is not being written anymore");
+  }
+  d_chunks.push_back(std::move(chunk));
+  d_cond.notify_all();
+}
+
+bool CacheSnapshotChunks::pop(std::string& chunk)
+{
+  std::unique_lock<std::mutex> lock(d_lock);
+  d_cond.wait(lock, [this]() { return d_finished || !d_chunks.empty(); });
+  if (d_chunks.empty()) {
+    return false;
+  }
+  chunk = std::move(d_chunks.front());
+  d_chunks.pop_front();
+  d_cond.notify_all();
+  return true;
+}
+
+void CacheSnapshotChunks::finish(bool complete)
+{
+  std::lock_guard<std::mutex> lock(d_lock);
+  d_finished = true;
+  d_complete = complete;
+  d_cond.notify_all();
+}
+
+void CacheSnapshotChunks::abort()
+{
+  std::lock_guard<std::mutex> lock(d_lock);
+  d_aborted = true;
+  d_chunks.clear();
+  d_cond.notify_all();
+}
+
+bool CacheSnapshotChunks::isComplete()
+{
+  std::lock_guard<std::mutex> lock(d_lock);
+  return d_complete;
+}
+
+void CacheSnapshotWriter::write(const void* data, size_t len)
+{
+  if (d_chunks) {
+    d_buffer.append(reinterpret_cast<const char*>(data), len);
+    if (d_buffer.size() >= CacheSnapshotChunks::s_chunkSize) {
+      flush();
+    }
+    return;
+  }
+  if (len > 0 && fwrite(data, len, 1, d_fp) != 1) {
+    throw std::runtime_error("Error writing to the cache snapshot: " + stringerror());
+  }
+}
+
+void CacheSnapshotWriter::writeHeader()
+{
+  write(s_snapshotMagic, sizeof(s_snapshotMagic));
+  writeU16(s_snapshotVersion);
+  writeU64(time(nullptr));
+}
+
+void CacheSnapshotWriter::writeTag(CacheSnapshotTag tag)
+{
+  writeU8(static_cast<uint8_t>(tag));
+}
+
+void CacheSnapshotWriter::writeU8(uint8_t value)
+{
+  write(&value, sizeof(value));
+}
+
+void CacheSnapshotWriter::writeU16(uint16_t value)
+{
+  value = htons(value);
+  write(&value, sizeof(value));
+}
+
+void CacheSnapshotWriter::writeU32(uint32_t value)
+{
+  value = htonl(value);
+  write(&value, sizeof(value));
+}
+
+void CacheSnapshotWriter::writeU64(uint64_t value)
+{
+  writeU32(static_cast<uint32_t>(value >> 32));
+  writeU32(static_cast<uint32_t>(value & 0xffffffff));
+}
+
+void CacheSnapshotWriter::writeString(const std::string& value)
+{
+  writeU32(value.size());
+  write(value.c_str(), value.size());
+}
+
+void CacheSnapshotWriter::writeName(const DNSName& name)
+{
+  writeString(name.toDNSString());
+}
+
+void CacheSnapshotWriter::writeContent(const DNSName& qname, const std::shared_ptr<DNSRecordContent>& content)
+{
+  writeString(content->serialize(qname));
+}
+
+void CacheSnapshotWriter::writeRecord(const DNSRecord& record)
+{
+  writeName(record.d_name);
+  writeU16(record.d_type);
+  writeU16(record.d_class);
+  writeU32(record.d_ttl);
+  writeU8(record.d_place);
+  writeContent(record.d_name, record.d_content);
+}
+
+void CacheSnapshotWriter::writeRecords(const std::vector<DNSRecord>& records)
+{
+  writeU32(records.size());
+  for (const auto& record : records) {
+    writeRecord(record);
+  }
+}
+
+void CacheSnapshotWriter::flush()
+{
+  if (d_chunks && !d_buffer.empty()) {
+    d_chunks->push(std::move(d_buffer));
+    d_buffer.clear();
+  }
+}
+
+void CacheSnapshotReader::read(void* data, size_t len)
+{
+  if (len > 0 && fread(data, len, 1, d_fp) != 1) {
+    throw std::runtime_error("Truncated cache snapshot");
+  }
+}
+
+void CacheSnapshotReader::readHeader()
+{
+  char magic[sizeof(s_snapshotMagic)];
+  read(magic, sizeof(magic));
+  if (memcmp(magic, s_snapshotMagic, sizeof(magic)) != 0) {
+    throw std::runtime_error("Not a cache snapshot");
+  }
+  uint16_t version = readU16();
+  if (version != s_snapshotVersion) {
+    throw std::runtime_error("Unsupported cache snapshot version " + std::to_string(version));
+  }
+  readU64(); // time of the snapshot
+}
+
+CacheSnapshotTag CacheSnapshotReader::readTag()
+{
+  uint8_t tag = readU8();
+  if (tag > static_cast<uint8_t>(CacheSnapshotTag::NSSpeed)) {
+    throw std::runtime_error("Unknown entry type " + std::to_string(tag) + " in the cache snapshot");
+  }
+  return static_cast<CacheSnapshotTag>(tag);
+}
+
+uint8_t CacheSnapshotReader::readU8()
+{
+  uint8_t value;
+  read(&value, sizeof(value));
+  return value;
+}
+
+uint16_t CacheSnapshotReader::readU16()
+{
+  uint16_t value;
+  read(&value, sizeof(value));
+  return ntohs(value);
+}
+
+uint32_t CacheSnapshotReader::readU32()
+{
+  uint32_t value;
+  read(&value, sizeof(value));
+  return ntohl(value);
+}
+
+uint64_t CacheSnapshotReader::readU64()
+{
+  uint64_t high = readU32();
+  return (high << 32) | readU32();
+}
+
+std::string CacheSnapshotReader::readString()
+{
+  uint32_t len = readU32();
+  /* nothing we store comes close to this, don't allocate garbage */
+  if (len > 65535) {
+    throw std::runtime_error("Invalid string length " + std::to_string(len) + " in the cache snapshot");
+  }
+  std::string value(len, '\0');
+  read(&value[0], len);
+  return value;
+}
+
+DNSName CacheSnapshotReader::readName()
+{
+  const std::string raw = readString();
+  return DNSName(raw.c_str(), raw.size(), 0, false);
+}
+
+std::shared_ptr<DNSRecordContent> CacheSnapshotReader::readContent(const DNSName& qname, uint16_t qtype)
+{
+  return DNSRecordContent::unserialize(qname, qtype, readString());
+}
+
+DNSRecord CacheSnapshotReader::readRecord()
+{
+  DNSRecord record;
+  record.d_name = readName();
+  record.d_type = readU16();
+  record.d_class = readU16();
+  record.d_ttl = readU32();
+  uint8_t place = readU8();
+  if (place < DNSResourceRecord::ANSWER || place > DNSResourceRecord::ADDITIONAL) {
+    throw std::runtime_error("Invalid record place " + std::to_string(place) + " in the cache snapshot");
+  }
+  record.d_place = static_cast<DNSResourceRecord::Place>(place);
+  record.d_content = readContent(record.d_name, record.d_type);
+  return record;
+}
+
+std::vector<DNSRecord> CacheSnapshotReader::readRecords()
+{
+  std::vector<DNSRecord> records;
+  uint32_t count = readU32();
+  for (uint32_t idx = 0; idx < count; idx++) {
+    records.push_back(readRecord());
+  }
+  return records;
+}
+
+static uint64_t writeCaches(CacheSnapshotWriter& writer)
+{
+  uint64_t count = 0;
+  writer.writeHeader();
+  count += SyncRes::saveNSSpeedsSnapshot(writer);
+  count += SyncRes::t_sstorage.negcache.saveSnapshot(writer);
+  count += t_RC->saveSnapshot(writer);
+  writer.writeTag(CacheSnapshotTag::End);
+  return count;
+}
+
+/* The snapshot is written to a temporary file first, then renamed,
+   so an existing snapshot is never left half-written. */
+template<typename T>
+static void writeSnapshotFile(const std::string& fname, const T& writeContent)
+{
+  const std::string tmpName = fname + ".tmp";
+  FILE* fp = fopen(tmpName.c_str(), "w");
+  if (!fp) {
+    throw std::runtime_error("Unable to open '" + tmpName + "' for writing: " + stringerror());
+  }
+
+  try {
+    writeContent(fp);
+  }
+  catch (...) {
+    fclose(fp);
+    unlink(tmpName.c_str());
+    throw;
+  }
+
+  if (fclose(fp) != 0) {
+    unlink(tmpName.c_str());
+    throw std::runtime_error("Error closing '" + tmpName + "': " + stringerror());
+  }
+
+  if (rename(tmpName.c_str(), fname.c_str()) != 0) {
+    unlink(tmpName.c_str());
+    throw std::runtime_error("Unable to rename '" + tmpName + "' to '" + fname + "': " + stringerror());
+  }
+}
+
+/*!
+ * Writes the content of the caches of the current thread to fname.
+ *
+ * \return the number of entries written
+ */
+uint64_t saveCacheSnapshot(const std::string& fname)
+{
+  uint64_t count = 0;
+  writeSnapshotFile(fname, [&count](FILE* fp) {
+      CacheSnapshotWriter writer(fp);
+      count = writeCaches(writer);
+    });
+  return count;
+}
+
+/*!
+ * Encodes the content of the caches of the current thread into chunks, while
+ * writeCacheSnapshot() writes them to disk from another thread. Only the encoding
+ * needs the thread owning the caches, the slower disk I/O does not, but the
+ * encoding waits for the disk when too many chunks are pending.
+ *
+ * \return the number of entries encoded
+ */
+uint64_t encodeCacheSnapshot(CacheSnapshotChunks& chunks)
+{
+  uint64_t count;
+  try {
+    CacheSnapshotWriter writer(chunks);
+    count = writeCaches(writer);
+    writer.flush();
+  }
+  catch (...) {
+    chunks.finish(false);
+    throw;
+  }
+  chunks.finish(true);
+  return count;
+}
+
+/*!
+ * Writes the chunks coming from encodeCacheSnapshot() to fname, until there are no
+ * more. The existing snapshot is only replaced if the encoding went all the way.
+ */
+void writeCacheSnapshot(const std::string& fname, CacheSnapshotChunks& chunks)
+{
+  try {
+    writeSnapshotFile(fname, [&chunks](FILE* fp) {
+        std::string chunk;
+        while (chunks.pop(chunk)) {
+          if (fwrite(chunk.c_str(), chunk.size(), 1, fp) != 1) {
+            throw std::runtime_error("Error writing to the cache snapshot: " + stringerror());
+          }
+        }
+        if (!chunks.isComplete()) {
+          throw std::runtime_error("The encoding of the cache snapshot failed");
+        }
+      });
+  }
+  catch (...) {
+    chunks.abort();
+    throw;
+  }
+}
+
+/*!
+ * Loads the entries of the snapshot in fname into the caches of the current thread,
+ * skipping the ones that expired since the snapshot was written. Entries are inserted
+ * as they are read. If the snapshot turns out to be truncated or corrupted, the entries
+ * read so far are kept and an exception is raised.
+ *
+ * \return the number of entries loaded, 0 if the file does not exist
+ */
+uint64_t loadCacheSnapshot(const std::string& fname)
+{
+  FILE* fp = fopen(fname.c_str(), "r");
+  if (!fp) {
+    if (errno == ENOENT) {
+      return 0;
+    }
+    throw std::runtime_error("Unable to open '" + fname + "' for reading: " + stringerror());
+  }
+
+  uint64_t count = 0;
+  try {
+    CacheSnapshotReader reader(fp);
+    reader.readHeader();
+    struct timeval now;
+    Utility::gettimeofday(&now, nullptr);
+
+    for (;;) {
+      CacheSnapshotTag tag = reader.readTag();
+      bool loaded = false;
+      if (tag == CacheSnapshotTag::End) {
+        break;
+      }
+      else if (tag == CacheSnapshotTag::Record) {
+        loaded = t_RC->loadSnapshotEntry(reader, now.tv_sec);
+      }
+      else if (tag == CacheSnapshotTag::Negative) {
+        loaded = SyncRes::t_sstorage.negcache.loadSnapshotEntry(reader, now.tv_sec);
+      }
+      else if (tag == CacheSnapshotTag::NSSpeed) {
+        loaded = SyncRes::loadNSSpeedsSnapshotEntry(reader, now);
+      }
+      if (loaded) {
+        count++;
+      }
+    }
+  }
+  catch (const std::exception& e) {
+    fclose(fp);
+    throw std::runtime_error("Error loading the cache snapshot from '" + fname + "' after " + std::to_string(count) + " entries: " + e.what());
+  }
+  catch (const PDNSException& e) {
+    fclose(fp);
+    throw std::runtime_error("Error loading the cache snapshot from '" + fname + "' after " + std::to_string(count) + " entries: " + e.reason);
+  }
+
+  fclose(fp);
+  return count;
+}
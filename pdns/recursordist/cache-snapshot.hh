@@ -0,0 +1,137 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <boost/utility.hpp>
+
+#include "dnsname.hh"
+#include "dnsparser.hh"
+
+/* Binary snapshots of the per-thread caches (record cache, negative cache
+ * and NS speeds), allowing a restarted recursor to start warm.
+ *
+ * The file starts with a magic and a format version, followed by tagged
+ * entries and an End tag. Integers are stored in network byte order, names
+ * and record contents in wire format. Entries are written and read one at a
+ * time, so neither saving nor loading needs a copy of the caches in memory.
+ * When the snapshot is written to disk by another thread, it is handed over
+ * in bounded chunks, see CacheSnapshotChunks.
+ */
+enum class CacheSnapshotTag : uint8_t { End = 0, Record = 1, Negative = 2, NSSpeed = 3 };
+
+/* Chunks of an encoded snapshot, going from the thread owning the caches to the
+ * one writing them to disk. The encoding thread waits as long as s_maxChunks are
+ * queued, so no more than that many chunks of about s_chunkSize bytes are held in
+ * memory, whatever the size of the caches.
+ */
+class CacheSnapshotChunks : public boost::noncopyable
+{
+public:
+  static const size_t s_chunkSize = 256 * 1024;
+  static const size_t s_maxChunks = 4;
+
+  /* throws if the writing side gave up */
+  void push(std::string&& chunk);
+  /* returns false once the encoding side is done and every chunk has been popped */
+  bool pop(std::string& chunk);
+  /* called by the encoding side when it is done, complete being false if it failed */
+  void finish(bool complete);
+  /* called by the writing side when it gives up, the encoding side then stops */
+  void abort();
+  bool isComplete();
+
+private:
+  std::mutex d_lock;
+  std::condition_variable d_cond;
+  std::deque<std::string> d_chunks;
+  bool d_finished{false};
+  bool d_complete{false};
+  bool d_aborted{false};
+};
+
+class CacheSnapshotWriter : public boost::noncopyable
+{
+public:
+  CacheSnapshotWriter(FILE* fp): d_fp(fp)
+  {
+  }
+  CacheSnapshotWriter(CacheSnapshotChunks& chunks): d_chunks(&chunks)
+  {
+  }
+
+  void writeHeader();
+  void writeTag(CacheSnapshotTag tag);
+  void writeU8(uint8_t value);
+  void writeU16(uint16_t value);
+  void writeU32(uint32_t value);
+  void writeU64(uint64_t value);
+  void writeString(const std::string& value);
+  void writeName(const DNSName& name);
+  void writeContent(const DNSName& qname, const std::shared_ptr<DNSRecordContent>& content);
+  void writeRecord(const DNSRecord& record);
+  void writeRecords(const std::vector<DNSRecord>& records);
+  /* hands the last, partial chunk over, if any */
+  void flush();
+
+private:
+  void write(const void* data, size_t len);
+
+  std::string d_buffer;
+  FILE* d_fp{nullptr};
+  CacheSnapshotChunks* d_chunks{nullptr};
+};
+
+class CacheSnapshotReader : public boost::noncopyable
+{
+public:
+  CacheSnapshotReader(FILE* fp): d_fp(fp)
+  {
+  }
+
+  void readHeader();
+  CacheSnapshotTag readTag();
+  uint8_t readU8();
+  uint16_t readU16();
+  uint32_t readU32();
+  uint64_t readU64();
+  std::string readString();
+  DNSName readName();
+  std::shared_ptr<DNSRecordContent> readContent(const DNSName& qname, uint16_t qtype);
+  DNSRecord readRecord();
+  std::vector<DNSRecord> readRecords();
+
+private:
+  void read(void* data, size_t len);
+
+  FILE* d_fp;
+};
+
+uint64_t saveCacheSnapshot(const std::string& fname);
+uint64_t encodeCacheSnapshot(CacheSnapshotChunks& chunks);
+void writeCacheSnapshot(const std::string& fname, CacheSnapshotChunks& chunks);
+uint64_t loadCacheSnapshot(const std::string& fname);
@@ -0,0 +1,158 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <algorithm>
+#include <unistd.h>
+
+#include "inflight.hh"
+#include "lock.hh"
+#include "misc.hh"
+
+InFlightResolutions::InFlightResolutions(size_t shardsCount): d_shards(shardsCount)
+{
+  for(auto& shard : d_shards) {
+    pthread_mutex_init(&shard.d_mutex, 0);
+  }
+}
+
+InFlightResolutions::~InFlightResolutions()
+{
+  for(auto& shard : d_shards) {
+    pthread_mutex_destroy(&shard.d_mutex);
+  }
+}
+
+InFlightResolutions::Key InFlightResolutions::makeKey(const DNSName& qname, uint16_t qtype, const Netmask& ecs)
+{
+  /* make sure that two subnets covering the same addresses compare equal */
+  if (ecs.empty()) {
+    return {qname, Netmask(), qtype};
+  }
+  return {qname, Netmask(ecs.getMaskedNetwork(), ecs.getBits()), qtype};
+}
+
+InFlightResolutions::Shard& InFlightResolutions::getShard(const Key& key)
+{
+  return d_shards[KeyHash()(key) % d_shards.size()];
+}
+
+bool InFlightResolutions::startOrWait(const DNSName& qname, uint16_t qtype, const Netmask& ecs, const Waiter& waiter)
+{
+  auto key = makeKey(qname, qtype, ecs);
+  auto& shard = getShard(key);
+  Lock l(&shard.d_mutex);
+
+  auto it = shard.d_resolutions.find(key);
+  if (it == shard.d_resolutions.end()) {
+    shard.d_resolutions.insert({std::move(key), std::vector<Waiter>()});
+    return true;
+  }
+
+  it->second.push_back(waiter);
+  return false;
+}
+
+std::vector<InFlightResolutions::Waiter> InFlightResolutions::done(const DNSName& qname, uint16_t qtype, const Netmask& ecs)
+{
+  std::vector<Waiter> waiters;
+  const auto key = makeKey(qname, qtype, ecs);
+  auto& shard = getShard(key);
+  Lock l(&shard.d_mutex);
+
+  auto it = shard.d_resolutions.find(key);
+  if (it != shard.d_resolutions.end()) {
+    waiters = std::move(it->second);
+    shard.d_resolutions.erase(it);
+  }
+
+  return waiters;
+}
+
+void InFlightResolutions::removeWaiter(const DNSName& qname, uint16_t qtype, const Netmask& ecs, const Waiter& waiter)
+{
+  const auto key = makeKey(qname, qtype, ecs);
+  auto& shard = getShard(key);
+  Lock l(&shard.d_mutex);
+
+  auto it = shard.d_resolutions.find(key);
+  if (it == shard.d_resolutions.end()) {
+    return;
+  }
+
+  auto& waiters = it->second;
+  waiters.erase(std::remove_if(waiters.begin(), waiters.end(), [&waiter](const Waiter& w) { return w.d_threadId == waiter.d_threadId && w.d_id == waiter.d_id; }), waiters.end());
+}
+
+size_t InFlightResolutions::size()
+{
+  size_t count = 0;
+  for(auto& shard : d_shards) {
+    Lock l(&shard.d_mutex);
+    count += shard.d_resolutions.size();
+  }
+  return count;
+}
+
+InFlightWakeups::InFlightWakeups(size_t threadsCount): d_queues(threadsCount)
+{
+  for(auto& queue : d_queues) {
+    pthread_mutex_init(&queue.d_mutex, 0);
+    int fd[2];
+    if(pipe(fd) < 0) {
+      unixDie("Creating pipe for coalesced queries wakeups");
+    }
+    queue.d_readFD = fd[0];
+    queue.d_writeFD = fd[1];
+    setNonBlocking(queue.d_readFD);
+    setNonBlocking(queue.d_writeFD);
+  }
+}
+
+InFlightWakeups::~InFlightWakeups()
+{
+  for(auto& queue : d_queues) {
+    close(queue.d_readFD);
+    close(queue.d_writeFD);
+    pthread_mutex_destroy(&queue.d_mutex);
+  }
+}
+
+void InFlightWakeups::wake(const DNSName& qname, uint16_t qtype, const std::vector<InFlightResolutions::Waiter>& waiters)
+{
+  for(const auto& waiter : waiters) {
+    auto& queue = d_queues.at(waiter.d_threadId);
+    bool wasEmpty;
+    {
+      Lock l(&queue.d_mutex);
+      wasEmpty = queue.d_wakeups.empty();
+      queue.d_wakeups.push_back({qname, qtype, waiter.d_id});
+    }
+
+    /* the thread takes the whole queue once woken up, no need to wake it up more than once */
+    if(wasEmpty) {
+      char c = 0;
+      if(write(queue.d_writeFD, &c, sizeof(c)) != sizeof(c)) {
+        /* nothing we can do, the waiters will time out */
+      }
+    }
+  }
+}
+
+int InFlightWakeups::getDescriptor(unsigned int threadId) const
+{
+  return d_queues.at(threadId).d_readFD;
+}
+
+std::vector<InFlightWakeups::Wakeup> InFlightWakeups::take(unsigned int threadId)
+{
+  auto& queue = d_queues.at(threadId);
+  char buffer[64];
+  while(read(queue.d_readFD, buffer, sizeof(buffer)) > 0) {
+  }
+
+  std::vector<Wakeup> wakeups;
+  Lock l(&queue.d_mutex);
+  wakeups.swap(queue.d_wakeups);
+  return wakeups;
+}
@@ -0,0 +1,135 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+
+#include <atomic>
+#include <unordered_map>
+#include <vector>
+#include <pthread.h>
+#include <boost/utility.hpp>
+
+#include "dnsname.hh"
+#include "iputils.hh"
+
+/* Keeps track of the client queries currently being resolved, so that a query for
+   a question that is already being resolved, possibly by another thread, can wait
+   for that resolution to finish instead of starting its own. Once woken up, the
+   waiting query does its own resolution, which will then be answered from the cache. */
+class InFlightResolutions : public boost::noncopyable
+{
+public:
+  struct Waiter
+  {
+    unsigned int d_threadId;
+    uint16_t d_id;
+  };
+
+  InFlightResolutions(size_t shardsCount=16);
+  ~InFlightResolutions();
+
+  /* returns true if nobody was resolving this question, meaning that the caller
+     should do it and call done() afterwards. Otherwise the caller has been added
+     to the waiters of the existing resolution */
+  bool startOrWait(const DNSName& qname, uint16_t qtype, const Netmask& ecs, const Waiter& waiter);
+  /* the resolution is over, returns the waiters that need to be woken up */
+  std::vector<Waiter> done(const DNSName& qname, uint16_t qtype, const Netmask& ecs);
+  /* the waiter gave up, it should not be woken up anymore */
+  void removeWaiter(const DNSName& qname, uint16_t qtype, const Netmask& ecs, const Waiter& waiter);
+  size_t size();
+
+private:
+  struct Key
+  {
+    DNSName d_qname;
+    Netmask d_ecs;
+    uint16_t d_qtype;
+
+    bool operator==(const Key& rhs) const
+    {
+      if (d_qtype != rhs.d_qtype || d_ecs.empty() != rhs.d_ecs.empty()) {
+        return false;
+      }
+      /* the address of an empty netmask is not initialized */
+      return (d_ecs.empty() || d_ecs == rhs.d_ecs) && d_qname == rhs.d_qname;
+    }
+  };
+
+  struct KeyHash
+  {
+    size_t operator()(const Key& key) const
+    {
+      size_t hash = key.d_qname.hash(key.d_qtype);
+      if (!key.d_ecs.empty()) {
+        hash = ComboAddress::addressOnlyHash()(key.d_ecs.getNetwork()) ^ (hash + key.d_ecs.getBits());
+      }
+      return hash;
+    }
+  };
+
+  typedef std::unordered_map<Key, std::vector<Waiter>, KeyHash> resolutions_t;
+
+  struct Shard
+  {
+    pthread_mutex_t d_mutex;
+    resolutions_t d_resolutions;
+  };
+
+  static Key makeKey(const DNSName& qname, uint16_t qtype, const Netmask& ecs);
+  Shard& getShard(const Key& key);
+
+  std::vector<Shard> d_shards;
+};
+
+/* Hands the waiters to wake up over to the thread they are waiting on. Each thread has its
+   own queue, and a non-blocking pipe that is written to when that queue stops being empty.
+   Queueing never blocks, so the thread that finished a resolution is never held back by a
+   busy or stuck waiting thread. If the pipe cannot be written to, the waiters just hit
+   their timeout. */
+class InFlightWakeups : public boost::noncopyable
+{
+public:
+  struct Wakeup
+  {
+    DNSName d_qname;
+    uint16_t d_qtype;
+    uint16_t d_id;
+  };
+
+  InFlightWakeups(size_t threadsCount);
+  ~InFlightWakeups();
+
+  void wake(const DNSName& qname, uint16_t qtype, const std::vector<InFlightResolutions::Waiter>& waiters);
+  /* readable when there is something to take() for that thread */
+  int getDescriptor(unsigned int threadId) const;
+  std::vector<Wakeup> take(unsigned int threadId);
+
+private:
+  struct Queue
+  {
+    pthread_mutex_t d_mutex;
+    std::vector<Wakeup> d_wakeups;
+    int d_readFD{-1};
+    int d_writeFD{-1};
+  };
+
+  std::vector<Queue> d_queues;
+};
@@ -24,6 +24,7 @@
 #include "negcache.hh"
 #include "misc.hh"
 #include "cachecleaner.hh"
+#include "cache-snapshot.hh"
 
 /*!
  * Set ne to the NegCacheEntry for the last label in qname and return true if there
@@ -196,3 +197,61 @@ uint64_t NegCache::dumpToFile(FILE* fp) {
   }
   return ret;
 }
+
+/*!
+ * Writes all the entries that have not expired yet to writer
+ *
+ * \param writer The snapshot to write the entries to
+ * \return The number of entries written
+ */
+uint64_t NegCache::saveSnapshot(CacheSnapshotWriter& writer) const {
+  uint64_t ret(0);
+  const time_t now = time(nullptr);
+  const negcache_sequence_t& sidx = d_negcache.get<1>();
+  for (const NegCacheEntry& ne : sidx) {
+    if (ne.d_ttd <= now) {
+      continue;
+    }
+    writer.writeTag(CacheSnapshotTag::Negative);
+    writer.writeName(ne.d_name);
+    writer.writeU16(ne.d_qtype.getCode());
+    writer.writeName(ne.d_auth);
+    writer.writeU32(ne.d_ttd);
+    writer.writeU8(ne.d_validationState);
+    writer.writeRecords(ne.authoritySOA.records);
+    writer.writeRecords(ne.authoritySOA.signatures);
+    writer.writeRecords(ne.DNSSECRecords.records);
+    writer.writeRecords(ne.DNSSECRecords.signatures);
+    ret++;
+  }
+  return ret;
+}
+
+/*!
+ * Reads one entry written by saveSnapshot() from reader and adds it to the
+ * cache, unless it expired in the meantime.
+ *
+ * \param reader The snapshot to read the entry from
+ * \param now    The current time
+ * \return true if the entry was added
+ */
+bool NegCache::loadSnapshotEntry(CacheSnapshotReader& reader, time_t now) {
+  NegCacheEntry ne;
+  ne.d_name = reader.readName();
+  ne.d_qtype = QType(reader.readU16());
+  ne.d_auth = reader.readName();
+  ne.d_ttd = reader.readU32();
+  uint8_t state = reader.readU8();
+  ne.d_validationState = state > TA ? Indeterminate : static_cast<vState>(state);
+  ne.authoritySOA.records = reader.readRecords();
+  ne.authoritySOA.signatures = reader.readRecords();
+  ne.DNSSECRecords.records = reader.readRecords();
+  ne.DNSSECRecords.signatures = reader.readRecords();
+
+  if (ne.d_ttd <= now) {
+    return false;
+  }
+
+  add(ne);
+  return true;
+}
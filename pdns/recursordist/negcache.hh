@@ -42,6 +42,9 @@ typedef struct {
   vector<DNSRecord> signatures;
 } recordsAndSignatures;
 
+class CacheSnapshotReader;
+class CacheSnapshotWriter;
+
 class NegCache : public boost::noncopyable {
   public:
     struct NegCacheEntry {
@@ -66,6 +69,8 @@ class NegCache : public boost::noncopyable {
     void prune(unsigned int maxEntries);
     void clear();
     uint64_t dumpToFile(FILE* fd);
+    uint64_t saveSnapshot(CacheSnapshotWriter& writer) const;
+    bool loadSnapshotEntry(CacheSnapshotReader& reader, time_t now);
     uint64_t wipe(const DNSName& name, bool subtree = false);
 
     uint64_t size() {
@@ -0,0 +1,98 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <cmath>
+
+#include "rec-latency.hh"
+
+thread_local LatencyHistograms t_latencyHistograms;
+
+const std::string& latencyPhaseToString(LatencyPhase phase)
+{
+  static const std::array<std::string, s_latencyPhasesCount> names = { "packetcache", "recordcache", "lua", "outgoing-udp", "outgoing-tcp", "validation", "total" };
+  return names.at(static_cast<size_t>(phase));
+}
+
+size_t LatencyHistogram::getBucket(uint64_t usec)
+{
+  if (usec < s_subBucketsCount) {
+    return usec;
+  }
+
+  const unsigned int power = 63 - __builtin_clzll(usec);
+  if (power > s_maxPower) {
+    return s_bucketsCount - 1;
+  }
+
+  const uint64_t sub = (usec >> (power - s_subBucketsBits)) & (s_subBucketsCount - 1);
+  return (power - s_subBucketsBits + 1) * s_subBucketsCount + sub;
+}
+
+uint64_t LatencyHistogram::getBucketUpperBound(size_t bucket)
+{
+  if (bucket < s_subBucketsCount) {
+    return bucket;
+  }
+
+  const unsigned int shift = bucket / s_subBucketsCount - 1;
+  const uint64_t sub = bucket % s_subBucketsCount;
+  const uint64_t lower = (s_subBucketsCount + sub) << shift;
+  return lower + (static_cast<uint64_t>(1) << shift) - 1;
+}
+
+LatencyHistogram& LatencyHistogram::operator+=(const LatencyHistogram& rhs)
+{
+  for (size_t idx = 0; idx < d_buckets.size(); idx++) {
+    d_buckets[idx] += rhs.d_buckets[idx];
+  }
+  d_count += rhs.d_count;
+  return *this;
+}
+
+void LatencyHistogram::halve(unsigned int times)
+{
+  d_count = 0;
+  for (auto& bucket : d_buckets) {
+    bucket = times < 64 ? bucket >> times : 0;
+    d_count += bucket;
+  }
+}
+
+void LatencyHistograms::doDecay(time_t now)
+{
+  if (d_lastDecay == 0) {
+    /* nothing to decay yet */
+    d_lastDecay = now;
+    return;
+  }
+
+  const time_t periods = (now - d_lastDecay) / s_halfLife;
+  const unsigned int times = periods < 64 ? periods : 64;
+  for (auto& phase : d_phases) {
+    phase.halve(times);
+  }
+  d_lastDecay += periods * s_halfLife;
+}
+
+uint64_t LatencyHistogram::getPercentile(double percentile) const
+{
+  if (d_count == 0) {
+    return 0;
+  }
+
+  uint64_t target = std::ceil(d_count * percentile / 100.0);
+  if (target == 0) {
+    target = 1;
+  }
+
+  uint64_t seen = 0;
+  for (size_t idx = 0; idx < d_buckets.size(); idx++) {
+    seen += d_buckets[idx];
+    if (seen >= target) {
+      return getBucketUpperBound(idx);
+    }
+  }
+
+  return getBucketUpperBound(d_buckets.size() - 1);
+}
@@ -0,0 +1,197 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <time.h>
+
+/* The phases of the processing of a query we keep track of the time spent in */
+enum class LatencyPhase : uint8_t { PacketCache = 0, RecordCache, Lua, OutgoingUDP, OutgoingTCP, Validation, Total };
+static const size_t s_latencyPhasesCount = static_cast<size_t>(LatencyPhase::Total) + 1;
+
+const std::string& latencyPhaseToString(LatencyPhase phase);
+
+/* A log-linear histogram of durations in microseconds, in the spirit of HDR histograms:
+   values below s_subBucketsCount are counted exactly, then every power of two is split
+   into s_subBucketsCount linear buckets, so that the value returned for a given
+   percentile is never more than 1/s_subBucketsCount (12.5%) above the real one.
+   Adding a value is a couple of shifts and an increment, no allocation is ever done. */
+class LatencyHistogram
+{
+public:
+  void add(uint64_t usec)
+  {
+    d_buckets[getBucket(usec)]++;
+    d_count++;
+  }
+
+  LatencyHistogram& operator+=(const LatencyHistogram& rhs);
+
+  /* returns the (upper bound of the bucket holding the) value below which 'percentile'
+     percent of the values added so far fall, 0 if the histogram is empty */
+  uint64_t getPercentile(double percentile) const;
+
+  uint64_t getCount() const
+  {
+    return d_count;
+  }
+
+  /* divides every bucket by 2^times, so that older values weigh less than recent ones */
+  void halve(unsigned int times);
+
+  static uint64_t getBucketUpperBound(size_t bucket);
+  static size_t getBucket(uint64_t usec);
+
+private:
+  static const unsigned int s_subBucketsBits = 3;
+  static const uint64_t s_subBucketsCount = 1 << s_subBucketsBits;
+  /* 2^40 usec is more than 12 days, anything above ends up in the last bucket */
+  static const unsigned int s_maxPower = 40;
+  static const size_t s_bucketsCount = (s_maxPower - s_subBucketsBits + 2) * s_subBucketsCount;
+
+  std::array<uint64_t, s_bucketsCount> d_buckets{};
+  uint64_t d_count{0};
+};
+
+/* The time spent in each phase by a single query */
+struct LatencyTrace
+{
+  std::array<uint64_t, s_latencyPhasesCount> d_usec{};
+};
+
+/* One histogram per phase, one instance per thread so no locking is needed.
+   The counts are halved every s_halfLife seconds so that the percentiles
+   reflect the last few minutes instead of everything seen since startup. */
+struct LatencyHistograms
+{
+  /* 'now' is in seconds, from a monotonic clock */
+  void add(LatencyPhase phase, uint64_t usec, time_t now)
+  {
+    decay(now);
+    d_phases[static_cast<size_t>(phase)].add(usec);
+  }
+
+  void decay(time_t now)
+  {
+    if (now - d_lastDecay >= s_halfLife) {
+      doDecay(now);
+    }
+  }
+
+  const LatencyHistogram& get(LatencyPhase phase) const
+  {
+    return d_phases[static_cast<size_t>(phase)];
+  }
+
+  static const time_t s_halfLife = 60;
+
+  std::array<LatencyHistogram, s_latencyPhasesCount> d_phases;
+  time_t d_lastDecay{0};
+
+private:
+  void doDecay(time_t now);
+};
+
+extern thread_local LatencyHistograms t_latencyHistograms;
+
+/* the current time in seconds of the monotonic clock used for the decay of the histograms */
+inline time_t getLatencyClockSeconds()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec;
+}
+
+/* Measures the (wall clock) time spent until stop() is called or the object goes out
+   of scope, using a monotonic clock, and records it into this thread's histogram for
+   'phase' and, if not null, into the per-query 'trace'. The time spent between
+   suspend() and resume(), for example while this MThread is waiting for the network,
+   is not counted. */
+class LatencyTimer
+{
+public:
+  LatencyTimer(LatencyPhase phase, LatencyTrace* trace=nullptr): d_trace(trace), d_phase(phase)
+  {
+    clock_gettime(CLOCK_MONOTONIC, &d_start);
+  }
+
+  ~LatencyTimer()
+  {
+    stop();
+  }
+
+  void suspend()
+  {
+    if (d_running) {
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      accumulate(now);
+      d_running = false;
+    }
+  }
+
+  void resume()
+  {
+    if (!d_running && !d_stopped) {
+      clock_gettime(CLOCK_MONOTONIC, &d_start);
+      d_running = true;
+    }
+  }
+
+  void stop()
+  {
+    if (d_stopped) {
+      return;
+    }
+    d_stopped = true;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (d_running) {
+      accumulate(now);
+      d_running = false;
+    }
+
+    t_latencyHistograms.add(d_phase, d_usec, now.tv_sec);
+    if (d_trace) {
+      d_trace->d_usec[static_cast<size_t>(d_phase)] += d_usec;
+    }
+  }
+
+private:
+  void accumulate(const struct timespec& now)
+  {
+    int64_t usec = (now.tv_sec - d_start.tv_sec) * 1000000 + (now.tv_nsec - d_start.tv_nsec) / 1000;
+    if (usec > 0) {
+      d_usec += usec;
+    }
+  }
+
+  struct timespec d_start;
+  LatencyTrace* d_trace;
+  uint64_t d_usec{0};
+  LatencyPhase d_phase;
+  bool d_running{true};
+  bool d_stopped{false};
+};
@@ -0,0 +1 @@
+../sha.hh
\ No newline at end of file
@@ -0,0 +1,255 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+#include <boost/test/unit_test.hpp>
+
+#include "aggressive_nsec.hh"
+#include "base32.hh"
+#include "dnssecinfra.hh"
+#include "dnsrecords.hh"
+
+static void addRecord(recordsAndSignatures& rs, const DNSName& name, const DNSName& zone, const uint16_t qtype, const string& content, const std::shared_ptr<DNSRecordContent>& drc=nullptr) {
+  DNSRecord rec;
+  rec.d_name = name;
+  rec.d_type = qtype;
+  rec.d_ttl = 600;
+  rec.d_place = DNSResourceRecord::AUTHORITY;
+  rec.d_content = drc ? drc : DNSRecordContent::mastermake(qtype, QClass::IN, content);
+  rs.records.push_back(rec);
+
+  rec.d_type = QType::RRSIG;
+  rec.d_content = std::make_shared<RRSIGRecordContent>(QType(qtype).getName() + " 8 " + std::to_string(name.countLabels()) + " 600 2100010100000000 20170101000000 24567 " + zone.toString() + " dummydata");
+  rs.signatures.push_back(rec);
+}
+
+static void addNSEC3(recordsAndSignatures& rs, const DNSName& name, const DNSName& zone, const std::set<uint16_t>& types, bool narrow, uint8_t flags=0) {
+  static const std::string salt = "deadbeef";
+  std::string hashed = hashQNameWithSalt(salt, 10, name);
+  std::string hashedNext(hashed);
+  incrementHash(hashedNext);
+  if (narrow) {
+    decrementHash(hashed);
+  }
+
+  auto nrc = std::make_shared<NSEC3RecordContent>();
+  nrc->d_algorithm = 1;
+  nrc->d_flags = flags;
+  nrc->d_iterations = 10;
+  nrc->d_salt = salt;
+  nrc->d_nexthash = hashedNext;
+  nrc->d_set = types;
+
+  addRecord(rs, DNSName(toBase32Hex(hashed)) + zone, zone, QType::NSEC3, "", nrc);
+}
+
+static recordsAndSignatures getSOA(const DNSName& zone) {
+  recordsAndSignatures soa;
+  addRecord(soa, zone, zone, QType::SOA, "ns1." + zone.toString() + " hostmaster." + zone.toString() + " 1 2 3 4 5");
+  return soa;
+}
+
+BOOST_AUTO_TEST_SUITE(aggressive_nsec_cc)
+
+BOOST_AUTO_TEST_CASE(test_nsec_nxdomain) {
+  reportAllTypes();
+  const DNSName zone("powerdns.com.");
+  const time_t now = time(nullptr);
+
+  recordsAndSignatures denial;
+  addRecord(denial, DNSName("a.powerdns.com."), zone, QType::NSEC, "c.powerdns.com. A RRSIG NSEC");
+  /* the apex NSEC proves that there is no wildcard */
+  addRecord(denial, zone, zone, QType::NSEC, "a.powerdns.com. SOA NS RRSIG NSEC DNSKEY");
+
+  AggressiveNSECCache cache;
+  cache.insert(zone, getSOA(zone), denial, now + 600);
+  BOOST_CHECK_EQUAL(cache.size(), 2);
+
+  vector<DNSRecord> ret;
+  int res = -1;
+  BOOST_CHECK(cache.getDenial(now, DNSName("b.powerdns.com."), QType(QType::A), ret, res, false));
+  BOOST_CHECK_EQUAL(res, RCode::NXDomain);
+  BOOST_REQUIRE_EQUAL(ret.size(), 1);
+  BOOST_CHECK_EQUAL(ret.at(0).d_type, QType::SOA);
+  BOOST_CHECK_EQUAL(ret.at(0).d_name, zone);
+  BOOST_CHECK_EQUAL(ret.at(0).d_ttl, 600);
+
+  /* with DNSSEC records */
+  ret.clear();
+  BOOST_CHECK(cache.getDenial(now + 100, DNSName("www.b.powerdns.com."), QType(QType::AAAA), ret, res, true));
+  BOOST_CHECK_EQUAL(res, RCode::NXDomain);
+  BOOST_CHECK_EQUAL(ret.size(), 6);
+  for (const auto& rec : ret) {
+    BOOST_CHECK_EQUAL(rec.d_ttl, 500);
+  }
+
+  /* not covered */
+  ret.clear();
+  BOOST_CHECK(!cache.getDenial(now, DNSName("d.powerdns.com."), QType(QType::A), ret, res, false));
+  BOOST_CHECK(!cache.getDenial(now, DNSName("b.powerdns.net."), QType(QType::A), ret, res, false));
+  BOOST_CHECK(ret.empty());
+
+  /* expired */
+  BOOST_CHECK(!cache.getDenial(now + 601, DNSName("b.powerdns.com."), QType(QType::A), ret, res, false));
+  BOOST_CHECK(ret.empty());
+}
+
+BOOST_AUTO_TEST_CASE(test_nsec_nodata) {
+  reportAllTypes();
+  const DNSName zone("powerdns.com.");
+  const time_t now = time(nullptr);
+
+  recordsAndSignatures denial;
+  addRecord(denial, DNSName("a.powerdns.com."), zone, QType::NSEC, "c.b.powerdns.com. A RRSIG NSEC");
+
+  AggressiveNSECCache cache;
+  cache.insert(zone, getSOA(zone), denial, now + 600);
+
+  vector<DNSRecord> ret;
+  int res = -1;
+  BOOST_CHECK(cache.getDenial(now, DNSName("a.powerdns.com."), QType(QType::AAAA), ret, res, false));
+  BOOST_CHECK_EQUAL(res, RCode::NoError);
+  BOOST_CHECK_EQUAL(ret.size(), 1);
+
+  /* the type exists */
+  ret.clear();
+  BOOST_CHECK(!cache.getDenial(now, DNSName("a.powerdns.com."), QType(QType::A), ret, res, false));
+
+  /* b.powerdns.com. is an empty non-terminal */
+  BOOST_CHECK(cache.getDenial(now, DNSName("b.powerdns.com."), QType(QType::A), ret, res, false));
+  BOOST_CHECK_EQUAL(res, RCode::NoError);
+
+  /* the same NSEC proves that *.b.powerdns.com. does not exist */
+  BOOST_CHECK(cache.getDenial(now, DNSName("a.b.powerdns.com."), QType(QType::A), ret, res, false));
+  BOOST_CHECK_EQUAL(res, RCode::NXDomain);
+
+  /* but we don't have the apex NSEC, so we can't prove there is no *.powerdns.com. */
+  ret.clear();
+  BOOST_CHECK(!cache.getDenial(now, DNSName("aa.powerdns.com."), QType(QType::A), ret, res, false));
+  BOOST_CHECK(ret.empty());
+}
+
+BOOST_AUTO_TEST_CASE(test_nsec_delegation) {
+  reportAllTypes();
+  const DNSName zone("powerdns.com.");
+  const time_t now = time(nullptr);
+
+  recordsAndSignatures denial;
+  addRecord(denial, zone, zone, QType::NSEC, "sub.powerdns.com. SOA NS RRSIG NSEC DNSKEY");
+  addRecord(denial, DNSName("sub.powerdns.com."), zone, QType::NSEC, "z.powerdns.com. NS RRSIG NSEC");
+
+  AggressiveNSECCache cache;
+  cache.insert(zone, getSOA(zone), denial, now + 600);
+
+  vector<DNSRecord> ret;
+  int res = -1;
+  /* an insecure delegation, we can deny the DS */
+  BOOST_CHECK(cache.getDenial(now, DNSName("sub.powerdns.com."), QType(QType::DS), ret, res, false));
+  BOOST_CHECK_EQUAL(res, RCode::NoError);
+
+  /* but not anything at or below the delegation point */
+  ret.clear();
+  BOOST_CHECK(!cache.getDenial(now, DNSName("sub.powerdns.com."), QType(QType::A), ret, res, false));
+  BOOST_CHECK(!cache.getDenial(now, DNSName("www.sub.powerdns.com."), QType(QType::A), ret, res, false));
+  BOOST_CHECK(ret.empty());
+}
+
+BOOST_AUTO_TEST_CASE(test_nsec_wildcard_expanded) {
+  reportAllTypes();
+  const DNSName zone("powerdns.com.");
+  const time_t now = time(nullptr);
+
+  recordsAndSignatures denial;
+  addRecord(denial, zone, zone, QType::NSEC, "a.powerdns.com. SOA NS RRSIG NSEC DNSKEY");
+  addRecord(denial, DNSName("a.powerdns.com."), zone, QType::NSEC, "c.powerdns.com. A RRSIG NSEC");
+  /* the NSEC of a wildcard-expanded answer, can't be used */
+  auto rrsig = std::dynamic_pointer_cast<RRSIGRecordContent>(denial.signatures.back().d_content);
+  rrsig->d_labels = 2;
+
+  AggressiveNSECCache cache;
+  cache.insert(zone, getSOA(zone), denial, now + 600);
+  BOOST_CHECK_EQUAL(cache.size(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(test_nsec3_nxdomain) {
+  reportAllTypes();
+  const DNSName zone("powerdns.com.");
+  const time_t now = time(nullptr);
+  const DNSName target("www.powerdns.com.");
+
+  recordsAndSignatures denial;
+  /* closest encloser */
+  addNSEC3(denial, zone, zone, { QType::SOA, QType::NS, QType::NSEC3, QType::RRSIG, QType::DNSKEY }, false);
+  /* next closer */
+  addNSEC3(denial, target, zone, { QType::A }, true);
+  /* wildcard */
+  addNSEC3(denial, g_wildcarddnsname + zone, zone, { QType::A }, true);
+
+  AggressiveNSECCache cache;
+  cache.insert(zone, getSOA(zone), denial, now + 600);
+  BOOST_CHECK_EQUAL(cache.size(), 3);
+
+  vector<DNSRecord> ret;
+  int res = -1;
+  BOOST_CHECK(cache.getDenial(now, target, QType(QType::A), ret, res, true));
+  BOOST_CHECK_EQUAL(res, RCode::NXDomain);
+  BOOST_CHECK_EQUAL(ret.size(), 8);
+
+  /* the apex exists, but has no A */
+  ret.clear();
+  BOOST_CHECK(cache.getDenial(now, zone, QType(QType::A), ret, res, false));
+  BOOST_CHECK_EQUAL(res, RCode::NoError);
+  BOOST_CHECK(!cache.getDenial(now, zone, QType(QType::SOA), ret, res, false));
+
+  /* wiping the zone */
+  BOOST_CHECK_EQUAL(cache.wipe(target), 3);
+  BOOST_CHECK_EQUAL(cache.size(), 0);
+  ret.clear();
+  BOOST_CHECK(!cache.getDenial(now, target, QType(QType::A), ret, res, true));
+}
+
+BOOST_AUTO_TEST_CASE(test_nsec3_optout) {
+  reportAllTypes();
+  const DNSName zone("powerdns.com.");
+  const time_t now = time(nullptr);
+
+  recordsAndSignatures denial;
+  addNSEC3(denial, zone, zone, { QType::SOA, QType::NS, QType::NSEC3, QType::RRSIG, QType::DNSKEY }, false);
+  addNSEC3(denial, DNSName("www.powerdns.com."), zone, { QType::A }, true, 1);
+
+  AggressiveNSECCache cache;
+  cache.insert(zone, getSOA(zone), denial, now + 600);
+  BOOST_CHECK_EQUAL(cache.size(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(test_wipe) {
+  reportAllTypes();
+  const DNSName zone("powerdns.com.");
+  const time_t now = time(nullptr);
+
+  recordsAndSignatures denial;
+  addRecord(denial, zone, zone, QType::NSEC, "a.powerdns.com. SOA NS RRSIG NSEC DNSKEY");
+  addRecord(denial, DNSName("a.powerdns.com."), zone, QType::NSEC, "c.powerdns.com. A RRSIG NSEC");
+  addRecord(denial, DNSName("c.powerdns.com."), zone, QType::NSEC, "e.powerdns.com. A RRSIG NSEC");
+  addRecord(denial, DNSName("x.c.powerdns.com."), zone, QType::NSEC, "z.powerdns.com. A RRSIG NSEC");
+
+  AggressiveNSECCache cache;
+  cache.insert(zone, getSOA(zone), denial, now + 600);
+  BOOST_CHECK_EQUAL(cache.size(), 4);
+
+  /* only the NSEC covering b.powerdns.com. */
+  BOOST_CHECK_EQUAL(cache.wipe(DNSName("b.powerdns.com.")), 1);
+  BOOST_CHECK_EQUAL(cache.size(), 3);
+
+  vector<DNSRecord> ret;
+  int res = -1;
+  BOOST_CHECK(!cache.getDenial(now, DNSName("b.powerdns.com."), QType(QType::A), ret, res, false));
+
+  /* c.powerdns.com. and everything below it */
+  BOOST_CHECK_EQUAL(cache.wipe(DNSName("c.powerdns.com."), true), 2);
+  BOOST_CHECK_EQUAL(cache.size(), 1);
+
+  /* the whole zone */
+  BOOST_CHECK_EQUAL(cache.wipe(DNSName("com."), true), 1);
+  BOOST_CHECK_EQUAL(cache.size(), 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
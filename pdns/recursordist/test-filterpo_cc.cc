@@ -0,0 +1,266 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+#include <boost/test/unit_test.hpp>
+
+#include "dnsrecords.hh"
+#include "filterpo.hh"
+
+static DNSFilterEngine::Policy makePolicy(DNSFilterEngine::PolicyKind kind)
+{
+  DNSFilterEngine::Policy pol;
+  pol.d_kind = kind;
+  return pol;
+}
+
+static std::shared_ptr<DNSFilterEngine::Zone> makeZone(const std::string& name)
+{
+  auto zone = std::make_shared<DNSFilterEngine::Zone>();
+  zone->setName(name);
+  return zone;
+}
+
+static std::string getZoneName(const DNSFilterEngine::Policy& pol)
+{
+  return pol.d_name ? *pol.d_name : "";
+}
+
+BOOST_AUTO_TEST_SUITE(filterpo_cc)
+
+BOOST_AUTO_TEST_CASE(test_filter_qname_compiled) {
+  DNSFilterEngine dfe;
+  const std::unordered_map<std::string,bool> noDiscard;
+  const ComboAddress client("192.0.2.1");
+
+  auto first = makeZone("first");
+  first->addQNameTrigger(DNSName("*.example.com."), makePolicy(DNSFilterEngine::PolicyKind::NXDOMAIN));
+  first->addQNameTrigger(DNSName("exact.example.net."), makePolicy(DNSFilterEngine::PolicyKind::Drop));
+  auto second = makeZone("second");
+  second->addQNameTrigger(DNSName("www.example.com."), makePolicy(DNSFilterEngine::PolicyKind::NODATA));
+  second->addQNameTrigger(DNSName("*.www.example.com."), makePolicy(DNSFilterEngine::PolicyKind::Truncate));
+  second->addQNameTrigger(DNSName("*.sub.example.net."), makePolicy(DNSFilterEngine::PolicyKind::NODATA));
+  second->addQNameTrigger(DNSName("*.example.net."), makePolicy(DNSFilterEngine::PolicyKind::Truncate));
+  dfe.addZone(first);
+  dfe.addZone(second);
+
+  BOOST_CHECK(!dfe.isCompiled());
+  const std::vector<std::string> names = { "www.example.com.", "a.www.example.com.", "example.com.", "EXAMPLE.com.", "x.Example.COM.", "exact.example.net.", "a.exact.example.net.", "a.sub.example.net.", "sub.example.net.", "example.net.", "*.example.com.", ".", "com.", "example.org." };
+  std::vector<DNSFilterEngine::Policy> uncompiled;
+  for (const auto& name : names) {
+    uncompiled.push_back(dfe.getQueryPolicy(DNSName(name), client, noDiscard));
+  }
+
+  dfe.compile();
+  BOOST_CHECK(dfe.isCompiled());
+  for (size_t idx = 0; idx < names.size(); idx++) {
+    const auto pol = dfe.getQueryPolicy(DNSName(names.at(idx)), client, noDiscard);
+    BOOST_CHECK_MESSAGE(pol.d_kind == uncompiled.at(idx).d_kind && getZoneName(pol) == getZoneName(uncompiled.at(idx)), "policy mismatch for " + names.at(idx));
+  }
+
+  /* the first zone wins, even with a less specific match */
+  auto pol = dfe.getQueryPolicy(DNSName("www.example.com."), client, noDiscard);
+  BOOST_CHECK(pol.d_kind == DNSFilterEngine::PolicyKind::NXDOMAIN);
+  BOOST_CHECK_EQUAL(getZoneName(pol), "first");
+  /* within a zone, the most specific wildcard wins */
+  pol = dfe.getQueryPolicy(DNSName("a.sub.example.net."), client, noDiscard);
+  BOOST_CHECK(pol.d_kind == DNSFilterEngine::PolicyKind::NODATA);
+  /* a wildcard does not match the name it is attached to */
+  pol = dfe.getQueryPolicy(DNSName("example.com."), client, noDiscard);
+  BOOST_CHECK(pol.d_kind == DNSFilterEngine::PolicyKind::NoAction);
+  BOOST_CHECK(pol.d_type == DNSFilterEngine::PolicyType::None);
+
+  /* discarding the first zone */
+  const std::unordered_map<std::string,bool> discardFirst = { { "first", true } };
+  pol = dfe.getQueryPolicy(DNSName("www.example.com."), client, discardFirst);
+  BOOST_CHECK(pol.d_kind == DNSFilterEngine::PolicyKind::NODATA);
+  BOOST_CHECK_EQUAL(getZoneName(pol), "second");
+
+  /* in-place modifications are noticed, and lookups walk the zones again */
+  second->addQNameTrigger(DNSName("example.org."), makePolicy(DNSFilterEngine::PolicyKind::Drop));
+  BOOST_CHECK(!dfe.isCompiled());
+  pol = dfe.getQueryPolicy(DNSName("example.org."), client, noDiscard);
+  BOOST_CHECK(pol.d_kind == DNSFilterEngine::PolicyKind::Drop);
+}
+
+BOOST_AUTO_TEST_CASE(test_filter_addresses_compiled) {
+  DNSFilterEngine dfe;
+  const std::unordered_map<std::string,bool> noDiscard;
+
+  auto first = makeZone("first");
+  first->addClientTrigger(Netmask("192.0.0.0/8"), makePolicy(DNSFilterEngine::PolicyKind::Drop));
+  first->addQNameTrigger(DNSName("www.example.net."), makePolicy(DNSFilterEngine::PolicyKind::Truncate));
+  first->addResponseTrigger(Netmask("2001:db8::/32"), makePolicy(DNSFilterEngine::PolicyKind::NXDOMAIN));
+  auto second = makeZone("second");
+  second->addClientTrigger(Netmask("192.0.2.0/24"), makePolicy(DNSFilterEngine::PolicyKind::NODATA));
+  second->addClientTrigger(Netmask("198.51.100.0/24"), makePolicy(DNSFilterEngine::PolicyKind::NODATA));
+  second->addQNameTrigger(DNSName("www.example.com."), makePolicy(DNSFilterEngine::PolicyKind::NXDOMAIN));
+  second->addNSIPTrigger(Netmask("203.0.113.0/24"), makePolicy(DNSFilterEngine::PolicyKind::Drop));
+  second->addNSTrigger(DNSName("ns.example.com."), makePolicy(DNSFilterEngine::PolicyKind::NODATA));
+  dfe.addZone(first);
+  dfe.addZone(second);
+  dfe.compile();
+  BOOST_REQUIRE(dfe.isCompiled());
+
+  /* the /8 of the first zone wins over the more specific /24 of the second */
+  auto pol = dfe.getQueryPolicy(DNSName("www.example.com."), ComboAddress("192.0.2.1"), noDiscard);
+  BOOST_CHECK(pol.d_kind == DNSFilterEngine::PolicyKind::Drop);
+  BOOST_CHECK(pol.d_type == DNSFilterEngine::PolicyType::ClientIP);
+
+  /* unless the first zone is discarded */
+  const std::unordered_map<std::string,bool> discardFirst = { { "first", true } };
+  pol = dfe.getQueryPolicy(DNSName("www.example.org."), ComboAddress("192.0.2.1"), discardFirst);
+  BOOST_CHECK(pol.d_kind == DNSFilterEngine::PolicyKind::NODATA);
+  BOOST_CHECK_EQUAL(getZoneName(pol), "second");
+
+  /* within a zone, the qname trigger wins over the client IP one */
+  pol = dfe.getQueryPolicy(DNSName("www.example.net."), ComboAddress("192.0.2.1"), noDiscard);
+  BOOST_CHECK(pol.d_kind == DNSFilterEngine::PolicyKind::Truncate);
+  BOOST_CHECK(pol.d_type == DNSFilterEngine::PolicyType::QName);
+
+  /* the client IP trigger of the second zone loses against the qname of the first one */
+  pol = dfe.getQueryPolicy(DNSName("www.example.net."), ComboAddress("198.51.100.1"), noDiscard);
+  BOOST_CHECK(pol.d_kind == DNSFilterEngine::PolicyKind::Truncate);
+  /* but wins against the qname trigger of the same zone */
+  pol = dfe.getQueryPolicy(DNSName("www.example.com."), ComboAddress("198.51.100.1"), noDiscard);
+  BOOST_CHECK(pol.d_kind == DNSFilterEngine::PolicyKind::NXDOMAIN);
+  BOOST_CHECK(pol.d_type == DNSFilterEngine::PolicyType::QName);
+  pol = dfe.getQueryPolicy(DNSName("www.example.org."), ComboAddress("198.51.100.1"), noDiscard);
+  BOOST_CHECK(pol.d_kind == DNSFilterEngine::PolicyKind::NODATA);
+  BOOST_CHECK(pol.d_type == DNSFilterEngine::PolicyType::ClientIP);
+
+  pol = dfe.getProcessingPolicy(ComboAddress("203.0.113.42"), noDiscard);
+  BOOST_CHECK(pol.d_kind == DNSFilterEngine::PolicyKind::Drop);
+  BOOST_CHECK(pol.d_type == DNSFilterEngine::PolicyType::NSIP);
+  pol = dfe.getProcessingPolicy(ComboAddress("192.0.2.1"), noDiscard);
+  BOOST_CHECK(pol.d_kind == DNSFilterEngine::PolicyKind::NoAction);
+  pol = dfe.getProcessingPolicy(DNSName("ns.example.com."), noDiscard);
+  BOOST_CHECK(pol.d_kind == DNSFilterEngine::PolicyKind::NODATA);
+  BOOST_CHECK(pol.d_type == DNSFilterEngine::PolicyType::NSDName);
+
+  vector<DNSRecord> records;
+  DNSRecord dr;
+  dr.d_name = DNSName("www.example.com.");
+  dr.d_place = DNSResourceRecord::ANSWER;
+  dr.d_type = QType::AAAA;
+  dr.d_content = std::make_shared<AAAARecordContent>(ComboAddress("2001:db8::1"));
+  records.push_back(dr);
+  pol = dfe.getPostPolicy(records, noDiscard);
+  BOOST_CHECK(pol.d_kind == DNSFilterEngine::PolicyKind::NXDOMAIN);
+  BOOST_CHECK(pol.d_type == DNSFilterEngine::PolicyType::ResponseIP);
+}
+
+BOOST_AUTO_TEST_CASE(test_filter_incremental_update) {
+  DNSFilterEngine dfe;
+  const std::unordered_map<std::string,bool> noDiscard;
+  const ComboAddress client("192.0.2.1");
+
+  auto first = makeZone("first");
+  first->addQNameTrigger(DNSName("a.example.com."), makePolicy(DNSFilterEngine::PolicyKind::NXDOMAIN));
+  auto second = makeZone("second");
+  second->addQNameTrigger(DNSName("b.example.com."), makePolicy(DNSFilterEngine::PolicyKind::NODATA));
+  second->addQNameTrigger(DNSName("c.example.com."), makePolicy(DNSFilterEngine::PolicyKind::NODATA));
+  size_t firstIdx = dfe.addZone(first);
+  size_t secondIdx = dfe.addZone(second);
+  dfe.compile();
+
+  /* a modified copy of a zone only updates the index */
+  auto newSecond = std::make_shared<DNSFilterEngine::Zone>(*second);
+  newSecond->rmQNameTrigger(DNSName("b.example.com."), makePolicy(DNSFilterEngine::PolicyKind::NODATA));
+  newSecond->addQNameTrigger(DNSName("a.example.com."), makePolicy(DNSFilterEngine::PolicyKind::Drop));
+  newSecond->addQNameTrigger(DNSName("*.d.example.com."), makePolicy(DNSFilterEngine::PolicyKind::Truncate));
+  dfe.setZone(secondIdx, newSecond);
+  BOOST_CHECK(dfe.isCompiled());
+
+  BOOST_CHECK(dfe.getQueryPolicy(DNSName("a.example.com."), client, noDiscard).d_kind == DNSFilterEngine::PolicyKind::NXDOMAIN);
+  BOOST_CHECK(dfe.getQueryPolicy(DNSName("b.example.com."), client, noDiscard).d_kind == DNSFilterEngine::PolicyKind::NoAction);
+  BOOST_CHECK(dfe.getQueryPolicy(DNSName("c.example.com."), client, noDiscard).d_kind == DNSFilterEngine::PolicyKind::NODATA);
+  BOOST_CHECK(dfe.getQueryPolicy(DNSName("x.d.example.com."), client, noDiscard).d_kind == DNSFilterEngine::PolicyKind::Truncate);
+  const std::unordered_map<std::string,bool> discardFirst = { { "first", true } };
+  BOOST_CHECK(dfe.getQueryPolicy(DNSName("a.example.com."), client, discardFirst).d_kind == DNSFilterEngine::PolicyKind::Drop);
+
+  /* a copy of the first zone, removing its only name */
+  auto newFirst = std::make_shared<DNSFilterEngine::Zone>(*first);
+  newFirst->rmQNameTrigger(DNSName("a.example.com."), makePolicy(DNSFilterEngine::PolicyKind::NXDOMAIN));
+  newFirst->addClientTrigger(Netmask("192.0.2.0/24"), makePolicy(DNSFilterEngine::PolicyKind::NODATA));
+  dfe.setZone(firstIdx, newFirst);
+  BOOST_CHECK(dfe.isCompiled());
+  auto pol = dfe.getQueryPolicy(DNSName("a.example.com."), client, noDiscard);
+  BOOST_CHECK(pol.d_kind == DNSFilterEngine::PolicyKind::NODATA);
+  BOOST_CHECK(pol.d_type == DNSFilterEngine::PolicyType::ClientIP);
+  pol = dfe.getQueryPolicy(DNSName("a.example.com."), ComboAddress("198.51.100.1"), noDiscard);
+  BOOST_CHECK(pol.d_kind == DNSFilterEngine::PolicyKind::Drop);
+
+  /* enough changes to fold the overlay into a new compiled tree */
+  auto bigSecond = std::make_shared<DNSFilterEngine::Zone>(*newSecond);
+  for (size_t idx = 0; idx < 5000; idx++) {
+    bigSecond->addQNameTrigger(DNSName(std::to_string(idx) + ".example.org."), makePolicy(DNSFilterEngine::PolicyKind::NXDOMAIN));
+  }
+  dfe.setZone(secondIdx, bigSecond);
+  BOOST_CHECK(dfe.isCompiled());
+  BOOST_CHECK(dfe.getQueryPolicy(DNSName("4999.example.org."), ComboAddress("198.51.100.1"), noDiscard).d_kind == DNSFilterEngine::PolicyKind::NXDOMAIN);
+  BOOST_CHECK(dfe.getQueryPolicy(DNSName("5000.example.org."), ComboAddress("198.51.100.1"), noDiscard).d_kind == DNSFilterEngine::PolicyKind::NoAction);
+  BOOST_CHECK(dfe.getQueryPolicy(DNSName("x.d.example.com."), ComboAddress("198.51.100.1"), noDiscard).d_kind == DNSFilterEngine::PolicyKind::Truncate);
+
+  /* a zone that is not a copy of the one it replaces triggers a full rebuild */
+  auto other = makeZone("other");
+  other->addQNameTrigger(DNSName("c.example.com."), makePolicy(DNSFilterEngine::PolicyKind::Drop));
+  dfe.setZone(secondIdx, other);
+  BOOST_CHECK(dfe.isCompiled());
+  BOOST_CHECK(dfe.getQueryPolicy(DNSName("c.example.com."), ComboAddress("198.51.100.1"), noDiscard).d_kind == DNSFilterEngine::PolicyKind::Drop);
+  BOOST_CHECK(dfe.getQueryPolicy(DNSName("4999.example.org."), ComboAddress("198.51.100.1"), noDiscard).d_kind == DNSFilterEngine::PolicyKind::NoAction);
+}
+
+BOOST_AUTO_TEST_CASE(test_filter_zone_copy) {
+  DNSFilterEngine::Policy pol;
+  auto zone = makeZone("zone");
+  for (size_t idx = 0; idx < 10000; idx++) {
+    zone->addQNameTrigger(DNSName(std::to_string(idx) + ".example.com."), makePolicy(DNSFilterEngine::PolicyKind::NXDOMAIN));
+  }
+  zone->addClientTrigger(Netmask("192.0.2.0/24"), makePolicy(DNSFilterEngine::PolicyKind::Drop));
+  BOOST_CHECK_EQUAL(zone->size(), 10001);
+
+  /* changes made to a copy are not visible in the original */
+  DNSFilterEngine::Zone copy(*zone);
+  copy.rmQNameTrigger(DNSName("1.example.com."), makePolicy(DNSFilterEngine::PolicyKind::NXDOMAIN));
+  copy.addQNameTrigger(DNSName("2.example.com."), makePolicy(DNSFilterEngine::PolicyKind::NODATA));
+  copy.addQNameTrigger(DNSName("new.example.com."), makePolicy(DNSFilterEngine::PolicyKind::Drop));
+  copy.rmClientTrigger(Netmask("192.0.2.0/24"), makePolicy(DNSFilterEngine::PolicyKind::Drop));
+  BOOST_CHECK_EQUAL(copy.size(), 10000);
+  BOOST_CHECK_EQUAL(zone->size(), 10001);
+
+  BOOST_CHECK(!copy.findQNamePolicy(DNSName("1.example.com."), pol));
+  BOOST_CHECK(zone->findQNamePolicy(DNSName("1.example.com."), pol));
+  BOOST_CHECK(copy.findQNamePolicy(DNSName("2.example.com."), pol));
+  BOOST_CHECK(pol.d_kind == DNSFilterEngine::PolicyKind::NODATA);
+  BOOST_CHECK(zone->findQNamePolicy(DNSName("2.example.com."), pol));
+  BOOST_CHECK(pol.d_kind == DNSFilterEngine::PolicyKind::NXDOMAIN);
+  BOOST_CHECK(copy.findQNamePolicy(DNSName("new.example.com."), pol));
+  BOOST_CHECK(!zone->findQNamePolicy(DNSName("new.example.com."), pol));
+  BOOST_CHECK(!copy.findClientPolicy(ComboAddress("192.0.2.1"), pol));
+  BOOST_CHECK(zone->findClientPolicy(ComboAddress("192.0.2.1"), pol));
+
+  /* removing then re-adding a name */
+  copy.rmQNameTrigger(DNSName("new.example.com."), makePolicy(DNSFilterEngine::PolicyKind::Drop));
+  copy.addQNameTrigger(DNSName("1.example.com."), makePolicy(DNSFilterEngine::PolicyKind::Truncate));
+  BOOST_CHECK_EQUAL(copy.size(), 10000);
+  BOOST_CHECK(copy.findQNamePolicy(DNSName("1.example.com."), pol));
+  BOOST_CHECK(pol.d_kind == DNSFilterEngine::PolicyKind::Truncate);
+
+  /* enough changes for the overlay to be folded into a new base */
+  for (size_t idx = 0; idx < 5000; idx++) {
+    copy.rmQNameTrigger(DNSName(std::to_string(idx) + ".example.com."), makePolicy(DNSFilterEngine::PolicyKind::NXDOMAIN));
+  }
+  BOOST_CHECK_EQUAL(copy.size(), 5000);
+  BOOST_CHECK_EQUAL(zone->size(), 10001);
+  BOOST_CHECK(!copy.findQNamePolicy(DNSName("4999.example.com."), pol));
+  BOOST_CHECK(copy.findQNamePolicy(DNSName("5000.example.com."), pol));
+  BOOST_CHECK(zone->findQNamePolicy(DNSName("4999.example.com."), pol));
+
+  /* once the original is gone, the copy owns its base and is modified in place */
+  zone.reset();
+  copy.addQNameTrigger(DNSName("4999.example.com."), makePolicy(DNSFilterEngine::PolicyKind::Drop));
+  BOOST_CHECK_EQUAL(copy.size(), 5001);
+  BOOST_CHECK(copy.findQNamePolicy(DNSName("4999.example.com."), pol));
+  BOOST_CHECK(pol.d_kind == DNSFilterEngine::PolicyKind::Drop);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
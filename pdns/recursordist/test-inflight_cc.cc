@@ -0,0 +1,105 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <boost/test/unit_test.hpp>
+#include <poll.h>
+
+#include "inflight.hh"
+#include "qtype.hh"
+
+BOOST_AUTO_TEST_SUITE(inflight_cc)
+
+BOOST_AUTO_TEST_CASE(test_inflight_coalescing) {
+  InFlightResolutions inflight;
+  const DNSName qname("www.powerdns.com.");
+
+  /* the first one resolves */
+  BOOST_CHECK_EQUAL(inflight.startOrWait(qname, QType::A, Netmask(), {0, 1}), true);
+  BOOST_CHECK_EQUAL(inflight.size(), 1);
+
+  /* identical queries wait, whatever the case of the name */
+  BOOST_CHECK_EQUAL(inflight.startOrWait(qname, QType::A, Netmask(), {1, 2}), false);
+  BOOST_CHECK_EQUAL(inflight.startOrWait(DNSName("WWW.PowerDNS.com."), QType::A, Netmask(), {2, 3}), false);
+
+  /* but not different ones */
+  BOOST_CHECK_EQUAL(inflight.startOrWait(qname, QType::AAAA, Netmask(), {1, 4}), true);
+  BOOST_CHECK_EQUAL(inflight.startOrWait(DNSName("powerdns.com."), QType::A, Netmask(), {1, 5}), true);
+  BOOST_CHECK_EQUAL(inflight.size(), 3);
+
+  /* the second waiter gives up */
+  inflight.removeWaiter(qname, QType::A, Netmask(), {2, 3});
+
+  auto waiters = inflight.done(qname, QType::A, Netmask());
+  BOOST_REQUIRE_EQUAL(waiters.size(), 1);
+  BOOST_CHECK_EQUAL(waiters.at(0).d_threadId, 1);
+  BOOST_CHECK_EQUAL(waiters.at(0).d_id, 2);
+  BOOST_CHECK_EQUAL(inflight.size(), 2);
+
+  /* nobody waited for these */
+  BOOST_CHECK_EQUAL(inflight.done(qname, QType::AAAA, Netmask()).size(), 0);
+  BOOST_CHECK_EQUAL(inflight.done(DNSName("powerdns.com."), QType::A, Netmask()).size(), 0);
+  BOOST_CHECK_EQUAL(inflight.size(), 0);
+
+  /* it's over, the next one resolves again */
+  BOOST_CHECK_EQUAL(inflight.startOrWait(qname, QType::A, Netmask(), {1, 6}), true);
+}
+
+BOOST_AUTO_TEST_CASE(test_inflight_ecs) {
+  InFlightResolutions inflight;
+  const DNSName qname("www.powerdns.com.");
+
+  BOOST_CHECK_EQUAL(inflight.startOrWait(qname, QType::A, Netmask("192.0.2.0/24"), {0, 1}), true);
+  /* same subnet, even if the address is not masked */
+  BOOST_CHECK_EQUAL(inflight.startOrWait(qname, QType::A, Netmask("192.0.2.42/24"), {0, 2}), false);
+  /* different subnets, or no subnet at all, do not */
+  BOOST_CHECK_EQUAL(inflight.startOrWait(qname, QType::A, Netmask("198.51.100.0/24"), {0, 3}), true);
+  BOOST_CHECK_EQUAL(inflight.startOrWait(qname, QType::A, Netmask("192.0.2.0/25"), {0, 4}), true);
+  BOOST_CHECK_EQUAL(inflight.startOrWait(qname, QType::A, Netmask(), {0, 5}), true);
+  BOOST_CHECK_EQUAL(inflight.size(), 4);
+
+  auto waiters = inflight.done(qname, QType::A, Netmask("192.0.2.0/24"));
+  BOOST_REQUIRE_EQUAL(waiters.size(), 1);
+  BOOST_CHECK_EQUAL(waiters.at(0).d_id, 2);
+}
+
+static bool isReadable(int fd)
+{
+  struct pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  return poll(&pfd, 1, 0) == 1;
+}
+
+BOOST_AUTO_TEST_CASE(test_inflight_wakeups) {
+  InFlightWakeups wakeups(2);
+  const DNSName qname("www.powerdns.com.");
+  BOOST_CHECK(!isReadable(wakeups.getDescriptor(0)));
+  BOOST_CHECK(!isReadable(wakeups.getDescriptor(1)));
+
+  /* each waiter is woken up on its own thread */
+  wakeups.wake(qname, QType::A, {{0, 1}, {1, 2}, {1, 3}});
+  BOOST_CHECK(isReadable(wakeups.getDescriptor(0)));
+  BOOST_CHECK(isReadable(wakeups.getDescriptor(1)));
+
+  auto taken = wakeups.take(1);
+  BOOST_REQUIRE_EQUAL(taken.size(), 2);
+  BOOST_CHECK_EQUAL(taken.at(0).d_qname, qname);
+  BOOST_CHECK_EQUAL(taken.at(0).d_qtype, QType::A);
+  BOOST_CHECK_EQUAL(taken.at(0).d_id, 2);
+  BOOST_CHECK_EQUAL(taken.at(1).d_id, 3);
+  BOOST_CHECK(!isReadable(wakeups.getDescriptor(1)));
+  BOOST_CHECK(wakeups.take(1).empty());
+
+  /* a thread that never takes its wakeups does not block the ones waking it up, however many there are */
+  for (uint16_t id = 0; id < 50000; id++) {
+    wakeups.wake(qname, QType::AAAA, {{0, id}});
+  }
+  taken = wakeups.take(0);
+  BOOST_CHECK_EQUAL(taken.size(), 50001);
+  BOOST_CHECK(!isReadable(wakeups.getDescriptor(0)));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -57,4 +57,55 @@ BOOST_AUTO_TEST_CASE(test_MtaskerException) {
       }
     }, std::exception);
 }
+
+static void doNothing(void* p)
+{
+}
+
+static void useStack(void* p)
+{
+  MTasker<>* mt = reinterpret_cast<MTasker<>*>(p);
+  volatile char buffer[32768];
+  for (size_t idx = 0; idx < sizeof(buffer); idx++) {
+    buffer[idx] = static_cast<char>(idx);
+  }
+  int i=12, o;
+  mt->waitEvent(i, &o);
+  g_result = o + buffer[1];
+}
+
+BOOST_AUTO_TEST_CASE(test_MtaskerStackCache) {
+  MTasker<> mt(65536, 1);
+  struct timeval now;
+  gettimeofday(&now, 0);
+  int o=24;
+
+  BOOST_CHECK_EQUAL(mt.getCachedStacksCount(), 0);
+  BOOST_CHECK_EQUAL(mt.getStacksHighWaterMark(), 0);
+
+  for (size_t run = 0; run < 2; run++) {
+    mt.makeThread(useStack, &mt);
+    /* the cached stack, if any, has been handed over to the new thread */
+    BOOST_CHECK_EQUAL(mt.getCachedStacksCount(), 0);
+    while(mt.schedule(&now));
+    BOOST_CHECK_GE(mt.getStacksHighWaterMark(), 32768);
+    BOOST_CHECK_LT(mt.getStacksHighWaterMark(), 65536);
+
+    mt.sendEvent(12, &o);
+    while(mt.schedule(&now));
+    BOOST_CHECK(mt.noProcesses());
+    BOOST_CHECK_EQUAL(g_result, o + 1);
+    BOOST_CHECK_EQUAL(mt.getCachedStacksCount(), 1);
+  }
+
+  /* only one stack is kept, the high water mark of the other one is remembered */
+  mt.makeThread(doNothing, nullptr);
+  mt.makeThread(doNothing, nullptr);
+  BOOST_CHECK_EQUAL(mt.getCachedStacksCount(), 0);
+  while(mt.schedule(&now));
+  BOOST_CHECK(mt.noProcesses());
+  BOOST_CHECK_EQUAL(mt.getCachedStacksCount(), 1);
+  BOOST_CHECK_GE(mt.getStacksHighWaterMark(), 32768);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
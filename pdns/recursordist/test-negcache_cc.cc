@@ -3,6 +3,7 @@
 #include <boost/test/unit_test.hpp>
 
 #include "negcache.hh"
+#include "cache-snapshot.hh"
 #include "dnsrecords.hh"
 #include "utility.hh"
 
@@ -390,6 +391,67 @@ BOOST_AUTO_TEST_CASE(test_dumpToFile) {
   fclose(fp);
 }
 
+BOOST_AUTO_TEST_CASE(test_snapshot) {
+  reportAllTypes();
+
+  DNSName qname("www2.powerdns.com");
+  DNSName auth("powerdns.com");
+
+  struct timeval now;
+  Utility::gettimeofday(&now, 0);
+
+  NegCache cache;
+  auto entry = genNegCacheEntry(qname, auth, now, QType::AAAA);
+  entry.d_validationState = Secure;
+  cache.add(entry);
+  cache.add(genNegCacheEntry(DNSName("www1.powerdns.com"), auth, now));
+
+  FILE* fp = tmpfile();
+  if (!fp)
+    BOOST_FAIL("Temporary file could not be opened");
+
+  {
+    CacheSnapshotWriter writer(fp);
+    BOOST_CHECK_EQUAL(cache.saveSnapshot(writer), 2);
+    writer.writeTag(CacheSnapshotTag::End);
+  }
+
+  NegCache restored;
+  rewind(fp);
+  {
+    CacheSnapshotReader reader(fp);
+    while (reader.readTag() == CacheSnapshotTag::Negative) {
+      BOOST_CHECK(restored.loadSnapshotEntry(reader, now.tv_sec));
+    }
+  }
+  BOOST_CHECK_EQUAL(restored.size(), 2);
+
+  NegCache::NegCacheEntry ne;
+  BOOST_REQUIRE(restored.get(qname, QType(QType::AAAA), now, ne, true));
+  BOOST_CHECK_EQUAL(ne.d_name, qname);
+  BOOST_CHECK_EQUAL(ne.d_auth, auth);
+  BOOST_CHECK_EQUAL(ne.d_ttd, entry.d_ttd);
+  BOOST_CHECK_EQUAL(ne.d_validationState, Secure);
+  BOOST_REQUIRE_EQUAL(ne.authoritySOA.records.size(), 1);
+  BOOST_CHECK_EQUAL(ne.authoritySOA.records.at(0).d_content->getZoneRepresentation(), entry.authoritySOA.records.at(0).d_content->getZoneRepresentation());
+  BOOST_CHECK_EQUAL(ne.authoritySOA.signatures.size(), 1);
+  BOOST_CHECK_EQUAL(ne.DNSSECRecords.records.size(), 1);
+  BOOST_CHECK_EQUAL(ne.DNSSECRecords.signatures.size(), 1);
+
+  /* expired entries are not loaded */
+  NegCache late;
+  rewind(fp);
+  {
+    CacheSnapshotReader reader(fp);
+    while (reader.readTag() == CacheSnapshotTag::Negative) {
+      BOOST_CHECK(!late.loadSnapshotEntry(reader, entry.d_ttd));
+    }
+  }
+  BOOST_CHECK_EQUAL(late.size(), 0);
+
+  fclose(fp);
+}
+
 BOOST_AUTO_TEST_CASE(test_count) {
   string qname(".powerdns.com");
   string qname2("powerdns.org");
@@ -0,0 +1,126 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <boost/test/unit_test.hpp>
+
+#include "rec-latency.hh"
+
+BOOST_AUTO_TEST_SUITE(rec_latency_cc)
+
+BOOST_AUTO_TEST_CASE(test_latency_histogram_buckets) {
+  /* small values are counted exactly */
+  for (uint64_t usec = 0; usec < 16; usec++) {
+    BOOST_CHECK_EQUAL(LatencyHistogram::getBucketUpperBound(LatencyHistogram::getBucket(usec)), usec);
+  }
+
+  /* larger ones are never rounded down, and by at most 12.5% up */
+  for (uint64_t usec = 16; usec < 10000000; usec = usec * 3 / 2 + 1) {
+    const auto upper = LatencyHistogram::getBucketUpperBound(LatencyHistogram::getBucket(usec));
+    BOOST_CHECK_GE(upper, usec);
+    BOOST_CHECK_LE(upper, usec + usec / 8);
+  }
+
+  /* buckets are ordered */
+  BOOST_CHECK_LT(LatencyHistogram::getBucket(999), LatencyHistogram::getBucket(1000000));
+
+  /* huge values do not overflow */
+  BOOST_CHECK_EQUAL(LatencyHistogram::getBucket(std::numeric_limits<uint64_t>::max()), LatencyHistogram::getBucket(static_cast<uint64_t>(1) << 50));
+}
+
+BOOST_AUTO_TEST_CASE(test_latency_histogram_percentiles) {
+  LatencyHistogram histo;
+  BOOST_CHECK_EQUAL(histo.getCount(), 0);
+  BOOST_CHECK_EQUAL(histo.getPercentile(50), 0);
+
+  /* 900 fast ones, 90 slower, 9 slow and a single very slow one */
+  for (size_t idx = 0; idx < 900; idx++) {
+    histo.add(5);
+  }
+  for (size_t idx = 0; idx < 90; idx++) {
+    histo.add(1000);
+  }
+  for (size_t idx = 0; idx < 9; idx++) {
+    histo.add(100000);
+  }
+  histo.add(2000000);
+  BOOST_CHECK_EQUAL(histo.getCount(), 1000);
+
+  BOOST_CHECK_EQUAL(histo.getPercentile(50), 5);
+  BOOST_CHECK_EQUAL(histo.getPercentile(90), 5);
+  const auto p99 = histo.getPercentile(99);
+  BOOST_CHECK(p99 >= 1000 && p99 <= 1125);
+  const auto p999 = histo.getPercentile(99.9);
+  BOOST_CHECK(p999 >= 100000 && p999 <= 112500);
+  const auto p100 = histo.getPercentile(100);
+  BOOST_CHECK(p100 >= 2000000 && p100 <= 2250000);
+
+  /* merging the histograms of several threads */
+  LatencyHistogram other;
+  for (size_t idx = 0; idx < 1000; idx++) {
+    other.add(1000000);
+  }
+  other += histo;
+  BOOST_CHECK_EQUAL(other.getCount(), 2000);
+  BOOST_CHECK_EQUAL(other.getPercentile(45), 5);
+  BOOST_CHECK_GE(other.getPercentile(60), 1000000);
+}
+
+BOOST_AUTO_TEST_CASE(test_latency_histograms_decay) {
+  LatencyHistograms histos;
+  const time_t now = 1000;
+
+  for (size_t idx = 0; idx < 1000; idx++) {
+    histos.add(LatencyPhase::Total, 5, now);
+  }
+  BOOST_CHECK_EQUAL(histos.get(LatencyPhase::Total).getCount(), 1000);
+
+  /* nothing happens before the half-life has passed */
+  histos.decay(now + LatencyHistograms::s_halfLife - 1);
+  BOOST_CHECK_EQUAL(histos.get(LatencyPhase::Total).getCount(), 1000);
+
+  /* the old values weigh half as much as the new ones */
+  for (size_t idx = 0; idx < 600; idx++) {
+    histos.add(LatencyPhase::Total, 100000, now + LatencyHistograms::s_halfLife);
+  }
+  BOOST_CHECK_EQUAL(histos.get(LatencyPhase::Total).getCount(), 1100);
+  BOOST_CHECK_GE(histos.get(LatencyPhase::Total).getPercentile(50), 100000);
+
+  /* and are eventually forgotten */
+  histos.decay(now + 20 * LatencyHistograms::s_halfLife);
+  BOOST_CHECK_EQUAL(histos.get(LatencyPhase::Total).getCount(), 0);
+  BOOST_CHECK_EQUAL(histos.get(LatencyPhase::Total).getPercentile(99), 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_latency_timer) {
+  LatencyTrace trace;
+  const auto before = t_latencyHistograms.get(LatencyPhase::Validation).getCount();
+  {
+    LatencyTimer timer(LatencyPhase::Validation, &trace);
+    timer.stop();
+    /* stopping twice does not count twice */
+  }
+  BOOST_CHECK_EQUAL(t_latencyHistograms.get(LatencyPhase::Validation).getCount(), before + 1);
+
+  {
+    LatencyTimer timer(LatencyPhase::Validation);
+    usleep(2000);
+  }
+  BOOST_CHECK_EQUAL(t_latencyHistograms.get(LatencyPhase::Validation).getCount(), before + 2);
+  BOOST_CHECK_GE(t_latencyHistograms.get(LatencyPhase::Validation).getPercentile(100), 2000);
+  BOOST_CHECK_LT(trace.d_usec.at(static_cast<size_t>(LatencyPhase::Validation)), 2000);
+  BOOST_CHECK_EQUAL(trace.d_usec.at(static_cast<size_t>(LatencyPhase::Lua)), 0);
+
+  /* the time spent while suspended is not counted */
+  {
+    LatencyTimer timer(LatencyPhase::Lua, &trace);
+    timer.suspend();
+    usleep(20000);
+    timer.resume();
+  }
+  BOOST_CHECK_LT(trace.d_usec.at(static_cast<size_t>(LatencyPhase::Lua)), 20000);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
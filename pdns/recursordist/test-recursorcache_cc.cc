@@ -6,13 +6,17 @@
 #endif
 #include <boost/test/unit_test.hpp>
 #include <boost/test/floating_point_comparison.hpp>
+#include <thread>
 
+#include "cache-snapshot.hh"
 #include "iputils.hh"
 #include "recursor_cache.hh"
 
 BOOST_AUTO_TEST_SUITE(recursorcache_cc)
 
 BOOST_AUTO_TEST_CASE(test_RecursorCacheSimple) {
+  reportAllTypes();
+
   MemRecursorCache MRC;
 
   std::vector<DNSRecord> records;
@@ -127,8 +131,15 @@ BOOST_AUTO_TEST_CASE(test_RecursorCacheSimple) {
     BOOST_CHECK_EQUAL(MRC.size(), 2);
 
     // insert a TXT one, we will use that later
+    DNSRecord drTXT;
+    drTXT.d_name = power;
+    drTXT.d_type = QType::TXT;
+    drTXT.d_class = QClass::IN;
+    drTXT.d_content = DNSRecordContent::mastermake(QType::TXT, QClass::IN, "\"later\"");
+    drTXT.d_ttl = static_cast<uint32_t>(ttd);
+    drTXT.d_place = DNSResourceRecord::ANSWER;
     records.clear();
-    records.push_back(dr1);
+    records.push_back(drTXT);
     MRC.replace(now, power, QType(QType::TXT), records, signatures, authRecords, true, boost::none);
     // we should not have replaced any existing entry
     BOOST_CHECK_EQUAL(MRC.size(), 3);
@@ -331,6 +342,8 @@ BOOST_AUTO_TEST_CASE(test_RecursorCacheSimple) {
 }
 
 BOOST_AUTO_TEST_CASE(test_RecursorCache_ExpungingExpiredEntries) {
+  reportAllTypes();
+
   MemRecursorCache MRC;
 
   std::vector<DNSRecord> records;
@@ -420,6 +433,8 @@ BOOST_AUTO_TEST_CASE(test_RecursorCache_ExpungingExpiredEntries) {
 }
 
 BOOST_AUTO_TEST_CASE(test_RecursorCache_ExpungingValidEntries) {
+  reportAllTypes();
+
   MemRecursorCache MRC;
 
   std::vector<DNSRecord> records;
@@ -597,6 +612,8 @@ BOOST_AUTO_TEST_CASE(test_RecursorCache_ExpungingValidEntries) {
 }
 
 BOOST_AUTO_TEST_CASE(test_RecursorCacheECSIndex) {
+  reportAllTypes();
+
   MemRecursorCache MRC;
 
   const DNSName power("powerdns.com.");
@@ -752,4 +769,434 @@ BOOST_AUTO_TEST_CASE(test_RecursorCacheECSIndex) {
   BOOST_CHECK_EQUAL(MRC.ecsIndexSize(), 0);
 }
 
+BOOST_AUTO_TEST_CASE(test_RecursorCache_ECSLimitPerName) {
+  MemRecursorCache MRC;
+  MemRecursorCache::s_maxECSEntriesPerName = 16;
+
+  const DNSName power("powerdns.com.");
+  const DNSName other("other.powerdns.com.");
+  std::vector<DNSRecord> records;
+  std::vector<std::shared_ptr<DNSRecord>> authRecords;
+  std::vector<std::shared_ptr<RRSIGRecordContent>> signatures;
+  time_t now = time(nullptr);
+  std::vector<DNSRecord> retrieved;
+
+  DNSRecord dr;
+  dr.d_name = power;
+  dr.d_type = QType::A;
+  dr.d_class = QClass::IN;
+  dr.d_content = std::make_shared<ARecordContent>(ComboAddress("192.0.2.1"));
+  dr.d_ttl = static_cast<uint32_t>(now + 30);
+  dr.d_place = DNSResourceRecord::ANSWER;
+  records.push_back(dr);
+
+  /* a non-specific entry, and a broad one for 'other' */
+  MRC.replace(now, power, QType(QType::A), records, signatures, authRecords, true, boost::none);
+  MRC.replace(now, other, QType(QType::A), records, signatures, authRecords, true, Netmask("192.0.2.0/24"));
+
+  /* a /24 that should survive, then 15 /32s to reach the limit */
+  MRC.replace(now, power, QType(QType::A), records, signatures, authRecords, true, Netmask("198.51.100.0/24"));
+  for (size_t idx = 0; idx < 15; idx++) {
+    MRC.replace(now, power, QType(QType::A), records, signatures, authRecords, true, Netmask("203.0.113." + std::to_string(idx) + "/32"));
+  }
+  BOOST_CHECK_EQUAL(MRC.size(), 18);
+  BOOST_CHECK_EQUAL(MRC.ecsEntriesCount(), 17);
+  BOOST_CHECK_EQUAL(MRC.ecsEvictions, 0);
+
+  /* one more, the limit is enforced: 1 + 16/8 /32s are evicted to make room */
+  MRC.replace(now, power, QType(QType::A), records, signatures, authRecords, true, Netmask("203.0.113.200/32"));
+  BOOST_CHECK_EQUAL(MRC.ecsEvictions, 3);
+  BOOST_CHECK_EQUAL(MRC.ecsEntriesCount(), 15);
+  BOOST_CHECK_EQUAL(MRC.size(), 16);
+  BOOST_CHECK_EQUAL(MRC.ecsIndexSize(), 2);
+
+  /* the broad entry, the new one and the one for the other name are still there */
+  BOOST_CHECK_GT(MRC.get(now, power, QType(QType::A), false, &retrieved, ComboAddress("198.51.100.42")), 0);
+  BOOST_CHECK_GT(MRC.get(now, power, QType(QType::A), false, &retrieved, ComboAddress("203.0.113.200")), 0);
+  BOOST_CHECK_GT(MRC.get(now, other, QType(QType::A), false, &retrieved, ComboAddress("192.0.2.42")), 0);
+
+  /* expired entries go before the narrow ones */
+  MRC.doPrune(0);
+  BOOST_CHECK_EQUAL(MRC.ecsEntriesCount(), 0);
+  MRC.replace(now, power, QType(QType::A), records, signatures, authRecords, true, Netmask("198.51.100.0/24"));
+  dr.d_ttl = static_cast<uint32_t>(now - 1);
+  records.clear();
+  records.push_back(dr);
+  for (size_t idx = 0; idx < 15; idx++) {
+    MRC.replace(now, power, QType(QType::A), records, signatures, authRecords, true, Netmask("203.0.113." + std::to_string(idx) + "/32"));
+  }
+  MRC.replace(now, power, QType(QType::A), records, signatures, authRecords, true, Netmask("192.0.2.0/24"));
+  BOOST_CHECK_EQUAL(MRC.ecsEntriesCount(), 14);
+  BOOST_CHECK_GT(MRC.get(now, power, QType(QType::A), false, &retrieved, ComboAddress("198.51.100.42")), 0);
+
+  MemRecursorCache::s_maxECSEntriesPerName = 0;
+}
+
+BOOST_AUTO_TEST_CASE(test_RecursorCache_ECSLimit) {
+  MemRecursorCache MRC;
+  MemRecursorCache::s_maxECSEntries = 100;
+
+  const DNSName power("powerdns.com.");
+  std::vector<DNSRecord> records;
+  std::vector<std::shared_ptr<DNSRecord>> authRecords;
+  std::vector<std::shared_ptr<RRSIGRecordContent>> signatures;
+  time_t now = time(nullptr);
+  std::vector<DNSRecord> retrieved;
+
+  DNSRecord dr;
+  dr.d_type = QType::A;
+  dr.d_class = QClass::IN;
+  dr.d_content = std::make_shared<ARecordContent>(ComboAddress("192.0.2.1"));
+  dr.d_ttl = static_cast<uint32_t>(now + 30);
+  dr.d_place = DNSResourceRecord::ANSWER;
+  records.push_back(dr);
+
+  /* 50 names without ECS, 50 names with a /24, and 50 names with two /32s each */
+  for (size_t idx = 0; idx < 50; idx++) {
+    const DNSName name(std::to_string(idx) + ".plain.powerdns.com.");
+    records.at(0).d_name = name;
+    MRC.replace(now, name, QType(QType::A), records, signatures, authRecords, true, boost::none);
+  }
+  for (size_t idx = 0; idx < 50; idx++) {
+    const DNSName name(std::to_string(idx) + ".broad.powerdns.com.");
+    records.at(0).d_name = name;
+    MRC.replace(now, name, QType(QType::A), records, signatures, authRecords, true, Netmask("192.0.2.0/24"));
+  }
+  for (size_t idx = 0; idx < 50; idx++) {
+    const DNSName name(std::to_string(idx) + ".narrow.powerdns.com.");
+    records.at(0).d_name = name;
+    MRC.replace(now, name, QType(QType::A), records, signatures, authRecords, true, Netmask("192.0.2.1/32"));
+    MRC.replace(now, name, QType(QType::A), records, signatures, authRecords, true, Netmask("192.0.2.2/32"));
+  }
+
+  BOOST_CHECK_EQUAL(MRC.size(), 200);
+  BOOST_CHECK_EQUAL(MRC.ecsEntriesCount(), 150);
+  BOOST_CHECK_EQUAL(MRC.ecsIndexSize(), 100);
+
+  /* the main cache is large enough, but we have too many ECS-specific entries: the /32s go first */
+  MRC.doPrune(1000);
+  BOOST_CHECK_EQUAL(MRC.ecsEvictions, 50);
+  BOOST_CHECK_EQUAL(MRC.ecsEntriesCount(), 100);
+  BOOST_CHECK_EQUAL(MRC.size(), 150);
+
+  size_t plain = 0, broad = 0, narrow = 0;
+  for (size_t idx = 0; idx < 50; idx++) {
+    if (MRC.get(now, DNSName(std::to_string(idx) + ".plain.powerdns.com."), QType(QType::A), false, &retrieved, ComboAddress("192.0.2.1")) > 0) {
+      plain++;
+    }
+    if (MRC.get(now, DNSName(std::to_string(idx) + ".broad.powerdns.com."), QType(QType::A), false, &retrieved, ComboAddress("192.0.2.1")) > 0) {
+      broad++;
+    }
+    if (MRC.get(now, DNSName(std::to_string(idx) + ".narrow.powerdns.com."), QType(QType::A), false, &retrieved, ComboAddress("192.0.2.1")) > 0) {
+      narrow++;
+    }
+  }
+  BOOST_CHECK_EQUAL(plain, 50);
+  BOOST_CHECK_EQUAL(broad, 50);
+  /* 50 /32s are left, but not necessarily the ones matching 192.0.2.1 */
+  BOOST_CHECK_LE(narrow, 50);
+
+  /* wiping takes care of the count as well */
+  MRC.doWipeCache(DNSName("powerdns.com."), true);
+  BOOST_CHECK_EQUAL(MRC.size(), 0);
+  BOOST_CHECK_EQUAL(MRC.ecsEntriesCount(), 0);
+
+  MemRecursorCache::s_maxECSEntries = 0;
+}
+
+BOOST_AUTO_TEST_CASE(test_RecursorCache_ServeStale) {
+  reportAllTypes();
+
+  MemRecursorCache MRC;
+
+  const DNSName power("powerdns.com.");
+  std::vector<DNSRecord> records;
+  std::vector<std::shared_ptr<DNSRecord>> authRecords;
+  std::vector<std::shared_ptr<RRSIGRecordContent>> signatures;
+  std::vector<DNSRecord> retrieved;
+  ComboAddress who("192.0.2.1");
+  time_t now = time(nullptr);
+  time_t ttd = now + 30;
+
+  DNSRecord dr1;
+  ComboAddress dr1Content("192.0.2.2");
+  dr1.d_name = power;
+  dr1.d_type = QType::A;
+  dr1.d_class = QClass::IN;
+  dr1.d_content = std::make_shared<ARecordContent>(dr1Content);
+  dr1.d_ttl = static_cast<uint32_t>(ttd);
+  dr1.d_place = DNSResourceRecord::ANSWER;
+  records.push_back(dr1);
+
+  MemRecursorCache::s_maxStaleTTL = 3600;
+  MemRecursorCache::s_staleAnswerTTL = 10;
+
+  MRC.replace(now, power, QType(QType::A), records, signatures, authRecords, true, boost::none);
+  BOOST_CHECK_EQUAL(MRC.size(), 1);
+
+  /* not expired yet, serving stale or not makes no difference */
+  BOOST_CHECK_EQUAL(MRC.get(now, power, QType(QType::A), false, &retrieved, who, nullptr, nullptr, nullptr, nullptr, nullptr, true), ttd - now);
+  BOOST_REQUIRE_EQUAL(retrieved.size(), 1);
+  BOOST_CHECK_EQUAL(retrieved.at(0).d_ttl, ttd);
+
+  /* expired, regular lookups don't get it */
+  time_t later = ttd + 60;
+  BOOST_CHECK_LE(MRC.get(later, power, QType(QType::A), false, &retrieved, who), 0);
+  BOOST_CHECK_EQUAL(retrieved.size(), 0);
+
+  /* but it should still be there to be served stale, with a short TTL */
+  BOOST_CHECK_EQUAL(MRC.get(later, power, QType(QType::A), false, &retrieved, who, nullptr, nullptr, nullptr, nullptr, nullptr, true), MemRecursorCache::s_staleAnswerTTL);
+  BOOST_REQUIRE_EQUAL(retrieved.size(), 1);
+  BOOST_CHECK_EQUAL(getRR<ARecordContent>(retrieved.at(0))->getCA().toString(), dr1Content.toString());
+  BOOST_CHECK_EQUAL(retrieved.at(0).d_ttl, later + MemRecursorCache::s_staleAnswerTTL);
+
+  BOOST_CHECK_EQUAL(MRC.staleHits, 1);
+
+  /* the same goes for an ECS-specific entry, which stays in the ECS index for that */
+  const DNSName www("www.powerdns.com.");
+  records.at(0).d_name = www;
+  MRC.replace(now, www, QType(QType::A), records, signatures, authRecords, true, Netmask("192.0.2.0/24"));
+  BOOST_CHECK_EQUAL(MRC.ecsIndexSize(), 1);
+  BOOST_CHECK_LE(MRC.get(later, www, QType(QType::A), false, &retrieved, who), 0);
+  BOOST_CHECK_EQUAL(retrieved.size(), 0);
+  BOOST_CHECK_EQUAL(MRC.get(later, www, QType(QType::A), false, &retrieved, who, nullptr, nullptr, nullptr, nullptr, nullptr, true), MemRecursorCache::s_staleAnswerTTL);
+  BOOST_REQUIRE_EQUAL(retrieved.size(), 1);
+  BOOST_CHECK_EQUAL(getRR<ARecordContent>(retrieved.at(0))->getCA().toString(), dr1Content.toString());
+  /* but not to clients outside of its scope */
+  BOOST_CHECK_LE(MRC.get(later, www, QType(QType::A), false, &retrieved, ComboAddress("198.51.100.1"), nullptr, nullptr, nullptr, nullptr, nullptr, true), 0);
+  BOOST_CHECK_EQUAL(MRC.staleHits, 2);
+
+  /* past the stale window, it can't be served anymore */
+  time_t muchLater = ttd + MemRecursorCache::s_maxStaleTTL + 1;
+  BOOST_CHECK_LE(MRC.get(muchLater, power, QType(QType::A), false, &retrieved, who, nullptr, nullptr, nullptr, nullptr, nullptr, true), 0);
+  BOOST_CHECK_EQUAL(retrieved.size(), 0);
+  BOOST_CHECK_LE(MRC.get(muchLater, www, QType(QType::A), false, &retrieved, who, nullptr, nullptr, nullptr, nullptr, nullptr, true), 0);
+  BOOST_CHECK_EQUAL(retrieved.size(), 0);
+
+  MemRecursorCache::s_maxStaleTTL = 0;
+  MemRecursorCache::s_staleAnswerTTL = 30;
+}
+
+BOOST_AUTO_TEST_CASE(test_RecursorCache_Contents) {
+  reportAllTypes();
+
+  MemRecursorCache MRC;
+
+  const DNSName power("powerdns.com.");
+  std::vector<DNSRecord> records;
+  std::vector<std::shared_ptr<DNSRecord>> authRecords;
+  std::vector<std::shared_ptr<RRSIGRecordContent>> signatures;
+  std::vector<std::shared_ptr<RRSIGRecordContent>> retrievedSignatures;
+  std::vector<DNSRecord> retrieved;
+  ComboAddress who("192.0.2.1");
+  time_t now = time(nullptr);
+  time_t ttd = now + 30;
+
+  BOOST_CHECK_EQUAL(MRC.bytes(), 0);
+
+  /* names in the content share a suffix with the owner name */
+  for (const auto& content : { "ns1.powerdns.com.", "ns2.powerdns.com.", "ns.example.net." }) {
+    DNSRecord dr;
+    dr.d_name = power;
+    dr.d_type = QType::NS;
+    dr.d_class = QClass::IN;
+    dr.d_content = DNSRecordContent::mastermake(QType::NS, QClass::IN, content);
+    dr.d_ttl = static_cast<uint32_t>(ttd);
+    dr.d_place = DNSResourceRecord::AUTHORITY;
+    records.push_back(dr);
+  }
+  signatures.push_back(std::dynamic_pointer_cast<RRSIGRecordContent>(DNSRecordContent::mastermake(QType::RRSIG, QClass::IN, "NS 8 2 3600 20300101000000 20200101000000 42 powerdns.com. c2lnbmF0dXJl")));
+
+  MRC.replace(now, power, QType(QType::NS), records, signatures, authRecords, true, boost::none);
+  BOOST_CHECK_EQUAL(MRC.size(), 1);
+  const uint64_t bytes = MRC.bytes();
+  BOOST_CHECK_GT(bytes, 0);
+
+  BOOST_CHECK_EQUAL(MRC.get(now, power, QType(QType::NS), false, &retrieved, who, &retrievedSignatures), ttd - now);
+  BOOST_REQUIRE_EQUAL(retrieved.size(), records.size());
+  for (size_t idx = 0; idx < records.size(); idx++) {
+    BOOST_CHECK_EQUAL(retrieved.at(idx).d_name, power);
+    BOOST_CHECK_EQUAL(retrieved.at(idx).d_type, QType::NS);
+    BOOST_CHECK_EQUAL(retrieved.at(idx).d_content->getZoneRepresentation(), records.at(idx).d_content->getZoneRepresentation());
+  }
+  BOOST_REQUIRE_EQUAL(retrievedSignatures.size(), 1);
+  BOOST_CHECK_EQUAL(retrievedSignatures.at(0)->getZoneRepresentation(), signatures.at(0)->getZoneRepresentation());
+
+  /* not asking for the signatures does not return any */
+  retrievedSignatures.clear();
+  BOOST_CHECK_EQUAL(MRC.get(now, power, QType(QType::NS), false, &retrieved, who), ttd - now);
+  BOOST_CHECK_EQUAL(retrievedSignatures.size(), 0);
+
+  /* a larger entry takes more room */
+  records.push_back(records.at(0));
+  records.back().d_content = DNSRecordContent::mastermake(QType::NS, QClass::IN, "a-much-longer-name-for-a-nameserver.example.org.");
+  MRC.replace(now, power, QType(QType::NS), records, signatures, authRecords, true, boost::none);
+  BOOST_CHECK_EQUAL(MRC.size(), 1);
+  BOOST_CHECK_GT(MRC.bytes(), bytes);
+
+  MRC.doWipeCache(power, false);
+  BOOST_CHECK_EQUAL(MRC.bytes(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_RecursorCache_Snapshot) {
+  reportAllTypes();
+
+  MemRecursorCache MRC;
+
+  const DNSName power("powerdns.com.");
+  const DNSName www("www.powerdns.com.");
+  std::vector<DNSRecord> records;
+  std::vector<std::shared_ptr<DNSRecord>> authRecords;
+  std::vector<std::shared_ptr<RRSIGRecordContent>> signatures;
+  std::vector<DNSRecord> retrieved;
+  ComboAddress who("192.0.2.1");
+  time_t now = time(nullptr);
+  time_t ttd = now + 30;
+
+  DNSRecord dr1;
+  ComboAddress dr1Content("192.0.2.2");
+  dr1.d_name = power;
+  dr1.d_type = QType::A;
+  dr1.d_class = QClass::IN;
+  dr1.d_content = std::make_shared<ARecordContent>(dr1Content);
+  dr1.d_ttl = static_cast<uint32_t>(ttd);
+  dr1.d_place = DNSResourceRecord::ANSWER;
+  records.push_back(dr1);
+  MRC.replace(now, power, QType(QType::A), records, signatures, authRecords, true, boost::none, Secure);
+
+  DNSRecord dr2;
+  ComboAddress dr2Content("192.0.2.3");
+  dr2.d_name = www;
+  dr2.d_type = QType::A;
+  dr2.d_class = QClass::IN;
+  dr2.d_content = std::make_shared<ARecordContent>(dr2Content);
+  dr2.d_ttl = static_cast<uint32_t>(ttd + 3600);
+  dr2.d_place = DNSResourceRecord::ANSWER;
+  records.clear();
+  records.push_back(dr2);
+  MRC.replace(now, www, QType(QType::A), records, signatures, authRecords, false, Netmask("192.0.2.0/24"), Bogus);
+  BOOST_CHECK_EQUAL(MRC.size(), 2);
+
+  FILE* fp = tmpfile();
+  BOOST_REQUIRE(fp != nullptr);
+  {
+    CacheSnapshotWriter writer(fp);
+    BOOST_CHECK_EQUAL(MRC.saveSnapshot(writer), 2);
+    writer.writeTag(CacheSnapshotTag::End);
+  }
+
+  /* handing it over in chunks, to be written by another thread, gives the same bytes */
+  {
+    CacheSnapshotChunks chunks;
+    std::string encoded;
+    std::thread consumer([&chunks, &encoded]() {
+        std::string chunk;
+        while (chunks.pop(chunk)) {
+          encoded += chunk;
+        }
+      });
+    {
+      CacheSnapshotWriter writer(chunks);
+      BOOST_CHECK_EQUAL(MRC.saveSnapshot(writer), 2);
+      writer.writeTag(CacheSnapshotTag::End);
+      writer.flush();
+    }
+    chunks.finish(true);
+    consumer.join();
+    BOOST_CHECK(chunks.isComplete());
+
+    std::string onDisk(encoded.size() + 1, '\0');
+    rewind(fp);
+    BOOST_CHECK_EQUAL(fread(&onDisk[0], 1, onDisk.size(), fp), encoded.size());
+    onDisk.resize(encoded.size());
+    BOOST_CHECK(onDisk == encoded);
+  }
+
+  MemRecursorCache restored;
+  rewind(fp);
+  {
+    CacheSnapshotReader reader(fp);
+    BOOST_REQUIRE(reader.readTag() == CacheSnapshotTag::Record);
+    BOOST_CHECK(restored.loadSnapshotEntry(reader, now));
+    BOOST_REQUIRE(reader.readTag() == CacheSnapshotTag::Record);
+    BOOST_CHECK(restored.loadSnapshotEntry(reader, now));
+    BOOST_CHECK(reader.readTag() == CacheSnapshotTag::End);
+  }
+  BOOST_CHECK_EQUAL(restored.size(), 2);
+  BOOST_CHECK_EQUAL(restored.ecsIndexSize(), 1);
+
+  /* the TTL, validation state and auth bit survived the round trip */
+  vState state = Indeterminate;
+  bool wasAuth = false;
+  BOOST_CHECK_EQUAL(restored.get(now, power, QType(QType::A), true, &retrieved, who, nullptr, nullptr, nullptr, &state, &wasAuth), ttd - now);
+  BOOST_REQUIRE_EQUAL(retrieved.size(), 1);
+  BOOST_CHECK_EQUAL(getRR<ARecordContent>(retrieved.at(0))->getCA().toString(), dr1Content.toString());
+  BOOST_CHECK_EQUAL(state, Secure);
+  BOOST_CHECK_EQUAL(wasAuth, true);
+
+  /* and so did the ECS scope */
+  BOOST_CHECK_EQUAL(restored.get(now, www, QType(QType::A), false, &retrieved, ComboAddress("192.0.2.42"), nullptr, nullptr, nullptr, &state), ttd + 3600 - now);
+  BOOST_REQUIRE_EQUAL(retrieved.size(), 1);
+  BOOST_CHECK_EQUAL(getRR<ARecordContent>(retrieved.at(0))->getCA().toString(), dr2Content.toString());
+  BOOST_CHECK_EQUAL(state, Bogus);
+  BOOST_CHECK_LE(restored.get(now, www, QType(QType::A), false, &retrieved, ComboAddress("198.51.100.1")), 0);
+
+  /* entries that expired since the snapshot was taken are not loaded */
+  MemRecursorCache late;
+  rewind(fp);
+  {
+    CacheSnapshotReader reader(fp);
+    BOOST_REQUIRE(reader.readTag() == CacheSnapshotTag::Record);
+    BOOST_CHECK(!late.loadSnapshotEntry(reader, ttd + 1));
+    BOOST_REQUIRE(reader.readTag() == CacheSnapshotTag::Record);
+    BOOST_CHECK(late.loadSnapshotEntry(reader, ttd + 1));
+  }
+  BOOST_CHECK_EQUAL(late.size(), 1);
+
+  fclose(fp);
+}
+
+BOOST_AUTO_TEST_CASE(test_CacheSnapshotChunks) {
+  /* the encoding side waits once s_maxChunks are queued */
+  CacheSnapshotChunks chunks;
+  for (size_t idx = 0; idx < CacheSnapshotChunks::s_maxChunks; idx++) {
+    chunks.push(std::to_string(idx));
+  }
+  std::atomic<bool> pushed(false);
+  std::thread producer([&chunks, &pushed]() {
+      chunks.push("last");
+      pushed = true;
+      chunks.finish(false);
+    });
+  usleep(100000);
+  BOOST_CHECK(!pushed);
+
+  std::string chunk;
+  BOOST_REQUIRE(chunks.pop(chunk));
+  BOOST_CHECK_EQUAL(chunk, "0");
+  producer.join();
+  BOOST_CHECK(pushed);
+
+  /* the remaining chunks are still there after the end, which is not a complete one */
+  size_t count = 0;
+  while (chunks.pop(chunk)) {
+    count++;
+  }
+  BOOST_CHECK_EQUAL(count, CacheSnapshotChunks::s_maxChunks);
+  BOOST_CHECK_EQUAL(chunk, "last");
+  BOOST_CHECK(!chunks.isComplete());
+
+  /* once the writing side gave up, the encoding side is told to stop instead of waiting forever */
+  CacheSnapshotChunks aborted;
+  for (size_t idx = 0; idx < CacheSnapshotChunks::s_maxChunks; idx++) {
+    aborted.push(std::to_string(idx));
+  }
+  std::thread writer([&aborted]() {
+      usleep(50000);
+      aborted.abort();
+    });
+  BOOST_CHECK_THROW(aborted.push("more"), std::runtime_error);
+  writer.join();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -298,7 +298,7 @@ string reloadAuthAndForwards()
     // purge again - new zones need to blank out the cache
     for(const auto& i : *newDomainMap) {
         broadcastAccFunction<uint64_t>(boost::bind(pleaseWipeCache, i.first, true));
-        broadcastAccFunction<uint64_t>(boost::bind(pleaseWipePacketCache, i.first, true));
+        wipePacketCache(i.first, true);
         broadcastAccFunction<uint64_t>(boost::bind(pleaseWipeAndCountNegCache, i.first, true));
     }
 
@@ -344,9 +344,12 @@ void RPZIXFRTracker(const ComboAddress& master, const DNSName& zoneName, boost::
       continue;
     L<<Logger::Info<<"Processing "<<deltas.size()<<" delta"<<addS(deltas)<<" for RPZ "<<zoneName<<endl;
 
+    DTime dt;
+    dt.set();
     auto luaconfsLocal = g_luaconfs.getLocal();
     const std::shared_ptr<DNSFilterEngine::Zone> oldZone = luaconfsLocal->dfe.getZone(zoneIdx);
-    /* we need to make a _full copy_ of the zone we are going to work on */
+    /* the copy shares the policies of the old zone and only stores the changes we are going to make,
+       so the threads still using the old zone are not affected */
     std::shared_ptr<DNSFilterEngine::Zone> newZone = std::make_shared<DNSFilterEngine::Zone>(*oldZone);
 
     int totremove=0, totadd=0;
@@ -402,6 +405,12 @@ void RPZIXFRTracker(const ComboAddress& master, const DNSName& zoneName, boost::
     g_luaconfs.modify([zoneIdx, &newZone](LuaConfigItems& lci) {
                         lci.dfe.setZone(zoneIdx, newZone);
                       });
+
+    uint64_t usec = dt.udiff();
+    g_stats.rpzUpdates++;
+    g_stats.rpzUpdateUsec += usec;
+    g_stats.rpzLastUpdateUsec = usec;
+    L<<Logger::Info<<"Applied the RPZ update for "<<zoneName<<" in "<<usec<<" usec"<<endl;
   }
 }
 
@@ -3,12 +3,8 @@
 #include "statbag.hh"
 
 extern StatBag S;
-/**
- *  Function that creates all the stats
- *  when udpOrTCP is true, it is udp
- */
-void ResponseStats::submitResponse(DNSPacket &p, bool udpOrTCP) {
-  const string& buf=p.getString();
+static void accountResponse(const ComboAddress& remote, size_t len, bool udpOrTCP)
+{
   static AtomicCounter &udpnumanswered=*S.getPointer("udp-answers");
   static AtomicCounter &udpnumanswered4=*S.getPointer("udp4-answers");
   static AtomicCounter &udpnumanswered6=*S.getPointer("udp6-answers");
@@ -22,35 +18,86 @@ void ResponseStats::submitResponse(DNSPacket &p, bool udpOrTCP) {
   static AtomicCounter &tcpbytesanswered4=*S.getPointer("tcp4-answers-bytes");
   static AtomicCounter &tcpbytesanswered6=*S.getPointer("tcp6-answers-bytes");
 
-  if(p.d.aa) {
-    if (p.d.rcode==RCode::NXDomain)
-      S.ringAccount("nxdomain-queries",p.qdomain.toLogString()+"/"+p.qtype.getName());
-  } else if (p.isEmpty()) {
-    S.ringAccount("unauth-queries",p.qdomain.toLogString()+"/"+p.qtype.getName());
-    S.ringAccount("remotes-unauth",p.d_remote);
-  }
-
   if (udpOrTCP) { // udp
     udpnumanswered++;
-    udpbytesanswered+=buf.length();
-    if(p.d_remote.sin4.sin_family==AF_INET) {
+    udpbytesanswered+=len;
+    if(remote.sin4.sin_family==AF_INET) {
       udpnumanswered4++;
-      udpbytesanswered4+=buf.length();
+      udpbytesanswered4+=len;
     } else {
       udpnumanswered6++;
-      udpbytesanswered6+=buf.length();
+      udpbytesanswered6+=len;
     }
   } else { //tcp
     tcpnumanswered++;
-    tcpbytesanswered+=buf.length();
-    if(p.d_remote.sin4.sin_family==AF_INET) {
+    tcpbytesanswered+=len;
+    if(remote.sin4.sin_family==AF_INET) {
       tcpnumanswered4++;
-      tcpbytesanswered4+=buf.length();
+      tcpbytesanswered4+=len;
     } else {
       tcpnumanswered6++;
-      tcpbytesanswered6+=buf.length();
+      tcpbytesanswered6+=len;
     }
   }
+}
+
+/**
+ *  Function that creates all the stats
+ *  when udpOrTCP is true, it is udp
+ */
+void ResponseStats::submitResponse(DNSPacket &p, bool udpOrTCP) {
+  const string& buf=p.getString();
+
+  if(p.d.aa) {
+    if (p.d.rcode==RCode::NXDomain)
+      S.ringAccount("nxdomain-queries",p.qdomain.toLogString()+"/"+p.qtype.getName());
+  } else if (p.isEmpty()) {
+    S.ringAccount("unauth-queries",p.qdomain.toLogString()+"/"+p.qtype.getName());
+    S.ringAccount("remotes-unauth",p.d_remote);
+  }
 
+  accountResponse(p.d_remote, buf.length(), udpOrTCP);
   submitResponse(p.qtype.getCode(), buf.length(), udpOrTCP);
 }
+
+/**
+ *  The wire format equivalent of DNSPacket::isEmpty(): no records, except
+ *  for the OPT record, which does not live in DNSPacket::d_rrs
+ */
+static bool isEmptyAnswer(const DNSName& qname, const char* answer, size_t len)
+{
+  const struct dnsheader* dh = reinterpret_cast<const struct dnsheader*>(answer);
+  if (dh->ancount || dh->nscount)
+    return false;
+  if (!dh->arcount)
+    return true;
+  if (ntohs(dh->arcount) != 1 || ntohs(dh->qdcount) != 1)
+    return false;
+
+  // the OPT record follows the question, with the root as its name
+  size_t pos = sizeof(struct dnsheader) + qname.wirelength() + 4;
+  if (len < pos + 3 || answer[pos] != 0)
+    return false;
+  uint16_t type;
+  memcpy(&type, answer + pos + 1, sizeof(type));
+  return ntohs(type) == QType::OPT;
+}
+
+/**
+ *  Same, for an answer that is only available in wire format,
+ *  like a packet cache hit
+ */
+void ResponseStats::submitResponse(const DNSName& qname, uint16_t qtype, const ComboAddress& remote, const char* answer, size_t len, bool udpOrTCP) {
+  const struct dnsheader* dh = reinterpret_cast<const struct dnsheader*>(answer);
+
+  if(dh->aa) {
+    if (dh->rcode==RCode::NXDomain)
+      S.ringAccount("nxdomain-queries",qname.toLogString()+"/"+QType(qtype).getName());
+  } else if (isEmptyAnswer(qname, answer, len)) {
+    S.ringAccount("unauth-queries",qname.toLogString()+"/"+QType(qtype).getName());
+    S.ringAccount("remotes-unauth",remote);
+  }
+
+  accountResponse(remote, len, udpOrTCP);
+  submitResponse(qtype, len, udpOrTCP);
+}
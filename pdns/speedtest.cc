@@ -6,6 +6,9 @@
 #include "misc.hh"
 #include "dnswriter.hh"
 #include "dnsrecords.hh"
+#include "dnssecinfra.hh"
+#include "filterpo.hh"
+#include "recpacketcache.hh"
 #include <fstream>
 
 #ifndef RECURSOR
@@ -779,6 +782,168 @@ struct B64DecodeTest
 };
 
 
+struct NSEC3HashTest
+{
+  explicit NSEC3HashTest(int iterations, bool cached): d_iterations(iterations), d_cached(cached)
+  {
+  }
+
+  string getName() const
+  {
+    return (boost::format("%d NSEC3 iterations, %s") % d_iterations % (d_cached ? "cached" : "uncached")).str();
+  }
+
+  void operator()() const
+  {
+    /* the closest encloser proof of a typical query hashes the name and all its ancestors */
+    static const vector<DNSName> names = { DNSName("www.sub.example.com"), DNSName("sub.example.com"), DNSName("example.com") };
+    for (const auto& name : names) {
+      if (d_cached) {
+        hashQNameWithSaltCached(d_salt, d_iterations, name);
+      }
+      else {
+        hashQNameWithSalt(d_salt, d_iterations, name);
+      }
+    }
+  }
+
+private:
+  const string d_salt{"\xaa\xbb\xcc\xdd", 4};
+  int d_iterations;
+  bool d_cached;
+};
+
+struct RecPacketCacheHitTest
+{
+  explicit RecPacketCacheHitTest(size_t entries): d_cache(std::make_shared<RecursorPacketCache>()), d_now(time(nullptr))
+  {
+    for (size_t idx = 0; idx < entries; idx++) {
+      DNSName name(std::to_string(idx) + ".example.com");
+      vector<uint8_t> packet;
+      DNSPacketWriter pw(packet, name, QType::A);
+      pw.getHeader()->rd=1;
+      d_queries.push_back(string(reinterpret_cast<const char*>(&packet[0]), packet.size()));
+
+      pw.getHeader()->qr=1;
+      pw.startRecord(name, QType::A, 3600);
+      ARecordContent ar(ComboAddress("192.0.2.1"));
+      ar.toPacket(pw);
+      pw.commit();
+
+      string response;
+      uint32_t age, qhash;
+      d_cache->getResponsePacket(0, d_queries.back(), d_now, &response, &age, &qhash);
+      d_cache->insertResponsePacket(0, qhash, name, QType::A, QClass::IN, string(reinterpret_cast<const char*>(&packet[0]), packet.size()), d_now, 3600);
+    }
+  }
+
+  string getName() const
+  {
+    return (boost::format("recursor packet cache hit, %d entries") % d_queries.size()).str();
+  }
+
+  void operator()() const
+  {
+    string response;
+    uint32_t age, qhash;
+    g_ret = d_cache->getResponsePacket(0, d_queries[d_pos++ % d_queries.size()], d_now, &response, &age, &qhash);
+  }
+
+private:
+  std::shared_ptr<RecursorPacketCache> d_cache;
+  vector<string> d_queries;
+  mutable size_t d_pos{0};
+  time_t d_now;
+};
+
+struct RPZLookupTest
+{
+  RPZLookupTest(size_t entries, size_t zones, bool compiled): d_compiled(compiled)
+  {
+    DTime dt;
+    dt.set();
+    for (size_t zoneIdx = 0; zoneIdx < zones; zoneIdx++) {
+      auto zone = std::make_shared<DNSFilterEngine::Zone>();
+      zone->setName("rpz" + std::to_string(zoneIdx));
+      zone->reserve(entries / zones);
+      DNSFilterEngine::Policy pol;
+      pol.d_kind = DNSFilterEngine::PolicyKind::NXDOMAIN;
+      for (size_t idx = zoneIdx; idx < entries; idx += zones) {
+        zone->addQNameTrigger(DNSName((idx % 2 ? "*." : "") + std::to_string(idx) + ".example" + std::to_string(idx % 100) + ".com"), pol);
+      }
+      zone->addClientTrigger(Netmask("192.0.2." + std::to_string(zoneIdx) + "/32"), pol);
+      d_dfe.addZone(zone);
+    }
+    int loadMsec = dt.udiff() / 1000;
+    if (d_compiled) {
+      d_dfe.compile();
+    }
+    cerr<<"loaded "<<entries<<" RPZ entries into "<<zones<<" zones in "<<loadMsec<<" ms, index built in "<<(dt.udiff() / 1000)<<" ms"<<endl;
+
+    /* most of the names miss */
+    for (size_t idx = 0; idx < 1000; idx++) {
+      size_t num = (idx * 7919) % (entries * 2);
+      d_names.push_back(DNSName("www." + std::to_string(num) + ".example" + std::to_string(num % 100) + ".com"));
+    }
+  }
+
+  string getName() const
+  {
+    return (boost::format("RPZ %s query policy lookup, %d zones") % (d_compiled ? "compiled" : "per-zone") % d_dfe.size()).str();
+  }
+
+  void operator()() const
+  {
+    auto pol = d_dfe.getQueryPolicy(d_names[d_pos++ % d_names.size()], d_client, d_discarded);
+    g_ret = pol.d_kind == DNSFilterEngine::PolicyKind::NoAction;
+  }
+
+private:
+  DNSFilterEngine d_dfe;
+  vector<DNSName> d_names;
+  const ComboAddress d_client{"198.51.100.1"};
+  const std::unordered_map<std::string,bool> d_discarded;
+  mutable size_t d_pos{0};
+  bool d_compiled;
+};
+
+struct RPZUpdateTest
+{
+  RPZUpdateTest(size_t entries, size_t changes): d_changes(changes)
+  {
+    auto zone = std::make_shared<DNSFilterEngine::Zone>();
+    zone->setName("rpz");
+    zone->reserve(entries);
+    d_pol.d_kind = DNSFilterEngine::PolicyKind::NXDOMAIN;
+    for (size_t idx = 0; idx < entries; idx++) {
+      zone->addQNameTrigger(DNSName(std::to_string(idx) + ".example.com"), d_pol);
+    }
+    d_dfe.addZone(zone);
+    d_dfe.compile();
+  }
+
+  string getName() const
+  {
+    return (boost::format("RPZ update of %d names in a %d entries zone") % d_changes % d_dfe.getZone(0)->size()).str();
+  }
+
+  /* what the IXFR tracker does: copy the zone, apply the delta, swap it in */
+  void operator()() const
+  {
+    auto newZone = std::make_shared<DNSFilterEngine::Zone>(*d_dfe.getZone(0));
+    for (size_t idx = 0; idx < d_changes; idx++) {
+      newZone->addQNameTrigger(DNSName("new" + std::to_string(d_pos++) + ".example.com"), d_pol);
+    }
+    d_dfe.setZone(0, newZone);
+  }
+
+private:
+  mutable DNSFilterEngine d_dfe;
+  DNSFilterEngine::Policy d_pol;
+  mutable size_t d_pos{0};
+  size_t d_changes;
+};
+
 struct NOPTest
 {
   string getName() const
@@ -877,6 +1042,20 @@ try
   doRun(DNSNameParseTest());
   doRun(DNSNameRootTest());
 
+  doRun(NSEC3HashTest(1, false));
+  doRun(NSEC3HashTest(1, true));
+  doRun(NSEC3HashTest(150, false));
+  doRun(NSEC3HashTest(150, true));
+  doRun(NSEC3HashTest(500, false));
+  doRun(NSEC3HashTest(500, true));
+
+  doRun(RecPacketCacheHitTest(1000));
+  doRun(RecPacketCacheHitTest(100000));
+
+  doRun(RPZLookupTest(2000000, 20, false));
+  doRun(RPZLookupTest(2000000, 20, true));
+  doRun(RPZUpdateTest(2000000, 10));
+
   cerr<<"Total runs: " << g_totalRuns<<endl;
 
 }
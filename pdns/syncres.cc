@@ -24,6 +24,7 @@
 #endif
 
 #include "arguments.hh"
+#include "cache-snapshot.hh"
 #include "cachecleaner.hh"
 #include "dns_random.hh"
 #include "dnsparser.hh"
@@ -68,6 +69,9 @@ std::atomic<uint64_t> SyncRes::s_nodelegated;
 std::atomic<uint64_t> SyncRes::s_unreachables;
 std::atomic<uint64_t> SyncRes::s_ecsqueries;
 std::atomic<uint64_t> SyncRes::s_ecsresponses;
+std::atomic<uint64_t> SyncRes::s_staleanswers;
+std::atomic<uint64_t> SyncRes::s_aggressivensecnxdomains;
+std::atomic<uint64_t> SyncRes::s_aggressivensecnodata;
 uint8_t SyncRes::s_ecsipv4limit;
 uint8_t SyncRes::s_ecsipv6limit;
 bool SyncRes::s_doIPv6;
@@ -135,7 +139,20 @@ int SyncRes::beginResolve(const DNSName &qname, const QType &qtype, uint16_t qcl
     return -1;
 
   set<GetBestNSAnswer> beenthere;
-  int res=doResolve(qname, qtype, ret, 0, beenthere, state);
+  int res;
+  try {
+    res=doResolve(qname, qtype, ret, 0, beenthere, state);
+  }
+  catch(const ImmediateServFailException& e) {
+    /* this includes going over max-total-msec, a stale answer is better than none */
+    if(!doServeStale(qname, qtype, ret, res, state)) {
+      throw;
+    }
+  }
+
+  if(res == RCode::ServFail) {
+    doServeStale(qname, qtype, ret, res, state);
+  }
   d_queryValidationState = state;
 
   if (d_queryValidationState != Indeterminate) {
@@ -383,6 +400,40 @@ uint64_t SyncRes::doDumpNSSpeeds(int fd)
   return count;
 }
 
+uint64_t SyncRes::saveNSSpeedsSnapshot(CacheSnapshotWriter& writer)
+{
+  uint64_t count=0;
+
+  for(const auto& i : t_sstorage.nsSpeeds)
+  {
+    if(i.second.d_collection.empty())
+      continue;
+
+    writer.writeTag(CacheSnapshotTag::NSSpeed);
+    writer.writeName(i.first);
+    writer.writeU32(i.second.d_collection.size());
+    for(const auto& j : i.second.d_collection)
+    {
+      writer.writeString(j.first.toStringWithPort());
+      writer.writeU32(static_cast<uint32_t>(j.second.peek()));
+    }
+    count++;
+  }
+  return count;
+}
+
+bool SyncRes::loadNSSpeedsSnapshotEntry(CacheSnapshotReader& reader, const struct timeval& now)
+{
+  DNSName name = reader.readName();
+  uint32_t count = reader.readU32();
+  for(uint32_t idx = 0; idx < count; idx++) {
+    ComboAddress address(reader.readString());
+    uint32_t usecs = reader.readU32();
+    t_sstorage.nsSpeeds[name].submit(address, usecs, &now);
+  }
+  return count > 0;
+}
+
 /* so here is the story. First we complete the full resolution process for a domain name. And only THEN do we decide
    to also do DNSSEC validation, which leads to new queries. To make this simple, we *always* ask for DNSSEC records
    so that if there are RRSIGs for a name, we'll have them.
@@ -458,11 +509,14 @@ int SyncRes::asyncresolveWrapper(const ComboAddress& ip, bool ednsMANDATORY, con
     if (g_lowercaseOutgoing)
       sendQname.makeUsLowerCase();
 
-    if (d_asyncResolve) {
-      ret = d_asyncResolve(ip, sendQname, type, doTCP, sendRDQuery, EDNSLevel, now, srcmask, ctx, luaconfsLocal->outgoingProtobufServer, res);
-    }
-    else {
-      ret=asyncresolve(ip, sendQname, type, doTCP, sendRDQuery, EDNSLevel, now, srcmask, ctx, luaconfsLocal->outgoingProtobufServer, res);
+    {
+      LatencyTimer outgoingTimer(doTCP ? LatencyPhase::OutgoingTCP : LatencyPhase::OutgoingUDP, &d_latencyTrace);
+      if (d_asyncResolve) {
+        ret = d_asyncResolve(ip, sendQname, type, doTCP, sendRDQuery, EDNSLevel, now, srcmask, ctx, luaconfsLocal->outgoingProtobufServer, res);
+      }
+      else {
+        ret=asyncresolve(ip, sendQname, type, doTCP, sendRDQuery, EDNSLevel, now, srcmask, ctx, luaconfsLocal->outgoingProtobufServer, res);
+      }
     }
     if(ret < 0) {
       return ret; // transport error, nothing to learn here
@@ -536,7 +590,7 @@ int SyncRes::doResolve(const DNSName &qname, const QType &qtype, vector<DNSRecor
           d_wasOutOfBand = doOOBResolve(qname, qtype, ret, depth, res);
           return res;
         }
-        else {
+        else if(!d_serveStale) { // the forwarders already failed us, only look in the cache
           const vector<ComboAddress>& servers = iter->second.d_servers;
           const ComboAddress remoteIP = servers.front();
           LOG(prefix<<qname<<": forwarding query to hardcoded nameserver '"<< remoteIP.toStringWithPort()<<"' for zone '"<<authname<<"'"<<endl);
@@ -567,6 +621,9 @@ int SyncRes::doResolve(const DNSName &qname, const QType &qtype, vector<DNSRecor
 
     if(doCacheCheck(qname,qtype,ret,depth,res,state)) // we done
       return res;
+
+    if(doAggressiveNSECCacheCheck(qname,qtype,ret,depth,res,state))
+      return res;
   }
 
   if(d_cacheonly)
@@ -871,7 +928,12 @@ bool SyncRes::doCNAMECacheCheck(const DNSName &qname, const QType &qtype, vector
   vector<std::shared_ptr<RRSIGRecordContent>> signatures;
   vector<std::shared_ptr<DNSRecord>> authorityRecs;
   bool wasAuth;
-  if(t_RC->get(d_now.tv_sec, qname, QType(QType::CNAME), d_requireAuthData, &cset, d_incomingECSFound ? d_incomingECSNetwork : d_requestor, d_doDNSSEC ? &signatures : nullptr, d_doDNSSEC ? &authorityRecs : nullptr, &d_wasVariable, &state, &wasAuth) > 0) {
+  int32_t cacheRet;
+  {
+    LatencyTimer cacheTimer(LatencyPhase::RecordCache, &d_latencyTrace);
+    cacheRet = t_RC->get(d_now.tv_sec, qname, QType(QType::CNAME), d_requireAuthData, &cset, d_incomingECSFound ? d_incomingECSNetwork : d_requestor, d_doDNSSEC ? &signatures : nullptr, d_doDNSSEC ? &authorityRecs : nullptr, &d_wasVariable, &state, &wasAuth, d_serveStale);
+  }
+  if(cacheRet > 0) {
 
     for(auto j=cset.cbegin() ; j != cset.cend() ; ++j) {
       if(j->d_ttl>(unsigned int) d_now.tv_sec) {
@@ -1129,7 +1191,12 @@ bool SyncRes::doCacheCheck(const DNSName &qname, const QType &qtype, vector<DNSR
   vector<std::shared_ptr<DNSRecord>> authorityRecs;
   uint32_t ttl=0;
   bool wasCachedAuth;
-  if(t_RC->get(d_now.tv_sec, sqname, sqt, d_requireAuthData, &cset, d_incomingECSFound ? d_incomingECSNetwork : d_requestor, d_doDNSSEC ? &signatures : nullptr, d_doDNSSEC ? &authorityRecs : nullptr, &d_wasVariable, &cachedState, &wasCachedAuth) > 0) {
+  int32_t cacheRet;
+  {
+    LatencyTimer cacheTimer(LatencyPhase::RecordCache, &d_latencyTrace);
+    cacheRet = t_RC->get(d_now.tv_sec, sqname, sqt, d_requireAuthData, &cset, d_incomingECSFound ? d_incomingECSNetwork : d_requestor, d_doDNSSEC ? &signatures : nullptr, d_doDNSSEC ? &authorityRecs : nullptr, &d_wasVariable, &cachedState, &wasCachedAuth, d_serveStale);
+  }
+  if(cacheRet > 0) {
 
     LOG(prefix<<sqname<<": Found cache hit for "<<sqt.getName()<<": ");
 
@@ -1208,6 +1275,98 @@ bool SyncRes::doCacheCheck(const DNSName &qname, const QType &qtype, vector<DNSR
   return false;
 }
 
+/*! Synthesizes a negative answer from the validated NSEC(3) records we have (RFC 8198)
+ *
+ * Only used when validation is enabled, and never for names we are authoritative for or forwarding.
+ *
+ * \return true if the denial was proven, in which case ret, res and state are updated
+ */
+bool SyncRes::doAggressiveNSECCacheCheck(const DNSName &qname, const QType &qtype, vector<DNSRecord>&ret, unsigned int depth, int &res, vState& state)
+{
+  if (AggressiveNSECCache::s_maxEntries == 0 || !validationEnabled() || !qtype.getCode() || qtype == QType::ANY) {
+    return false;
+  }
+
+  DNSName authname(qname);
+  if (getBestAuthZone(&authname) != t_sstorage.domainmap->end()) {
+    return false;
+  }
+
+  vector<DNSRecord> denial;
+  int denialRes;
+  if (!t_sstorage.aggressiveNSEC.getDenial(d_now.tv_sec, qname, qtype, denial, denialRes, d_doDNSSEC)) {
+    return false;
+  }
+
+  string prefix;
+  if(doLog()) {
+    prefix=d_prefix;
+    prefix.append(depth, ' ');
+  }
+
+  if (denialRes == RCode::NXDomain) {
+    s_aggressivensecnxdomains++;
+    LOG(prefix<<qname<<": Entire name '"<<qname<<"' is denied by the aggressive NSEC cache"<<endl);
+  }
+  else {
+    s_aggressivensecnodata++;
+    LOG(prefix<<qname<<": "<<qtype.getName()<<" is denied by the aggressive NSEC cache"<<endl);
+  }
+
+  res = denialRes;
+  state = Secure;
+  ret.insert(ret.end(), denial.begin(), denial.end());
+  return true;
+}
+
+/*! Looks for a stale answer after a failed resolution
+ *
+ * Expired record cache entries are kept for max-stale-ttl seconds. When all the
+ * authoritative servers failed us we prefer serving those, with a short TTL,
+ * over a SERVFAIL (RFC 8767). The next query after that TTL will try to refresh
+ * the entry again.
+ *
+ * \return true if a stale answer was found, in which case ret, res and state are updated
+ */
+bool SyncRes::doServeStale(const DNSName &qname, const QType &qtype, vector<DNSRecord>&ret, int &res, vState& state)
+{
+  if(MemRecursorCache::s_maxStaleTTL == 0 || d_cacheonly) {
+    return false;
+  }
+
+  vector<DNSRecord> staleRet;
+  set<GetBestNSAnswer> beenthere;
+  vState staleState = Indeterminate;
+  int staleRes;
+  const uint64_t staleHits = t_RC->staleHits;
+
+  d_serveStale = true;
+  d_cacheonly = true;
+  try {
+    staleRes = doResolve(qname, qtype, staleRet, 0, beenthere, staleState);
+  }
+  catch(const ImmediateServFailException& e) {
+    staleRes = RCode::ServFail;
+  }
+  d_cacheonly = false;
+  d_serveStale = false;
+
+  if(staleRet.empty() || (staleRes != RCode::NoError && staleRes != RCode::NXDomain)) {
+    LOG(d_prefix<<qname<<": no stale answer available for '"<<qname<<"|"<<qtype.getName()<<"'"<<endl);
+    return false;
+  }
+
+  LOG(d_prefix<<qname<<": serving stale answer for '"<<qname<<"|"<<qtype.getName()<<"'"<<endl);
+  /* the answer might come from the negative cache or from entries that were still valid only */
+  if(t_RC->staleHits != staleHits) {
+    s_staleanswers++;
+  }
+  ret = std::move(staleRet);
+  res = staleRes;
+  state = staleState;
+  return true;
+}
+
 bool SyncRes::moreSpecificThan(const DNSName& a, const DNSName &b) const
 {
   return (a.isPartOf(b) && a.countLabels() > b.countLabels());
@@ -1789,7 +1948,10 @@ vState SyncRes::validateDNSKeys(const DNSName& zone, const std::vector<DNSRecord
 
   LOG(d_prefix<<": trying to validate "<<std::to_string(tentativeKeys.size())<<" DNSKEYs with "<<std::to_string(ds.size())<<" DS"<<endl);
   skeyset_t validatedKeys;
-  validateDNSKeysAgainstDS(d_now.tv_sec, zone, ds, tentativeKeys, toSign, signatures, validatedKeys);
+  {
+    LatencyTimer validationTimer(LatencyPhase::Validation, &d_latencyTrace);
+    validateDNSKeysAgainstDS(d_now.tv_sec, zone, ds, tentativeKeys, toSign, signatures, validatedKeys);
+  }
 
   LOG(d_prefix<<": we now have "<<std::to_string(validatedKeys.size())<<" DNSKEYs"<<endl);
 
@@ -1863,7 +2025,12 @@ vState SyncRes::validateRecordsWithSigs(unsigned int depth, const DNSName& qname
   }
 
   LOG(d_prefix<<"Going to validate "<<recordcontents.size()<< " record contents with "<<signatures.size()<<" sigs and "<<keys.size()<<" keys for "<<name<<endl);
-  if (validateWithKeySet(d_now.tv_sec, name, recordcontents, signatures, keys, false)) {
+  bool valid;
+  {
+    LatencyTimer validationTimer(LatencyPhase::Validation, &d_latencyTrace);
+    valid = validateWithKeySet(d_now.tv_sec, name, recordcontents, signatures, keys, false);
+  }
+  if (valid) {
     LOG(d_prefix<<"Secure!"<<endl);
     return Secure;
   }
@@ -2144,6 +2311,9 @@ bool SyncRes::processRecords(const std::string& prefix, const DNSName& qname, co
       */
       if(!wasVariable() && newtarget.empty()) {
         t_sstorage.negcache.add(ne);
+        if (state == Secure && AggressiveNSECCache::s_maxEntries > 0) {
+          t_sstorage.aggressiveNSEC.insert(ne.d_auth, ne.authoritySOA, ne.DNSSECRecords, ne.d_ttd);
+        }
         if(s_rootNXTrust && ne.d_auth.isRoot() && auth.isRoot()) {
           ne.d_name = ne.d_name.getLastLabel();
           t_sstorage.negcache.add(ne);
@@ -2288,6 +2458,9 @@ bool SyncRes::processRecords(const std::string& prefix, const DNSName& qname, co
           if(qtype.getCode()) {  // prevents us from blacking out a whole domain
             t_sstorage.negcache.add(ne);
           }
+          if (state == Secure && AggressiveNSECCache::s_maxEntries > 0) {
+            t_sstorage.aggressiveNSEC.insert(ne.d_auth, ne.authoritySOA, ne.DNSSECRecords, ne.d_ttd);
+          }
         }
         negindic=true;
       }
@@ -2726,6 +2899,26 @@ void SyncRes::setIncomingECS(boost::optional<const EDNSSubnetOpts&> incomingECS)
   }
 }
 
+Netmask SyncRes::getECSSourceSubnet() const
+{
+  if(s_ednssubnets.empty() && s_ednsdomains.d_tree.children.empty() && !s_ednsdomains.d_tree.endNode) {
+    return Netmask();
+  }
+
+  if(d_incomingECSFound) {
+    return d_incomingECS->source;
+  }
+
+  if(!d_requestor.isIPv4() || d_requestor.sin4.sin_addr.s_addr) { // detect unset 'requestor'
+    ComboAddress trunc = d_requestor;
+    uint8_t bits = trunc.isIPv4() ? s_ecsipv4limit : s_ecsipv6limit;
+    trunc.truncate(bits);
+    return Netmask(trunc, bits);
+  }
+
+  return Netmask();
+}
+
 boost::optional<Netmask> SyncRes::getEDNSSubnetMask(const ComboAddress& local, const DNSName&dn, const ComboAddress& rem)
 {
   boost::optional<Netmask> result;
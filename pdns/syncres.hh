@@ -49,6 +49,8 @@
 #include "ednssubnet.hh"
 #include "filterpo.hh"
 #include "negcache.hh"
+#include "aggressive_nsec.hh"
+#include "rec-latency.hh"
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
@@ -380,6 +382,7 @@ public:
 
   struct ThreadLocalStorage {
     NegCache negcache;
+    AggressiveNSECCache aggressiveNSEC;
     nsspeeds_t nsSpeeds;
     throttle_t throttle;
     ednsstatus_t ednsstatus;
@@ -393,6 +396,8 @@ public:
   }
   static void doEDNSDumpAndClose(int fd);
   static uint64_t doDumpNSSpeeds(int fd);
+  static uint64_t saveNSSpeedsSnapshot(CacheSnapshotWriter& writer);
+  static bool loadNSSpeedsSnapshotEntry(CacheSnapshotReader& reader, const struct timeval& now);
   static int getRootNS(struct timeval now, asyncresolve_t asyncCallback);
   static void clearDelegationOnly()
   {
@@ -529,6 +534,26 @@ public:
     return t_sstorage.negcache.wipe(name, subtree);
   }
 
+  static void clearAggressiveNSECCache()
+  {
+    t_sstorage.aggressiveNSEC.clear();
+  }
+
+  static uint64_t getAggressiveNSECCacheSize()
+  {
+    return t_sstorage.aggressiveNSEC.size();
+  }
+
+  static void pruneAggressiveNSECCache(unsigned int maxEntries)
+  {
+    t_sstorage.aggressiveNSEC.prune(maxEntries);
+  }
+
+  static uint64_t wipeAggressiveNSECCache(const DNSName& name, bool subtree = false)
+  {
+    return t_sstorage.aggressiveNSEC.wipe(name, subtree);
+  }
+
   static void setDomainMap(std::shared_ptr<domainmap_t> newMap)
   {
     t_sstorage.domainmap = newMap;
@@ -628,12 +653,19 @@ public:
     return d_now;
   }
 
+  void setNow(const struct timeval& now)
+  {
+    d_now = now;
+  }
+
   void setSkipCNAMECheck(bool skip = false)
   {
     d_skipCNAMECheck = skip;
   }
 
   void setIncomingECS(boost::optional<const EDNSSubnetOpts&> incomingECS);
+  /* the client subnet any ECS option sent to authoritative servers would be derived from, empty if ECS is not in use */
+  Netmask getECSSourceSubnet() const;
 
 #ifdef HAVE_PROTOBUF
   void setInitialRequestId(boost::optional<const boost::uuids::uuid&> initialRequestId)
@@ -666,6 +698,9 @@ public:
   static std::atomic<uint64_t> s_unreachables;
   static std::atomic<uint64_t> s_ecsqueries;
   static std::atomic<uint64_t> s_ecsresponses;
+  static std::atomic<uint64_t> s_staleanswers;
+  static std::atomic<uint64_t> s_aggressivensecnxdomains;
+  static std::atomic<uint64_t> s_aggressivensecnodata;
 
   static string s_serverID;
   static unsigned int s_minimumTTL;
@@ -695,6 +730,7 @@ public:
   unsigned int d_unreachables;
   unsigned int d_totUsec;
   ComboAddress d_requestor;
+  mutable LatencyTrace d_latencyTrace; // updated by asyncresolveWrapper() const as well
 
 private:
 
@@ -730,6 +766,8 @@ private:
   domainmap_t::const_iterator getBestAuthZone(DNSName* qname) const;
   bool doCNAMECacheCheck(const DNSName &qname, const QType &qtype, vector<DNSRecord>&ret, unsigned int depth, int &res, vState& state);
   bool doCacheCheck(const DNSName &qname, const QType &qtype, vector<DNSRecord>&ret, unsigned int depth, int &res, vState& state);
+  bool doAggressiveNSECCacheCheck(const DNSName &qname, const QType &qtype, vector<DNSRecord>&ret, unsigned int depth, int &res, vState& state);
+  bool doServeStale(const DNSName &qname, const QType &qtype, vector<DNSRecord>&ret, int &res, vState& state);
   void getBestNSFromCache(const DNSName &qname, const QType &qtype, vector<DNSRecord>&bestns, bool* flawedNSSet, unsigned int depth, set<GetBestNSAnswer>& beenthere);
   DNSName getBestNSNamesFromCache(const DNSName &qname, const QType &qtype, NsSet& nsset, bool* flawedNSSet, unsigned int depth, set<GetBestNSAnswer>&beenthere);
 
@@ -794,6 +832,8 @@ private:
   bool d_doEDNS0{true};
   bool d_incomingECSFound{false};
   bool d_requireAuthData{true};
+  /* set while we are looking for stale cache entries after a failed resolution */
+  bool d_serveStale{false};
   bool d_skipCNAMECheck{false};
   bool d_updatingRootNS{false};
   bool d_wantsRPZ{true};
@@ -805,8 +845,8 @@ private:
 
 class Socket;
 /* external functions, opaque to us */
-int asendtcp(const string& data, Socket* sock);
-int arecvtcp(string& data, size_t len, Socket* sock, bool incompleteOkay);
+int asendtcp(const string& data, Socket* sock, unsigned int timeoutMsec=0);
+int arecvtcp(string& data, size_t len, Socket* sock, bool incompleteOkay, unsigned int timeoutMsec=0);
 
 
 struct PacketID
@@ -862,7 +902,7 @@ struct PacketIDBirthdayCompare: public std::binary_function<PacketID, PacketID,
   }
 };
 extern thread_local std::unique_ptr<MemRecursorCache> t_RC;
-extern thread_local std::unique_ptr<RecursorPacketCache> t_packetCache;
+extern std::unique_ptr<RecursorPacketCache> g_packetCache;
 typedef MTasker<PacketID,string> MT_t;
 MT_t* getMT();
 
@@ -893,7 +933,11 @@ struct RecursorStats
   std::atomic<uint64_t> resourceLimits;
   std::atomic<uint64_t> overCapacityDrops;
   std::atomic<uint64_t> ipv6queries;
+  std::atomic<uint64_t> tcpOutConnectionsReused;
+  std::atomic<uint64_t> tcpOutQueriesPipelined;
   std::atomic<uint64_t> chainResends;
+  std::atomic<uint64_t> coalescedQueries;
+  std::atomic<uint64_t> coalesceTimeouts;
   std::atomic<uint64_t> nsSetInvalidations;
   std::atomic<uint64_t> ednsPingMatches;
   std::atomic<uint64_t> ednsPingMismatches;
@@ -907,6 +951,9 @@ struct RecursorStats
   std::atomic<uint64_t> dnssecValidations; // should be the sum of all dnssecResult* stats
   std::map<vState, std::atomic<uint64_t> > dnssecResults;
   std::map<DNSFilterEngine::PolicyKind, std::atomic<uint64_t> > policyResults;
+  std::atomic<uint64_t> rpzUpdates;
+  std::atomic<uint64_t> rpzUpdateUsec;
+  std::atomic<uint64_t> rpzLastUpdateUsec;
 };
 
 //! represents a running TCP/IP client session
@@ -975,11 +1022,10 @@ uint64_t* pleaseGetCacheHits();
 uint64_t* pleaseGetCacheMisses();
 uint64_t* pleaseGetConcurrentQueries();
 uint64_t* pleaseGetThrottleSize();
-uint64_t* pleaseGetPacketCacheHits();
-uint64_t* pleaseGetPacketCacheSize();
 uint64_t* pleaseWipeCache(const DNSName& canon, bool subtree=false);
-uint64_t* pleaseWipePacketCache(const DNSName& canon, bool subtree);
+uint64_t wipePacketCache(const DNSName& canon, bool subtree);
 uint64_t* pleaseWipeAndCountNegCache(const DNSName& canon, bool subtree=false);
+uint64_t* pleaseSaveCacheSnapshot();
 void doCarbonDump(void*);
 void primeHints(void);
 
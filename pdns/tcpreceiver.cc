@@ -23,6 +23,8 @@
 #include "config.h"
 #endif
 #include <boost/algorithm/string.hpp>
+#include <deque>
+#include <memory>
 #include "auth-packetcache.hh"
 #include "utility.hh"
 #include "dnssecinfra.hh"
@@ -37,6 +39,7 @@
 #include <string>
 #include "tcpreceiver.hh"
 #include "sstuff.hh"
+#include "mplexer.hh"
 
 #include <errno.h>
 #include <signal.h>
@@ -66,8 +69,9 @@ extern StatBag S;
 */
 
 pthread_mutex_t TCPNameserver::s_plock = PTHREAD_MUTEX_INITIALIZER;
-Semaphore *TCPNameserver::d_connectionroom_sem;
 PacketHandler *TCPNameserver::s_P; 
+std::atomic<size_t> TCPNameserver::s_connections{0};
+size_t TCPNameserver::d_maxConnections;
 NetmaskGroup TCPNameserver::d_ng;
 size_t TCPNameserver::d_maxTransactionsPerConn;
 size_t TCPNameserver::d_maxConnectionsPerClient;
@@ -76,73 +80,7 @@ unsigned int TCPNameserver::d_maxConnectionDuration;
 std::mutex TCPNameserver::s_clientsCountMutex;
 std::map<ComboAddress,size_t,ComboAddress::addressOnlyLessThan> TCPNameserver::s_clientsCount;
 
-void TCPNameserver::go()
-{
-  L<<Logger::Error<<"Creating backend connection for TCP"<<endl;
-  s_P=0;
-  try {
-    s_P=new PacketHandler;
-  }
-  catch(PDNSException &ae) {
-    L<<Logger::Error<<"TCP server is unable to launch backends - will try again when questions come in: "<<ae.reason<<endl;
-  }
-  pthread_create(&d_tid, 0, launcher, static_cast<void *>(this));
-}
-
-void *TCPNameserver::launcher(void *data)
-{
-  static_cast<TCPNameserver *>(data)->thread();
-  return 0;
-}
-
-// throws PDNSException if things didn't go according to plan, returns 0 if really 0 bytes were read
-static int readnWithTimeout(int fd, void* buffer, unsigned int n, unsigned int idleTimeout, bool throwOnEOF=true, unsigned int totalTimeout=0)
-{
-  unsigned int bytes=n;
-  char *ptr = (char*)buffer;
-  int ret;
-  time_t start = 0;
-  unsigned int remainingTotal = totalTimeout;
-  if (totalTimeout) {
-    start = time(NULL);
-  }
-  while(bytes) {
-    ret=read(fd, ptr, bytes);
-    if(ret < 0) {
-      if(errno==EAGAIN) {
-        ret=waitForData(fd, (totalTimeout == 0 || idleTimeout <= remainingTotal) ? idleTimeout : remainingTotal);
-        if(ret < 0)
-          throw NetworkError("Waiting for data read");
-        if(!ret)
-          throw NetworkError("Timeout reading data");
-        continue;
-      }
-      else
-        throw NetworkError("Reading data: "+stringerror());
-    }
-    if(!ret) {
-      if(!throwOnEOF && n == bytes)
-        return 0;
-      else
-        throw NetworkError("Did not fulfill read from TCP due to EOF");
-    }
-    
-    ptr += ret;
-    bytes -= ret;
-    if (totalTimeout) {
-      time_t now = time(NULL);
-      unsigned int elapsed = now - start;
-      if (elapsed >= remainingTotal) {
-        throw NetworkError("Timeout while reading data");
-      }
-      start = now;
-      remainingTotal -= elapsed;
-    }
-  }
-  return n;
-}
-
-// ditto
+// throws NetworkError if things didn't go according to plan
 static void writenWithTimeout(int fd, const void *buffer, unsigned int n, unsigned int idleTimeout)
 {
   unsigned int bytes=n;
@@ -209,15 +147,6 @@ void TCPNameserver::sendPacket(shared_ptr<DNSPacket> p, int outsock)
 }
 
 
-void TCPNameserver::getQuestion(int fd, char *mesg, int pktlen, const ComboAddress &remote, unsigned int totalTime)
-try
-{
-  readnWithTimeout(fd, mesg, pktlen, d_idleTimeout, true, totalTime);
-}
-catch(NetworkError& ae) {
-  throw NetworkError("Error reading DNS data from TCP client "+remote.toString()+": "+ae.what());
-}
-
 static void incTCPAnswerCount(const ComboAddress& remote)
 {
   S.inc("tcp-answers");
@@ -227,18 +156,6 @@ static void incTCPAnswerCount(const ComboAddress& remote)
     S.inc("tcp4-answers");
 }
 
-static bool maxConnectionDurationReached(unsigned int maxConnectionDuration, time_t start, unsigned int& remainingTime)
-{
-  if (maxConnectionDuration) {
-    time_t elapsed = time(NULL) - start;
-    if (elapsed >= maxConnectionDuration) {
-      return true;
-    }
-    remainingTime = maxConnectionDuration - elapsed;
-  }
-  return false;
-}
-
 void TCPNameserver::decrementClientCount(const ComboAddress& remote)
 {
   if (d_maxConnectionsPerClient) {
@@ -250,141 +167,594 @@ void TCPNameserver::decrementClientCount(const ComboAddress& remote)
   }
 }
 
-void *TCPNameserver::doConnection(void *data)
+typedef Distributor<DNSPacket,DNSPacket,PacketHandler> DNSDistributor;
+
+static FDMultiplexer* getMultiplexer()
 {
-  shared_ptr<DNSPacket> packet;
-  // Fix gcc-4.0 error (on AMD64)
-  int fd=(int)(long)data; // gotta love C (generates a harmless warning on opteron)
-  ComboAddress remote;
-  socklen_t remotelen=sizeof(remote);
-  size_t transactions = 0;
-  time_t start = 0;
-  if (d_maxConnectionDuration) {
-    start = time(NULL);
+  for(const auto& i : FDMultiplexer::getMultiplexerMap()) {
+    try {
+      return i.second();
+    }
+    catch(const FDMultiplexerException &fe) {
+      L<<Logger::Error<<"Non-fatal error initializing possible multiplexer ("<<fe.what()<<"), falling back"<<endl;
+    }
+    catch(...) {
+      L<<Logger::Error<<"Non-fatal error initializing possible multiplexer"<<endl;
+    }
   }
+  throw PDNSException("No working multiplexer found for the TCP server");
+}
 
-  pthread_detach(pthread_self());
-  if(getpeername(fd, (struct sockaddr *)&remote, &remotelen) < 0) {
-    L<<Logger::Warning<<"Received question from socket which had no remote address, dropping ("<<stringerror()<<")"<<endl;
-    d_connectionroom_sem->post();
-    try {
-      closesocket(fd);
+class TCPNameserver::Worker
+{
+public:
+  Worker(const vector<int>& listeners);
+  void run();
+
+private:
+  struct Connection
+  {
+    Connection(int fd, const ComboAddress& remote, time_t now): d_remote(remote), d_start(now), d_lastActivity(now), d_fd(fd)
+    {
+    }
+
+    /* Reading: waiting for queries, or at least for their answers. After the client closed its side (d_eof),
+         the queries already in the input buffer are still handled before moving to Draining
+       Draining: no more queries will be read, we close once every answer has been sent
+       Transfer: an AXFR or IXFR is waiting for the answers to the previous queries to be sent
+       Closed: no more I/O, waiting for the remaining answers from the distributor to release the socket */
+    enum class State { Reading, Draining, Transfer, Closed };
+    enum class Watch { None, Read, Write };
+
+    std::string d_input;
+    std::string d_output;
+    size_t d_outputPos{0};
+    std::shared_ptr<DNSPacket> d_transfer;
+    ComboAddress d_remote;
+    uint64_t d_id{0};
+    time_t d_start;
+    time_t d_lastActivity;
+    size_t d_transactions{0};
+    size_t d_inflight{0};
+    int d_fd;
+    bool d_eof{false};
+    State d_state{State::Reading};
+    Watch d_watch{Watch::None};
+  };
+
+  /* sent to the worker by the distributor threads (answers) and by the transfer threads (connections handed back) */
+  struct Event
+  {
+    std::shared_ptr<Connection> d_returned;
+    DNSPacket* d_answer{nullptr};
+    uint64_t d_connId{0};
+  };
+
+  struct TransferData
+  {
+    Worker* d_worker;
+    std::shared_ptr<Connection> d_conn;
+  };
+
+  /* we stop reading from a connection once that many of its queries are waiting for the backends */
+  static const size_t s_maxInflightPerConnection = 64;
+
+  static void* doTransfer(void* data);
+  static void releaseConnection(Connection& conn);
+
+  void pushEvent(Event&& event);
+  void handleEvents();
+  void handleAccept(int sock);
+  void handleReadable(const std::shared_ptr<Connection>& conn);
+  void handleWritable(const std::shared_ptr<Connection>& conn);
+  void handleQuery(const std::shared_ptr<Connection>& conn, const char* data, uint16_t len);
+  void processInput(const std::shared_ptr<Connection>& conn);
+  void writeAnswer(const std::shared_ptr<Connection>& conn, DNSPacket& answer);
+  void tryWrite(const std::shared_ptr<Connection>& conn);
+  void setWatch(const std::shared_ptr<Connection>& conn, Connection::Watch wanted);
+  void closeConnection(const std::shared_ptr<Connection>& conn);
+  void startTransfer(const std::shared_ptr<Connection>& conn);
+  void update(const std::shared_ptr<Connection>& conn);
+  void updateListening();
+  void checkTimeouts(time_t now);
+
+  std::map<uint64_t, std::shared_ptr<Connection>> d_connections;
+  std::deque<Event> d_events;
+  std::mutex d_eventsLock;
+  std::vector<char> d_readBuffer;
+  const vector<int> d_listeners;
+  std::unique_ptr<FDMultiplexer> d_mplexer;
+  DNSDistributor* d_distributor{nullptr};
+  uint64_t d_nextId{0};
+  int d_pipe[2];
+  bool d_listening{false};
+  bool d_logDNSQueries;
+};
+
+TCPNameserver::Worker::Worker(const vector<int>& listeners): d_readBuffer(65535), d_listeners(listeners), d_mplexer(getMultiplexer()), d_logDNSQueries(::arg().mustDo("log-dns-queries"))
+{
+  if(pipe(d_pipe) < 0) {
+    throw PDNSException("Unable to create the TCP worker pipe: "+stringerror());
+  }
+  setNonBlocking(d_pipe[0]);
+  setCloseOnExec(d_pipe[0]);
+  setCloseOnExec(d_pipe[1]);
+  d_mplexer->addReadFD(d_pipe[0], [this](int, FDMultiplexer::funcparam_t&) { handleEvents(); });
+}
+
+void TCPNameserver::Worker::run()
+{
+  d_distributor = DNSDistributor::Create(::arg().asNum("distributor-threads", 1));
+
+  struct timeval now;
+  time_t lastCheck = 0;
+  for(;;) {
+    updateListening();
+    d_mplexer->run(&now);
+    if (now.tv_sec != lastCheck) {
+      lastCheck = now.tv_sec;
+      checkTimeouts(now.tv_sec);
     }
-    catch(const PDNSException& e) {
-      L<<Logger::Error<<"Error closing TCP socket: "<<e.reason<<endl;
+  }
+}
+
+void TCPNameserver::Worker::pushEvent(Event&& event)
+{
+  bool wasEmpty;
+  {
+    std::lock_guard<std::mutex> lock(d_eventsLock);
+    wasEmpty = d_events.empty();
+    d_events.push_back(std::move(event));
+  }
+
+  /* the worker drains the whole queue when woken up, no need to wake it up more than once */
+  if (wasEmpty) {
+    char c = 0;
+    if (write(d_pipe[1], &c, sizeof(c)) != sizeof(c)) {
+      unixDie("write to TCP worker pipe");
     }
-    return 0;
   }
+}
 
+void TCPNameserver::Worker::handleEvents()
+{
+  char buffer[64];
+  while (read(d_pipe[0], buffer, sizeof(buffer)) > 0) {
+  }
+
+  std::deque<Event> events;
+  {
+    std::lock_guard<std::mutex> lock(d_eventsLock);
+    events.swap(d_events);
+  }
+
+  for (auto& event : events) {
+    if (event.d_returned) {
+      /* back from a transfer */
+      auto conn = event.d_returned;
+      d_connections[conn->d_id] = conn;
+      processInput(conn);
+      update(conn);
+      continue;
+    }
+
+    std::unique_ptr<DNSPacket> answer(event.d_answer);
+    auto it = d_connections.find(event.d_connId);
+    if (it == d_connections.end()) {
+      continue;
+    }
+    auto conn = it->second;
+    conn->d_inflight--;
+
+    /* no answer means this question failed or timed out in the queue, skip it and go on with the next ones */
+    if (answer && conn->d_state != Connection::State::Closed) {
+      writeAnswer(conn, *answer);
+    }
+
+    processInput(conn);
+    update(conn);
+  }
+}
+
+void TCPNameserver::Worker::updateListening()
+{
+  const bool room = s_connections < d_maxConnections;
+  if (room == d_listening) {
+    return;
+  }
+
+  for (const auto sock : d_listeners) {
+    if (room) {
+      d_mplexer->addReadFD(sock, [this](int fd, FDMultiplexer::funcparam_t&) { handleAccept(fd); });
+    }
+    else {
+      d_mplexer->removeReadFD(sock);
+    }
+  }
+
+  if (!room) {
+    L<<Logger::Warning<<"Limit of simultaneous TCP connections reached - raise max-tcp-connections"<<endl;
+  }
+  d_listening = room;
+}
+
+void TCPNameserver::Worker::handleAccept(int sock)
+{
+  ComboAddress remote;
+  remote.sin4.sin_family = AF_INET6;
+  Utility::socklen_t addrlen = remote.getSocklen();
+
+  int fd = accept(sock, reinterpret_cast<sockaddr*>(&remote), &addrlen);
+  if (fd < 0) {
+    /* the listening sockets are shared between workers, another one might have been faster */
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED) {
+      return;
+    }
+
+    L<<Logger::Error<<"TCP question accept error: "<<strerror(errno)<<endl;
+    if (errno == EMFILE) {
+      L<<Logger::Error<<"TCP handler out of filedescriptors, exiting, won't recover from this"<<endl;
+      _exit(1);
+    }
+    return;
+  }
+
+  if (s_connections++ >= d_maxConnections) {
+    /* another worker accepted a connection at the same time */
+    s_connections--;
+    L<<Logger::Warning<<"Limit of simultaneous TCP connections reached - raise max-tcp-connections"<<endl;
+    close(fd);
+    return;
+  }
+
+  if (d_maxConnectionsPerClient) {
+    std::lock_guard<std::mutex> lock(s_clientsCountMutex);
+    if (s_clientsCount[remote] >= d_maxConnectionsPerClient) {
+      L<<Logger::Notice<<"Limit of simultaneous TCP connections per client reached for "<< remote<<", dropping"<<endl;
+      s_connections--;
+      close(fd);
+      return;
+    }
+    s_clientsCount[remote]++;
+  }
+
+  DLOG(L<<"TCP Connection accepted on fd "<<fd<<endl);
   setNonBlocking(fd);
+  auto conn = std::make_shared<Connection>(fd, remote, time(nullptr));
+  conn->d_id = d_nextId++;
+  d_connections[conn->d_id] = conn;
+  update(conn);
+}
+
+void TCPNameserver::Worker::handleReadable(const std::shared_ptr<Connection>& conn)
+{
+  ssize_t got = read(conn->d_fd, d_readBuffer.data(), d_readBuffer.size());
+  if (got < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+      return;
+    }
+    L<<Logger::Info<<"Error reading DNS data from TCP client "<<conn->d_remote.toString()<<": "<<stringerror()<<endl;
+    closeConnection(conn);
+  }
+  else if (got == 0) {
+    /* the client is done sending queries, but might still be waiting for answers, including to the ones we have buffered */
+    conn->d_eof = true;
+    processInput(conn);
+  }
+  else {
+    conn->d_lastActivity = time(nullptr);
+    conn->d_input.append(d_readBuffer.data(), got);
+    processInput(conn);
+  }
+
+  update(conn);
+}
+
+void TCPNameserver::Worker::handleWritable(const std::shared_ptr<Connection>& conn)
+{
+  tryWrite(conn);
+  processInput(conn);
+  update(conn);
+}
+
+/* handles the complete queries we have in the input buffer of that connection, as long as we are allowed to */
+void TCPNameserver::Worker::processInput(const std::shared_ptr<Connection>& conn)
+{
+  size_t pos = 0;
+  while (conn->d_state == Connection::State::Reading && conn->d_inflight < s_maxInflightPerConnection) {
+    if (conn->d_input.size() - pos < 2) {
+      break;
+    }
+    const uint16_t pktlen = (static_cast<uint8_t>(conn->d_input.at(pos)) << 8) + static_cast<uint8_t>(conn->d_input.at(pos + 1));
+    if (conn->d_input.size() - pos - 2 < pktlen) {
+      break;
+    }
+
+    conn->d_transactions++;
+    if (d_maxTransactionsPerConn && conn->d_transactions > d_maxTransactionsPerConn) {
+      L << Logger::Notice<<"TCP Remote "<< conn->d_remote <<" exceeded the number of transactions per connection, dropping."<<endl;
+      conn->d_state = Connection::State::Draining;
+      break;
+    }
+
+    handleQuery(conn, conn->d_input.data() + pos + 2, pktlen);
+    pos += 2 + pktlen;
+  }
+
+  if (pos > 0) {
+    conn->d_input.erase(0, pos);
+  }
+
+  /* nothing more will come in, and every complete query we had has been handled */
+  if (conn->d_eof && conn->d_state == Connection::State::Reading && conn->d_inflight < s_maxInflightPerConnection) {
+    conn->d_state = Connection::State::Draining;
+  }
+}
+
+void TCPNameserver::Worker::handleQuery(const std::shared_ptr<Connection>& conn, const char* data, uint16_t len)
+{
+  S.inc("tcp-queries");
+  if(conn->d_remote.sin4.sin_family == AF_INET6)
+    S.inc("tcp6-queries");
+  else
+    S.inc("tcp4-queries");
+
+  auto packet = std::make_shared<DNSPacket>(true);
+  packet->setRemote(&conn->d_remote);
+  packet->d_tcp=true;
+  packet->setSocket(conn->d_fd);
+  packet->d_dt.set();
+  if(packet->parse(data, len)<0) {
+    conn->d_state = Connection::State::Draining;
+    return;
+  }
+
+  if(packet->qtype.getCode()==QType::AXFR || packet->qtype.getCode()==QType::IXFR) {
+    /* done once the answers to the previous queries have been sent */
+    conn->d_transfer = packet;
+    conn->d_state = Connection::State::Transfer;
+    return;
+  }
+
+  if(d_logDNSQueries)  {
+    string remote_text;
+    if(packet->hasEDNSSubnet())
+      remote_text = packet->getRemote().toString() + "<-" + packet->getRealRemote().toString();
+    else
+      remote_text = packet->getRemote().toString();
+    L << Logger::Notice<<"TCP Remote "<< remote_text <<" wants '" << packet->qdomain<<"|"<<packet->qtype.getName() <<
+    "', do = " <<packet->d_dnssecOk <<", bufsize = "<< packet->getMaxReplyLen()<<": ";
+  }
+
+  DNSPacket cached(false);
+  if(packet->couldBeCached() && PC.get(packet.get(), &cached)) { // short circuit - does the PacketCache recognize this question?
+    if(d_logDNSQueries)
+      L<<"packetcache HIT"<<endl;
+    cached.setRemote(&packet->d_remote);
+    cached.d.id=packet->d.id;
+    cached.d.rd=packet->d.rd; // copy in recursion desired bit
+    cached.commitD(); // commit d to the packet                        inlined
+
+    writeAnswer(conn, cached); // presigned, don't do it again
+    return;
+  }
+
+  if(d_distributor->isOverloaded()) {
+    /* unlike over UDP, the client is not going to retry, let it know right away */
+    if(d_logDNSQueries)
+      L<<"ServFail, backends are overloaded"<<endl;
+    S.inc("overload-drops");
+    S.inc("servfail-packets");
+    std::unique_ptr<DNSPacket> answer(packet->replyPacket());
+    answer->setRcode(RCode::ServFail);
+    writeAnswer(conn, *answer);
+    return;
+  }
+
+  if(d_logDNSQueries)
+    L<<"packetcache MISS"<<endl;
+
+  conn->d_inflight++;
+  const uint64_t connId = conn->d_id;
   try {
-    int mesgsize=65535;
-    scoped_array<char> mesg(new char[mesgsize]);
-    
-    DLOG(L<<"TCP Connection accepted on fd "<<fd<<endl);
-    bool logDNSQueries= ::arg().mustDo("log-dns-queries");
-    for(;;) {
-      unsigned int remainingTime = 0;
-      transactions++;
-      if (d_maxTransactionsPerConn && transactions > d_maxTransactionsPerConn) {
-        L << Logger::Notice<<"TCP Remote "<< remote <<" exceeded the number of transactions per connection, dropping.";
-        break;
-      }
-      if (maxConnectionDurationReached(d_maxConnectionDuration, start, remainingTime)) {
-        L << Logger::Notice<<"TCP Remote "<< remote <<" exceeded the maximum TCP connection duration, dropping.";
-        break;
-      }
+    /* the callback is called from a distributor thread, hand the answer back to us */
+    d_distributor->question(packet.get(), [this, connId](DNSPacket* answer) {
+        Event event;
+        event.d_connId = connId;
+        event.d_answer = answer;
+        pushEvent(std::move(event));
+      });
+  }
+  catch(DistributorFatal& df) { // when this happens, we have leaked loads of memory. Bailing out time.
+    _exit(1);
+  }
+}
 
-      uint16_t pktlen;
-      if(!readnWithTimeout(fd, &pktlen, 2, d_idleTimeout, false, remainingTime))
-        break;
-      else
-        pktlen=ntohs(pktlen);
+void TCPNameserver::Worker::writeAnswer(const std::shared_ptr<Connection>& conn, DNSPacket& answer)
+{
+  g_rs.submitResponse(answer, false);
 
-      // this check will always be false *if* no one touches
-      // the mesg array. pktlen can be maximum of 65535 as
-      // it is 2 byte unsigned variable. In getQuestion, we 
-      // write to 0 up to pktlen-1 so 65535 is just right. 
+  const string& content = answer.getString();
+  const uint16_t len = htons(content.length());
+  conn->d_output.append(reinterpret_cast<const char*>(&len), sizeof(len));
+  conn->d_output.append(content);
+  tryWrite(conn);
+}
 
-      // do not remove this check as it will catch if someone
-      // decreases the mesg buffer size for some reason. 
-      if(pktlen > mesgsize) {
-        L<<Logger::Warning<<"Received an overly large question from "<<remote.toString()<<", dropping"<<endl;
-        break;
+void TCPNameserver::Worker::tryWrite(const std::shared_ptr<Connection>& conn)
+{
+  while (conn->d_state != Connection::State::Closed && conn->d_outputPos < conn->d_output.size()) {
+    ssize_t sent = write(conn->d_fd, conn->d_output.data() + conn->d_outputPos, conn->d_output.size() - conn->d_outputPos);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
       }
-      
-      if (maxConnectionDurationReached(d_maxConnectionDuration, start, remainingTime)) {
-        L << Logger::Notice<<"TCP Remote "<< remote <<" exceeded the maximum TCP connection duration, dropping.";
-        break;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return;
       }
+      L<<Logger::Info<<"Error writing DNS data to TCP client "<<conn->d_remote.toString()<<": "<<stringerror()<<endl;
+      closeConnection(conn);
+      return;
+    }
+    if (sent == 0) {
+      closeConnection(conn);
+      return;
+    }
+    conn->d_outputPos += sent;
+    conn->d_lastActivity = time(nullptr);
+  }
 
-      getQuestion(fd, mesg.get(), pktlen, remote, remainingTime);
-      S.inc("tcp-queries");      
-      if(remote.sin4.sin_family == AF_INET6)
-        S.inc("tcp6-queries");
-      else
-        S.inc("tcp4-queries");
+  conn->d_output.clear();
+  conn->d_outputPos = 0;
+}
 
-      packet=shared_ptr<DNSPacket>(new DNSPacket(true));
-      packet->setRemote(&remote);
-      packet->d_tcp=true;
-      packet->setSocket(fd);
-      if(packet->parse(mesg.get(), pktlen)<0)
-        break;
-      
-      if(packet->qtype.getCode()==QType::AXFR) {
-        if(doAXFR(packet->qdomain, packet, fd))
-          incTCPAnswerCount(remote);
-        continue;
-      }
+void TCPNameserver::Worker::setWatch(const std::shared_ptr<Connection>& conn, Connection::Watch wanted)
+{
+  if (conn->d_watch == wanted) {
+    return;
+  }
 
-      if(packet->qtype.getCode()==QType::IXFR) {
-        if(doIXFR(packet, fd))
-          incTCPAnswerCount(remote);
-        continue;
-      }
+  /* an fd can only be in one of the lists at a time */
+  if (conn->d_watch == Connection::Watch::Read) {
+    d_mplexer->removeReadFD(conn->d_fd);
+  }
+  else if (conn->d_watch == Connection::Watch::Write) {
+    d_mplexer->removeWriteFD(conn->d_fd);
+  }
 
-      shared_ptr<DNSPacket> reply; 
-      shared_ptr<DNSPacket> cached= shared_ptr<DNSPacket>(new DNSPacket(false));
-      if(logDNSQueries)  {
-        string remote_text;
-        if(packet->hasEDNSSubnet())
-          remote_text = packet->getRemote().toString() + "<-" + packet->getRealRemote().toString();
-        else
-          remote_text = packet->getRemote().toString();
-        L << Logger::Notice<<"TCP Remote "<< remote_text <<" wants '" << packet->qdomain<<"|"<<packet->qtype.getName() <<
-        "', do = " <<packet->d_dnssecOk <<", bufsize = "<< packet->getMaxReplyLen()<<": ";
-      }
+  if (wanted == Connection::Watch::Read) {
+    d_mplexer->addReadFD(conn->d_fd, [this](int, FDMultiplexer::funcparam_t& param) {
+        auto conn = boost::any_cast<std::shared_ptr<Connection>>(param);
+        handleReadable(conn);
+      }, conn);
+  }
+  else if (wanted == Connection::Watch::Write) {
+    d_mplexer->addWriteFD(conn->d_fd, [this](int, FDMultiplexer::funcparam_t& param) {
+        auto conn = boost::any_cast<std::shared_ptr<Connection>>(param);
+        handleWritable(conn);
+      }, conn);
+  }
 
+  conn->d_watch = wanted;
+}
 
-      if(packet->couldBeCached() && PC.get(packet.get(), cached.get())) { // short circuit - does the PacketCache recognize this question?
-        if(logDNSQueries)
-          L<<"packetcache HIT"<<endl;
-        cached->setRemote(&packet->d_remote);
-        cached->d.id=packet->d.id;
-        cached->d.rd=packet->d.rd; // copy in recursion desired bit 
-        cached->commitD(); // commit d to the packet                        inlined
+void TCPNameserver::Worker::closeConnection(const std::shared_ptr<Connection>& conn)
+{
+  setWatch(conn, Connection::Watch::None);
+  conn->d_state = Connection::State::Closed;
+}
 
-        sendPacket(cached, fd); // presigned, don't do it again
-        continue;
-      }
-      if(logDNSQueries)
-          L<<"packetcache MISS"<<endl;  
-      {
-        Lock l(&s_plock);
-        if(!s_P) {
-          L<<Logger::Error<<"TCP server is without backend connections, launching"<<endl;
-          s_P=new PacketHandler;
-        }
+void TCPNameserver::Worker::releaseConnection(Connection& conn)
+{
+  try {
+    closesocket(conn.d_fd);
+  }
+  catch(const PDNSException& e) {
+    L<<Logger::Error<<"Error closing TCP socket: "<<e.reason<<endl;
+  }
+  conn.d_fd = -1;
+  decrementClientCount(conn.d_remote);
+  s_connections--;
+}
 
-        reply=shared_ptr<DNSPacket>(s_P->doQuestion(packet.get())); // we really need to ask the backend :-)
-      }
+/* Decides what to do next with that connection, depending on its state: closing it,
+   starting a transfer, waiting for it to become readable or writable. */
+void TCPNameserver::Worker::update(const std::shared_ptr<Connection>& conn)
+{
+  if (conn->d_state == Connection::State::Closed) {
+    /* the socket is in use by the packets handed to the distributor, until they come back */
+    if (conn->d_inflight == 0 && conn->d_fd != -1) {
+      releaseConnection(*conn);
+      d_connections.erase(conn->d_id);
+    }
+    return;
+  }
 
-      if(!reply)  // unable to write an answer?
-        break;
+  const bool pendingOutput = conn->d_outputPos < conn->d_output.size();
+  if (!pendingOutput && conn->d_inflight == 0) {
+    if (conn->d_state == Connection::State::Draining) {
+      closeConnection(conn);
+      update(conn);
+      return;
+    }
+    if (conn->d_state == Connection::State::Transfer) {
+      startTransfer(conn);
+      return;
+    }
+  }
 
-      sendPacket(reply, fd);
+  if (pendingOutput) {
+    setWatch(conn, Connection::Watch::Write);
+  }
+  else if (conn->d_state == Connection::State::Reading && conn->d_inflight < s_maxInflightPerConnection) {
+    setWatch(conn, Connection::Watch::Read);
+  }
+  else {
+    setWatch(conn, Connection::Watch::None);
+  }
+}
+
+void TCPNameserver::Worker::checkTimeouts(time_t now)
+{
+  /* update() might remove connections from the map */
+  std::vector<std::shared_ptr<Connection>> expired;
+  for (const auto& entry : d_connections) {
+    const auto& conn = entry.second;
+    if (conn->d_state == Connection::State::Closed) {
+      continue;
+    }
+
+    if (d_maxConnectionDuration && (now - conn->d_start) >= d_maxConnectionDuration) {
+      L << Logger::Notice<<"TCP Remote "<< conn->d_remote <<" exceeded the maximum TCP connection duration, dropping."<<endl;
+      expired.push_back(conn);
+    }
+    else if (conn->d_inflight == 0 && (now - conn->d_lastActivity) >= d_idleTimeout) {
+      expired.push_back(conn);
+    }
+  }
+
+  for (const auto& conn : expired) {
+    closeConnection(conn);
+    update(conn);
+  }
+}
+
+void TCPNameserver::Worker::startTransfer(const std::shared_ptr<Connection>& conn)
+{
+  /* the transfer thread owns the connection until it hands it back */
+  setWatch(conn, Connection::Watch::None);
+  d_connections.erase(conn->d_id);
+
+  pthread_t tid;
+  auto data = new TransferData{this, conn};
+  if(pthread_create(&tid, 0, &doTransfer, data)) {
+    L<<Logger::Error<<"Error creating thread: "<<stringerror()<<endl;
+    delete data;
+    releaseConnection(*conn);
+  }
+}
+
+void* TCPNameserver::Worker::doTransfer(void* data)
+{
+  pthread_detach(pthread_self());
+  std::unique_ptr<TransferData> td(static_cast<TransferData*>(data));
+  auto conn = td->d_conn;
+  auto packet = conn->d_transfer;
+  conn->d_transfer.reset();
+
+  bool success = false;
+  try {
+    int ret;
+    if(packet->qtype.getCode()==QType::AXFR) {
+      ret = doAXFR(packet->qdomain, packet, conn->d_fd);
+    }
+    else {
+      ret = doIXFR(packet, conn->d_fd);
+    }
+    if(ret) {
+      incTCPAnswerCount(conn->d_remote);
     }
+    success = true;
   }
   catch(PDNSException &ae) {
     Lock l(&s_plock);
@@ -395,7 +765,6 @@ void *TCPNameserver::doConnection(void *data)
   catch(NetworkError &e) {
     L<<Logger::Info<<"TCP Connection Thread died because of network error: "<<e.what()<<endl;
   }
-
   catch(std::exception &e) {
     L<<Logger::Error<<"TCP Connection Thread died because of STL error: "<<e.what()<<endl;
   }
@@ -403,19 +772,59 @@ void *TCPNameserver::doConnection(void *data)
   {
     L << Logger::Error << "TCP Connection Thread caught unknown exception." << endl;
   }
-  d_connectionroom_sem->post();
 
+  if (!success) {
+    releaseConnection(*conn);
+    return 0;
+  }
+
+  /* back to the worker for the next queries, if any */
+  conn->d_state = Connection::State::Reading;
+  conn->d_lastActivity = time(nullptr);
+  Event event;
+  event.d_returned = conn;
+  td->d_worker->pushEvent(std::move(event));
+  return 0;
+}
+
+void TCPNameserver::go()
+{
+  L<<Logger::Error<<"Creating backend connection for TCP"<<endl;
+  s_P=0;
   try {
-    closesocket(fd);
+    s_P=new PacketHandler;
   }
-  catch(const PDNSException& e) {
-    L<<Logger::Error<<"Error closing TCP socket: "<<e.reason<<endl;
+  catch(PDNSException &ae) {
+    L<<Logger::Error<<"TCP server is unable to launch backends - will try again when questions come in: "<<ae.reason<<endl;
   }
-  decrementClientCount(remote);
 
-  return 0;
+  const unsigned int numWorkers = ::arg().asNum("tcp-receiver-threads", 1);
+  for(unsigned int n = 0; n < numWorkers; ++n) {
+    d_workers.push_back(new Worker(d_sockets));
+  }
+
+  for(auto worker : d_workers) {
+    pthread_t tid;
+    pthread_create(&tid, 0, launcher, static_cast<void *>(worker));
+  }
 }
 
+void *TCPNameserver::launcher(void *data)
+{
+  try {
+    static_cast<Worker *>(data)->run();
+  }
+  catch(PDNSException &AE) {
+    L<<Logger::Error<<"TCP Nameserver thread dying because of fatal error: "<<AE.reason<<endl;
+  }
+  catch(std::exception &e) {
+    L<<Logger::Error<<"TCP Nameserver thread dying because of STL error: "<<e.what()<<endl;
+  }
+  catch(...) {
+    L<<Logger::Error<<"TCPNameserver dying because of an unexpected fatal error"<<endl;
+  }
+  _exit(1); // take rest of server with us
+}
 
 // call this method with s_plock held!
 bool TCPNameserver::canDoAXFR(shared_ptr<DNSPacket> q)
@@ -674,6 +1083,9 @@ int TCPNameserver::doAXFR(const DNSName &target, shared_ptr<DNSPacket> q, int ou
   if(haveTSIGDetails && !tsigkeyname.empty())
     outpacket->setTSIGDetails(trc, tsigkeyname, tsigsecret, trc.d_mac); // first answer is 'normal'
   
+  DTime dt;
+  dt.set();
+  uint64_t records = outpacket->getRRS().size();
   sendPacket(outpacket, outsock);
   
   trc.d_mac = outpacket->d_trc.d_mac;
@@ -756,190 +1168,253 @@ int TCPNameserver::doAXFR(const DNSName &target, shared_ptr<DNSPacket> q, int ou
     csp.submit(zrr);
   }
   
-  // now start list zone
-  if(!(sd.db->list(target, sd.domain_id))) {  
-    L<<Logger::Error<<"Backend signals error condition"<<endl;
-    outpacket->setRcode(RCode::ServFail);
-    sendPacket(outpacket,outsock);
-    return 0;
-  }
-
-
   const bool rectify = !(presignedZone || ::arg().mustDo("disable-axfr-rectify"));
-  set<DNSName> qnames, nsset, terms;
-  vector<DNSZoneRecord> zrrs;
-
-  // Add the CDNSKEY and CDS records we created earlier
-  for (auto const &synth_zrr : cds)
-    zrrs.push_back(synth_zrr);
-
-  for (auto const &synth_zrr : cdnskey)
-    zrrs.push_back(synth_zrr);
+  const bool directDNSKEY = ::arg().mustDo("direct-dnskey");
+
+  /* Records are sent as they are listed, without holding the zone in memory. Signing needs each RRset
+     in one piece, and NSEC(3) and rectifying need to know all names and delegations, so for a secured
+     zone a first pass over the listing collects just that. If that pass shows the backend lists the
+     records of a name together, which most do, each name is sent once its records are in. Otherwise,
+     the zone is sorted in memory first. */
+  struct NameInfo
+  {
+    bool nsec3{false}; // has records that need an NSEC3 with the current opt-out setting
+    bool sent{false};
+  };
+  map<DNSName, NameInfo> names;
+  set<DNSName> nsset;
+  bool grouped = true;
 
-  while(sd.db->get(zrr)) {
-    zrr.dr.d_name.makeUsLowerCase();
-    if(zrr.dr.d_name.isPartOf(target)) {
-      if (zrr.dr.d_type == QType::ALIAS && ::arg().mustDo("outgoing-axfr-expand-alias")) {
-        vector<DNSZoneRecord> ips;
-        int ret1 = stubDoResolve(getRR<ALIASRecordContent>(zrr.dr)->d_content, QType::A, ips);
-        int ret2 = stubDoResolve(getRR<ALIASRecordContent>(zrr.dr)->d_content, QType::AAAA, ips);
-        if(ret1 != RCode::NoError || ret2 != RCode::NoError) {
-          L<<Logger::Error<<"Error resolving for ALIAS "<<zrr.dr.d_content->getZoneRepresentation()<<", aborting AXFR"<<endl;
-          outpacket->setRcode(RCode::ServFail);
-          sendPacket(outpacket,outsock);
-          return 0;
-        }
-        for(const auto& ip: ips) {
-          zrr.dr.d_type = ip.dr.d_type;
-          zrr.dr.d_content = ip.dr.d_content;
-          zrrs.push_back(zrr);
-        }
+  if(securedZone) {
+    if(!(sd.db->list(target, sd.domain_id))) {
+      L<<Logger::Error<<"Backend signals error condition"<<endl;
+      outpacket->setRcode(RCode::ServFail);
+      sendPacket(outpacket,outsock);
+      return 0;
+    }
+    DNSName last;
+    while(sd.db->get(zrr)) {
+      zrr.dr.d_name.makeUsLowerCase();
+      if(!zrr.dr.d_name.isPartOf(target) || (rectify && !zrr.dr.d_type))
         continue;
-      }
+      auto iter = names.find(zrr.dr.d_name);
+      if(iter == names.end())
+        iter = names.insert(make_pair(zrr.dr.d_name, NameInfo())).first;
+      else if(zrr.dr.d_name != last)
+        grouped = false;
+      last = zrr.dr.d_name;
+      if(zrr.dr.d_type != QType::NS || !ns3pr.d_flags)
+        iter->second.nsec3 = true;
+      if(rectify && zrr.dr.d_type == QType::NS && zrr.dr.d_name!=target)
+        nsset.insert(zrr.dr.d_name);
+    }
+    if(!grouped)
+      L<<Logger::Warning<<"Backend does not list the records of each name in zone '"<<target<<"' together, sorting them for AXFR"<<endl;
+  }
 
-      if (rectify) {
-        if (zrr.dr.d_type) {
-          qnames.insert(zrr.dr.d_name);
-          if(zrr.dr.d_type == QType::NS && zrr.dr.d_name!=target)
-            nsset.insert(zrr.dr.d_name);
-        } else {
-          // remove existing ents
-          continue;
-        }
+  DNSName keyname;
+  auto addToNSECx = [&](const DNSZoneRecord& rr) {
+    if (NSEC3Zone || rr.dr.d_type) {
+      if (presignedZone && NSEC3Zone && rr.dr.d_type == QType::RRSIG && getRR<RRSIGRecordContent>(rr.dr)->d_type == QType::NSEC3) {
+        keyname = rr.dr.d_name.makeRelative(sd.qname);
+      } else {
+        keyname = NSEC3Zone ? DNSName(toBase32Hex(hashQNameWithSalt(ns3pr, rr.dr.d_name))) : rr.dr.d_name;
+      }
+      NSECXEntry& ne = nsecxrepo[keyname];
+      ne.d_ttl = sd.default_ttl;
+      ne.d_auth = (ne.d_auth || rr.auth || (NSEC3Zone && (!ns3pr.d_flags)));
+      if (rr.dr.d_type && rr.dr.d_type != QType::RRSIG) {
+        ne.d_set.insert(rr.dr.d_type);
       }
-      zrrs.push_back(zrr);
-    } else {
-      if (zrr.dr.d_type)
-        L<<Logger::Warning<<"Zone '"<<target<<"' contains out-of-zone data '"<<zrr.dr.d_name<<"|"<<DNSRecordContent::NumberToType(zrr.dr.d_type)<<"', ignoring"<<endl;
     }
-  }
+  };
 
-  // Group records by name and type, signpipe stumbles over interrupted rrsets
-  sort(zrrs.begin(), zrrs.end(), [](const DNSZoneRecord& a, const DNSZoneRecord& b) {
-    return tie(a.dr.d_name, a.dr.d_type) < tie(b.dr.d_name, b.dr.d_type);
-  });
-
-  if(rectify) {
-    // set auth
-    for(DNSZoneRecord &loopZRR :  zrrs) {
-      loopZRR.auth=true;
-      if (loopZRR.dr.d_type != QType::NS || loopZRR.dr.d_name!=target) {
-        DNSName shorter(loopZRR.dr.d_name);
+  if(rectify && NSEC3Zone) {
+    // ents are only required for NSEC3 zones
+    uint32_t maxent = ::arg().asNum("max-ent-entries");
+    set<DNSName> nsec3set, nonterm;
+    for (const auto& name : names) {
+      bool skip=false;
+      DNSName shorter = name.first;
+      if (shorter != target && shorter.chopOff() && shorter != target) {
         do {
-          if (shorter==target) // apex is always auth
-            break;
-          if(nsset.count(shorter) && !(loopZRR.dr.d_name==shorter && loopZRR.dr.d_type == QType::DS)) {
-            loopZRR.auth=false;
+          if(nsset.count(shorter)) {
+            skip=true;
             break;
           }
-        } while(shorter.chopOff());
+        } while(shorter.chopOff() && shorter != target);
       }
-    }
-
-    if(NSEC3Zone) {
-      // ents are only required for NSEC3 zones
-      uint32_t maxent = ::arg().asNum("max-ent-entries");
-      set<DNSName> nsec3set, nonterm;
-      for (auto &loopZRR: zrrs) {
-        bool skip=false;
-        DNSName shorter = loopZRR.dr.d_name;
-        if (shorter != target && shorter.chopOff() && shorter != target) {
-          do {
-            if(nsset.count(shorter)) {
-              skip=true;
-              break;
-            }
-          } while(shorter.chopOff() && shorter != target);
-        }
-        shorter = loopZRR.dr.d_name;
-        if(!skip && (loopZRR.dr.d_type != QType::NS || !ns3pr.d_flags)) {
-          do {
-            if(!nsec3set.count(shorter)) {
-              nsec3set.insert(shorter);
-            }
-          } while(shorter != target && shorter.chopOff());
-        }
+      shorter = name.first;
+      if(!skip && name.second.nsec3) {
+        do {
+          if(!nsec3set.count(shorter)) {
+            nsec3set.insert(shorter);
+          }
+        } while(shorter != target && shorter.chopOff());
       }
+    }
 
-      for(DNSZoneRecord &loopZRR :  zrrs) {
-        DNSName shorter(loopZRR.dr.d_name);
-        while(shorter != target && shorter.chopOff()) {
-          if(!qnames.count(shorter) && !nonterm.count(shorter) && nsec3set.count(shorter)) {
-            if(!(maxent)) {
-              L<<Logger::Warning<<"Zone '"<<target<<"' has too many empty non terminals."<<endl;
-              return 0;
-            }
-            nonterm.insert(shorter);
-            --maxent;
+    for(const auto& name : names) {
+      DNSName shorter(name.first);
+      while(shorter != target && shorter.chopOff()) {
+        if(!names.count(shorter) && !nonterm.count(shorter) && nsec3set.count(shorter)) {
+          if(!(maxent)) {
+            L<<Logger::Warning<<"Zone '"<<target<<"' has too many empty non terminals."<<endl;
+            return 0;
           }
+          nonterm.insert(shorter);
+          --maxent;
         }
       }
+    }
 
-      for(const auto& nt :  nonterm) {
-        DNSZoneRecord tempRR;
-        tempRR.dr.d_name=nt;
-        tempRR.dr.d_type=QType::ENT;
-        tempRR.auth=true;
-        zrrs.push_back(tempRR);
-      }
+    for(const auto& nt :  nonterm) {
+      DNSZoneRecord tempRR;
+      tempRR.dr.d_name=nt;
+      tempRR.dr.d_type=QType::ENT;
+      tempRR.auth=true;
+      addToNSECx(tempRR);
     }
   }
 
-
   /* now write all other records */
-  
-  DNSName keyname;
-  unsigned int udiff;
-  DTime dt;
-  dt.set();
-  int records=0;
-  for(DNSZoneRecord &loopZRR :  zrrs) {
-    if (!presignedZone && loopZRR.dr.d_type == QType::RRSIG)
-      continue;
+
+  auto sendChunks = [&](bool final) {
+    for(;;) {
+      outpacket->getRRS() = csp.getChunk(final);
+      if(outpacket->getRRS().empty())
+        break;
+      records += outpacket->getRRS().size();
+      if(haveTSIGDetails && !tsigkeyname.empty())
+        outpacket->setTSIGDetails(trc, tsigkeyname, tsigsecret, trc.d_mac, true);
+      sendPacket(outpacket, outsock);
+      trc.d_mac=outpacket->d_trc.d_mac;
+      outpacket=getFreshAXFRPacket(q);
+    }
+  };
+
+  auto sendRecord = [&](DNSZoneRecord& rr) {
+    if (!presignedZone && rr.dr.d_type == QType::RRSIG)
+      return;
 
     // only skip the DNSKEY, CDNSKEY and CDS if direct-dnskey is enabled, to avoid changing behaviour
     // when it is not enabled.
-    if(::arg().mustDo("direct-dnskey") && (loopZRR.dr.d_type == QType::DNSKEY || loopZRR.dr.d_type == QType::CDNSKEY || loopZRR.dr.d_type == QType::CDS))
-      continue;
-
-    records++;
-    if(securedZone && (loopZRR.auth || loopZRR.dr.d_type == QType::NS)) {
-      if (NSEC3Zone || loopZRR.dr.d_type) {
-        if (presignedZone && NSEC3Zone && loopZRR.dr.d_type == QType::RRSIG && getRR<RRSIGRecordContent>(loopZRR.dr)->d_type == QType::NSEC3) {
-          keyname = loopZRR.dr.d_name.makeRelative(sd.qname);
-        } else {
-          keyname = NSEC3Zone ? DNSName(toBase32Hex(hashQNameWithSalt(ns3pr, loopZRR.dr.d_name))) : loopZRR.dr.d_name;
-        }
-        NSECXEntry& ne = nsecxrepo[keyname];
-        ne.d_ttl = sd.default_ttl;
-        ne.d_auth = (ne.d_auth || loopZRR.auth || (NSEC3Zone && (!ns3pr.d_flags)));
-        if (loopZRR.dr.d_type && loopZRR.dr.d_type != QType::RRSIG) {
-          ne.d_set.insert(loopZRR.dr.d_type);
-        }
+    if(directDNSKEY && (rr.dr.d_type == QType::DNSKEY || rr.dr.d_type == QType::CDNSKEY || rr.dr.d_type == QType::CDS))
+      return;
+
+    if(rectify) {
+      // set auth
+      rr.auth=true;
+      if (rr.dr.d_type != QType::NS || rr.dr.d_name!=target) {
+        DNSName shorter(rr.dr.d_name);
+        do {
+          if (shorter==target) // apex is always auth
+            break;
+          if(nsset.count(shorter) && !(rr.dr.d_name==shorter && rr.dr.d_type == QType::DS)) {
+            rr.auth=false;
+            break;
+          }
+        } while(shorter.chopOff());
       }
     }
 
-    if (!loopZRR.dr.d_type)
-      continue; // skip empty non-terminals
+    if(securedZone && (rr.auth || rr.dr.d_type == QType::NS))
+      addToNSECx(rr);
+
+    if (!rr.dr.d_type)
+      return; // skip empty non-terminals
 
-    if(loopZRR.dr.d_type == QType::SOA)
-      continue; // skip SOA - would indicate end of AXFR
+    if(rr.dr.d_type == QType::SOA)
+      return; // skip SOA - would indicate end of AXFR
 
-    if(csp.submit(loopZRR)) {
-      for(;;) {
-        outpacket->getRRS() = csp.getChunk();
-        if(!outpacket->getRRS().empty()) {
-          if(haveTSIGDetails && !tsigkeyname.empty())
-            outpacket->setTSIGDetails(trc, tsigkeyname, tsigsecret, trc.d_mac, true);
-          sendPacket(outpacket, outsock);
-          trc.d_mac=outpacket->d_trc.d_mac;
-          outpacket=getFreshAXFRPacket(q);
+    if(csp.submit(rr))
+      sendChunks(false);
+  };
+
+  // Group records by name and type, signpipe stumbles over interrupted rrsets
+  vector<DNSZoneRecord> group;
+  auto sendGroup = [&]() {
+    sort(group.begin(), group.end(), [](const DNSZoneRecord& a, const DNSZoneRecord& b) {
+      return tie(a.dr.d_name, a.dr.d_type) < tie(b.dr.d_name, b.dr.d_type);
+    });
+    for(auto& rr : group)
+      sendRecord(rr);
+    group.clear();
+  };
+
+  // the CDNSKEY and CDS records we created earlier go with the rest of the apex
+  vector<DNSZoneRecord> synthesized(cds);
+  synthesized.insert(synthesized.end(), cdnskey.begin(), cdnskey.end());
+  if(!securedZone) {
+    for(auto& synth_zrr : synthesized)
+      sendRecord(synth_zrr);
+  }
+  else if(!grouped)
+    group = synthesized;
+
+  bool zoneChanged = false;
+  auto addRecord = [&](DNSZoneRecord& rr) {
+    if(!securedZone) {
+      sendRecord(rr);
+      return;
+    }
+    if(grouped && (group.empty() || rr.dr.d_name != group.front().dr.d_name)) {
+      sendGroup();
+      bool& sent = names[rr.dr.d_name].sent;
+      if(sent) // the first pass saw this name's records together
+        zoneChanged = true;
+      sent = true;
+      if(rr.dr.d_name == target)
+        group = synthesized;
+    }
+    group.push_back(rr);
+  };
+
+  if(!(sd.db->list(target, sd.domain_id))) {
+    L<<Logger::Error<<"Backend signals error condition"<<endl;
+    outpacket->setRcode(RCode::ServFail);
+    sendPacket(outpacket,outsock);
+    return 0;
+  }
+
+  while(!zoneChanged && sd.db->get(zrr)) {
+    zrr.dr.d_name.makeUsLowerCase();
+    if(zrr.dr.d_name.isPartOf(target)) {
+      if (zrr.dr.d_type == QType::ALIAS && ::arg().mustDo("outgoing-axfr-expand-alias")) {
+        vector<DNSZoneRecord> ips;
+        int ret1 = stubDoResolve(getRR<ALIASRecordContent>(zrr.dr)->d_content, QType::A, ips);
+        int ret2 = stubDoResolve(getRR<ALIASRecordContent>(zrr.dr)->d_content, QType::AAAA, ips);
+        if(ret1 != RCode::NoError || ret2 != RCode::NoError) {
+          L<<Logger::Error<<"Error resolving for ALIAS "<<zrr.dr.d_content->getZoneRepresentation()<<", aborting AXFR"<<endl;
+          outpacket->setRcode(RCode::ServFail);
+          sendPacket(outpacket,outsock);
+          return 0;
         }
-        else
-          break;
+        for(const auto& ip: ips) {
+          zrr.dr.d_type = ip.dr.d_type;
+          zrr.dr.d_content = ip.dr.d_content;
+          addRecord(zrr);
+        }
+        continue;
       }
+
+      if (rectify && !zrr.dr.d_type)
+        continue; // remove existing ents
+
+      addRecord(zrr);
+    } else {
+      if (zrr.dr.d_type)
+        L<<Logger::Warning<<"Zone '"<<target<<"' contains out-of-zone data '"<<zrr.dr.d_name<<"|"<<DNSRecordContent::NumberToType(zrr.dr.d_type)<<"', ignoring"<<endl;
     }
   }
+  if(zoneChanged) {
+    L<<Logger::Error<<"Zone '"<<target<<"' changed during AXFR to "<<q->getRemote()<<", aborting"<<endl;
+    outpacket->setRcode(RCode::ServFail);
+    sendPacket(outpacket,outsock);
+    return 0;
+  }
+  sendGroup();
+
   /*
   udiff=dt.udiffNoReset();
   cerr<<"Starting NSEC: "<<csp.d_signed/(udiff/1000000.0)<<" sigs/s, "<<csp.d_signed<<" / "<<udiff/1000000.0<<endl;
@@ -976,20 +1451,8 @@ int TCPNameserver::doAXFR(const DNSName &target, shared_ptr<DNSPacket> q, int ou
           zrr.dr.d_type = QType::NSEC3;
           zrr.dr.d_place = DNSResourceRecord::ANSWER;
           zrr.auth=true;
-          if(csp.submit(zrr)) {
-            for(;;) {
-              outpacket->getRRS() = csp.getChunk();
-              if(!outpacket->getRRS().empty()) {
-                if(haveTSIGDetails && !tsigkeyname.empty())
-                  outpacket->setTSIGDetails(trc, tsigkeyname, tsigsecret, trc.d_mac, true);
-                sendPacket(outpacket, outsock);
-                trc.d_mac=outpacket->d_trc.d_mac;
-                outpacket=getFreshAXFRPacket(q);
-              }
-              else
-                break;
-            }
-          }
+          if(csp.submit(zrr))
+            sendChunks(false);
         }
       }
     }
@@ -1010,20 +1473,8 @@ int TCPNameserver::doAXFR(const DNSName &target, shared_ptr<DNSPacket> q, int ou
       zrr.dr.d_type = QType::NSEC;
       zrr.dr.d_place = DNSResourceRecord::ANSWER;
       zrr.auth=true;
-      if(csp.submit(zrr)) {
-        for(;;) {
-          outpacket->getRRS() = csp.getChunk();
-          if(!outpacket->getRRS().empty()) {
-            if(haveTSIGDetails && !tsigkeyname.empty())
-              outpacket->setTSIGDetails(trc, tsigkeyname, tsigsecret, trc.d_mac, true); 
-            sendPacket(outpacket, outsock);
-            trc.d_mac=outpacket->d_trc.d_mac;
-            outpacket=getFreshAXFRPacket(q);
-          }
-          else
-            break;
-        }
-      }
+      if(csp.submit(zrr))
+        sendChunks(false);
     }
   }
   /*
@@ -1032,20 +1483,9 @@ int TCPNameserver::doAXFR(const DNSName &target, shared_ptr<DNSPacket> q, int ou
   cerr<<"Outstanding: "<<csp.d_outstanding<<", "<<csp.d_queued - csp.d_signed << endl;
   cerr<<"Ready for consumption: "<<csp.getReady()<<endl;
   * */
-  for(;;) { 
-    outpacket->getRRS() = csp.getChunk(true); // flush the pipe
-    if(!outpacket->getRRS().empty()) {
-      if(haveTSIGDetails && !tsigkeyname.empty())
-        outpacket->setTSIGDetails(trc, tsigkeyname, tsigsecret, trc.d_mac, true); // first answer is 'normal'
-      sendPacket(outpacket, outsock);
-      trc.d_mac=outpacket->d_trc.d_mac;
-      outpacket=getFreshAXFRPacket(q);
-    }
-    else 
-      break;
-  }
-  
-  udiff=dt.udiffNoReset();
+  sendChunks(true); // flush the pipe
+
+  unsigned int udiff=dt.udiffNoReset();
   if(securedZone) 
     L<<Logger::Info<<"Done signing: "<<csp.d_signed/(udiff/1000000.0)<<" sigs/s, "<<endl;
   
@@ -1057,9 +1497,11 @@ int TCPNameserver::doAXFR(const DNSName &target, shared_ptr<DNSPacket> q, int ou
     outpacket->setTSIGDetails(trc, tsigkeyname, tsigsecret, trc.d_mac, true); 
   
   sendPacket(outpacket, outsock);
+  records += outpacket->getRRS().size();
   
   DLOG(L<<"last packet - close"<<endl);
-  L<<Logger::Error<<"AXFR of domain '"<<target<<"' to "<<q->getRemote()<<" finished"<<endl;
+  udiff=std::max(dt.udiffNoReset(), 1);
+  L<<Logger::Error<<"AXFR of domain '"<<target<<"' to "<<q->getRemote()<<" finished, "<<records<<" records in "<<udiff/1000000.0<<" seconds ("<<(uint64_t)(records*1000000.0/udiff)<<" records/s)"<<endl;
 
   return 1;
 }
@@ -1206,7 +1648,6 @@ int TCPNameserver::doIXFR(shared_ptr<DNSPacket> q, int outsock)
 
 TCPNameserver::~TCPNameserver()
 {
-  delete d_connectionroom_sem;
 }
 
 TCPNameserver::TCPNameserver()
@@ -1216,9 +1657,7 @@ TCPNameserver::TCPNameserver()
   d_maxConnectionDuration = ::arg().asNum("max-tcp-connection-duration");
   d_maxConnectionsPerClient = ::arg().asNum("max-tcp-connections-per-client");
 
-//  sem_init(&d_connectionroom_sem,0,::arg().asNum("max-tcp-connections"));
-  d_connectionroom_sem = new Semaphore( ::arg().asNum( "max-tcp-connections" ));
-  d_tid=0;
+  d_maxConnections = ::arg().asNum("max-tcp-connections");
   vector<string>locals;
   stringtok(locals,::arg()["local-address"]," ,");
 
@@ -1275,13 +1714,8 @@ TCPNameserver::TCPNameserver()
     
     listen(s,128);
     L<<Logger::Error<<"TCP server bound to "<<local.toStringWithPort()<<endl;
+    setNonBlocking(s);
     d_sockets.push_back(s);
-    struct pollfd pfd;
-    memset(&pfd, 0, sizeof(pfd));
-    pfd.fd = s;
-    pfd.events = POLLIN;
-
-    d_prfds.push_back(pfd);
   }
 
   for(vector<string>::const_iterator laddr=locals6.begin();laddr!=locals6.end();++laddr) {
@@ -1329,83 +1763,7 @@ TCPNameserver::TCPNameserver()
     
     listen(s,128);
     L<<Logger::Error<<"TCPv6 server bound to "<<local.toStringWithPort()<<endl; // this gets %eth0 right
+    setNonBlocking(s);
     d_sockets.push_back(s);
-
-    struct pollfd pfd;
-    memset(&pfd, 0, sizeof(pfd));
-    pfd.fd = s;
-    pfd.events = POLLIN;
-
-    d_prfds.push_back(pfd);
   }
 }
-
-
-//! Start of TCP operations thread, we launch a new thread for each incoming TCP question
-void TCPNameserver::thread()
-{
-  try {
-    for(;;) {
-      int fd;
-      ComboAddress remote;
-      Utility::socklen_t addrlen=remote.getSocklen();
-
-      int ret=poll(&d_prfds[0], d_prfds.size(), -1); // blocks, forever if need be
-      if(ret <= 0)
-        continue;
-
-      int sock=-1;
-      for(const pollfd& pfd :  d_prfds) {
-        if(pfd.revents == POLLIN) {
-          sock = pfd.fd;
-          remote.sin4.sin_family = AF_INET6;
-          addrlen=remote.getSocklen();
-
-          if((fd=accept(sock, (sockaddr*)&remote, &addrlen))<0) {
-            L<<Logger::Error<<"TCP question accept error: "<<strerror(errno)<<endl;
-            
-            if(errno==EMFILE) {
-              L<<Logger::Error<<"TCP handler out of filedescriptors, exiting, won't recover from this"<<endl;
-              _exit(1);
-            }
-          }
-          else {
-            if (d_maxConnectionsPerClient) {
-              std::lock_guard<std::mutex> lock(s_clientsCountMutex);
-              if (s_clientsCount[remote] >= d_maxConnectionsPerClient) {
-                L<<Logger::Notice<<"Limit of simultaneous TCP connections per client reached for "<< remote<<", dropping"<<endl;
-                close(fd);
-                continue;
-              }
-              s_clientsCount[remote]++;
-            }
-
-            pthread_t tid;
-            d_connectionroom_sem->wait(); // blocks if no connections are available
-
-            int room;
-            d_connectionroom_sem->getValue( &room);
-            if(room<1)
-              L<<Logger::Warning<<"Limit of simultaneous TCP connections reached - raise max-tcp-connections"<<endl;
-
-            if(pthread_create(&tid, 0, &doConnection, reinterpret_cast<void*>(fd))) {
-              L<<Logger::Error<<"Error creating thread: "<<stringerror()<<endl;
-              d_connectionroom_sem->post();
-              close(fd);
-              decrementClientCount(remote);
-            }
-          }
-        }
-      }
-    }
-  }
-  catch(PDNSException &AE) {
-    L<<Logger::Error<<"TCP Nameserver thread dying because of fatal error: "<<AE.reason<<endl;
-  }
-  catch(...) {
-    L<<Logger::Error<<"TCPNameserver dying because of an unexpected fatal error"<<endl;
-  }
-  _exit(1); // take rest of server with us
-}
-
-
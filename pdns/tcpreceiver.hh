@@ -26,6 +26,7 @@
 #include "iputils.hh"
 #include "dnsbackend.hh"
 #include "packethandler.hh"
+#include <atomic>
 #include <vector>
 #include <mutex>
 #include <poll.h>
@@ -48,23 +49,27 @@ public:
   ~TCPNameserver();
   void go();
 private:
+  /* Each worker runs its own event loop, accepting connections on all the
+     listening sockets and multiplexing them. Regular queries are answered
+     from the packet cache or handed to the worker's own Distributor, so a slow
+     backend never blocks the event loop. AXFR and IXFR are served by a
+     dedicated thread, the connection is handed back to the worker afterwards. */
+  class Worker;
 
   static void sendPacket(std::shared_ptr<DNSPacket> p, int outsock);
-  static int readLength(int fd, ComboAddress *remote);
-  static void getQuestion(int fd, char *mesg, int pktlen, const ComboAddress& remote, unsigned int totalTime);
   static int doAXFR(const DNSName &target, std::shared_ptr<DNSPacket> q, int outsock);
   static int doIXFR(std::shared_ptr<DNSPacket> q, int outsock);
   static bool canDoAXFR(std::shared_ptr<DNSPacket> q);
-  static void *doConnection(void *data);
+  static void *doTransfer(void *data);
   static void *launcher(void *data);
   static void decrementClientCount(const ComboAddress& remote);
-  void thread(void);
+  // AXFR and IXFR only, the regular queries go through the workers' Distributors
   static pthread_mutex_t s_plock;
   static std::mutex s_clientsCountMutex;
   static std::map<ComboAddress,size_t,ComboAddress::addressOnlyLessThan> s_clientsCount;
   static PacketHandler *s_P;
-  pthread_t d_tid;
-  static Semaphore *d_connectionroom_sem;
+  static std::atomic<size_t> s_connections;
+  static size_t d_maxConnections;
   static NetmaskGroup d_ng;
   static size_t d_maxTransactionsPerConn;
   static size_t d_maxConnectionsPerClient;
@@ -72,7 +77,7 @@ private:
   static unsigned int d_maxConnectionDuration;
 
   vector<int>d_sockets;
-  vector<struct pollfd> d_prfds;
+  vector<Worker*> d_workers;
 };
 
 #endif /* PDNS_TCPRECEIVER_HH */
@@ -0,0 +1,178 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <boost/test/unit_test.hpp>
+#include <thread>
+#include "auth-signaturecache.hh"
+#include "md5.hh"
+
+BOOST_AUTO_TEST_SUITE(authsignaturecache_cc)
+
+static AuthSignatureCache::key_t makeKey(unsigned int n)
+{
+  return AuthSignatureCache::key_t("pubkey", pdns_md5sum(std::to_string(n)));
+}
+
+BOOST_AUTO_TEST_CASE(test_AuthSignatureCacheSimple) {
+  AuthSignatureCache cache(1000);
+  string signature;
+  bool renew;
+
+  BOOST_CHECK(!cache.get(makeKey(1), signature, 0, 0, renew));
+  cache.insert(makeKey(1), "sig1", 0, 0);
+  BOOST_CHECK(cache.get(makeKey(1), signature, 0, 0, renew));
+  BOOST_CHECK_EQUAL(signature, "sig1");
+  BOOST_CHECK(!renew);
+  BOOST_CHECK(!cache.get(AuthSignatureCache::key_t("otherkey", makeKey(1).second), signature, 0, 0, renew));
+
+  cache.insert(makeKey(1), "sig1bis", 0, 0);
+  BOOST_CHECK(cache.get(makeKey(1), signature, 0, 0, renew));
+  BOOST_CHECK_EQUAL(signature, "sig1bis");
+
+  BOOST_CHECK_EQUAL(cache.size(), 1);
+  BOOST_CHECK_EQUAL(cache.d_hits, 2);
+  BOOST_CHECK_EQUAL(cache.d_misses, 2);
+  BOOST_CHECK_EQUAL(cache.d_evictions, 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_AuthSignatureCacheEviction) {
+  AuthSignatureCache cache(4, 1);
+  string signature;
+  bool renew;
+
+  for(unsigned int n = 0; n < 4; n++)
+    cache.insert(makeKey(n), std::to_string(n), 0, 0);
+  BOOST_CHECK_EQUAL(cache.size(), 4);
+
+  // 0 and 2 get a second chance, so 1 and 3 make room
+  BOOST_CHECK(cache.get(makeKey(0), signature, 0, 0, renew));
+  BOOST_CHECK(cache.get(makeKey(2), signature, 0, 0, renew));
+  cache.insert(makeKey(4), "4", 0, 0);
+  cache.insert(makeKey(5), "5", 0, 0);
+
+  BOOST_CHECK_EQUAL(cache.size(), 4);
+  BOOST_CHECK_EQUAL(cache.d_evictions, 2);
+  BOOST_CHECK(cache.get(makeKey(0), signature, 0, 0, renew));
+  BOOST_CHECK_EQUAL(signature, "0");
+  BOOST_CHECK(!cache.get(makeKey(1), signature, 0, 0, renew));
+  BOOST_CHECK(cache.get(makeKey(2), signature, 0, 0, renew));
+  BOOST_CHECK(!cache.get(makeKey(3), signature, 0, 0, renew));
+  BOOST_CHECK(cache.get(makeKey(4), signature, 0, 0, renew));
+  BOOST_CHECK(cache.get(makeKey(5), signature, 0, 0, renew));
+  BOOST_CHECK_EQUAL(signature, "5");
+
+  // all flagged now, a full round clears them and the sweep goes on from there
+  cache.insert(makeKey(6), "6", 0, 0);
+  BOOST_CHECK_EQUAL(cache.size(), 4);
+  BOOST_CHECK_EQUAL(cache.d_evictions, 3);
+  BOOST_CHECK(cache.get(makeKey(6), signature, 0, 0, renew));
+}
+
+BOOST_AUTO_TEST_CASE(test_AuthSignatureCacheRenew) {
+  AuthSignatureCache cache(1000);
+  string signature;
+  bool renew;
+  const time_t rollover = 7 * 86400 * 2500;
+
+  for(unsigned int n = 0; n < 100; n++)
+    cache.insert(makeKey(n), std::to_string(n), 0, 0);
+
+  // before the window, nothing is renewed
+  for(unsigned int n = 0; n < 100; n++) {
+    BOOST_CHECK(cache.get(makeKey(n), signature, rollover - AuthSignatureCache::s_renewWindow - 1, rollover, renew));
+    BOOST_CHECK(!renew);
+  }
+
+  // halfway the window, about half of the entries are due, each only once
+  unsigned int renewed = 0;
+  for(unsigned int n = 0; n < 100; n++) {
+    BOOST_CHECK(cache.get(makeKey(n), signature, rollover - AuthSignatureCache::s_renewWindow / 2, rollover, renew));
+    if(renew)
+      renewed++;
+    BOOST_CHECK(cache.get(makeKey(n), signature, rollover - AuthSignatureCache::s_renewWindow / 2, rollover, renew));
+    BOOST_CHECK(!renew);
+  }
+  BOOST_CHECK_GT(renewed, 25);
+  BOOST_CHECK_LT(renewed, 75);
+
+  // just before the rollover, the rest is due
+  for(unsigned int n = 0; n < 100; n++) {
+    BOOST_CHECK(cache.get(makeKey(n), signature, rollover - 1, rollover, renew));
+    if(renew)
+      renewed++;
+  }
+  BOOST_CHECK_EQUAL(renewed, 100);
+
+  // once the week has changed, it is too late
+  cache.insert(makeKey(100), "100", 0, 0);
+  BOOST_CHECK(cache.get(makeKey(100), signature, rollover, rollover, renew));
+  BOOST_CHECK(!renew);
+}
+
+BOOST_AUTO_TEST_CASE(test_AuthSignatureCacheClaim) {
+  AuthSignatureCache cache(1000);
+  string signature;
+  bool renew;
+
+  // the first miss claims the key, the next one waits for its signature
+  BOOST_CHECK(!cache.getOrClaim(makeKey(1), signature, 0, 0, renew));
+  std::atomic<bool> done{false};
+  std::thread waiter([&cache, &done]() {
+    string sig;
+    bool ren;
+    BOOST_CHECK(cache.getOrClaim(makeKey(1), sig, 0, 0, ren));
+    BOOST_CHECK_EQUAL(sig, "sig1");
+    done = true;
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  BOOST_CHECK(!done);
+  cache.insert(makeKey(1), "sig1", 0, 0);
+  waiter.join();
+  BOOST_CHECK(done);
+  BOOST_CHECK_EQUAL(cache.d_misses, 1);
+  BOOST_CHECK_EQUAL(cache.d_waits + cache.d_hits, 1);
+
+  // an abandoned claim leaves the key to the next caller
+  BOOST_CHECK(!cache.getOrClaim(makeKey(2), signature, 0, 0, renew));
+  cache.abandon(makeKey(2));
+  BOOST_CHECK(!cache.getOrClaim(makeKey(2), signature, 0, 0, renew));
+  cache.insert(makeKey(2), "sig2", 0, 0);
+  BOOST_CHECK(cache.getOrClaim(makeKey(2), signature, 0, 0, renew));
+  BOOST_CHECK_EQUAL(signature, "sig2");
+}
+
+BOOST_AUTO_TEST_CASE(test_AuthSignatureCacheRollover) {
+  AuthSignatureCache cache(1000000, 4);
+  string signature;
+  bool renew;
+  const time_t week = 7 * 86400;
+  const time_t start = week * 2500;
+
+  // a fresh set of signatures every week, the cache far from full: the old ones still go
+  for(unsigned int n = 0; n < 10; n++) {
+    const time_t currentWeek = start + n * week;
+    for(unsigned int k = 0; k < 1000; k++)
+      cache.insert(makeKey(n * 1000 + k), std::to_string(k), currentWeek, currentWeek);
+    BOOST_CHECK_EQUAL(cache.size(), 1000);
+  }
+  BOOST_CHECK(cache.get(makeKey(9000), signature, 0, 0, renew));
+  BOOST_CHECK(!cache.get(makeKey(8000), signature, 0, 0, renew));
+
+  // signatures made ahead for next week survive the rollover
+  const time_t lastWeek = start + 9 * week;
+  for(unsigned int k = 0; k < 100; k++)
+    cache.insert(makeKey(10000 + k), "renewed", lastWeek + week, lastWeek);
+  BOOST_CHECK_EQUAL(cache.size(), 1100);
+  for(unsigned int k = 0; k < 100; k++)
+    cache.insert(makeKey(20000 + k), "new", lastWeek + week, lastWeek + week);
+  BOOST_CHECK_EQUAL(cache.size(), 200);
+  BOOST_CHECK(cache.get(makeKey(10000), signature, 0, 0, renew));
+  BOOST_CHECK_EQUAL(signature, "renewed");
+  BOOST_CHECK(cache.get(makeKey(20099), signature, 0, 0, renew));
+  BOOST_CHECK(!cache.get(makeKey(9000), signature, 0, 0, renew));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
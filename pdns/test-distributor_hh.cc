@@ -5,8 +5,10 @@
 #endif
 #include <stdlib.h>
 #include <unistd.h>
+#include <sched.h>
 #include <boost/test/unit_test.hpp>
 #include "distributor.hh"
+#include "mpmcqueue.hh"
 #include "dnspacket.hh"
 #include "namespaces.hh" 
 
@@ -40,10 +42,16 @@ static void report(DNSPacket* A)
 
 BOOST_AUTO_TEST_CASE(test_distributor_basic) {
   ::arg().set("overload-queue-length","Maximum queuelength moving to packetcache only")="0";
+  ::arg().set("overload-queue-delay","Maximum number of milliseconds questions wait for a backend thread before moving to packetcache only")="0";
   ::arg().set("max-queue-length","Maximum queuelength before considering situation lost")="5000";
   ::arg().set("queue-limit","Maximum number of milliseconds to queue a query")="1500";
   S.declare("servfail-packets","Number of times a server-failed packet was sent out");
   S.declare("timedout-packets", "timedout-packets");
+  S.declare("queue-wait0-1", "queue-wait0-1");
+  S.declare("queue-wait1-10", "queue-wait1-10");
+  S.declare("queue-wait10-100", "queue-wait10-100");
+  S.declare("queue-wait100-1000", "queue-wait100-1000");
+  S.declare("queue-wait-slow", "queue-wait-slow");
 
   auto d=Distributor<DNSPacket, Question, Backend>::Create(2);
 
@@ -141,4 +149,148 @@ BOOST_AUTO_TEST_CASE(test_distributor_dies) {
 
 
 
+struct BackendFirstSlow
+{
+  DNSPacket* question(Question* q)
+  {
+    if(q->q == 0) {
+      sleep(1);
+    }
+    return new DNSPacket(true);
+  }
+};
+
+static std::atomic<int> g_receivedAnswers3;
+static void report3(DNSPacket* A)
+{
+  delete A;
+  g_receivedAnswers3++;
+}
+
+BOOST_AUTO_TEST_CASE(test_distributor_slow_question) {
+  auto d=Distributor<DNSPacket, Question, BackendFirstSlow>::Create(2);
+  g_receivedAnswers3=0;
+
+  /* the thread stuck on the first question does not hold back the ones queued after it */
+  for(int n=0; n < 100; ++n)  {
+    Question q;
+    q.q=n;
+    q.d_dt.set();
+    d->question(&q, report3);
+  }
+  usleep(300000);
+  BOOST_CHECK_EQUAL(g_receivedAnswers3, 99);
+  BOOST_CHECK(!d->isOverloaded());
+  sleep(1);
+  BOOST_CHECK_EQUAL(g_receivedAnswers3, 100);
+};
+
+BOOST_AUTO_TEST_CASE(test_distributor_overload_delay) {
+  ::arg().set("overload-queue-delay")="100";
+  auto d=Distributor<DNSPacket, Question, BackendSlow>::Create(2);
+  ::arg().set("overload-queue-delay")="0";
+
+  for(int n=0; n < 4; ++n)  {
+    Question q;
+    q.d_dt.set();
+    d->question(&q, report);
+  }
+  /* both threads are busy, and the questions behind them are not getting any younger */
+  BOOST_CHECK(!d->isOverloaded());
+  usleep(300000);
+  BOOST_CHECK(d->isOverloaded());
+  BOOST_CHECK_EQUAL(d->getQueueSize(), 2);
+};
+
+static std::atomic<int> g_answered4, g_timedout4;
+static void report4(DNSPacket* A)
+{
+  if(A) {
+    delete A;
+    g_answered4++;
+  }
+  else {
+    g_timedout4++;
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_distributor_queue_limit) {
+  ::arg().set("queue-limit")="100";
+  auto d=Distributor<DNSPacket, Question, BackendSlow>::Create(2);
+  ::arg().set("queue-limit")="1500";
+  g_answered4=0;
+  g_timedout4=0;
+
+  for(int n=0; n < 6; ++n)  {
+    Question q;
+    q.d_dt.set();
+    d->question(&q, report4);
+  }
+  /* the first two questions are answered, the ones that waited behind them for more than queue-limit
+     are dropped, but the callback still hears about every single one of them */
+  usleep(1500000);
+  BOOST_CHECK_EQUAL(g_answered4, 2);
+  BOOST_CHECK_EQUAL(g_timedout4, 4);
+  BOOST_CHECK_EQUAL(d->getQueueSize(), 0);
+};
+
+static void* mpmcProducer(void* p)
+{
+  auto queue = static_cast<MPMCQueue<uint64_t>*>(p);
+  for(uint64_t value = 1; value <= 10000; ++value) {
+    while(!queue->push(value))
+      sched_yield();
+  }
+  return nullptr;
+}
+
+static std::atomic<uint64_t> g_mpmcSum, g_mpmcCount;
+
+static void* mpmcConsumer(void* p)
+{
+  auto queue = static_cast<MPMCQueue<uint64_t>*>(p);
+  uint64_t value;
+  while(g_mpmcCount < 40000) {
+    if(queue->pop(value)) {
+      g_mpmcSum += value;
+      g_mpmcCount++;
+    }
+    else
+      sched_yield();
+  }
+  return nullptr;
+}
+
+BOOST_AUTO_TEST_CASE(test_mpmcqueue) {
+  MPMCQueue<uint64_t> queue(3);
+  BOOST_CHECK_EQUAL(queue.capacity(), 4);
+
+  uint64_t value;
+  BOOST_CHECK(!queue.pop(value));
+  for(uint64_t n=0; n < 4; ++n)
+    BOOST_CHECK(queue.push(n));
+  BOOST_CHECK(!queue.push(4));
+  for(uint64_t n=0; n < 4; ++n) {
+    BOOST_CHECK(queue.pop(value));
+    BOOST_CHECK_EQUAL(value, n);
+  }
+  BOOST_CHECK(!queue.pop(value));
+
+  /* every value pushed by 4 producers is popped exactly once by 4 consumers */
+  MPMCQueue<uint64_t> shared(64);
+  g_mpmcSum=0;
+  g_mpmcCount=0;
+  pthread_t tid[8];
+  for(int i=0; i < 4; ++i) {
+    pthread_create(&tid[i], 0, mpmcProducer, &shared);
+    pthread_create(&tid[4 + i], 0, mpmcConsumer, &shared);
+  }
+  void* res;
+  for(int i=0; i < 8; ++i)
+    pthread_join(tid[i], &res);
+
+  BOOST_CHECK_EQUAL(g_mpmcCount, 40000);
+  BOOST_CHECK_EQUAL(g_mpmcSum, 4 * (10000ULL * 10001 / 2));
+}
+
 BOOST_AUTO_TEST_SUITE_END();
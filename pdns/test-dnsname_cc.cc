@@ -551,6 +551,43 @@ BOOST_AUTO_TEST_CASE(test_suffixmatch_tree) {
   BOOST_CHECK_EQUAL(*smt.lookup(net), net);
 }
 
+BOOST_AUTO_TEST_CASE(test_suffixmatch_tree_remove) {
+  SuffixMatchTree<DNSName> smt;
+  DNSName com("com.");
+  DNSName examplecom("example.com.");
+  DNSName subexamplecom("a.sub.example.com.");
+  smt.add(com, com);
+  smt.add(subexamplecom, subexamplecom);
+
+  /* example.com. is only an intermediary node, the best match is com. */
+  BOOST_REQUIRE(smt.lookup(DNSName("www.example.com.")));
+  BOOST_CHECK_EQUAL(*smt.lookup(DNSName("www.example.com.")), com);
+  BOOST_REQUIRE(smt.lookup(DNSName("www.a.sub.example.com.")));
+  BOOST_CHECK_EQUAL(*smt.lookup(DNSName("www.a.sub.example.com.")), subexamplecom);
+
+  smt.add(examplecom, examplecom);
+  BOOST_REQUIRE(smt.lookup(DNSName("b.sub.example.com.")));
+  BOOST_CHECK_EQUAL(*smt.lookup(DNSName("b.sub.example.com.")), examplecom);
+
+  smt.remove(examplecom);
+  BOOST_REQUIRE(smt.lookup(DNSName("b.sub.example.com.")));
+  BOOST_CHECK_EQUAL(*smt.lookup(DNSName("b.sub.example.com.")), com);
+  BOOST_REQUIRE(smt.lookup(DNSName("www.a.sub.example.com.")));
+  BOOST_CHECK_EQUAL(*smt.lookup(DNSName("www.a.sub.example.com.")), subexamplecom);
+
+  smt.remove(subexamplecom);
+  BOOST_REQUIRE(smt.lookup(DNSName("www.a.sub.example.com.")));
+  BOOST_CHECK_EQUAL(*smt.lookup(DNSName("www.a.sub.example.com.")), com);
+  BOOST_REQUIRE_EQUAL(smt.children.size(), 1);
+  BOOST_CHECK(smt.children.begin()->children.empty());
+
+  /* removing something that does not exist is a no-op */
+  smt.remove(DNSName("example.net."));
+  smt.remove(com);
+  BOOST_CHECK(smt.lookup(DNSName("www.example.com.")) == nullptr);
+  BOOST_CHECK(smt.children.empty());
+}
+
 
 BOOST_AUTO_TEST_CASE(test_concat) {
   DNSName first("www."), second("powerdns.com.");
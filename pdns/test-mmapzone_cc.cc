@@ -0,0 +1,208 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <boost/test/unit_test.hpp>
+#include <fstream>
+#include "base32.hh"
+#include "dnssecinfra.hh"
+#include "mmapzone.hh"
+#include "pdnsexception.hh"
+
+BOOST_AUTO_TEST_SUITE(mmapzone_cc)
+
+static std::string getTempName()
+{
+  char path[] = "/tmp/pdns-test-mmapzone.XXXXXX";
+  int fd = mkstemp(path);
+  BOOST_REQUIRE(fd >= 0);
+  close(fd);
+  return path;
+}
+
+static void addRecord(std::vector<DNSResourceRecord>& records, const std::string& qname, uint16_t qtype, const std::string& content)
+{
+  DNSResourceRecord rr;
+  rr.qname = DNSName(qname);
+  rr.qtype = qtype;
+  rr.content = content;
+  rr.ttl = 3600;
+  records.push_back(rr);
+}
+
+static std::vector<DNSResourceRecord> getRecords()
+{
+  std::vector<DNSResourceRecord> records;
+  addRecord(records, "www.example.com.", QType::A, "192.0.2.3");
+  addRecord(records, "example.com.", QType::NS, "ns1.example.com.");
+  addRecord(records, "ns1.example.com.", QType::A, "192.0.2.1");
+  addRecord(records, "A.b.c.example.com.", QType::A, "192.0.2.2");
+  addRecord(records, "sub.example.com.", QType::NS, "ns.sub.example.com.");
+  addRecord(records, "sub.example.com.", QType::DS, "12345 8 2 0000000000000000000000000000000000000000000000000000000000000000");
+  addRecord(records, "ns.sub.example.com.", QType::A, "192.0.2.4");
+  addRecord(records, "example.com.", QType::SOA, "ns1.example.com. hostmaster.example.com. 2017010100 3600 600 86400 300");
+  return records;
+}
+
+BOOST_AUTO_TEST_CASE(test_canonicalKey) {
+  /* RFC 4034 section 6.1 */
+  const std::vector<DNSName> names = {
+    DNSName("example."), DNSName("a.example."), DNSName("yljkjljk.a.example."), DNSName("Z.a.example."),
+    DNSName("zABC.a.EXAMPLE."), DNSName("z.example."), DNSName("\\001.z.example."), DNSName("*.z.example."),
+    DNSName("\\200.z.example.")
+  };
+
+  for(size_t idx = 1; idx < names.size(); idx++) {
+    BOOST_CHECK_LT(MMapZone::canonicalKey(names.at(idx - 1)), MMapZone::canonicalKey(names.at(idx)));
+  }
+  BOOST_CHECK_EQUAL(MMapZone::canonicalKey(DNSName("WWW.example.")), MMapZone::canonicalKey(DNSName("www.EXAMPLE.")));
+  BOOST_CHECK_LT(MMapZone::canonicalKey(DNSName("a.example.")), MMapZone::canonicalKey(DNSName("a\\000.example.")));
+  BOOST_CHECK_LT(MMapZone::canonicalKey(DNSName("a\\000.example.")), MMapZone::canonicalKey(DNSName("a\\001.example.")));
+  BOOST_CHECK_LT(MMapZone::canonicalKey(DNSName("a\\001.example.")), MMapZone::canonicalKey(DNSName("a\\002.example.")));
+}
+
+BOOST_AUTO_TEST_CASE(test_mmapzone) {
+  const DNSName zone("example.com.");
+  const std::string fname = getTempName();
+  NSEC3PARAMRecordContent ns3pr;
+  MMapZone::compile(zone, getRecords(), fname, false, ns3pr, false, 100000);
+
+  MMapZone mz(fname);
+  BOOST_CHECK_EQUAL(mz.getZone(), zone);
+  BOOST_CHECK(!mz.isNSEC3());
+  /* the 6 names with records, plus the empty non-terminals c and b.c */
+  BOOST_CHECK_EQUAL(mz.getNameCount(), 8);
+  BOOST_CHECK_EQUAL(mz.getRecordCount(), 10);
+
+  uint32_t index;
+  DNSResourceRecord rr;
+  BOOST_REQUIRE(mz.findName(g_rootdnsname, index));
+  BOOST_CHECK_EQUAL(index, 0);
+  BOOST_CHECK_EQUAL(mz.getName(index), g_rootdnsname);
+  BOOST_CHECK_EQUAL(mz.getNameEntry(index).recordCount, 2);
+  mz.getRecord(mz.getNameEntry(index).firstRecord, rr);
+  BOOST_CHECK_EQUAL(rr.qtype.getCode(), QType::SOA);
+  BOOST_CHECK_EQUAL(rr.content, "ns1.example.com. hostmaster.example.com. 2017010100 3600 600 86400 300");
+  BOOST_CHECK_EQUAL(rr.ttl, 3600);
+  BOOST_CHECK(rr.auth);
+
+  BOOST_REQUIRE(mz.findName(DNSName("WWW"), index));
+  BOOST_CHECK_EQUAL(mz.getName(index), DNSName("www"));
+  BOOST_CHECK_EQUAL(mz.getNameEntry(index).recordCount, 1);
+  mz.getRecord(mz.getNameEntry(index).firstRecord, rr);
+  BOOST_CHECK_EQUAL(rr.qtype.getCode(), QType::A);
+  BOOST_CHECK_EQUAL(rr.content, "192.0.2.3");
+
+  BOOST_CHECK(!mz.findName(DNSName("nope"), index));
+  BOOST_CHECK(!mz.findName(DNSName("a.b"), index));
+
+  /* the original case of the name is kept */
+  BOOST_REQUIRE(mz.findName(DNSName("a.b.c"), index));
+  BOOST_CHECK_EQUAL(mz.getName(index).toString(), "A.b.c.");
+
+  /* empty non-terminal */
+  BOOST_REQUIRE(mz.findName(DNSName("b.c"), index));
+  BOOST_CHECK_EQUAL(mz.getNameEntry(index).recordCount, 1);
+  BOOST_CHECK_EQUAL(mz.getNameEntry(index).flags & MMapZone::s_flagNSEC, 0);
+  mz.getRecord(mz.getNameEntry(index).firstRecord, rr);
+  BOOST_CHECK_EQUAL(rr.qtype.getCode(), 0);
+  BOOST_CHECK(rr.auth);
+
+  /* delegation */
+  BOOST_REQUIRE(mz.findName(DNSName("sub"), index));
+  BOOST_CHECK_EQUAL(mz.getNameEntry(index).recordCount, 2);
+  for(uint32_t idx = 0; idx < mz.getNameEntry(index).recordCount; idx++) {
+    mz.getRecord(mz.getNameEntry(index).firstRecord + idx, rr);
+    BOOST_CHECK_EQUAL(rr.auth, rr.qtype.getCode() == QType::DS);
+  }
+  BOOST_REQUIRE(mz.findName(DNSName("ns.sub"), index));
+  mz.getRecord(mz.getNameEntry(index).firstRecord, rr);
+  BOOST_CHECK_EQUAL(rr.qtype.getCode(), QType::A);
+  BOOST_CHECK(!rr.auth);
+  BOOST_CHECK_EQUAL(mz.getNameEntry(index).flags & MMapZone::s_flagNSEC, 0);
+
+  /* the NSEC chain is ., A.b.c, ns1, sub, www */
+  DNSName before, after;
+  BOOST_REQUIRE(mz.getBeforeAndAfterUnhashed(DNSName("b.c"), before, after));
+  BOOST_CHECK_EQUAL(before, g_rootdnsname);
+  BOOST_CHECK_EQUAL(after, DNSName("a.b.c"));
+  BOOST_REQUIRE(mz.getBeforeAndAfterUnhashed(DNSName("ns1"), before, after));
+  BOOST_CHECK_EQUAL(before, DNSName("ns1"));
+  BOOST_CHECK_EQUAL(after, DNSName("sub"));
+  BOOST_REQUIRE(mz.getBeforeAndAfterUnhashed(DNSName("x.sub"), before, after));
+  BOOST_CHECK_EQUAL(before, DNSName("sub"));
+  BOOST_CHECK_EQUAL(after, DNSName("www"));
+  BOOST_REQUIRE(mz.getBeforeAndAfterUnhashed(DNSName("zzz"), before, after));
+  BOOST_CHECK_EQUAL(before, DNSName("www"));
+  BOOST_CHECK_EQUAL(after, g_rootdnsname);
+
+  unlink(fname.c_str());
+}
+
+BOOST_AUTO_TEST_CASE(test_mmapzone_nsec3) {
+  const DNSName zone("example.com.");
+  const std::string fname = getTempName();
+  NSEC3PARAMRecordContent ns3pr;
+  ns3pr.d_algorithm = 1;
+  ns3pr.d_iterations = 1;
+  ns3pr.d_salt = "\xaa\xbb";
+  MMapZone::compile(zone, getRecords(), fname, true, ns3pr, false, 100000);
+
+  MMapZone mz(fname);
+  BOOST_CHECK(mz.isNSEC3());
+
+  /* everything but the glue below the delegation gets a hash */
+  std::vector<std::string> hashes;
+  for(const auto& name : { "", "c", "b.c", "a.b.c", "ns1", "sub", "www" }) {
+    hashes.push_back(toBase32Hex(hashQNameWithSalt(ns3pr, DNSName(name) + zone)));
+  }
+  std::sort(hashes.begin(), hashes.end());
+
+  const DNSName www(toBase32Hex(hashQNameWithSalt(ns3pr, DNSName("www.example.com."))));
+  DNSName unhashed, before, after;
+  BOOST_REQUIRE(mz.getBeforeAndAfterHashed(www, unhashed, before, after));
+  BOOST_CHECK_EQUAL(unhashed, DNSName("www.example.com."));
+  BOOST_CHECK_EQUAL(before, www);
+  auto pos = std::find(hashes.begin(), hashes.end(), www.toStringNoDot());
+  BOOST_REQUIRE(pos != hashes.end());
+  ++pos;
+  BOOST_CHECK_EQUAL(after, DNSName(pos == hashes.end() ? hashes.front() : *pos));
+
+  /* before the first hash wraps around to the last one */
+  BOOST_REQUIRE(mz.getBeforeAndAfterHashed(DNSName("0"), unhashed, before, after));
+  BOOST_CHECK_EQUAL(before, DNSName(hashes.back()));
+  BOOST_CHECK_EQUAL(after, DNSName(hashes.front()));
+
+  /* narrow mode stores no hashes */
+  MMapZone::compile(zone, getRecords(), fname, true, ns3pr, true, 100000);
+  MMapZone narrow(fname);
+  BOOST_CHECK(!narrow.isNSEC3());
+
+  unlink(fname.c_str());
+}
+
+BOOST_AUTO_TEST_CASE(test_mmapzone_invalid) {
+  const std::string fname = getTempName();
+
+  /* empty */
+  BOOST_CHECK_THROW(MMapZone mz(fname), PDNSException);
+
+  {
+    std::ofstream ofs(fname, std::ios::binary | std::ios::trunc);
+    ofs << std::string(sizeof(MMapZone::Header) * 2, 'x');
+  }
+  BOOST_CHECK_THROW(MMapZone mz(fname), PDNSException);
+
+  /* a valid header whose tables point past the end of the file */
+  NSEC3PARAMRecordContent ns3pr;
+  MMapZone::compile(DNSName("example.com."), getRecords(), fname, false, ns3pr, false, 100000);
+  BOOST_REQUIRE_EQUAL(truncate(fname.c_str(), sizeof(MMapZone::Header) + 10), 0);
+  BOOST_CHECK_THROW(MMapZone mz(fname), PDNSException);
+
+  unlink(fname.c_str());
+  BOOST_CHECK_THROW(MMapZone mz(fname), PDNSException);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
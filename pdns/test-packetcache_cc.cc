@@ -460,4 +460,384 @@ BOOST_AUTO_TEST_CASE(test_AuthPacketCache) {
   }
 }
 
+static void checkUDPHit(AuthPacketCache& PC, DNSPacket& q, DNSPacket& r)
+{
+  char buffer[4096];
+  size_t size = PC.getUDP(&q, buffer, sizeof(buffer));
+  BOOST_REQUIRE_EQUAL(size, r.getString().size());
+  const string& query = q.getString();
+  /* the ID and the question come from the query, the rest from the cached answer */
+  BOOST_CHECK_EQUAL(string(buffer, 2), query.substr(0, 2));
+  BOOST_CHECK_EQUAL(string(buffer + 2, 10), r.getString().substr(2, 10));
+  BOOST_CHECK_EQUAL(string(buffer + 12, q.qdomain.wirelength()), query.substr(12, q.qdomain.wirelength()));
+  BOOST_CHECK_EQUAL(string(buffer + 12 + q.qdomain.wirelength(), size - 12 - q.qdomain.wirelength()), r.getString().substr(12 + q.qdomain.wirelength()));
+}
+
+static void testAuthPacketCacheUDP(size_t fastEntries)
+{
+  AuthPacketCache PC;
+  PC.setTTL(20);
+  PC.setMaxEntries(100000);
+  PC.setFastEntries(fastEntries);
+
+  vector<uint8_t> pak;
+  DNSPacket q(true), otherCaseQ(true), ednsQ(true), otherQ(true);
+  DNSPacket r(false), bigR(false);
+  char buffer[4096];
+
+  {
+    DNSPacketWriter pw(pak, DNSName("www.powerdns.com"), QType::A);
+    pw.getHeader()->id = htons(42);
+    pw.getHeader()->rd = 1;
+    pw.commit();
+    q.parse((char*)&pak[0], pak.size());
+    pak.clear();
+  }
+  {
+    DNSPacketWriter pw(pak, DNSName("WwW.PowerDNS.com"), QType::A);
+    pw.getHeader()->id = htons(4242);
+    pw.getHeader()->rd = 1;
+    pw.commit();
+    otherCaseQ.parse((char*)&pak[0], pak.size());
+    pak.clear();
+  }
+  {
+    DNSPacketWriter pw(pak, DNSName("www.powerdns.com"), QType::A);
+    pw.getHeader()->rd = 1;
+    pw.addOpt(512, 0, 0);
+    pw.commit();
+    ednsQ.parse((char*)&pak[0], pak.size());
+    pak.clear();
+  }
+  {
+    DNSPacketWriter pw(pak, DNSName("powerdns.com"), QType::A);
+    pw.getHeader()->rd = 1;
+    pw.commit();
+    otherQ.parse((char*)&pak[0], pak.size());
+    pak.clear();
+  }
+  {
+    DNSPacketWriter pw(pak, DNSName("www.powerdns.com"), QType::A);
+    pw.getHeader()->id = htons(42);
+    pw.getHeader()->rd = 1;
+    pw.getHeader()->qr = 1;
+    pw.getHeader()->aa = 1;
+    pw.startRecord(DNSName("www.powerdns.com"), QType::A, 16, 1, DNSResourceRecord::ANSWER);
+    pw.xfrIP(htonl(0x7f000001));
+    pw.commit();
+    r.parse((char*)&pak[0], pak.size());
+    pak.clear();
+  }
+  {
+    DNSPacketWriter pw(pak, DNSName("powerdns.com"), QType::A);
+    pw.getHeader()->rd = 1;
+    pw.getHeader()->qr = 1;
+    pw.getHeader()->aa = 1;
+    for(uint32_t idx = 0; idx < 100; idx++) {
+      pw.startRecord(DNSName("powerdns.com"), QType::A, 16, 1, DNSResourceRecord::ANSWER);
+      pw.xfrIP(htonl(0x7f000000 + idx));
+    }
+    pw.commit();
+    bigR.parse((char*)&pak[0], pak.size());
+    pak.clear();
+  }
+
+  BOOST_CHECK_EQUAL(PC.getUDP(&q, buffer, sizeof(buffer)), 0);
+  PC.insert(&q, &r, 3600);
+  BOOST_CHECK_EQUAL(PC.size(), 1);
+
+  checkUDPHit(PC, q, r);
+  /* different ID and qname case, still a hit */
+  checkUDPHit(PC, otherCaseQ, r);
+  {
+    /* straight from the wire, without a DNSPacket */
+    const string& query = otherCaseQ.getString();
+    uint32_t hash = 0;
+    size_t size = PC.getUDP(query.c_str(), query.size(), otherCaseQ.qdomain, QType::A, hash, buffer, sizeof(buffer));
+    BOOST_CHECK_EQUAL(size, r.getString().size());
+    BOOST_CHECK_EQUAL(hash, otherCaseQ.getHash());
+    BOOST_CHECK_EQUAL(string(buffer, 2), query.substr(0, 2));
+    BOOST_CHECK_EQUAL(string(buffer + 12, otherCaseQ.qdomain.wirelength()), query.substr(12, otherCaseQ.qdomain.wirelength()));
+    const string& ednsQuery = ednsQ.getString();
+    BOOST_CHECK_EQUAL(PC.getUDP(ednsQuery.c_str(), ednsQuery.size(), ednsQ.qdomain, QType::A, hash, buffer, sizeof(buffer)), 0);
+  }
+  /* and the slow path also gets the same answer from a DNSPacket */
+  DNSPacket r2(false);
+  BOOST_CHECK_EQUAL(PC.get(&q, &r2), true);
+  BOOST_CHECK_EQUAL(r2.getString().size(), r.getString().size());
+
+  /* EDNS or not is part of the key */
+  BOOST_CHECK_EQUAL(PC.getUDP(&ednsQ, buffer, sizeof(buffer)), 0);
+
+  /* the answer does not fit */
+  BOOST_CHECK_EQUAL(PC.getUDP(&q, buffer, r.getString().size() - 1), 0);
+
+  /* an answer too large for the lock-free table is still served */
+  BOOST_CHECK_EQUAL(PC.getUDP(&otherQ, buffer, sizeof(buffer)), 0);
+  PC.insert(&otherQ, &bigR, 3600);
+  BOOST_CHECK_EQUAL(PC.size(), 2);
+  checkUDPHit(PC, otherQ, bigR);
+
+  /* purging any name invalidates the whole lock-free table, and the entries
+     still in the main cache are served from there */
+  BOOST_CHECK_EQUAL(PC.purge("powerdns.com"), 1);
+  checkUDPHit(PC, q, r);
+  BOOST_CHECK_EQUAL(PC.getUDP(&otherQ, buffer, sizeof(buffer)), 0);
+  BOOST_CHECK_EQUAL(PC.purgeExact(DNSName("www.powerdns.com")), 1);
+  BOOST_CHECK_EQUAL(PC.getUDP(&q, buffer, sizeof(buffer)), 0);
+  BOOST_CHECK_EQUAL(PC.getUDP(&otherCaseQ, buffer, sizeof(buffer)), 0);
+  BOOST_CHECK_EQUAL(PC.size(), 0);
+
+  PC.insert(&q, &r, 3600);
+  checkUDPHit(PC, q, r);
+  BOOST_CHECK_EQUAL(PC.purge("com$"), 1);
+  BOOST_CHECK_EQUAL(PC.getUDP(&q, buffer, sizeof(buffer)), 0);
+
+  PC.insert(&q, &r, 3600);
+  checkUDPHit(PC, q, r);
+  BOOST_CHECK_EQUAL(PC.purge(), 1);
+  BOOST_CHECK_EQUAL(PC.getUDP(&q, buffer, sizeof(buffer)), 0);
+
+  /* TCP answers are not served to UDP queries, and the other way around */
+  r.d_tcp = true;
+  PC.insert(&q, &r, 3600);
+  BOOST_CHECK_EQUAL(PC.getUDP(&q, buffer, sizeof(buffer)), 0);
+  q.d_tcp = true;
+  checkUDPHit(PC, q, r);
+}
+
+BOOST_AUTO_TEST_CASE(test_AuthPacketCacheUDP) {
+  try {
+    ::arg().setSwitch("no-shuffle","Set this to prevent random shuffling of answers - for regression testing")="off";
+
+    testAuthPacketCacheUDP(0);
+    testAuthPacketCacheUDP(1024);
+    /* a single bucket of 4 probes */
+    testAuthPacketCacheUDP(1);
+  }
+  catch(PDNSException& e) {
+    cerr<<"Had error in AuthPacketCache: "<<e.reason<<endl;
+    throw;
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_couldBeCachedWire) {
+  const DNSName name("www.powerdns.com");
+  DNSName qname;
+  uint16_t qtype;
+  bool dnssecOk;
+  vector<uint8_t> pak;
+
+  {
+    DNSPacketWriter pw(pak, name, QType::AAAA);
+    pw.getHeader()->rd = 1;
+    pw.commit();
+  }
+  BOOST_CHECK(DNSPacket::couldBeCached((char*)&pak[0], pak.size(), qname, qtype, dnssecOk));
+  BOOST_CHECK_EQUAL(qname, name);
+  BOOST_CHECK_EQUAL(qtype, QType::AAAA);
+  BOOST_CHECK(!dnssecOk);
+  /* trailing garbage */
+  pak.push_back(0);
+  BOOST_CHECK(!DNSPacket::couldBeCached((char*)&pak[0], pak.size(), qname, qtype, dnssecOk));
+  /* truncated */
+  pak.resize(pak.size() - 4);
+  BOOST_CHECK(!DNSPacket::couldBeCached((char*)&pak[0], pak.size(), qname, qtype, dnssecOk));
+
+  pak.clear();
+  {
+    DNSPacketWriter pw(pak, name, QType::A);
+    pw.addOpt(4096, 0, EDNSOpts::DNSSECOK);
+    pw.commit();
+  }
+  BOOST_CHECK(DNSPacket::couldBeCached((char*)&pak[0], pak.size(), qname, qtype, dnssecOk));
+  BOOST_CHECK(dnssecOk);
+
+  /* NSID needs a tailored answer */
+  pak.clear();
+  {
+    DNSPacketWriter pw(pak, name, QType::A);
+    DNSPacketWriter::optvect_t opts;
+    opts.push_back(make_pair(3, string()));
+    pw.addOpt(4096, 0, 0, opts);
+    pw.commit();
+  }
+  BOOST_CHECK(!DNSPacket::couldBeCached((char*)&pak[0], pak.size(), qname, qtype, dnssecOk));
+
+  /* so do responses, other opcodes and classes, and any other additional record, like a TSIG one */
+  pak.clear();
+  {
+    DNSPacketWriter pw(pak, name, QType::A);
+    pw.getHeader()->qr = 1;
+    pw.commit();
+  }
+  BOOST_CHECK(!DNSPacket::couldBeCached((char*)&pak[0], pak.size(), qname, qtype, dnssecOk));
+  pak.clear();
+  {
+    DNSPacketWriter pw(pak, name, QType::SOA);
+    pw.getHeader()->opcode = Opcode::Notify;
+    pw.commit();
+  }
+  BOOST_CHECK(!DNSPacket::couldBeCached((char*)&pak[0], pak.size(), qname, qtype, dnssecOk));
+  pak.clear();
+  {
+    DNSPacketWriter pw(pak, name, QType::A, QClass::CHAOS);
+    pw.commit();
+  }
+  BOOST_CHECK(!DNSPacket::couldBeCached((char*)&pak[0], pak.size(), qname, qtype, dnssecOk));
+  pak.clear();
+  {
+    DNSPacketWriter pw(pak, name, QType::A);
+    pw.startRecord(DNSName("key"), QType::TSIG, 0, QClass::ANY, DNSResourceRecord::ADDITIONAL);
+    pw.xfr32BitInt(0);
+    pw.commit();
+  }
+  BOOST_CHECK(!DNSPacket::couldBeCached((char*)&pak[0], pak.size(), qname, qtype, dnssecOk));
+}
+
+static std::atomic<uint64_t> g_PCFastWrong;
+
+static void *threadPCFastReader(void* a)
+try
+{
+  unsigned int offset=(unsigned int)(unsigned long)a;
+  char buffer[512];
+  for(unsigned int counter=0; counter < 200000; ++counter) {
+    vector<uint8_t> pak;
+    DNSName qname = DNSName("hello ")+DNSName(std::to_string((counter+offset) % 1000));
+
+    DNSPacketWriter pw(pak, qname, QType::A);
+    DNSPacket q(true);
+    q.parse((char*)&pak[0], pak.size());
+
+    size_t size = g_PC->getUDP(&q, buffer, sizeof(buffer));
+    if(size > 0) {
+      DNSPacket r(false);
+      r.parse(buffer, size);
+      if(r.qdomain != qname) {
+        g_PCFastWrong++;
+      }
+    }
+    else {
+      DNSPacket r(false);
+      pak.clear();
+      DNSPacketWriter pw2(pak, qname, QType::A);
+      pw2.getHeader()->qr = 1;
+      pw2.startRecord(qname, QType::A, 16, 1, DNSResourceRecord::ANSWER);
+      pw2.xfrIP(htonl(0x7f000001));
+      pw2.commit();
+      r.parse((char*)&pak[0], pak.size());
+      g_PC->insert(&q, &r, 60);
+    }
+    if(counter % 1000 == 0) {
+      g_PC->purge(qname.toString());
+    }
+  }
+
+  return 0;
+}
+catch(PDNSException& e) {
+  cerr<<"Had error in threadPCFastReader: "<<e.reason<<endl;
+  throw;
+}
+
+BOOST_AUTO_TEST_CASE(test_PacketCacheFastThreaded) {
+  try {
+    AuthPacketCache PC;
+    PC.setMaxEntries(1000000);
+    PC.setTTL(20);
+    /* much fewer entries than names, to have plenty of concurrent overwrites */
+    PC.setFastEntries(64);
+
+    g_PC=&PC;
+    g_PCFastWrong=0;
+    pthread_t tid[4];
+    for(int i=0; i < 4; ++i)
+      pthread_create(&tid[i], 0, threadPCFastReader, (void*)(i*7UL));
+    void* res;
+    for(int i=0; i < 4 ; ++i)
+      pthread_join(tid[i], &res);
+
+    BOOST_CHECK_EQUAL(g_PCFastWrong, 0);
+  }
+  catch(PDNSException& e) {
+    cerr<<"Had error: "<<e.reason<<endl;
+    throw;
+  }
+}
+
+static std::atomic<bool> g_PCPurgeDone;
+
+static void *threadPCPurgeReader(void* a)
+{
+  vector<uint8_t> pak;
+  DNSPacketWriter pw(pak, DNSName("purged.powerdns.com"), QType::A);
+  DNSPacket q(true);
+  q.parse((char*)&pak[0], pak.size());
+
+  char buffer[512];
+  while(!g_PCPurgeDone) {
+    g_PC->getUDP(&q, buffer, sizeof(buffer));
+  }
+  return 0;
+}
+
+BOOST_AUTO_TEST_CASE(test_PacketCacheFastPurge) {
+  try {
+    AuthPacketCache PC;
+    PC.setMaxEntries(1000000);
+    PC.setTTL(20);
+    PC.setFastEntries(64);
+
+    const DNSName qname("purged.powerdns.com");
+    vector<uint8_t> pak;
+    DNSPacket q(true), r(false);
+    {
+      DNSPacketWriter pw(pak, qname, QType::A);
+      pw.commit();
+      q.parse((char*)&pak[0], pak.size());
+      pak.clear();
+    }
+    {
+      DNSPacketWriter pw(pak, qname, QType::A);
+      pw.getHeader()->qr = 1;
+      pw.startRecord(qname, QType::A, 16, 1, DNSResourceRecord::ANSWER);
+      pw.xfrIP(htonl(0x7f000001));
+      pw.commit();
+      r.parse((char*)&pak[0], pak.size());
+    }
+
+    /* the readers keep copying the answer from the main cache to the lock-free table,
+       which must not bring it back once a purge has returned */
+    g_PC=&PC;
+    g_PCPurgeDone=false;
+    pthread_t tid[2];
+    for(int i=0; i < 2; ++i)
+      pthread_create(&tid[i], 0, threadPCPurgeReader, 0);
+
+    char buffer[512];
+    unsigned int survived = 0;
+    for(unsigned int round = 0; round < 20000; ++round) {
+      PC.insert(&q, &r, 60);
+      if(round % 2)
+        PC.purge();
+      else
+        PC.purgeExact(qname);
+      if(PC.getUDP(&q, buffer, sizeof(buffer)) != 0)
+        survived++;
+    }
+
+    g_PCPurgeDone=true;
+    void* res;
+    for(int i=0; i < 2 ; ++i)
+      pthread_join(tid[i], &res);
+
+    BOOST_CHECK_EQUAL(survived, 0);
+  }
+  catch(PDNSException& e) {
+    cerr<<"Had error: "<<e.reason<<endl;
+    throw;
+  }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -48,6 +48,9 @@ BOOST_AUTO_TEST_CASE(test_recPacketCacheSimple) {
   rpc.insertResponsePacket(tag, qhash, qname, QType::A, QClass::IN, rpacket, time(0), ttd);
   BOOST_CHECK_EQUAL(rpc.size(), 1);
   rpc.doWipePacketCache(qname);
+  /* wipes are applied lazily, a lookup removes the entry */
+  BOOST_CHECK_EQUAL(rpc.size(), 1);
+  BOOST_CHECK_EQUAL(rpc.getResponsePacket(tag, qpacket, time(nullptr), &fpacket, &age, &qhash), false);
   BOOST_CHECK_EQUAL(rpc.size(), 0);
 
   rpc.insertResponsePacket(tag, qhash, qname, QType::A, QClass::IN, rpacket, time(0), ttd);
@@ -76,6 +79,8 @@ BOOST_AUTO_TEST_CASE(test_recPacketCacheSimple) {
   BOOST_CHECK_EQUAL(found, false);
 
   rpc.doWipePacketCache(DNSName("com"), 0xffff, true);
+  /* and pruning applies the pending wipes to the whole cache */
+  rpc.doPruneTo();
   BOOST_CHECK_EQUAL(rpc.size(), 0);
 }
 
@@ -152,6 +157,7 @@ BOOST_AUTO_TEST_CASE(test_recPacketCache_Tags) {
 
   /* remove the responses by qname, should remove both */
   rpc.doWipePacketCache(qname);
+  rpc.doPruneTo();
   BOOST_CHECK_EQUAL(rpc.size(), 0);
 
   /* insert the response for tag1 */
@@ -196,4 +202,104 @@ BOOST_AUTO_TEST_CASE(test_recPacketCache_Tags) {
   BOOST_CHECK_EQUAL(fpacket, r2packet);
 }
 
+static std::string makeQuery(const DNSName& qname, uint16_t qtype)
+{
+  vector<uint8_t> packet;
+  DNSPacketWriter pw(packet, qname, qtype);
+  pw.getHeader()->rd=true;
+  pw.getHeader()->id=random();
+  return string(reinterpret_cast<const char*>(&packet[0]), packet.size());
+}
+
+static std::string makeResponse(const DNSName& qname, uint16_t qtype, const std::string& address)
+{
+  vector<uint8_t> packet;
+  DNSPacketWriter pw(packet, qname, qtype);
+  pw.getHeader()->rd=true;
+  pw.getHeader()->qr=true;
+  pw.startRecord(qname, QType::A, 3600);
+  ARecordContent ar(address);
+  ar.toPacket(pw);
+  pw.commit();
+  return string(reinterpret_cast<const char*>(&packet[0]), packet.size());
+}
+
+BOOST_AUTO_TEST_CASE(test_recPacketCache_LazyWipe) {
+  RecursorPacketCache rpc;
+  string fpacket;
+  const unsigned int tag=0;
+  uint32_t age=0;
+  uint32_t qhash=0;
+  const time_t now = time(nullptr);
+
+  const DNSName apex("powerdns.com.");
+  const DNSName www("www.powerdns.com.");
+  const DNSName other("powerdns.org.");
+
+  const std::vector<std::pair<DNSName, uint16_t>> names = { {apex, QType::A}, {apex, QType::AAAA}, {www, QType::A}, {other, QType::A} };
+  for (const auto& name : names) {
+    const auto query = makeQuery(name.first, name.second);
+    BOOST_CHECK_EQUAL(rpc.getResponsePacket(tag, query, now, &fpacket, &age, &qhash), false);
+    rpc.insertResponsePacket(tag, qhash, name.first, name.second, QClass::IN, makeResponse(name.first, name.second, "192.0.2.1"), now, 3600);
+  }
+  BOOST_CHECK_EQUAL(rpc.size(), names.size());
+
+  /* only the AAAA entry of the apex */
+  BOOST_CHECK_EQUAL(rpc.doWipePacketCache(apex, QType::AAAA, false), 0);
+  BOOST_CHECK_EQUAL(rpc.getResponsePacket(tag, makeQuery(apex, QType::AAAA), now, &fpacket, &age, &qhash), false);
+  BOOST_CHECK_EQUAL(rpc.getResponsePacket(tag, makeQuery(apex, QType::A), now, &fpacket, &age, &qhash), true);
+  BOOST_CHECK_EQUAL(rpc.getResponsePacket(tag, makeQuery(www, QType::A), now, &fpacket, &age, &qhash), true);
+  BOOST_CHECK_EQUAL(rpc.size(), names.size() - 1);
+
+  /* a response inserted after the wipe is not affected by it */
+  rpc.getResponsePacket(tag, makeQuery(apex, QType::AAAA), now, &fpacket, &age, &qhash);
+  rpc.insertResponsePacket(tag, qhash, apex, QType::AAAA, QClass::IN, makeResponse(apex, QType::AAAA, "192.0.2.2"), now, 3600);
+  BOOST_CHECK_EQUAL(rpc.getResponsePacket(tag, makeQuery(apex, QType::AAAA), now, &fpacket, &age, &qhash), true);
+
+  /* the whole powerdns.com subtree */
+  rpc.doWipePacketCache(apex, 0xffff, true);
+  BOOST_CHECK_EQUAL(rpc.getResponsePacket(tag, makeQuery(www, QType::A), now, &fpacket, &age, &qhash), false);
+  BOOST_CHECK_EQUAL(rpc.getResponsePacket(tag, makeQuery(other, QType::A), now, &fpacket, &age, &qhash), true);
+  rpc.doPruneTo();
+  BOOST_CHECK_EQUAL(rpc.size(), 1);
+  BOOST_CHECK_EQUAL(rpc.getResponsePacket(tag, makeQuery(other, QType::A), now, &fpacket, &age, &qhash), true);
+}
+
+BOOST_AUTO_TEST_CASE(test_recPacketCache_Eviction) {
+  /* use a single shard so that the eviction order is fully predictable */
+  RecursorPacketCache rpc(1);
+  string fpacket;
+  const unsigned int tag=0;
+  uint32_t age=0;
+  uint32_t qhash=0;
+  const time_t now = time(nullptr);
+  const size_t count = 1000;
+
+  for (size_t idx = 0; idx < count; idx++) {
+    const DNSName name(std::to_string(idx) + ".powerdns.com.");
+    rpc.getResponsePacket(tag, makeQuery(name, QType::A), now, &fpacket, &age, &qhash);
+    /* every fourth entry is already expired */
+    rpc.insertResponsePacket(tag, qhash, name, QType::A, QClass::IN, makeResponse(name, QType::A, "192.0.2.1"), now, (idx % 4) == 0 ? 0 : 3600);
+  }
+  BOOST_CHECK_EQUAL(rpc.size(), count);
+
+  /* hit the first hundred entries so they get a second chance */
+  for (size_t idx = 0; idx < 100; idx++) {
+    const DNSName name(std::to_string(idx) + ".powerdns.com.");
+    BOOST_CHECK_EQUAL(rpc.getResponsePacket(tag, makeQuery(name, QType::A), now, &fpacket, &age, &qhash), (idx % 4) != 0);
+  }
+
+  /* the expired ones go first, then the ones that have not been hit */
+  rpc.doPruneTo(75);
+  BOOST_CHECK_EQUAL(rpc.size(), 75);
+  for (size_t idx = 0; idx < 100; idx++) {
+    const DNSName name(std::to_string(idx) + ".powerdns.com.");
+    BOOST_CHECK_EQUAL(rpc.getResponsePacket(tag, makeQuery(name, QType::A), now, &fpacket, &age, &qhash), (idx % 4) != 0);
+  }
+
+  rpc.doPruneTo(0);
+  BOOST_CHECK_EQUAL(rpc.size(), 0);
+  BOOST_CHECK_EQUAL(rpc.getResponsePacket(tag, makeQuery(DNSName("1.powerdns.com."), QType::A), now, &fpacket, &age, &qhash), false);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
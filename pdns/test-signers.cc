@@ -9,6 +9,7 @@
 #include <boost/tuple/tuple.hpp>
 #include <boost/scoped_ptr.hpp>
 
+#include "base32.hh"
 #include "base64.hh"
 #include "dnsseckeeper.hh"
 #include "dnssecinfra.hh"
@@ -277,4 +278,29 @@ BOOST_AUTO_TEST_CASE(test_ed448_signer) {
 }
 #endif
 
+BOOST_AUTO_TEST_CASE(test_nsec3_hash_cached) {
+  /* RFC 5155 Appendix A */
+  const std::string salt("\xaa\xbb\xcc\xdd", 4);
+  const DNSName name("a.example.");
+
+  BOOST_CHECK_EQUAL(toBase32Hex(hashQNameWithSalt(salt, 12, name)), "35mthgpgcu1qg68fab165klnsnk3dpvl");
+
+  /* a miss, then a hit */
+  BOOST_CHECK_EQUAL(toBase32Hex(hashQNameWithSaltCached(salt, 12, name)), "35mthgpgcu1qg68fab165klnsnk3dpvl");
+  BOOST_CHECK_EQUAL(toBase32Hex(hashQNameWithSaltCached(salt, 12, name)), "35mthgpgcu1qg68fab165klnsnk3dpvl");
+  /* the hash is case-insensitive */
+  BOOST_CHECK_EQUAL(toBase32Hex(hashQNameWithSaltCached(salt, 12, DNSName("A.EXAMPLE."))), "35mthgpgcu1qg68fab165klnsnk3dpvl");
+
+  /* the salt and the number of iterations are part of the key */
+  BOOST_CHECK_EQUAL(hashQNameWithSaltCached(salt, 11, name), hashQNameWithSalt(salt, 11, name));
+  BOOST_CHECK_NE(hashQNameWithSaltCached(salt, 11, name), hashQNameWithSaltCached(salt, 12, name));
+  BOOST_CHECK_EQUAL(hashQNameWithSaltCached(std::string(), 12, name), hashQNameWithSalt(std::string(), 12, name));
+  BOOST_CHECK_NE(hashQNameWithSaltCached(std::string(), 12, name), hashQNameWithSaltCached(salt, 12, name));
+
+  NSEC3PARAMRecordContent ns3prc;
+  ns3prc.d_salt = salt;
+  ns3prc.d_iterations = 12;
+  BOOST_CHECK_EQUAL(hashQNameWithSaltCached(ns3prc, name), hashQNameWithSalt(ns3prc, name));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -8,8 +8,10 @@
 #include <boost/test/unit_test.hpp>
 #include "auth-packetcache.hh"
 #include "auth-querycache.hh"
+#include "auth-zoneindex.hh"
 #include "statbag.hh"
 StatBag S;
 AuthPacketCache PC;
 AuthQueryCache QC;
+AuthZoneIndex g_zoneIndex;
 
@@ -26,6 +26,7 @@
 #include <boost/archive/binary_oarchive.hpp>
 
 #include "auth-querycache.hh"
+#include "auth-zoneindex.hh"
 #include "utility.hh"
 
 
@@ -48,6 +49,7 @@
 #include "statbag.hh"
 
 extern StatBag S;
+extern AuthZoneIndex g_zoneIndex;
 
 vector<UeberBackend *>UeberBackend::instances;
 pthread_mutex_t UeberBackend::instances_lock=PTHREAD_MUTEX_INITIALIZER;
@@ -264,12 +266,26 @@ bool UeberBackend::getAuth(const DNSName &target, const QType& qtype, SOAData* s
   // backend again for b.c.example.com., c.example.com. and example.com.
   // If a backend has no match it may respond with an enmpty qname.
 
+  // When the zone apex index is loaded, we jump straight to the closest
+  // enclosing zone it knows about instead of trying every label in turn.
+  // If that zone turns out not to exist anymore, we keep going from there.
+
   bool found = false;
   int cstat;
   DNSName shorter(target);
+  bool useIndex = cachedOk && g_zoneIndex.isEnabled();
   vector<pair<size_t, SOAData> > bestmatch (backends.size(), make_pair(target.wirelength()+1, SOAData()));
   do {
 
+    if(useIndex) {
+      DNSName apex;
+      if(!g_zoneIndex.getApex(shorter, apex)) {
+        DLOG(L<<Logger::Error<<"no zone in the index for: "<<shorter<<endl);
+        break;
+      }
+      shorter = apex;
+    }
+
     // Check cache
     if(cachedOk && (d_cache_ttl || d_negcache_ttl)) {
       d_question.qtype = QType::SOA;
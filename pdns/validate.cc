@@ -5,8 +5,10 @@
 #include "rec-lua-conf.hh"
 #include "base32.hh"
 #include "logger.hh"
+#include "sha.hh"
 bool g_dnssecLOG{false};
 uint16_t g_maxNSEC3Iterations{0};
+SignatureVerificationCache g_signatureVerificationCache;
 
 #define LOG(x) if(g_dnssecLOG) { L <<Logger::Warning << x; }
 void dotEdge(DNSName zone, string type1, DNSName name1, string tag1, string type2, DNSName name2, string tag2, string color="");
@@ -59,7 +61,7 @@ static std::string getHashFromNSEC3(const DNSName& qname, const std::shared_ptr<
     return result;
   }
 
-  return hashQNameWithSalt(nsec3->d_salt, nsec3->d_iterations, qname);
+  return hashQNameWithSaltCached(nsec3->d_salt, nsec3->d_iterations, qname);
 }
 
 /* There is no delegation at this exact point if:
@@ -657,6 +659,98 @@ bool isRRSIGNotExpired(const time_t now, const shared_ptr<RRSIGRecordContent> si
   return sig->d_siginception <= now && sig->d_sigexpire >= now;
 }
 
+SignatureVerificationCache::SignatureVerificationCache(size_t shardsCount): d_shards(shardsCount)
+{
+  for(auto& shard : d_shards) {
+    pthread_rwlock_init(&shard.d_lock, 0);
+  }
+}
+
+SignatureVerificationCache::~SignatureVerificationCache()
+{
+  for(auto& shard : d_shards) {
+    pthread_rwlock_destroy(&shard.d_lock);
+  }
+}
+
+std::string SignatureVerificationCache::makeKey(const std::string& msg, const RRSIGRecordContent& sig, const DNSKEYRecordContent& key)
+{
+  /* the lengths are there to make sure that bytes can't be moved from one part to the next */
+  std::string data;
+  data.reserve(msg.size() + sig.d_signature.size() + key.d_key.size() + 13);
+  data.append(std::to_string(msg.size()) + ":");
+  data.append(msg);
+  data.append(std::to_string(sig.d_signature.size()) + ":");
+  data.append(sig.d_signature);
+  data.append(std::to_string(key.d_algorithm) + ":" + std::to_string(key.d_key.size()) + ":");
+  data.append(key.d_key);
+  return pdns_sha256sum(data);
+}
+
+SignatureVerificationCache::Shard& SignatureVerificationCache::getShard(const std::string& key)
+{
+  /* the key is a digest, any part of it is as good as another */
+  return d_shards[static_cast<uint8_t>(key.at(0)) % d_shards.size()];
+}
+
+bool SignatureVerificationCache::get(const std::string& key, time_t now, bool& valid)
+{
+  auto& shard = getShard(key);
+  {
+    ReadLock rl(&shard.d_lock);
+    const auto it = shard.d_entries.find(key);
+    if (it != shard.d_entries.end() && it->d_ttd >= now) {
+      valid = it->d_valid;
+      d_hits++;
+      return true;
+    }
+  }
+  d_misses++;
+  return false;
+}
+
+void SignatureVerificationCache::insert(const std::string& key, time_t ttd, bool valid)
+{
+  const size_t maxEntries = d_maxEntries / d_shards.size() + 1;
+  auto& shard = getShard(key);
+  WriteLock wl(&shard.d_lock);
+
+  auto& sidx = shard.d_entries.get<1>();
+  auto res = sidx.push_back({key, ttd, valid});
+  if (!res.second) {
+    /* already there, another thread might have beaten us to it */
+    sidx.replace(res.first, {key, ttd, valid});
+    sidx.relocate(sidx.end(), res.first);
+  }
+
+  while (shard.d_entries.size() > maxEntries) {
+    sidx.pop_front();
+  }
+}
+
+void SignatureVerificationCache::setMaxEntries(size_t maxEntries)
+{
+  d_maxEntries = maxEntries;
+}
+
+size_t SignatureVerificationCache::size()
+{
+  size_t count = 0;
+  for(auto& shard : d_shards) {
+    ReadLock rl(&shard.d_lock);
+    count += shard.d_entries.size();
+  }
+  return count;
+}
+
+void SignatureVerificationCache::clear()
+{
+  for(auto& shard : d_shards) {
+    WriteLock wl(&shard.d_lock);
+    shard.d_entries.clear();
+  }
+}
+
 static bool checkSignatureWithKey(time_t now, const shared_ptr<RRSIGRecordContent> sig, const shared_ptr<DNSKEYRecordContent> key, const std::string& msg)
 {
   bool result = false;
@@ -666,9 +760,22 @@ static bool checkSignatureWithKey(time_t now, const shared_ptr<RRSIGRecordConten
        - The validator's notion of the current time MUST be greater than or equal to the time listed in the RRSIG RR's Inception field.
     */
     if(isRRSIGNotExpired(now, sig)) {
+      std::string cacheKey;
+      if (g_signatureVerificationCache.getMaxEntries() > 0) {
+        cacheKey = SignatureVerificationCache::makeKey(msg, *sig, *key);
+        if (g_signatureVerificationCache.get(cacheKey, now, result)) {
+          LOG("signature by key with tag "<<sig->d_tag<<" and algorithm "<<DNSSECKeeper::algorithm2name(sig->d_algorithm)<<" was already known to be " << (result ? "" : "NOT ")<<"valid"<<endl);
+          return result;
+        }
+      }
+
       std::shared_ptr<DNSCryptoKeyEngine> dke = shared_ptr<DNSCryptoKeyEngine>(DNSCryptoKeyEngine::makeFromPublicKeyString(key->d_algorithm, key->d_key));
       result = dke->verify(msg, sig->d_signature);
       LOG("signature by key with tag "<<sig->d_tag<<" and algorithm "<<DNSSECKeeper::algorithm2name(sig->d_algorithm)<<" was " << (result ? "" : "NOT ")<<"valid"<<endl);
+
+      if (!cacheKey.empty()) {
+        g_signatureVerificationCache.insert(cacheKey, sig->d_sigexpire, result);
+      }
     }
     else {
       LOG("Signature is "<<((sig->d_siginception > now) ? "not yet valid" : "expired")<<" (inception: "<<sig->d_siginception<<", expiration: "<<sig->d_sigexpire<<", now: "<<now<<")"<<endl);
@@ -23,7 +23,13 @@
 
 #include "dnsparser.hh"
 #include "dnsname.hh"
+#include <atomic>
 #include <vector>
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/hashed_index.hpp>
+#include <boost/multi_index/member.hpp>
+#include <boost/multi_index/sequenced_index.hpp>
+#include "lock.hh"
 #include "namespaces.hh"
 #include "dnsrecords.hh"
  
@@ -64,6 +70,65 @@ struct sharedDNSKeyRecordContentCompare
 
 typedef set<shared_ptr<DNSKEYRecordContent>, sharedDNSKeyRecordContentCompare > skeyset_t;
 
+/* Outcome of the cryptographic verification of signatures, shared between all
+   threads. The same RRset, signed by the same key, is usually validated over and
+   over again while it is popular, so this saves a lot of CPU.
+   Entries are keyed by a SHA-256 digest of the signed data (which includes the
+   RRSIG fields and the canonical RRset), of the signature itself and of the
+   public key, and are kept until the signature expires or they are evicted
+   because the cache is full, oldest first. The validity period of a signature
+   is not part of the verdict, it is checked before looking it up. */
+class SignatureVerificationCache : public boost::noncopyable
+{
+public:
+  SignatureVerificationCache(size_t shardsCount=16);
+  ~SignatureVerificationCache();
+
+  static std::string makeKey(const std::string& msg, const RRSIGRecordContent& sig, const DNSKEYRecordContent& key);
+
+  bool get(const std::string& key, time_t now, bool& valid);
+  void insert(const std::string& key, time_t ttd, bool valid);
+  void setMaxEntries(size_t maxEntries);
+  size_t getMaxEntries() const
+  {
+    return d_maxEntries;
+  }
+  size_t size();
+  void clear();
+
+  std::atomic<uint64_t> d_hits{0};
+  std::atomic<uint64_t> d_misses{0};
+
+private:
+  struct Entry
+  {
+    std::string d_key;
+    time_t d_ttd;
+    bool d_valid;
+  };
+
+  typedef boost::multi_index::multi_index_container<
+    Entry,
+    boost::multi_index::indexed_by <
+      boost::multi_index::hashed_unique<boost::multi_index::member<Entry, std::string, &Entry::d_key> >,
+      boost::multi_index::sequenced<>
+    >
+  > cache_t;
+
+  struct Shard
+  {
+    pthread_rwlock_t d_lock;
+    cache_t d_entries;
+  };
+
+  Shard& getShard(const std::string& key);
+
+  std::vector<Shard> d_shards;
+  std::atomic<size_t> d_maxEntries{0};
+};
+
+extern SignatureVerificationCache g_signatureVerificationCache;
+
 bool validateWithKeySet(time_t now, const DNSName& name, const vector<shared_ptr<DNSRecordContent> >& records, const vector<shared_ptr<RRSIGRecordContent> >& signatures, const skeyset_t& keys, bool validateAllSigs=true);
 void validateWithKeySet(const cspmap_t& rrsets, cspmap_t& validated, const skeyset_t& keys);
 cspmap_t harvestCSPFromRecs(const vector<DNSRecord>& recs);
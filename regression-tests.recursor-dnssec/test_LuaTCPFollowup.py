@@ -0,0 +1,130 @@
+import dns
+import os
+import socket
+import struct
+import threading
+import time
+from recursortests import RecursorTest
+
+stubAddress = os.environ['PREFIX'] + '.31'
+stubPort = 53
+stubRunning = False
+
+class testLuaTCPFollowup(RecursorTest):
+    """
+    Checks the tcpQueryResponse Lua followup against a local TCP stub: the
+    answer is everything the stub sends until it closes the connection, and
+    is empty if the stub does not close it in time or resets it.
+    """
+    _confdir = 'LuaTCPFollowup'
+    _config_template = """
+    """
+    _lua_dns_script_file = """
+    function preresolve(dq)
+      if not dq.qname:isPartOf(newDN("tcp-followup.example.")) then
+        return false
+      end
+      dq.followupFunction = "tcpQueryResponse"
+      dq.udpQueryDest = newCA("%s:%d")
+      dq.udpQuery = dq.qname:toString()
+      dq.udpCallback = "gotanswer"
+      dq.followupTimeout = 1000
+      return true
+    end
+
+    function gotanswer(dq)
+      dq.followupFunction = ""
+      if dq.udpAnswer == "" then
+        dq:addAnswer(pdns.TXT, '"failed"', 60)
+      else
+        dq:addAnswer(pdns.TXT, '"' .. dq.udpAnswer .. '"', 60)
+      end
+      return true
+    end
+    """ % (stubAddress, stubPort)
+
+    @classmethod
+    def startResponders(cls):
+        global stubRunning
+        print("Launching responders..")
+
+        if not stubRunning:
+            sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+            sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+            sock.bind((stubAddress, stubPort))
+            sock.listen(100)
+            cls._TCPStub = threading.Thread(name='TCP Stub', target=TCPStub, args=[sock])
+            cls._TCPStub.setDaemon(True)
+            cls._TCPStub.start()
+            stubRunning = True
+
+    @classmethod
+    def setUpClass(cls):
+        cls.setUpSockets()
+
+        cls.startResponders()
+
+        confdir = os.path.join('configs', cls._confdir)
+        cls.createConfigDir(confdir)
+
+        cls.generateRecursorConfig(confdir)
+        cls.startRecursor(confdir, cls._recursorPort)
+
+        print("Launching tests..")
+
+    @classmethod
+    def tearDownClass(cls):
+        cls.tearDownRecursor()
+
+    def checkTXT(self, name, content):
+        expected = dns.rrset.from_text(name, 60, dns.rdataclass.IN, 'TXT', '"%s"' % content)
+        query = dns.message.make_query(name, 'TXT')
+        res = self.sendUDPQuery(query)
+
+        self.assertRcodeEqual(res, dns.rcode.NOERROR)
+        self.assertRRsetInAnswer(res, expected)
+
+    def testAnswer(self):
+        """
+        The answer is sent in several chunks, then the connection is closed
+        """
+        self.checkTXT('answer.tcp-followup.example.', 'hello world')
+
+    def testTimeout(self):
+        """
+        The stub never answers, the followup gives up after followupTimeout
+        """
+        start = time.time()
+        self.checkTXT('timeout.tcp-followup.example.', 'failed')
+        self.assertLess(time.time() - start, 1.9)
+
+    def testReset(self):
+        """
+        The stub resets the connection after sending a partial answer, which
+        must not be handed to Lua as if it were complete
+        """
+        self.checkTXT('reset.tcp-followup.example.', 'failed')
+
+def TCPStubConnection(conn):
+    query = conn.recv(4096).decode('ascii')
+    if query.startswith('answer.'):
+        conn.send(b'hello')
+        time.sleep(0.1)
+        conn.send(b' world')
+        conn.close()
+    elif query.startswith('reset.'):
+        conn.send(b'partial')
+        time.sleep(0.1)
+        # closing with a zero linger time sends a RST instead of a FIN
+        conn.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER, struct.pack('ii', 1, 0))
+        conn.close()
+    else:
+        time.sleep(3)
+        conn.close()
+
+def TCPStub(sock):
+    while True:
+        (conn, _) = sock.accept()
+        thread = threading.Thread(name='TCP Stub Connection', target=TCPStubConnection, args=[conn])
+        thread.setDaemon(True)
+        thread.start()
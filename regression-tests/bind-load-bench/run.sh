@@ -0,0 +1,66 @@
+#!/usr/bin/env bash
+set -e
+if [ "${PDNS_DEBUG}" = "YES" ]; then
+  set -x
+fi
+
+PDNS=${PDNS:-../pdns/pdns_server}
+PDNSCONTROL=${PDNSCONTROL:-../pdns/pdns_control}
+DIG=${DIG:-dig}
+AMOUNT=${1:-20000}
+THREADS=${2:-4}
+port=${3:-5300}
+
+ROOT=./bind-load-bench/tmp
+
+if [ ! -x $PDNS ]; then
+    echo "Could not find PDNS, run from ./regression-tests"
+    exit 1
+fi
+
+mkdir -p $ROOT
+TMP=$(mktemp -d --tmpdir=${ROOT})
+
+onexit()
+{
+    [ -f $TMP/pdns.pid ] && kill $(cat $TMP/pdns.pid)
+    [ -n "$KEEP" ] || rm -fr $TMP
+}
+trap 'onexit' EXIT
+
+now()
+{
+    date +%s%N
+}
+
+for f in $(seq 1 $AMOUNT); do
+    sed -e "s/test.com/zone$f.example/g" zones/test.com > $TMP/zone$f.example
+    echo "zone \"zone$f.example\" { type master; file \"$TMP/zone$f.example\"; };"
+done > $TMP/named.conf
+
+start=$(now)
+$PDNS --daemon=no --local-address=127.0.0.1 --local-port=$port --socket-dir=$TMP \
+      --no-shuffle --launch=bind --bind-config=$TMP/named.conf \
+      --bind-load-threads=$THREADS --cache-ttl=0 --no-config \
+      --loglevel=4 > $TMP/pdns.log 2>&1 &
+echo $! > $TMP/pdns.pid
+
+until $PDNSCONTROL --socket-dir=$TMP --no-config rping >/dev/null 2>&1; do
+    sleep 0.01
+done
+
+# zone1.example was written first, so it is among the first zones parsed
+while [ -z "$($DIG +short +time=1 +tries=1 -p $port @127.0.0.1 zone1.example SOA 2>/dev/null)" ]; do
+    sleep 0.01
+done
+first=$(now)
+
+while [ "$($PDNSCONTROL --socket-dir=$TMP --no-config show bind-zones-queued 2>/dev/null)" != "0" ]; do
+    sleep 0.1
+done
+done=$(now)
+
+echo "$AMOUNT zones, bind-load-threads=$THREADS"
+echo "zone1.example answered after $(( (first - start) / 1000000 )) ms"
+echo "all zones parsed after $(( (done - start) / 1000000 )) ms"
+echo "$($PDNSCONTROL --socket-dir=$TMP --no-config show bind-zones-failed) zones failed to parse"